@@ -0,0 +1,1683 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Block store backends. file does pread()/pwrite() on the disk file, mmap
+  maps the disk file and copies blocks in and out of the mapping, ram keeps
+  the whole volume in anonymous memory and forgets it on unmount, io_uring
+  does the reads and writes of file through an io_uring submission queue,
+  stripe spreads the volume over several disk files, mirror keeps a copy
+  of it in each of them, tier puts its first part on a fast disk file and
+  the rest on a slow one.
+  sim puts a modelled slow device in front of any of them.
+*/
+
+#define _GNU_SOURCE // fallocate(), mremap(), syscall()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "backend.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#define MAP_GROW_MIN (16*1024*1024) // The mapping grows at least that much, to not remap on every new block
+
+static int disk_fd = -1; // Disk file of file, mmap and io_uring
+
+/*
+ * file backend
+ */
+static int file_open(const char *path)
+{
+    disk_fd = open(path, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
+    return (disk_fd < 0) ? -1 : 0;
+}
+
+static ssize_t file_read(void *buf, size_t size, off_t offset)
+{
+    return pread(disk_fd, buf, size, offset);
+}
+
+static ssize_t file_write(const void *buf, size_t size, off_t offset)
+{
+    return pwrite(disk_fd, buf, size, offset);
+}
+
+static ssize_t file_readv(const struct iovec *iov, int count, off_t offset)
+{
+    return preadv(disk_fd, iov, count, offset);
+}
+
+static ssize_t file_writev(const struct iovec *iov, int count, off_t offset)
+{
+    return pwritev(disk_fd, iov, count, offset);
+}
+
+static int file_flush()
+{
+#ifdef HAVE_FDATASYNC
+    return fdatasync(disk_fd);
+#else
+    return fsync(disk_fd);
+#endif
+}
+
+static int file_discard(off_t offset, off_t length)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    return fallocate(disk_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+static off_t file_size()
+{
+    struct stat st;
+    if (fstat(disk_fd, &st) < 0) {
+	return -1;
+    }
+
+    return st.st_size;
+}
+
+static void file_close()
+{
+    if (disk_fd >= 0) {
+	close(disk_fd);
+	disk_fd = -1;
+    }
+}
+
+const block_backend file_backend = {
+    "file", 0, file_open, file_read, file_write, file_readv, file_writev,
+    file_flush, file_discard, file_size, file_close
+};
+
+/*
+ * mmap and ram backends. Both copy blocks in and out of one mapping, of
+ * the disk file (disk_fd >= 0) or of anonymous memory. Writes past its end
+ * grow the mapping, and the disk file with it.
+ */
+static char *map_base = NULL;
+static size_t map_len = 0;
+static pthread_rwlock_t map_lock = PTHREAD_RWLOCK_INITIALIZER; // Write locked to move the mapping
+static int map_written = 0; // Set by the first write, until then the ram store reads as new
+
+static int map_grow(size_t need)
+{
+    int retstat = 0;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    pthread_rwlock_wrlock(&map_lock);
+    if (need > map_len) {
+	size_t len = map_len * 2;
+	if (len < need) {
+	    len = need;
+	}
+	if (len < map_len + MAP_GROW_MIN) {
+	    len = map_len + MAP_GROW_MIN;
+	}
+	len = (len + page - 1) / page * page;
+
+	char *base = MAP_FAILED;
+	if ((disk_fd >= 0) && (ftruncate(disk_fd, len) < 0)) {
+	    retstat = -1;
+	} else if (map_base == NULL) {
+	    base = mmap(NULL, len, PROT_READ|PROT_WRITE,
+		    (disk_fd >= 0) ? MAP_SHARED : (MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE), disk_fd, 0);
+	} else {
+	    base = mremap(map_base, map_len, len, MREMAP_MAYMOVE);
+	}
+
+	if (base != MAP_FAILED) {
+	    map_base = base;
+	    map_len = len;
+	} else {
+	    retstat = -1;
+	}
+    }
+    pthread_rwlock_unlock(&map_lock);
+
+    return retstat;
+}
+
+static ssize_t map_copy(const struct iovec *iov, int count, off_t offset, int write)
+{
+    size_t total = 0;
+    int i = 0;
+    for (i = 0; i < count; ++i) {
+	total += iov[i].iov_len;
+    }
+
+    pthread_rwlock_rdlock(&map_lock);
+    while (write && ((size_t)offset + total > map_len)) {
+	pthread_rwlock_unlock(&map_lock);
+	if (map_grow((size_t)offset + total) < 0) {
+	    return -1;
+	}
+	pthread_rwlock_rdlock(&map_lock);
+    }
+
+    // Like pread(), reads stop at the end of the store
+    if ((size_t)offset >= map_len) {
+	total = 0;
+    } else if ((size_t)offset + total > map_len) {
+	total = map_len - offset;
+    }
+
+    size_t done = 0;
+    for (i = 0; (i < count) && (done < total); ++i) {
+	size_t len = iov[i].iov_len;
+	if (len > total - done) {
+	    len = total - done;
+	}
+	if (write) {
+	    map_written = 1;
+	    memcpy(map_base + offset + done, iov[i].iov_base, len);
+	} else {
+	    memcpy(iov[i].iov_base, map_base + offset + done, len);
+	}
+	done += len;
+    }
+    pthread_rwlock_unlock(&map_lock);
+
+    return done;
+}
+
+static ssize_t map_read(void *buf, size_t size, off_t offset)
+{
+    struct iovec iov = { buf, size };
+    return map_copy(&iov, 1, offset, 0);
+}
+
+static ssize_t map_write(const void *buf, size_t size, off_t offset)
+{
+    struct iovec iov = { (void*)buf, size };
+    return map_copy(&iov, 1, offset, 1);
+}
+
+static ssize_t map_readv(const struct iovec *iov, int count, off_t offset)
+{
+    return map_copy(iov, count, offset, 0);
+}
+
+static ssize_t map_writev(const struct iovec *iov, int count, off_t offset)
+{
+    return map_copy(iov, count, offset, 1);
+}
+
+static off_t map_size()
+{
+    pthread_rwlock_rdlock(&map_lock);
+    off_t size = map_len;
+    pthread_rwlock_unlock(&map_lock);
+
+    return size;
+}
+
+static void map_close()
+{
+    if (map_base != NULL) {
+	munmap(map_base, map_len);
+	map_base = NULL;
+	map_len = 0;
+    }
+    map_written = 0;
+    file_close();
+}
+
+static int mmap_open(const char *path)
+{
+    if (file_open(path) < 0) {
+	return -1;
+    }
+
+    // An empty disk file gets mapped by its first write
+    off_t size = file_size();
+    if (size > 0) {
+	map_base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, disk_fd, 0);
+	if (map_base == MAP_FAILED) {
+	    map_base = NULL;
+	    file_close();
+	    return -1;
+	}
+	map_len = size;
+    }
+
+    return 0;
+}
+
+static int mmap_flush()
+{
+    int retstat = 0;
+    pthread_rwlock_rdlock(&map_lock);
+    if (map_base != NULL) {
+	retstat = msync(map_base, map_len, MS_SYNC);
+    }
+    pthread_rwlock_unlock(&map_lock);
+
+    return (retstat < 0) ? retstat : file_flush();
+}
+
+const block_backend mmap_backend = {
+    "mmap", 0, mmap_open, map_read, map_write, map_readv, map_writev,
+    mmap_flush, file_discard, map_size, map_close
+};
+
+static size_t ram_reserve = 0;
+static int ram_hugepages = 0;
+
+/** Size the ram store up front
+ *
+ * ram_open() maps size bytes in one go, backed by huge pages if asked for
+ * and the system has some to spare, instead of growing the mapping as
+ * blocks get written. Pages only get used when written either way.
+ */
+void ram_backend_reserve(size_t size, int hugepages)
+{
+    ram_reserve = size;
+    ram_hugepages = hugepages;
+}
+
+static int ram_open(const char *path)
+{
+    (void)path; // Nothing on disk
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = (ram_reserve + page - 1) / page * page;
+    if (len == 0) {
+	return 0;
+    }
+
+    map_base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (ram_hugepages) {
+	size_t huge = 2*1024*1024;
+	size_t huge_len = (len + huge - 1) / huge * huge;
+	// Reserved from the pool, without the reservation a short pool
+	// means SIGBUS on the first write to a page it can't back
+	map_base = mmap(NULL, huge_len, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if (map_base != MAP_FAILED) {
+	    len = huge_len;
+	}
+    }
+#endif
+    if (map_base == MAP_FAILED) {
+	map_base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (map_base == MAP_FAILED) {
+	    map_base = NULL;
+	    return -1;
+	}
+#ifdef MADV_HUGEPAGE
+	// No huge page pool, transparent huge pages are the next best thing
+	if (ram_hugepages) {
+	    madvise(map_base, len, MADV_HUGEPAGE);
+	}
+#endif
+    }
+    map_len = len;
+
+    return 0;
+}
+
+static int ram_flush()
+{
+    return 0;
+}
+
+static off_t ram_size()
+{
+    return map_written ? map_size() : 0;
+}
+
+/*
+ * Whole pages go back to the system, the partial ones at the edges of the
+ * range are zeroed.
+ */
+static int ram_discard(off_t offset, off_t length)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    pthread_rwlock_rdlock(&map_lock);
+    if ((size_t)offset < map_len) {
+	size_t end = offset + length;
+	if (end > map_len) {
+	    end = map_len;
+	}
+	size_t first = ((size_t)offset + page - 1) / page * page;
+	size_t last = end / page * page;
+	if (first < last) {
+	    memset(map_base + offset, 0, first - offset);
+	    madvise(map_base + first, last - first, MADV_DONTNEED);
+	    memset(map_base + last, 0, end - last);
+	} else {
+	    memset(map_base + offset, 0, end - offset);
+	}
+    }
+    pthread_rwlock_unlock(&map_lock);
+
+    return 0;
+}
+
+const block_backend ram_backend = {
+    "ram", 1, ram_open, map_read, map_write, map_readv, map_writev,
+    ram_flush, ram_discard, ram_size, map_close
+};
+
+/*
+ * io_uring backend, spoken to with raw system calls. Every caller queues its
+ * request and waits for the completion, one of the waiters at a time reaps
+ * the completion queue for all of them. Discards stay fallocate() calls.
+ */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+
+#define URING_ENTRIES 64
+
+typedef struct {
+    int done;
+    int res;
+} uring_request;
+
+static int uring_fd = -1;
+static void *uring_sq = MAP_FAILED;
+static void *uring_cq = MAP_FAILED;
+static struct io_uring_sqe *uring_sqes = MAP_FAILED;
+static size_t uring_sq_len, uring_cq_len, uring_sqes_len;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static unsigned uring_entries;
+static unsigned uring_in_flight = 0;
+static int uring_reaping = 0; // A waiter is in io_uring_enter() for completions
+static pthread_mutex_t uring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t uring_cond = PTHREAD_COND_INITIALIZER;
+
+static void uring_close()
+{
+    if (uring_sqes != MAP_FAILED) {
+	munmap(uring_sqes, uring_sqes_len);
+	uring_sqes = MAP_FAILED;
+    }
+    if (uring_cq != MAP_FAILED) {
+	munmap(uring_cq, uring_cq_len);
+	uring_cq = MAP_FAILED;
+    }
+    if (uring_sq != MAP_FAILED) {
+	munmap(uring_sq, uring_sq_len);
+	uring_sq = MAP_FAILED;
+    }
+    if (uring_fd >= 0) {
+	close(uring_fd);
+	uring_fd = -1;
+    }
+    file_close();
+}
+
+static int uring_open(const char *path)
+{
+    struct io_uring_params p;
+
+    if (file_open(path) < 0) {
+	return -1;
+    }
+
+    memset(&p, 0, sizeof(p));
+    uring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (uring_fd < 0) {
+	int err = errno; // ENOSYS without io_uring in the kernel, see disk_open()
+	file_close();
+	errno = err;
+	return -1;
+    }
+
+    uring_sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    uring_cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    uring_sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    uring_sq = mmap(NULL, uring_sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring_fd, IORING_OFF_SQ_RING);
+    uring_cq = mmap(NULL, uring_cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring_fd, IORING_OFF_CQ_RING);
+    uring_sqes = mmap(NULL, uring_sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring_fd, IORING_OFF_SQES);
+    if ((uring_sq == MAP_FAILED) || (uring_cq == MAP_FAILED) || (uring_sqes == MAP_FAILED)) {
+	int err = errno;
+	uring_close();
+	errno = err;
+	return -1;
+    }
+
+    sq_head = (unsigned*)((char*)uring_sq + p.sq_off.head);
+    sq_tail = (unsigned*)((char*)uring_sq + p.sq_off.tail);
+    sq_mask = (unsigned*)((char*)uring_sq + p.sq_off.ring_mask);
+    sq_array = (unsigned*)((char*)uring_sq + p.sq_off.array);
+    cq_head = (unsigned*)((char*)uring_cq + p.cq_off.head);
+    cq_tail = (unsigned*)((char*)uring_cq + p.cq_off.tail);
+    cq_mask = (unsigned*)((char*)uring_cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)((char*)uring_cq + p.cq_off.cqes);
+    uring_entries = p.sq_entries;
+
+    return 0;
+}
+
+/*
+ * Hands every completion to its waiter. Caller must hold uring_lock.
+ */
+static void uring_reap()
+{
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+	struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+	uring_request *req = (uring_request*)(uintptr_t)cqe->user_data;
+	req->res = cqe->res;
+	req->done = 1;
+	uring_in_flight--;
+	head++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&uring_cond);
+}
+
+/*
+ * Submits one request and waits for it, returns its result like the
+ * matching system call would.
+ */
+static ssize_t uring_do(int opcode, const void *addr, unsigned len, off_t offset, unsigned fsync_flags)
+{
+    uring_request req = { 0, 0 };
+
+    pthread_mutex_lock(&uring_lock);
+    // Never more in flight than fit in the queues
+    while (uring_in_flight >= uring_entries) {
+	pthread_cond_wait(&uring_cond, &uring_lock);
+    }
+
+    unsigned tail = *sq_tail;
+    unsigned idx = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &uring_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = disk_fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->fsync_flags = fsync_flags;
+    sqe->user_data = (uintptr_t)&req;
+    sq_array[idx] = idx;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    int retstat = 0;
+    do {
+	retstat = syscall(__NR_io_uring_enter, uring_fd, 1, 0, 0, NULL, 0);
+    } while ((retstat < 0) && ((errno == EINTR) || (errno == EAGAIN)));
+    if (retstat < 0) {
+	// Not consumed by the kernel, take it back
+	int err = errno;
+	__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&uring_lock);
+	errno = err;
+	return -1;
+    }
+    uring_in_flight++;
+
+    uring_reap();
+    while (!req.done) {
+	if (uring_reaping) {
+	    pthread_cond_wait(&uring_cond, &uring_lock);
+	} else {
+	    uring_reaping = 1;
+	    pthread_mutex_unlock(&uring_lock);
+	    syscall(__NR_io_uring_enter, uring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	    pthread_mutex_lock(&uring_lock);
+	    uring_reaping = 0;
+	    uring_reap();
+	}
+    }
+    pthread_mutex_unlock(&uring_lock);
+
+    if (req.res < 0) {
+	errno = -req.res;
+	return -1;
+    }
+
+    return req.res;
+}
+
+static ssize_t uring_readv(const struct iovec *iov, int count, off_t offset)
+{
+    return uring_do(IORING_OP_READV, iov, count, offset, 0);
+}
+
+static ssize_t uring_writev(const struct iovec *iov, int count, off_t offset)
+{
+    return uring_do(IORING_OP_WRITEV, iov, count, offset, 0);
+}
+
+static ssize_t uring_read(void *buf, size_t size, off_t offset)
+{
+    struct iovec iov = { buf, size };
+    return uring_readv(&iov, 1, offset);
+}
+
+static ssize_t uring_write(const void *buf, size_t size, off_t offset)
+{
+    struct iovec iov = { (void*)buf, size };
+    return uring_writev(&iov, 1, offset);
+}
+
+static int uring_flush()
+{
+    return uring_do(IORING_OP_FSYNC, NULL, 0, 0, IORING_FSYNC_DATASYNC);
+}
+
+#else
+
+static int uring_open(const char *path)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#define uring_read file_read
+#define uring_write file_write
+#define uring_readv file_readv
+#define uring_writev file_writev
+#define uring_flush file_flush
+#define uring_close file_close
+
+#endif
+
+const block_backend uring_backend = {
+    "io_uring", 0, uring_open, uring_read, uring_write, uring_readv, uring_writev,
+    uring_flush, file_discard, file_size, uring_close
+};
+
+/*
+ * stripe backend. The disk file path lists several files separated by ':',
+ * the volume is laid out over them RAID-0 style in stripe_unit byte
+ * chunks. The part of a range which falls on one file is contiguous in it,
+ * so an I/O becomes at most one preadv()/pwritev() per file. Each file has
+ * a worker thread, the parts of an I/O spanning files run in parallel.
+ * The mirror and tier backends further down use the same files and workers.
+ */
+#define STRIPE_MAX_DEVICES 16
+#define STRIPE_DEFAULT_UNIT (64*1024)
+
+#define STRIPE_READ 0
+#define STRIPE_WRITE 1
+#define STRIPE_FLUSH 2
+
+typedef struct stripe_io {
+    struct stripe_io *next;
+    int op;
+    struct iovec *iov;
+    int count;
+    off_t offset; // In the file
+    ssize_t result; // -errno on failure
+    int *pending; // I/Os of the request not done yet, protected by stripe_lock
+} stripe_io;
+
+typedef struct {
+    int fd;
+    int in_flight; // I/Os submitted and not done, protected by stripe_lock
+    int failed; // Mirror left out after an I/O error, protected by stripe_lock
+    pthread_t worker;
+    pthread_cond_t work; // Signalled when there is something in the queue
+    stripe_io *queue; // Protected by stripe_lock
+    stripe_io **queue_tail;
+} stripe_device;
+
+static stripe_device stripe_devices[STRIPE_MAX_DEVICES];
+static int stripe_count = 0;
+static size_t stripe_unit = STRIPE_DEFAULT_UNIT;
+static int stripe_stop = 0;
+static pthread_mutex_t stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stripe_done = PTHREAD_COND_INITIALIZER; // Signalled when a request has no I/O pending anymore
+
+/** Set the chunk size of the stripe backend
+ *
+ * unit is rounded down to a multiple of 512 bytes, 0 keeps the default.
+ */
+void stripe_backend_setup(size_t unit)
+{
+    unit = unit / 512 * 512;
+    stripe_unit = (unit > 0) ? unit : STRIPE_DEFAULT_UNIT;
+}
+
+static ssize_t stripe_do(stripe_device *dev, stripe_io *io)
+{
+    ssize_t retstat = 0;
+    if (io->op == STRIPE_READ) {
+	retstat = preadv(dev->fd, io->iov, io->count, io->offset);
+    } else if (io->op == STRIPE_WRITE) {
+	retstat = pwritev(dev->fd, io->iov, io->count, io->offset);
+    } else {
+#ifdef HAVE_FDATASYNC
+	retstat = fdatasync(dev->fd);
+#else
+	retstat = fsync(dev->fd);
+#endif
+    }
+
+    return (retstat < 0) ? -errno : retstat;
+}
+
+static void* stripe_worker(void *arg)
+{
+    stripe_device *dev = arg;
+
+    pthread_mutex_lock(&stripe_lock);
+    while (!stripe_stop) {
+	stripe_io *io = dev->queue;
+	if (io == NULL) {
+	    pthread_cond_wait(&dev->work, &stripe_lock);
+	    continue;
+	}
+	dev->queue = io->next;
+	if (dev->queue == NULL) {
+	    dev->queue_tail = &dev->queue;
+	}
+	pthread_mutex_unlock(&stripe_lock);
+
+	io->result = stripe_do(dev, io);
+
+	pthread_mutex_lock(&stripe_lock);
+	dev->in_flight--;
+	if (--(*io->pending) == 0) {
+	    pthread_cond_broadcast(&stripe_done);
+	}
+    }
+    pthread_mutex_unlock(&stripe_lock);
+
+    return NULL;
+}
+
+/*
+ * Runs one I/O per file, those with a count of 0 are left out. With more
+ * than one, all but the first go to the workers of their file.
+ */
+static void stripe_submit(stripe_io *ios)
+{
+    int pending = 0;
+    int first = -1;
+    int i = 0;
+
+    pthread_mutex_lock(&stripe_lock);
+    for (i = 0; i < stripe_count; ++i) {
+	ios[i].result = 0;
+	if ((ios[i].op != STRIPE_FLUSH) && (ios[i].count == 0)) {
+	    continue;
+	}
+	stripe_devices[i].in_flight++;
+	if (first < 0) {
+	    first = i;
+	    continue;
+	}
+	ios[i].next = NULL;
+	ios[i].pending = &pending;
+	*stripe_devices[i].queue_tail = &ios[i];
+	stripe_devices[i].queue_tail = &ios[i].next;
+	pending++;
+	pthread_cond_signal(&stripe_devices[i].work);
+    }
+    pthread_mutex_unlock(&stripe_lock);
+
+    if (first >= 0) {
+	ios[first].result = stripe_do(&stripe_devices[first], &ios[first]);
+    }
+
+    pthread_mutex_lock(&stripe_lock);
+    if (first >= 0) {
+	stripe_devices[first].in_flight--;
+    }
+    while (pending > 0) {
+	pthread_cond_wait(&stripe_done, &stripe_lock);
+    }
+    pthread_mutex_unlock(&stripe_lock);
+}
+
+static void stripe_close()
+{
+    int i = 0;
+
+    pthread_mutex_lock(&stripe_lock);
+    stripe_stop = 1;
+    for (i = 0; i < stripe_count; ++i) {
+	pthread_cond_signal(&stripe_devices[i].work);
+    }
+    pthread_mutex_unlock(&stripe_lock);
+
+    for (i = 0; i < stripe_count; ++i) {
+	if (stripe_devices[i].worker != 0) {
+	    pthread_join(stripe_devices[i].worker, NULL);
+	}
+	close(stripe_devices[i].fd);
+	pthread_cond_destroy(&stripe_devices[i].work);
+    }
+    stripe_count = 0;
+    stripe_stop = 0;
+}
+
+static int stripe_open(const char *path)
+{
+    char *paths = strdup(path);
+    char *saveptr = NULL;
+    char *name = NULL;
+    int retstat = 0;
+
+    stripe_count = 0;
+    stripe_stop = 0;
+    for (name = strtok_r(paths, ":", &saveptr); name != NULL; name = strtok_r(NULL, ":", &saveptr)) {
+	if (stripe_count == STRIPE_MAX_DEVICES) {
+	    errno = EINVAL;
+	    retstat = -1;
+	    break;
+	}
+	stripe_device *dev = &stripe_devices[stripe_count];
+	memset(dev, 0, sizeof(*dev));
+	dev->fd = open(name, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
+	if (dev->fd < 0) {
+	    retstat = -1;
+	    break;
+	}
+	dev->queue = NULL;
+	dev->queue_tail = &dev->queue;
+	pthread_cond_init(&dev->work, NULL);
+	stripe_count++;
+	if (pthread_create(&dev->worker, NULL, stripe_worker, dev) != 0) {
+	    dev->worker = 0;
+	    retstat = -1;
+	    break;
+	}
+    }
+    free(paths);
+
+    if ((retstat == 0) && (stripe_count == 0)) {
+	errno = EINVAL;
+	retstat = -1;
+    }
+    if (retstat < 0) {
+	int err = errno;
+	stripe_close();
+	errno = err;
+    }
+
+    return retstat;
+}
+
+/*
+ * Finds where the part of length bytes from offset that falls on file dev
+ * starts in it and how long it is, 0 if nothing falls on it.
+ */
+static off_t stripe_map(off_t offset, off_t length, int dev, off_t *dev_offset)
+{
+    off_t first = offset / stripe_unit;
+    off_t last = (offset + length - 1) / stripe_unit;
+
+    // First and last chunks on dev
+    off_t dev_first = first + ((dev - first % stripe_count) + stripe_count) % stripe_count;
+    off_t dev_last = last - ((last % stripe_count - dev) + stripe_count) % stripe_count;
+    if ((length == 0) || (dev_first > last) || (dev_last < first)) {
+	return 0;
+    }
+
+    off_t start = (dev_first / stripe_count) * stripe_unit;
+    if (dev_first == first) {
+	start += offset % stripe_unit;
+    }
+    off_t end = (dev_last / stripe_count + 1) * stripe_unit;
+    if (dev_last == last) {
+	end -= stripe_unit - ((offset + length - 1) % stripe_unit + 1);
+    }
+    *dev_offset = start;
+
+    return end - start;
+}
+
+/*
+ * Volume size from the file sizes, where the furthest byte written lands.
+ */
+static off_t stripe_size()
+{
+    off_t size = 0;
+    int i = 0;
+    for (i = 0; i < stripe_count; ++i) {
+	struct stat st;
+	if (fstat(stripe_devices[i].fd, &st) < 0) {
+	    return -1;
+	}
+	if (st.st_size > 0) {
+	    off_t row = (st.st_size - 1) / stripe_unit;
+	    off_t end = (row * stripe_count + i) * stripe_unit + (st.st_size - 1) % stripe_unit + 1;
+	    if (end > size) {
+		size = end;
+	    }
+	}
+    }
+
+    return size;
+}
+
+/*
+ * Splits the buffers of a volume I/O along the chunks, each file gets the
+ * pieces falling on it in order.
+ */
+static ssize_t stripe_rw(const struct iovec *iov, int count, off_t offset, int op)
+{
+    stripe_io ios[STRIPE_MAX_DEVICES];
+    size_t total = 0;
+    int i = 0;
+
+    for (i = 0; i < count; ++i) {
+	total += iov[i].iov_len;
+    }
+    if (total == 0) {
+	return 0;
+    }
+
+    // A piece ends at a chunk or a buffer boundary
+    int max_pieces = total / stripe_unit + 2 + count;
+    struct iovec *pieces = malloc(stripe_count * max_pieces * sizeof(struct iovec));
+    if (pieces == NULL) {
+	errno = ENOMEM;
+	return -1;
+    }
+    for (i = 0; i < stripe_count; ++i) {
+	ios[i].op = op;
+	ios[i].iov = pieces + i * max_pieces;
+	ios[i].count = 0;
+	stripe_map(offset, total, i, &ios[i].offset);
+    }
+
+    size_t done = 0;
+    size_t in_iov = 0;
+    i = 0;
+    while (done < total) {
+	off_t pos = offset + done;
+	int dev = (pos / stripe_unit) % stripe_count;
+	size_t len = stripe_unit - pos % stripe_unit;
+	if (len > iov[i].iov_len - in_iov) {
+	    len = iov[i].iov_len - in_iov;
+	}
+	stripe_io *io = &ios[dev];
+	io->iov[io->count].iov_base = (char*)iov[i].iov_base + in_iov;
+	io->iov[io->count].iov_len = len;
+	io->count++;
+
+	done += len;
+	in_iov += len;
+	if (in_iov == iov[i].iov_len) {
+	    i++;
+	    in_iov = 0;
+	}
+    }
+
+    stripe_submit(ios);
+
+    // A file shorter than the others reads as zeros past its end, the
+    // volume only ends where the longest one does
+    ssize_t retstat = total;
+    int short_read = 0;
+    for (i = 0; i < stripe_count; ++i) {
+	if (ios[i].result < 0) {
+	    errno = -ios[i].result;
+	    retstat = -1;
+	    break;
+	}
+	if (op == STRIPE_READ) {
+	    ssize_t got = ios[i].result;
+	    int k = 0;
+	    for (k = 0; k < ios[i].count; ++k) {
+		if (got < (ssize_t)ios[i].iov[k].iov_len) {
+		    memset((char*)ios[i].iov[k].iov_base + got, 0, ios[i].iov[k].iov_len - got);
+		    short_read = 1;
+		}
+		got = (got > (ssize_t)ios[i].iov[k].iov_len) ? (got - ios[i].iov[k].iov_len) : 0;
+	    }
+	}
+    }
+    if ((retstat > 0) && short_read) {
+	off_t size = stripe_size();
+	retstat = (offset >= size) ? 0 : ((offset + (off_t)total > size) ? (size - offset) : (off_t)total);
+    }
+    free(pieces);
+
+    return retstat;
+}
+
+static ssize_t stripe_readv(const struct iovec *iov, int count, off_t offset)
+{
+    return stripe_rw(iov, count, offset, STRIPE_READ);
+}
+
+static ssize_t stripe_writev(const struct iovec *iov, int count, off_t offset)
+{
+    return stripe_rw(iov, count, offset, STRIPE_WRITE);
+}
+
+static ssize_t stripe_read(void *buf, size_t size, off_t offset)
+{
+    struct iovec iov = { buf, size };
+    return stripe_rw(&iov, 1, offset, STRIPE_READ);
+}
+
+static ssize_t stripe_write(const void *buf, size_t size, off_t offset)
+{
+    struct iovec iov = { (void*)buf, size };
+    return stripe_rw(&iov, 1, offset, STRIPE_WRITE);
+}
+
+static int stripe_flush()
+{
+    stripe_io ios[STRIPE_MAX_DEVICES];
+    int i = 0;
+    for (i = 0; i < stripe_count; ++i) {
+	ios[i].op = STRIPE_FLUSH;
+	ios[i].count = 0;
+    }
+
+    stripe_submit(ios);
+    for (i = 0; i < stripe_count; ++i) {
+	if (ios[i].result < 0) {
+	    errno = -ios[i].result;
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+static int stripe_discard(off_t offset, off_t length)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    int i = 0;
+    for (i = 0; i < stripe_count; ++i) {
+	off_t dev_offset = 0;
+	off_t dev_length = stripe_map(offset, length, i, &dev_offset);
+	if ((dev_length > 0) && (fallocate(stripe_devices[i].fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, dev_offset, dev_length) < 0)) {
+	    return -1;
+	}
+    }
+
+    return 0;
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+const block_backend stripe_backend = {
+    "stripe", 0, stripe_open, stripe_read, stripe_write, stripe_readv, stripe_writev,
+    stripe_flush, stripe_discard, stripe_size, stripe_close
+};
+
+/*
+ * mirror backend. The disk file path lists the mirrors separated by ':',
+ * each one holds the whole volume. Writes, flushes and discards go to all
+ * of them at once through their workers, a read goes to the one with the
+ * fewest I/Os in flight and on error to the next one. A mirror failing an
+ * I/O is left out until unmount, the volume fails once all of them have.
+ * Nothing copies the volume to a new or failed mirror, it has to be in
+ * sync with the others when mounting.
+ */
+static int mirror_open(const char *path)
+{
+    int i = 0;
+    if (stripe_open(path) < 0) {
+	return -1;
+    }
+    for (i = 0; i < stripe_count; ++i) {
+	stripe_devices[i].failed = 0;
+	stripe_devices[i].in_flight = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Runs the same I/O on every mirror still in use, and leaves out those
+ * which fail it. Returns the result of a mirror that didn't.
+ */
+static ssize_t mirror_all(int op, const struct iovec *iov, int count, off_t offset)
+{
+    stripe_io ios[STRIPE_MAX_DEVICES];
+    int i = 0;
+
+    pthread_mutex_lock(&stripe_lock);
+    for (i = 0; i < stripe_count; ++i) {
+	ios[i].op = stripe_devices[i].failed ? STRIPE_READ : op;
+	ios[i].iov = (struct iovec*)iov;
+	ios[i].count = stripe_devices[i].failed ? 0 : count;
+	ios[i].offset = offset;
+    }
+    pthread_mutex_unlock(&stripe_lock);
+
+    stripe_submit(ios);
+
+    ssize_t retstat = -1;
+    int err = EIO;
+    pthread_mutex_lock(&stripe_lock);
+    for (i = 0; i < stripe_count; ++i) {
+	if ((ios[i].op == STRIPE_READ) && (ios[i].count == 0)) {
+	    continue;
+	}
+	if (ios[i].result >= 0) {
+	    retstat = ios[i].result;
+	} else {
+	    err = -ios[i].result;
+	    stripe_devices[i].failed = 1;
+	    fprintf(stderr, "mirror %d failed: %s\n", i, strerror(err));
+	}
+    }
+    pthread_mutex_unlock(&stripe_lock);
+
+    if (retstat < 0) {
+	errno = err;
+    }
+
+    return retstat;
+}
+
+static ssize_t mirror_readv(const struct iovec *iov, int count, off_t offset)
+{
+    int tried[STRIPE_MAX_DEVICES];
+    int err = EIO;
+    memset(tried, 0, sizeof(tried));
+
+    for (;;) {
+	int i = 0;
+	int best = -1;
+
+	pthread_mutex_lock(&stripe_lock);
+	for (i = 0; i < stripe_count; ++i) {
+	    if (!stripe_devices[i].failed && !tried[i] &&
+		    ((best < 0) || (stripe_devices[i].in_flight < stripe_devices[best].in_flight))) {
+		best = i;
+	    }
+	}
+	if (best >= 0) {
+	    stripe_devices[best].in_flight++;
+	}
+	pthread_mutex_unlock(&stripe_lock);
+	if (best < 0) {
+	    errno = err;
+	    return -1;
+	}
+
+	ssize_t retstat = preadv(stripe_devices[best].fd, iov, count, offset);
+	if (retstat < 0) {
+	    err = errno;
+	}
+
+	pthread_mutex_lock(&stripe_lock);
+	stripe_devices[best].in_flight--;
+	if (retstat < 0) {
+	    stripe_devices[best].failed = 1;
+	    fprintf(stderr, "mirror %d failed: %s, reading another one\n", best, strerror(err));
+	}
+	pthread_mutex_unlock(&stripe_lock);
+
+	if (retstat >= 0) {
+	    return retstat;
+	}
+	tried[best] = 1;
+    }
+}
+
+static ssize_t mirror_writev(const struct iovec *iov, int count, off_t offset)
+{
+    return mirror_all(STRIPE_WRITE, iov, count, offset);
+}
+
+static ssize_t mirror_read(void *buf, size_t size, off_t offset)
+{
+    struct iovec iov = { buf, size };
+    return mirror_readv(&iov, 1, offset);
+}
+
+static ssize_t mirror_write(const void *buf, size_t size, off_t offset)
+{
+    struct iovec iov = { (void*)buf, size };
+    return mirror_all(STRIPE_WRITE, &iov, 1, offset);
+}
+
+static int mirror_flush()
+{
+    return (mirror_all(STRIPE_FLUSH, NULL, 0, 0) < 0) ? -1 : 0;
+}
+
+static int mirror_discard(off_t offset, off_t length)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    int retstat = -1;
+    int err = EIO;
+    int i = 0;
+    for (i = 0; i < stripe_count; ++i) {
+	if (stripe_devices[i].failed) {
+	    continue;
+	}
+	if (fallocate(stripe_devices[i].fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) < 0) {
+	    err = errno;
+	} else {
+	    retstat = 0;
+	}
+    }
+    if (retstat < 0) {
+	errno = err;
+    }
+
+    return retstat;
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+static off_t mirror_size()
+{
+    off_t size = 0;
+    int i = 0;
+    for (i = 0; i < stripe_count; ++i) {
+	struct stat st;
+	if (!stripe_devices[i].failed && (fstat(stripe_devices[i].fd, &st) == 0) && (st.st_size > size)) {
+	    size = st.st_size;
+	}
+    }
+
+    return size;
+}
+
+const block_backend mirror_backend = {
+    "mirror", 0, mirror_open, mirror_read, mirror_write, mirror_readv, mirror_writev,
+    mirror_flush, mirror_discard, mirror_size, stripe_close
+};
+
+/*
+ * tier backend. The disk file path names a fast and a slow file separated
+ * by ':', the volume is the fast file followed by the slow one. The fast
+ * file gets the size of tier_backend_setup() when it is new, and keeps it,
+ * that size is where the slow tier starts on every later mount. The part
+ * of an I/O on each file goes through its worker like with stripe, so the
+ * two tiers work at the same time.
+ */
+static off_t tier_fast_size = 0; // Wanted size of a new fast file
+static off_t tier_split = 0; // Size of the fast file, 0 if the tier backend isn't open
+static int tier_written = 0; // The volume is formatted, there was data in it or it got some since
+
+/** Set the size of a new fast file for the tier backend
+ *
+ * size is rounded down to a multiple of 512 bytes.
+ */
+void tier_backend_setup(off_t size)
+{
+    tier_fast_size = size / 512 * 512;
+}
+
+/** Bytes at the start of the volume on the fast file
+ *
+ * 0 unless the tier backend is open.
+ */
+off_t tier_backend_split()
+{
+    return tier_split;
+}
+
+static void tier_close()
+{
+    stripe_close();
+    tier_split = 0;
+}
+
+static int tier_open(const char *path)
+{
+    struct stat st;
+    if (stripe_open(path) < 0) {
+	return -1;
+    }
+    if (stripe_count != 2) {
+	stripe_close();
+	errno = EINVAL;
+	return -1;
+    }
+
+    if (fstat(stripe_devices[0].fd, &st) < 0) {
+	int err = errno;
+	stripe_close();
+	errno = err;
+	return -1;
+    }
+    tier_written = (st.st_size > 0);
+    tier_split = st.st_size;
+    if (tier_split == 0) {
+	if ((tier_fast_size == 0) || (ftruncate(stripe_devices[0].fd, tier_fast_size) < 0)) {
+	    int err = (tier_fast_size == 0) ? EINVAL : errno;
+	    stripe_close();
+	    errno = err;
+	    return -1;
+	}
+	tier_split = tier_fast_size;
+    }
+
+    return 0;
+}
+
+/*
+ * Splits the buffers of a volume I/O at the end of the fast file, the part
+ * below it goes to the fast file, the rest to the slow one.
+ */
+static ssize_t tier_rw(const struct iovec *iov, int count, off_t offset, int op)
+{
+    stripe_io ios[2];
+    size_t total = 0;
+    int i = 0;
+
+    for (i = 0; i < count; ++i) {
+	total += iov[i].iov_len;
+    }
+    if (total == 0) {
+	return 0;
+    }
+    if (op == STRIPE_WRITE) {
+	tier_written = 1;
+    }
+
+    // At most one buffer gets cut in two
+    struct iovec *pieces = malloc(2 * (count + 1) * sizeof(struct iovec));
+    if (pieces == NULL) {
+	errno = ENOMEM;
+	return -1;
+    }
+    for (i = 0; i < 2; ++i) {
+	ios[i].op = op;
+	ios[i].iov = pieces + i * (count + 1);
+	ios[i].count = 0;
+    }
+    ios[0].offset = offset;
+    ios[1].offset = (offset > tier_split) ? (offset - tier_split) : 0;
+
+    off_t pos = offset;
+    for (i = 0; i < count; ++i) {
+	size_t done = 0;
+	while (done < iov[i].iov_len) {
+	    int dev = (pos >= tier_split);
+	    size_t len = iov[i].iov_len - done;
+	    if (!dev && (pos + (off_t)len > tier_split)) {
+		len = tier_split - pos;
+	    }
+	    stripe_io *io = &ios[dev];
+	    io->iov[io->count].iov_base = (char*)iov[i].iov_base + done;
+	    io->iov[io->count].iov_len = len;
+	    io->count++;
+	    done += len;
+	    pos += len;
+	}
+    }
+
+    stripe_submit(ios);
+
+    // The slow file reads as zeros past its end
+    ssize_t retstat = total;
+    for (i = 0; i < 2; ++i) {
+	if (ios[i].result < 0) {
+	    errno = -ios[i].result;
+	    retstat = -1;
+	    break;
+	}
+	if (op == STRIPE_READ) {
+	    ssize_t got = ios[i].result;
+	    int k = 0;
+	    for (k = 0; k < ios[i].count; ++k) {
+		if (got < (ssize_t)ios[i].iov[k].iov_len) {
+		    memset((char*)ios[i].iov[k].iov_base + got, 0, ios[i].iov[k].iov_len - got);
+		}
+		got = (got > (ssize_t)ios[i].iov[k].iov_len) ? (got - ios[i].iov[k].iov_len) : 0;
+	    }
+	}
+    }
+    free(pieces);
+
+    return retstat;
+}
+
+static ssize_t tier_readv(const struct iovec *iov, int count, off_t offset)
+{
+    return tier_rw(iov, count, offset, STRIPE_READ);
+}
+
+static ssize_t tier_writev(const struct iovec *iov, int count, off_t offset)
+{
+    return tier_rw(iov, count, offset, STRIPE_WRITE);
+}
+
+static ssize_t tier_read(void *buf, size_t size, off_t offset)
+{
+    struct iovec iov = { buf, size };
+    return tier_rw(&iov, 1, offset, STRIPE_READ);
+}
+
+static ssize_t tier_write(const void *buf, size_t size, off_t offset)
+{
+    struct iovec iov = { (void*)buf, size };
+    return tier_rw(&iov, 1, offset, STRIPE_WRITE);
+}
+
+static int tier_discard(off_t offset, off_t length)
+{
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (offset < tier_split) {
+	off_t fast_length = (offset + length > tier_split) ? (tier_split - offset) : length;
+	if (fallocate(stripe_devices[0].fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, fast_length) < 0) {
+	    return -1;
+	}
+	offset += fast_length;
+	length -= fast_length;
+    }
+    if ((length > 0) &&
+	    (fallocate(stripe_devices[1].fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset - tier_split, length) < 0)) {
+	return -1;
+    }
+
+    return 0;
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+/*
+ * The fast file has its full size from the start, a volume is new until
+ * something gets written to it.
+ */
+static off_t tier_size()
+{
+    struct stat st;
+    if (fstat(stripe_devices[1].fd, &st) < 0) {
+	return -1;
+    }
+
+    return tier_written ? (tier_split + st.st_size) : 0;
+}
+
+const block_backend tier_backend = {
+    "tier", 0, tier_open, tier_read, tier_write, tier_readv, tier_writev,
+    stripe_flush, tier_discard, tier_size, tier_close
+};
+
+/*
+ * sim backend. Passes everything on to the backend it wraps, but makes each
+ * I/O take as long as it would on a modelled device: a fixed latency, a
+ * seek and half a rotation for a disk head that has to move, and the
+ * transfer at the device bandwidth. At most qdepth I/Os are in flight,
+ * the others wait for a slot. Given the same I/O sequence the times are
+ * the same on any host, as long as it is faster than the model.
+ */
+typedef struct {
+    const char *name;
+    int latency_us; // Per I/O
+    int bandwidth_mb; // MB/s, transfers share it
+    int qdepth;
+    int seeks; // One head, I/Os are served one after the other and pay for moving it
+} sim_model;
+
+static const sim_model sim_models[] = {
+    { "hdd", 100, 150, 1, 1 },
+    { "ssd", 80, 500, 32, 0 },
+    { NULL, 0, 0, 0, 0 }
+};
+
+#define SIM_SEEK_MIN_US 500 // Track to track
+#define SIM_SEEK_MAX_US 8000 // Full stroke, seeks get longer linearly in between
+#define SIM_STROKE_BYTES (1LL << 40) // Distance of a full stroke
+#define SIM_ROTATION_US 4167 // Half a turn at 7200 rpm
+
+static const block_backend *sim_lower = NULL;
+static sim_model sim;
+static int sim_configured = 0;
+static int sim_in_flight = 0;
+static off_t sim_head = 0; // Where the last I/O ended
+static long long sim_busy_until = 0; // Microseconds, end of the transfers (and seeks) queued so far
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sim_cond = PTHREAD_COND_INITIALIZER;
+
+/** Pick the device model of the sim backend
+ *
+ * model is hdd or ssd, NULL for no simulation. The other values replace
+ * those of the model when > 0. Returns -1 for an unknown model.
+ */
+int sim_backend_setup(const char *model, int latency_us, int bandwidth_mb, int qdepth)
+{
+    int i = 0;
+    sim_configured = 0;
+    if (model == NULL) {
+	return 0;
+    }
+
+    for (i = 0; sim_models[i].name != NULL; ++i) {
+	if (strcmp(sim_models[i].name, model) == 0) {
+	    break;
+	}
+    }
+    if (sim_models[i].name == NULL) {
+	return -1;
+    }
+
+    sim = sim_models[i];
+    if (latency_us > 0) {
+	sim.latency_us = latency_us;
+    }
+    if (bandwidth_mb > 0) {
+	sim.bandwidth_mb = bandwidth_mb;
+    }
+    if (qdepth > 0) {
+	sim.qdepth = qdepth;
+    }
+    sim_configured = 1;
+
+    return 0;
+}
+
+static long long sim_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * Takes a queue slot for an I/O of size bytes at offset, -1 for one that
+ * doesn't move the head (a flush), and returns when it completes.
+ */
+static long long sim_start(off_t offset, size_t size)
+{
+    pthread_mutex_lock(&sim_lock);
+    while (sim_in_flight >= sim.qdepth) {
+	pthread_cond_wait(&sim_cond, &sim_lock);
+    }
+    sim_in_flight++;
+
+    long long now = sim_now();
+    long long service = sim.latency_us;
+    long long transfer = (long long)size / sim.bandwidth_mb; // Bytes per MB/s are microseconds
+    if (sim.seeks && (offset >= 0) && (offset != sim_head)) {
+	long long distance = (offset > sim_head) ? (offset - sim_head) : (sim_head - offset);
+	if (distance > SIM_STROKE_BYTES) {
+	    distance = SIM_STROKE_BYTES;
+	}
+	service += SIM_SEEK_MIN_US + (SIM_SEEK_MAX_US - SIM_SEEK_MIN_US) * distance / SIM_STROKE_BYTES + SIM_ROTATION_US;
+    }
+    if (offset >= 0) {
+	sim_head = offset + size;
+    }
+
+    long long done = 0;
+    long long start = (sim_busy_until > now) ? sim_busy_until : now;
+    if (sim.seeks) {
+	done = start + service + transfer;
+	sim_busy_until = done;
+    } else {
+	sim_busy_until = start + transfer;
+	done = (now + service > sim_busy_until) ? (now + service) : sim_busy_until;
+    }
+    pthread_mutex_unlock(&sim_lock);
+
+    return done;
+}
+
+/*
+ * Waits for the modelled completion of the I/O, the real one is done
+ * already, and gives back its queue slot.
+ */
+static void sim_finish(long long done)
+{
+    struct timespec until;
+    until.tv_sec = done / 1000000;
+    until.tv_nsec = (done % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {
+    }
+
+    pthread_mutex_lock(&sim_lock);
+    sim_in_flight--;
+    pthread_cond_signal(&sim_cond);
+    pthread_mutex_unlock(&sim_lock);
+}
+
+static size_t sim_iov_size(const struct iovec *iov, int count)
+{
+    size_t size = 0;
+    int i = 0;
+    for (i = 0; i < count; ++i) {
+	size += iov[i].iov_len;
+    }
+
+    return size;
+}
+
+static int sim_open(const char *path)
+{
+    return sim_lower->open(path);
+}
+
+static ssize_t sim_read(void *buf, size_t size, off_t offset)
+{
+    long long done = sim_start(offset, size);
+    ssize_t retstat = sim_lower->read(buf, size, offset);
+    sim_finish(done);
+
+    return retstat;
+}
+
+static ssize_t sim_write(const void *buf, size_t size, off_t offset)
+{
+    long long done = sim_start(offset, size);
+    ssize_t retstat = sim_lower->write(buf, size, offset);
+    sim_finish(done);
+
+    return retstat;
+}
+
+static ssize_t sim_readv(const struct iovec *iov, int count, off_t offset)
+{
+    long long done = sim_start(offset, sim_iov_size(iov, count));
+    ssize_t retstat = sim_lower->readv(iov, count, offset);
+    sim_finish(done);
+
+    return retstat;
+}
+
+static ssize_t sim_writev(const struct iovec *iov, int count, off_t offset)
+{
+    long long done = sim_start(offset, sim_iov_size(iov, count));
+    ssize_t retstat = sim_lower->writev(iov, count, offset);
+    sim_finish(done);
+
+    return retstat;
+}
+
+static int sim_flush()
+{
+    long long done = sim_start(-1, 0);
+    int retstat = sim_lower->flush();
+    sim_finish(done);
+
+    return retstat;
+}
+
+static int sim_discard(off_t offset, off_t length)
+{
+    return sim_lower->discard(offset, length);
+}
+
+static off_t sim_size()
+{
+    return sim_lower->size();
+}
+
+static void sim_close()
+{
+    sim_lower->close();
+    sim_lower = NULL;
+}
+
+static const block_backend sim_backend = {
+    "sim", 0, sim_open, sim_read, sim_write, sim_readv, sim_writev,
+    sim_flush, sim_discard, sim_size, sim_close
+};
+
+/** Put the device model of sim_backend_setup() in front of an open backend
+ *
+ * Returns the backend itself if no model was picked.
+ */
+const block_backend* sim_backend_wrap(const block_backend *lower)
+{
+    if (!sim_configured) {
+	return lower;
+    }
+
+    sim_lower = lower;
+    sim_head = 0;
+    sim_busy_until = 0;
+    sim_in_flight = 0;
+
+    return &sim_backend;
+}
+
+static const block_backend *backends[] = {
+    &file_backend, &mmap_backend, &ram_backend, &uring_backend, &stripe_backend,
+    &mirror_backend, &tier_backend, NULL
+};
+
+/** Find a backend by name, NULL picks the file backend
+ *
+ * Returns NULL if there is none with that name.
+ */
+const block_backend* backend_find(const char *name)
+{
+    int i = 0;
+    if (name == NULL) {
+	return &file_backend;
+    }
+
+    for (i = 0; backends[i] != NULL; ++i) {
+	if (strcmp(backends[i]->name, name) == 0) {
+	    return backends[i];
+	}
+    }
+
+    return NULL;
+}
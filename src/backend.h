@@ -0,0 +1,50 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _BACKEND_H_
+#define _BACKEND_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Where block.c keeps the blocks, picked with the backend= mount option.
+ * Offsets and sizes are in bytes. Like the system calls they stand in for,
+ * the functions return -1 with errno set on failure, reads return 0 past
+ * the end of what was ever written.
+ */
+typedef struct block_backend {
+    const char *name;
+    int uncached; // As fast as memory, block.c doesn't cache its blocks
+    int (*open)(const char *path);
+    ssize_t (*read)(void *buf, size_t size, off_t offset);
+    ssize_t (*write)(const void *buf, size_t size, off_t offset);
+    ssize_t (*readv)(const struct iovec *iov, int count, off_t offset);
+    ssize_t (*writev)(const struct iovec *iov, int count, off_t offset);
+    int (*flush)();
+    int (*discard)(off_t offset, off_t length); // Range reads as zeros afterwards
+    off_t (*size)(); // Bytes in the store, 0 when it has to be formatted
+    void (*close)();
+} block_backend;
+
+extern const block_backend file_backend;
+extern const block_backend mmap_backend;
+extern const block_backend ram_backend;
+extern const block_backend uring_backend;
+extern const block_backend stripe_backend;
+extern const block_backend mirror_backend;
+extern const block_backend tier_backend;
+
+const block_backend* backend_find(const char *name);
+void ram_backend_reserve(size_t size, int hugepages);
+void stripe_backend_setup(size_t unit);
+void tier_backend_setup(off_t size);
+off_t tier_backend_split();
+int sim_backend_setup(const char *model, int latency_us, int bandwidth_mb, int qdepth);
+const block_backend* sim_backend_wrap(const block_backend *lower);
+
+#endif
@@ -0,0 +1,361 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Microbenchmarks of the block, inode and directory layers, run in process
+  on top of libsfs by `make bench`. The results go to stdout as JSON, one
+  entry per benchmark, so runs of different releases can be compared.
+
+  usage: sfs_bench [-o options] [diskfile]
+
+  options are the mount options of sfs, diskfile must not exist yet, it
+  is created, formatted and removed again. The block layer benchmarks
+  run first, on the file backend and a store of their own in diskfile.
+*/
+
+#include "params.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "inode.h"
+#include "libsfs.h"
+
+#define BENCH_DEFAULT_DISKFILE "sfs_bench.img"
+#define BENCH_DEFAULT_OPTIONS "nblocks=524288" // 256MB volume
+#define BENCH_BLOCKS 16384 // Store of the block layer benchmarks, 4 times the block cache
+#define BENCH_INODES 1024 // Inodes get_inode() and update_inode_data() pick from
+#define BENCH_INODE_OPS 200000
+#define BENCH_FILES 4096 // Files created and then unlinked
+#define BENCH_LOOKUPS 20000 // path_2_ino() calls per directory size
+#define BENCH_FILE_SIZE (64 * 1024 * 1024) // File of the read/write benchmarks
+#define BENCH_SEQ_IO (128 * 1024) // Bytes per sequential read_inode()/write_inode()
+#define BENCH_RAND_IO 4096 // Bytes per random read_inode()/write_inode()
+#define BENCH_RAND_OPS 8192
+
+// Entries in the directories path_2_ino() looks names up in
+static const int bench_dir_sizes[] = { 16, 256, 4096 };
+
+static int bench_results = 0; // Entries printed so far
+static uint32_t bench_seed = 2463534242u;
+
+/*
+ * Deterministic xorshift, every run does the same random I/O.
+ */
+static uint32_t bench_rand()
+{
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 17;
+    bench_seed ^= bench_seed << 5;
+
+    return bench_seed;
+}
+
+static double bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void bench_fail(const char *what)
+{
+    fprintf(stderr, "sfs_bench: %s failed: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+/*
+ * Prints the entry of one benchmark. dir_entries is only printed if it
+ * is not negative, bytes only if it is not 0.
+ */
+static void bench_result(const char *name, int dir_entries, long ops, uint64_t bytes, double start)
+{
+    double seconds = bench_now() - start;
+
+    printf("%s\n    { \"name\": \"%s\"", (bench_results++ > 0) ? "," : "", name);
+    if (dir_entries >= 0) {
+	printf(", \"dir_entries\": %d", dir_entries);
+    }
+    printf(", \"ops\": %ld, \"seconds\": %.6f, \"ops_per_sec\": %.1f", ops, seconds, ops / seconds);
+    if (bytes > 0) {
+	printf(", \"mb_per_sec\": %.2f", bytes / seconds / (1024 * 1024));
+    }
+    printf(" }");
+    fflush(stdout);
+}
+
+/*
+ * block_write() and block_read() through the block cache, sequential
+ * writes and reads and random reads over a store 4 times its size.
+ */
+static void bench_block(const char *diskfile)
+{
+    char buf[BLOCK_SIZE];
+    double start = 0;
+    int i = 0;
+
+    errno = 0;
+    if (disk_open(diskfile, NULL) < 0) {
+	bench_fail("disk_open");
+    }
+    memset(buf, 0xa5, BLOCK_SIZE);
+
+    start = bench_now();
+    for (i = 0; i < BENCH_BLOCKS; ++i) {
+	block_write(i, buf);
+    }
+    disk_sync();
+    bench_result("block_write_seq", -1, BENCH_BLOCKS, (uint64_t)BENCH_BLOCKS * BLOCK_SIZE, start);
+
+    start = bench_now();
+    for (i = 0; i < BENCH_BLOCKS; ++i) {
+	block_read(i, buf);
+    }
+    bench_result("block_read_seq", -1, BENCH_BLOCKS, (uint64_t)BENCH_BLOCKS * BLOCK_SIZE, start);
+
+    start = bench_now();
+    for (i = 0; i < BENCH_BLOCKS; ++i) {
+	block_read(bench_rand() % BENCH_BLOCKS, buf);
+    }
+    bench_result("block_read_rand", -1, BENCH_BLOCKS, (uint64_t)BENCH_BLOCKS * BLOCK_SIZE, start);
+
+    disk_close();
+}
+
+/*
+ * Creates count files in the new directory dir, their inode numbers go
+ * to inos if it isn't NULL.
+ */
+static void bench_fill_dir(sfs_volume *vol, const char *dir, int count, uint64_t *inos)
+{
+    char path[PATH_MAX];
+    int i = 0;
+
+    if (libsfs_mkdir(vol, dir, 0755) < 0) {
+	bench_fail("mkdir");
+    }
+    for (i = 0; i < count; ++i) {
+	snprintf(path, sizeof(path), "%s/f%d", dir, i);
+	uint64_t ino = create_inode(path, S_IFREG | 0644);
+	if (ino == SFS_INVALID_INO) {
+	    errno = ENOSPC;
+	    bench_fail("create_inode");
+	}
+	if (inos != NULL) {
+	    inos[i] = ino;
+	}
+    }
+}
+
+/*
+ * get_inode() and update_inode_data() of random inodes, all of them in
+ * the inode cache.
+ */
+static void bench_inode(sfs_volume *vol)
+{
+    uint64_t *inos = malloc(sizeof(uint64_t) * BENCH_INODES);
+    sfs_inode_t *inodes = malloc(sizeof(sfs_inode_t) * BENCH_INODES);
+    sfs_inode_t inode;
+    double start = 0;
+    int i = 0;
+
+    bench_fill_dir(vol, "/inodes", BENCH_INODES, inos);
+    for (i = 0; i < BENCH_INODES; ++i) {
+	get_inode(inos[i], &inodes[i]);
+    }
+
+    start = bench_now();
+    for (i = 0; i < BENCH_INODE_OPS; ++i) {
+	get_inode(inos[bench_rand() % BENCH_INODES], &inode);
+    }
+    bench_result("get_inode", -1, BENCH_INODE_OPS, 0, start);
+
+    start = bench_now();
+    for (i = 0; i < BENCH_INODE_OPS; ++i) {
+	int k = bench_rand() % BENCH_INODES;
+	update_inode_data(inos[k], &inodes[k]);
+    }
+    bench_result("update_inode_data", -1, BENCH_INODE_OPS, 0, start);
+
+    free(inodes);
+    free(inos);
+}
+
+/*
+ * path_2_ino() of random names in directories of growing size.
+ */
+static void bench_lookup(sfs_volume *vol)
+{
+    char dir[SFS_MAX_LENGTH_FILE_NAME];
+    char path[PATH_MAX];
+    size_t d = 0;
+    int i = 0;
+
+    for (d = 0; d < sizeof(bench_dir_sizes) / sizeof(bench_dir_sizes[0]); ++d) {
+	int size = bench_dir_sizes[d];
+	snprintf(dir, sizeof(dir), "/lookup%d", size);
+	bench_fill_dir(vol, dir, size, NULL);
+
+	double start = bench_now();
+	for (i = 0; i < BENCH_LOOKUPS; ++i) {
+	    snprintf(path, sizeof(path), "%s/f%u", dir, bench_rand() % size);
+	    if (path_2_ino(path) == SFS_INVALID_INO) {
+		errno = ENOENT;
+		bench_fail("path_2_ino");
+	    }
+	}
+	bench_result("path_2_ino", size, BENCH_LOOKUPS, 0, start);
+    }
+}
+
+/*
+ * create_inode() and remove_inode() of files in one directory.
+ */
+static void bench_create(sfs_volume *vol)
+{
+    char path[PATH_MAX];
+    double start = 0;
+    int i = 0;
+
+    if (libsfs_mkdir(vol, "/files", 0755) < 0) {
+	bench_fail("mkdir");
+    }
+
+    start = bench_now();
+    for (i = 0; i < BENCH_FILES; ++i) {
+	snprintf(path, sizeof(path), "/files/f%d", i);
+	if (create_inode(path, S_IFREG | 0644) == SFS_INVALID_INO) {
+	    errno = ENOSPC;
+	    bench_fail("create_inode");
+	}
+    }
+    flush_inodes();
+    bench_result("create", -1, BENCH_FILES, 0, start);
+
+    start = bench_now();
+    for (i = 0; i < BENCH_FILES; ++i) {
+	snprintf(path, sizeof(path), "/files/f%d", i);
+	if ((errno = -remove_inode(path)) > 0) {
+	    bench_fail("remove_inode");
+	}
+    }
+    flush_inodes();
+    bench_result("unlink", -1, BENCH_FILES, 0, start);
+}
+
+/*
+ * write_inode() and read_inode() of a file, sequential and at random 4K
+ * aligned offsets. The writes are on disk before the clock stops.
+ */
+static void bench_rw(sfs_volume *vol)
+{
+    char *buf = malloc(BENCH_SEQ_IO);
+    sfs_readahead_t ra;
+    sfs_inode_t inode;
+    double start = 0;
+    off_t offset = 0;
+    int i = 0;
+
+    memset(buf, 0x5a, BENCH_SEQ_IO);
+    memset(&ra, 0, sizeof(ra));
+    uint64_t ino = create_inode("/data", S_IFREG | 0644);
+    if (ino == SFS_INVALID_INO) {
+	errno = ENOSPC;
+	bench_fail("create_inode");
+    }
+    get_inode(ino, &inode);
+
+    start = bench_now();
+    for (offset = 0; offset < BENCH_FILE_SIZE; offset += BENCH_SEQ_IO) {
+	if ((errno = -write_inode(&inode, buf, BENCH_SEQ_IO, offset)) > 0) {
+	    bench_fail("write_inode");
+	}
+    }
+    libsfs_sync(vol);
+    bench_result("write_seq", -1, BENCH_FILE_SIZE / BENCH_SEQ_IO, BENCH_FILE_SIZE, start);
+
+    start = bench_now();
+    for (offset = 0; offset < BENCH_FILE_SIZE; offset += BENCH_SEQ_IO) {
+	readahead_inode(&inode, &ra, BENCH_SEQ_IO, offset);
+	if ((errno = -read_inode(&inode, buf, BENCH_SEQ_IO, offset)) > 0) {
+	    bench_fail("read_inode");
+	}
+    }
+    bench_result("read_seq", -1, BENCH_FILE_SIZE / BENCH_SEQ_IO, BENCH_FILE_SIZE, start);
+
+    start = bench_now();
+    for (i = 0; i < BENCH_RAND_OPS; ++i) {
+	offset = (off_t)(bench_rand() % (BENCH_FILE_SIZE / BENCH_RAND_IO)) * BENCH_RAND_IO;
+	if ((errno = -write_inode(&inode, buf, BENCH_RAND_IO, offset)) > 0) {
+	    bench_fail("write_inode");
+	}
+    }
+    libsfs_sync(vol);
+    bench_result("write_rand", -1, BENCH_RAND_OPS, (uint64_t)BENCH_RAND_OPS * BENCH_RAND_IO, start);
+
+    start = bench_now();
+    for (i = 0; i < BENCH_RAND_OPS; ++i) {
+	offset = (off_t)(bench_rand() % (BENCH_FILE_SIZE / BENCH_RAND_IO)) * BENCH_RAND_IO;
+	readahead_inode(&inode, &ra, BENCH_RAND_IO, offset);
+	if ((errno = -read_inode(&inode, buf, BENCH_RAND_IO, offset)) > 0) {
+	    bench_fail("read_inode");
+	}
+    }
+    bench_result("read_rand", -1, BENCH_RAND_OPS, (uint64_t)BENCH_RAND_OPS * BENCH_RAND_IO, start);
+
+    free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *diskfile = BENCH_DEFAULT_DISKFILE;
+    const char *options = BENCH_DEFAULT_OPTIONS;
+    struct stat statbuf;
+    int opt = 0;
+
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+	if (opt != 'o') {
+	    fprintf(stderr, "usage:  sfs_bench [-o options] [diskfile]\n");
+	    return EXIT_FAILURE;
+	}
+	options = optarg;
+    }
+    if (optind < argc) {
+	diskfile = argv[optind];
+	if (stat(diskfile, &statbuf) == 0) {
+	    fprintf(stderr, "sfs_bench: %s exists, the benchmarks need a new file\n", diskfile);
+	    return EXIT_FAILURE;
+	}
+    } else {
+	unlink(diskfile); // Left behind by a run that didn't finish
+    }
+
+    printf("{\n  \"diskfile\": \"%s\",\n  \"options\": \"%s\",\n  \"block_size\": %d,\n  \"results\": [",
+	    diskfile, options, BLOCK_SIZE);
+
+    bench_block(diskfile);
+    unlink(diskfile);
+
+    sfs_volume *vol = libsfs_mount(diskfile, options);
+    if (vol == NULL) {
+	bench_fail("libsfs_mount");
+    }
+    bench_inode(vol);
+    bench_lookup(vol);
+    bench_create(vol);
+    bench_rw(vol);
+    libsfs_unmount(vol);
+    unlink(diskfile);
+
+    printf("\n  ]\n}\n");
+
+    return EXIT_SUCCESS;
+}
@@ -5,35 +5,341 @@
   See the file COPYING.
 */
 
-#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <sys/types.h>
-#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 
+#include "config.h"
 #include "block.h"
+#include "backend.h"
+#include "list.h"
 
-int diskfile = -1;
+static const block_backend *backend = NULL;
 
-void disk_open(const char* diskfile_path)
+/*
+ * Block cache. Reads are served from memory when the block is cached, every
+ * write goes to the disk file and updates the cached copy. Blocks passed to
+ * block_prefetch() are read into the cache by a background thread, so a
+ * sequential reader finds them there instead of waiting on the disk.
+ * Backends keeping the blocks in memory already (uncached) go without it.
+ */
+#define BLOCK_CACHE_BLOCKS 4096 // 2MB
+#define BLOCK_CACHE_HASH 1024
+#define BLOCK_PREFETCH_QUEUE 1024 // Pending prefetch requests, more get dropped
+#define BLOCK_PREFETCH_MAX_RUN 64 // Adjacent blocks fetched with a single read
+
+#define BLOCK_LOADING 0 // Read in progress, data not valid yet
+#define BLOCK_VALID 1
+
+typedef struct cached_block {
+    int block_num;
+    int state;
+    struct cached_block *hash_next;
+    list_t lru; // Least recently used first, or free list
+    char data[BLOCK_SIZE];
+} cached_block;
+
+static cached_block *cache_pool = NULL;
+static cached_block *cache_hash[BLOCK_CACHE_HASH];
+static list_t cache_lru;
+static list_t cache_free;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_loaded = PTHREAD_COND_INITIALIZER; // Signalled when a BLOCK_LOADING block is done
+
+static int prefetch_queue[BLOCK_PREFETCH_QUEUE];
+static int prefetch_head = 0;
+static int prefetch_count = 0;
+static int prefetch_stop = 0;
+static int prefetch_running = 0;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t prefetcher;
+
+static void* block_prefetcher(void *arg);
+
+/*
+ * Opens the block store with the backend of that name, NULL for the
+ * default file backend. io_uring in a kernel without it gets replaced by
+ * the file backend, any other failure is returned. The device
+ * model of sim_backend_setup() goes in front of it, if one was picked.
+ * Returns -errno if there is no store to be had, -EBUSY if one is open.
+ */
+int disk_open(const char* diskfile_path, const char *backend_name)
 {
-    if(diskfile >= 0){
-	return;
+    if(backend != NULL){
+	return -EBUSY;
+    }
+
+    backend = backend_find(backend_name);
+    if (backend == NULL) {
+	fprintf(stderr, "disk_open unknown backend %s\n", backend_name);
+	return -EINVAL;
+    }
+    int retstat = backend->open(diskfile_path);
+    if ((retstat < 0) && (backend == &uring_backend) && (errno == ENOSYS)) {
+	perror("disk_open io_uring failed, using file");
+	backend = &file_backend;
+	retstat = backend->open(diskfile_path);
     }
-    
-    diskfile = open(diskfile_path, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
-    if (diskfile < 0) {
+    if (retstat < 0) {
+	retstat = -errno;
 	perror("disk_open failed");
-	exit(EXIT_FAILURE);
+	backend = NULL;
+	return retstat;
+    }
+    backend = sim_backend_wrap(backend);
+
+    int i = 0;
+    memset(cache_hash, 0, sizeof(cache_hash));
+    INIT_LIST_HEAD(&cache_lru);
+    INIT_LIST_HEAD(&cache_free);
+    if (backend->uncached) {
+	return 0;
+    }
+
+    cache_pool = malloc(BLOCK_CACHE_BLOCKS * sizeof(cached_block));
+    if (cache_pool == NULL) {
+	fprintf(stderr, "disk_open no memory for the block cache\n");
+	backend->close();
+	backend = NULL;
+	return -ENOMEM;
     }
+    for (i = 0; i < BLOCK_CACHE_BLOCKS; ++i) {
+	list_add_tail(&cache_pool[i].lru, &cache_free);
+    }
+
+    prefetch_head = prefetch_count = 0;
+    prefetch_stop = 0;
+    prefetch_running = (pthread_create(&prefetcher, NULL, block_prefetcher, NULL) == 0);
+    if (!prefetch_running) {
+	perror("disk_open couldn't start the prefetch thread");
+    }
+
+    return 0;
 }
 
 void disk_close()
 {
-    if(diskfile >= 0){
-	close(diskfile);
+    if (prefetch_running) {
+	pthread_mutex_lock(&cache_lock);
+	prefetch_stop = 1;
+	pthread_cond_signal(&prefetch_cond);
+	pthread_mutex_unlock(&cache_lock);
+
+	pthread_join(prefetcher, NULL);
+	prefetch_running = 0;
+    }
+
+    if(backend != NULL){
+	backend->close();
+	backend = NULL;
+    }
+
+    free(cache_pool);
+    cache_pool = NULL;
+}
+
+/*
+ * Caller must hold cache_lock for all cache_* functions.
+ */
+static cached_block* cache_lookup(int block_num)
+{
+    cached_block *block = cache_hash[block_num % BLOCK_CACHE_HASH];
+    while ((block != NULL) && (block->block_num != block_num)) {
+	block = block->hash_next;
+    }
+
+    return block;
+}
+
+static void cache_remove(cached_block *block)
+{
+    cached_block **link = &cache_hash[block->block_num % BLOCK_CACHE_HASH];
+    while (*link != block) {
+	link = &(*link)->hash_next;
+    }
+    *link = block->hash_next;
+
+    list_del(&block->lru);
+    list_add_tail(&block->lru, &cache_free);
+}
+
+/*
+ * Adds a block in BLOCK_LOADING state, taking the least recently used
+ * loaded block if the cache is full. Returns NULL if nothing can be evicted.
+ */
+static cached_block* cache_insert(int block_num)
+{
+    cached_block *block = NULL;
+    if (list_empty(&cache_free)) {
+	list_t *pos = NULL;
+	list_for_each(pos, &cache_lru) {
+	    cached_block *victim = list_entry(pos, cached_block, lru);
+	    if (victim->state == BLOCK_VALID) {
+		cache_remove(victim);
+		break;
+	    }
+	}
+	if (list_empty(&cache_free)) {
+	    return NULL;
+	}
     }
+
+    block = list_entry(cache_free.next, cached_block, lru);
+    list_del(&block->lru);
+    list_add_tail(&block->lru, &cache_lru);
+
+    block->block_num = block_num;
+    block->state = BLOCK_LOADING;
+    block->hash_next = cache_hash[block_num % BLOCK_CACHE_HASH];
+    cache_hash[block_num % BLOCK_CACHE_HASH] = block;
+
+    return block;
+}
+
+/*
+ * Puts data just written to the disk file into the cache.
+ */
+static void cache_update(int block_num, const void *buf)
+{
+    cached_block *block = cache_lookup(block_num);
+    if (block == NULL) {
+	block = cache_insert(block_num);
+    }
+    if (block != NULL) {
+	memcpy(block->data, buf, BLOCK_SIZE);
+	block->state = BLOCK_VALID;
+	pthread_cond_broadcast(&cache_loaded);
+    }
+}
+
+/*
+ * Reads count adjacent blocks from the disk file into buf, and into the
+ * cache for those which aren't there yet.
+ */
+static int read_through(const int block_num, int count, char *buf)
+{
+    int retstat = 0;
+    int i = 0;
+    cached_block *loading[BLOCK_PREFETCH_MAX_RUN];
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < count; ++i) {
+	loading[i] = (cache_lookup(block_num + i) == NULL) ? cache_insert(block_num + i) : NULL;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    retstat = backend->read(buf, (size_t)count*BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+
+    // A write which happened in the meantime has made the block valid
+    // already, with newer data than what was read here
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < count; ++i) {
+	if ((loading[i] != NULL) && (loading[i]->state == BLOCK_LOADING)) {
+	    if (retstat >= (i + 1)*BLOCK_SIZE) {
+		memcpy(loading[i]->data, buf + i*BLOCK_SIZE, BLOCK_SIZE);
+		loading[i]->state = BLOCK_VALID;
+	    } else {
+		cache_remove(loading[i]);
+	    }
+	}
+    }
+    pthread_cond_broadcast(&cache_loaded);
+    pthread_mutex_unlock(&cache_lock);
+
+    return retstat;
+}
+
+static void* block_prefetcher(void *arg)
+{
+    (void)arg;
+    char *buf = malloc(BLOCK_PREFETCH_MAX_RUN * BLOCK_SIZE);
+    if (buf == NULL) {
+	perror("block_prefetcher");
+	return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    while (!prefetch_stop) {
+	if (prefetch_count == 0) {
+	    pthread_cond_wait(&prefetch_cond, &cache_lock);
+	    continue;
+	}
+
+	// Take a run of adjacent blocks off the queue, leaving out the
+	// cached ones at its start
+	int block_num = prefetch_queue[prefetch_head];
+	int count = 0;
+	while ((prefetch_count > 0) && (count < BLOCK_PREFETCH_MAX_RUN) &&
+		(prefetch_queue[prefetch_head] == block_num + count)) {
+	    prefetch_head = (prefetch_head + 1) % BLOCK_PREFETCH_QUEUE;
+	    prefetch_count--;
+	    count++;
+	}
+	while ((count > 0) && (cache_lookup(block_num) != NULL)) {
+	    block_num++;
+	    count--;
+	}
+	if (count == 0) {
+	    continue;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+	read_through(block_num, count, buf);
+	pthread_mutex_lock(&cache_lock);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    free(buf);
+    return NULL;
+}
+
+/** Ask for blocks to be read into the cache in the background
+ *
+ * Blocks already cached are skipped, requests beyond what the queue can
+ * hold are dropped.
+ */
+void block_prefetch(const int *block_nums, int count)
+{
+    int i = 0;
+    if (backend->uncached) {
+	return;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; (i < count) && (prefetch_count < BLOCK_PREFETCH_QUEUE); ++i) {
+	if (cache_lookup(block_nums[i]) == NULL) {
+	    prefetch_queue[(prefetch_head + prefetch_count) % BLOCK_PREFETCH_QUEUE] = block_nums[i];
+	    prefetch_count++;
+	}
+    }
+    pthread_cond_signal(&prefetch_cond);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Copies a cached block to buf, waiting for it if it is being read.
+ * Returns 0 if the block isn't cached.
+ */
+static int cache_read(int block_num, void *buf)
+{
+    pthread_mutex_lock(&cache_lock);
+    cached_block *block = cache_lookup(block_num);
+    while ((block != NULL) && (block->state == BLOCK_LOADING)) {
+	pthread_cond_wait(&cache_loaded, &cache_lock);
+	block = cache_lookup(block_num);
+    }
+    if (block != NULL) {
+	memcpy(buf, block->data, BLOCK_SIZE);
+	list_del(&block->lru);
+	list_add_tail(&block->lru, &cache_lru);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return (block != NULL);
 }
 
 /** Read a block from an open file
@@ -44,7 +350,14 @@ void disk_close()
 int block_read(const int block_num, void *buf)
 {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+
+    if (backend->uncached) {
+	retstat = backend->read(buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+    } else if (cache_read(block_num, buf)) {
+	return BLOCK_SIZE;
+    } else {
+	retstat = read_through(block_num, 1, buf);
+    }
     if (retstat <= 0){
 	memset(buf, 0, BLOCK_SIZE);
 	if(retstat<0)
@@ -61,10 +374,45 @@ int block_read(const int block_num, void *buf)
 int block_write(const int block_num, const void *buf)
 {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat < 0)
+    retstat = backend->write(buf, BLOCK_SIZE, (off_t)block_num*BLOCK_SIZE);
+    if (retstat < 0) {
 	perror("block_write failed");
-    
+	return retstat;
+    }
+    if (backend->uncached) {
+	return retstat;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    cache_update(block_num, buf);
+    pthread_mutex_unlock(&cache_lock);
+
+    return retstat;
+}
+
+/** Write count adjacent blocks, one BLOCK_SIZE buffer per iovec, with a single call
+ *
+ * Write should return exactly count * @BLOCK_SIZE except on error.
+ */
+int block_writev(const int block_num, const struct iovec *iov, int count)
+{
+    int retstat = 0;
+    int i = 0;
+    retstat = backend->writev(iov, count, (off_t)block_num*BLOCK_SIZE);
+    if (retstat < 0) {
+	perror("block_writev failed");
+	return retstat;
+    }
+    if (backend->uncached) {
+	return retstat;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < count; ++i) {
+	cache_update(block_num + i, iov[i].iov_base);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
     return retstat;
 }
 
@@ -74,17 +422,76 @@ int block_write(const int block_num, const void *buf)
  */
 int block_write_padded(const int block_num, const void *buf, int size)
 {
-    int retstat = 0;
     char tmp_buffer[BLOCK_SIZE];
     memset(tmp_buffer, '0', sizeof(tmp_buffer));
+    memcpy(tmp_buffer, buf, size);
+
+    return block_write(block_num, tmp_buffer);
+}
 
-    retstat = pwrite(diskfile, tmp_buffer, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat >= 0) {
-        retstat = pwrite(diskfile, buf, size, block_num*BLOCK_SIZE);
+/*
+ * Gives count blocks from block_num on back to the host by punching them
+ * out of the block store, they read as zeros afterwards.
+ * Returns -EOPNOTSUPP if the host can't do it.
+ */
+int block_discard(const int block_num, int count)
+{
+    int retstat = 0;
+    retstat = backend->discard((off_t)block_num*BLOCK_SIZE, (off_t)count*BLOCK_SIZE);
+    if (retstat < 0) {
+	retstat = -errno;
+	if (retstat != -EOPNOTSUPP) {
+	    perror("block_discard failed");
+	}
+	return retstat;
     }
+    if (backend->uncached) {
+	return retstat;
+    }
+
+    // Cached copies of freed blocks are of no use anymore
+    int i = 0;
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < count; ++i) {
+	cached_block *block = cache_lookup(block_num + i);
+	if ((block != NULL) && (block->state == BLOCK_VALID)) {
+	    cache_remove(block);
+	}
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return retstat;
+}
 
-    if (retstat < 0)
-    	perror("block_write failed");
+/** Flush everything written so far to stable storage
+ *
+ * Returns 0 on success or a negative errno value.
+ */
+int disk_sync()
+{
+    int retstat = 0;
+    retstat = backend->flush();
+    if (retstat < 0) {
+	perror("disk_sync failed");
+	retstat = -errno;
+    }
 
     return retstat;
 }
+
+/*
+ * Size in bytes of the block store, 0 if it is new and has to be formatted.
+ */
+off_t disk_size()
+{
+    return backend->size();
+}
+
+/*
+ * Size in bytes of the part of the volume on the fast disk file of the
+ * tier backend, 0 with any other one.
+ */
+off_t disk_fast_size()
+{
+    return tier_backend_split();
+}
@@ -8,12 +8,21 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #define BLOCK_SIZE 512
 
-void disk_open(const char* diskfile_path);
+int disk_open(const char* diskfile_path, const char *backend_name);
 void disk_close();
 int block_read(const int block_num, void *buf);
 int block_write(const int block_num, const void *buf);
+int block_writev(const int block_num, const struct iovec *iov, int count);
 int block_write_padded(const int block_num, const void *buf, int size);
+int block_discard(const int block_num, int count);
+int disk_sync();
+off_t disk_size();
+off_t disk_fast_size();
+void block_prefetch(const int *block_nums, int count);
 
 #endif
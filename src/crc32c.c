@@ -0,0 +1,191 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  CRC32C (Castagnoli), the checksum of the block checksums. Uses the CRC
+  instructions of SSE4.2 or ARMv8 when the CPU has them, eight bytes at a
+  time, and a slicing-by-8 table otherwise. The CRC instruction takes
+  several cycles but can start one every cycle, so the hardware versions
+  run three streams over CRC32C_LANE bytes each side by side and combine
+  them afterwards, which gives the same CRC as a single stream.
+*/
+
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78 // Reversed
+#define CRC32C_LANE 168 // Bytes per stream, three of them fit a 512 byte block
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_lane_table[4][256]; // Moves a CRC over CRC32C_LANE zero bytes
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *p, size_t len);
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+	while ((len > 0) && ((uintptr_t)p & 7)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	while (len >= 8) {
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		word ^= crc; // Little endian
+		crc = crc32c_table[7][word & 0xff] ^
+			crc32c_table[6][(word >> 8) & 0xff] ^
+			crc32c_table[5][(word >> 16) & 0xff] ^
+			crc32c_table[4][(word >> 24) & 0xff] ^
+			crc32c_table[3][(word >> 32) & 0xff] ^
+			crc32c_table[2][(word >> 40) & 0xff] ^
+			crc32c_table[1][(word >> 48) & 0xff] ^
+			crc32c_table[0][word >> 56];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len > 0) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	return crc;
+}
+
+/*
+ * Continues crc over CRC32C_LANE zero bytes, for appending the CRC of the
+ * next stream with an exclusive or.
+ */
+static inline uint32_t crc32c_shift(uint32_t crc) {
+	return crc32c_lane_table[0][crc & 0xff] ^ crc32c_lane_table[1][(crc >> 8) & 0xff] ^
+		crc32c_lane_table[2][(crc >> 16) & 0xff] ^ crc32c_lane_table[3][crc >> 24];
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+	uint64_t crc64 = crc;
+	while ((len > 0) && ((uintptr_t)p & 7)) {
+		crc64 = __builtin_ia32_crc32qi(crc64, *p++);
+		len--;
+	}
+	while (len >= 3 * CRC32C_LANE) {
+		uint64_t crc1 = 0, crc2 = 0;
+		size_t i = 0;
+		for (i = 0; i < CRC32C_LANE; i += 8) {
+			uint64_t word0, word1, word2;
+			memcpy(&word0, p + i, sizeof(word0));
+			memcpy(&word1, p + CRC32C_LANE + i, sizeof(word1));
+			memcpy(&word2, p + 2 * CRC32C_LANE + i, sizeof(word2));
+			crc64 = __builtin_ia32_crc32di(crc64, word0);
+			crc1 = __builtin_ia32_crc32di(crc1, word1);
+			crc2 = __builtin_ia32_crc32di(crc2, word2);
+		}
+		crc64 = crc32c_shift(crc32c_shift(crc64) ^ crc1) ^ crc2;
+		p += 3 * CRC32C_LANE;
+		len -= 3 * CRC32C_LANE;
+	}
+	while (len >= 8) {
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		crc64 = __builtin_ia32_crc32di(crc64, word);
+		p += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		crc64 = __builtin_ia32_crc32qi(crc64, *p++);
+		len--;
+	}
+
+	return crc64;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+	while ((len > 0) && ((uintptr_t)p & 7)) {
+		crc = __crc32cb(crc, *p++);
+		len--;
+	}
+	while (len >= 3 * CRC32C_LANE) {
+		uint32_t crc1 = 0, crc2 = 0;
+		size_t i = 0;
+		for (i = 0; i < CRC32C_LANE; i += 8) {
+			uint64_t word0, word1, word2;
+			memcpy(&word0, p + i, sizeof(word0));
+			memcpy(&word1, p + CRC32C_LANE + i, sizeof(word1));
+			memcpy(&word2, p + 2 * CRC32C_LANE + i, sizeof(word2));
+			crc = __crc32cd(crc, word0);
+			crc1 = __crc32cd(crc1, word1);
+			crc2 = __crc32cd(crc2, word2);
+		}
+		crc = crc32c_shift(crc32c_shift(crc) ^ crc1) ^ crc2;
+		p += 3 * CRC32C_LANE;
+		len -= 3 * CRC32C_LANE;
+	}
+	while (len >= 8) {
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		crc = __crc32cd(crc, word);
+		p += 8;
+		len -= 8;
+	}
+	while (len > 0) {
+		crc = __crc32cb(crc, *p++);
+		len--;
+	}
+
+	return crc;
+}
+#endif
+
+static void crc32c_init() {
+	int i = 0, j = 0;
+	for (i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+		for (j = 0; j < 8; ++j) {
+			crc = (crc & 1) ? ((crc >> 1) ^ CRC32C_POLY) : (crc >> 1);
+		}
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; ++i) {
+		for (j = 1; j < 8; ++j) {
+			crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xff] ^ (crc32c_table[j - 1][i] >> 8);
+		}
+	}
+
+	// The CRC is linear, moving each byte of it separately adds up
+	for (j = 0; j < 4; ++j) {
+		for (i = 0; i < 256; ++i) {
+			uint32_t crc = (uint32_t)i << (8 * j);
+			int k = 0;
+			for (k = 0; k < CRC32C_LANE; ++k) {
+				crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			}
+			crc32c_lane_table[j][i] = crc;
+		}
+	}
+
+	crc32c_impl = crc32c_sw;
+#if defined(__GNUC__) && defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_impl = crc32c_hw;
+	}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+	crc32c_impl = crc32c_hw;
+#endif
+}
+
+/*
+ * Continues crc over len bytes of data, start with 0.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+	pthread_once(&crc32c_once, crc32c_init);
+	return ~crc32c_impl(~crc, data, len);
+}
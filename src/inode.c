@@ -5,42 +5,236 @@
  *      Author: ashish
  */
 
-#include "inode.h"
 #include "params.h"
+#include "inode.h"
 #include "block.h"
+#include "log.h"
+#include "lz.h"
+#include "crc32c.h"
 #include <errno.h>
+#include <libgen.h>
 
  // Local functions
-void read_dentry_from_block(uint32_t block_id, sfs_dentry_t* dentries, int num_entries);
+int read_inode_data(sfs_inode_t *inode_data, char* buffer, int size, off_t offset);
+
+int uninline_inode(sfs_inode_t *inode_data);
+
+int zero_block_range(struct sfs_state *sfs, sfs_inode_t *inode, uint64_t idx, int from, int to);
+
+void compress_clusters(sfs_write_buffer *wb, uint64_t num_data_blocks);
+
+int read_cluster_block(struct sfs_state *sfs, sfs_inode_t *inode, uint64_t idx, char *data);
+
+int expand_cluster(struct sfs_state *sfs, sfs_inode_t *inode, uint64_t idx, int must_reserve);
+
+uint64_t path_2_ino_internal(const char *path, uint64_t ino_parent);
+
+uint64_t split_path(const char *path, char *name);
+
+int find_inode_chunk(sfs_group *group, uint32_t block_no);
+
+sfs_group* block_group(struct sfs_state *sfs, uint64_t block_no);
+
+sfs_group_desc_t* get_group_desc(struct sfs_state *sfs, uint32_t g);
+
+void update_sb_counters(struct sfs_state *sfs, int64_t free_blocks, int64_t free_inodes, int64_t inodes);
+
+int inode_in_use(uint64_t ino);
+
+void free_ino(uint64_t ino);
+
+uint32_t find_dir_group(struct sfs_state *sfs, uint32_t parent_group);
 
-uint32_t path_2_ino_internal(const char *path, uint32_t ino_parent);
+uint64_t get_ino_in_group(struct sfs_state *sfs, sfs_group *group, int may_grow);
 
-void free_ino(uint32_t ino);
+uint64_t get_ino(uint64_t ino_goal, int is_dir);
 
-uint32_t get_ino();
+int grow_inode_table(struct sfs_state *sfs, sfs_group *group);
 
 void free_block_no(uint32_t b_no);
 
-uint32_t get_block_no();
+int ref_block(struct sfs_state *sfs, uint32_t block_no);
+
+int unref_block(struct sfs_state *sfs, sfs_group *group, uint32_t offset);
+
+int block_shared(struct sfs_state *sfs, uint32_t block_no);
+
+uint32_t block_checksum(const char *data);
+
+int alloc_checksum_blocks(struct sfs_state *sfs, sfs_group *group);
+
+void store_checksums(struct sfs_state *sfs, uint32_t block_no, const struct iovec *iov, int count);
+
+void load_checksums(struct sfs_state *sfs, const uint32_t *block_nos, uint32_t *sums, int count);
+
+int verify_checksum(uint32_t block_no, uint32_t sum, const char *data);
+
+int verify_checksums(struct sfs_state *sfs, const uint32_t *block_nos, const char *data, int count);
+
+uint64_t block_fingerprint(const char *data);
+
+uint32_t find_duplicate(struct sfs_state *sfs, const char *data);
+
+void index_block(struct sfs_state *sfs, uint32_t block_no, const char *data);
+
+void forget_fingerprint(struct sfs_state *sfs, uint32_t block_no);
+
+int clone_blocks(struct sfs_state *sfs, uint64_t src_ino, uint64_t dest_ino, uint64_t src_first, uint64_t dest_first, uint64_t count);
+
+int copy_bytes(sfs_inode_t *src, sfs_inode_t *dest, off_t src_offset, off_t dest_offset, uint64_t length);
+
+int block_on_fast_tier(struct sfs_state *sfs, uint32_t block_no);
+
+uint32_t tier_goal(struct sfs_state *sfs, uint32_t goal, int fast);
 
-void update_inode_bitmap(uint32_t ino, char ch);
+int fast_tier_free_pct(struct sfs_state *sfs);
 
-void update_block_bitmap(uint32_t bno, char ch);
+sfs_group* alloc_group(struct sfs_state *sfs, sfs_group *start, uint32_t i);
 
-void update_inode_data(uint32_t ino, sfs_inode_t *inode);
+uint32_t get_block_no(uint32_t goal);
+
+uint32_t find_free_blocks(sfs_group *group, uint32_t goal, uint32_t count);
+
+void update_block_bitmap(struct sfs_state *sfs, sfs_group *group, uint32_t offset, uint32_t count, int used);
+
+int block_path(uint64_t idx, int offsets[4]);
+
+uint32_t get_block_ptr(sfs_inode_t *inode, uint64_t idx);
+
+int set_block_ptr(sfs_inode_t *inode, uint64_t idx, uint32_t block_no);
+
+uint32_t read_indirect(uint32_t block_no, int offset);
+
+void write_indirect(uint32_t block_no, int offset, uint32_t value);
+
+int free_block_tree(sfs_inode_t *inode, uint32_t block_no, int level, uint64_t base, uint64_t first, uint64_t end);
+
+void free_inode_blocks(sfs_inode_t *inode, uint64_t first, uint64_t end);
 
 void update_block_data(uint32_t bno, char* buffer);
 
-void create_dentry(const char *name, sfs_inode_t *inode, uint32_t ino_parent);
+uint32_t get_block_run(uint32_t goal, uint32_t *count);
+
+uint32_t segment_used(sfs_group *group, uint32_t offset);
+
+uint32_t get_segment_run(struct sfs_state *sfs, uint32_t block_no, uint32_t *count);
+
+uint32_t get_log_run(struct sfs_state *sfs, uint32_t *count);
+
+pthread_rwlock_t* inode_map_lock(struct sfs_state *sfs, uint64_t ino);
+
+void begin_change(struct sfs_state *sfs);
+
+void end_change(struct sfs_state *sfs);
+
+sfs_write_buffer* get_write_buffer(struct sfs_state *sfs, uint64_t ino, int create);
+
+void free_write_buffer(struct sfs_state *sfs, sfs_write_buffer *wb);
+
+sfs_buffered_block* find_buffered_block(sfs_write_buffer *wb, uint64_t idx);
+
+sfs_buffered_block* add_buffered_block(sfs_write_buffer *wb, uint64_t idx);
+
+void drop_write_buffer(struct sfs_state *sfs, uint64_t ino, uint64_t first, uint64_t end);
+
+int reserve_blocks(struct sfs_state *sfs, uint64_t count);
+
+void unreserve_blocks(struct sfs_state *sfs, uint64_t count);
+
+int flush_write_buffer(struct sfs_state *sfs, sfs_write_buffer *wb, sfs_inode_t *inode);
+
+void flush_write_buffers(struct sfs_state *sfs, int min_age);
+
+sfs_cached_block* find_cached_block(struct sfs_state *sfs, uint32_t block_no);
+
+sfs_cached_block* get_cached_block(struct sfs_state *sfs, uint32_t block_no, int load);
+
+void mark_block_dirty(struct sfs_state *sfs, sfs_cached_block *block, int times_only);
+
+void forget_cached_block(struct sfs_state *sfs, uint32_t block_no);
+
+void flush_cached_blocks(struct sfs_state *sfs, int min_age, int min_time_age);
+
+void queue_discard(struct sfs_state *sfs, uint32_t block_no);
+
+void discard_blocks(struct sfs_state *sfs);
+
+void* inode_flusher(void *arg);
 
-void remove_dentry(sfs_inode_t *inode, uint32_t ino_parent);
+void add_orphan(struct sfs_state *sfs, sfs_inode_t *inode);
+
+int reclaim_orphan(struct sfs_state *sfs, uint64_t ino);
+
+void* orphan_reclaimer(void *arg);
+
+sfs_extent_heat* heat_entry(struct sfs_state *sfs, uint64_t ino, uint32_t extent);
+
+void heat_up(struct sfs_state *sfs, uint64_t ino, off_t offset, int size);
+
+uint32_t extent_heat(struct sfs_state *sfs, uint64_t ino, uint32_t extent);
+
+uint64_t next_inode_slot(struct sfs_state *sfs, uint64_t ino);
+
+int move_extent(struct sfs_state *sfs, uint64_t ino, uint32_t extent, int to);
+
+void migrate_extents(struct sfs_state *sfs);
+
+void* migrator(void *arg);
+
+void* cleaner(void *arg);
+
+int snapshot_dir(uint64_t ino_src, const char *dest_path);
+
+sfs_snapshot_image* find_snapshot_image(struct sfs_state *sfs, uint64_t ino, int create);
+
+void keep_snapshot_image(struct sfs_state *sfs, uint64_t ino, int copy);
+
+int take_snapshot_image(struct sfs_state *sfs, uint64_t ino, uint64_t *image);
+
+int copy_inode_image(struct sfs_state *sfs, uint64_t ino, uint64_t *image);
+
+int share_block_tree(struct sfs_state *sfs, sfs_inode_t *dest, uint32_t block_no, int level, uint64_t base);
+
+int share_block(struct sfs_state *sfs, sfs_inode_t *dest, uint64_t idx, uint32_t block_no);
+
+void free_inode_image(struct sfs_state *sfs, uint64_t ino);
+
+int remove_tree(const char *path);
+
+void create_dentry(const char *name, sfs_inode_t *inode, uint64_t ino_parent);
+
+void remove_dentry(sfs_inode_t *inode, uint64_t ino_parent);
 
 // Function defs
-uint32_t path_2_ino(const char *path) {
+uint64_t path_2_ino(const char *path) {
 	if (strcmp(path, "/") == 0) {
 		return (SFS_DATA->ino_root);
 	} else if (*path == '/') {
-		return path_2_ino_internal(path+1, SFS_DATA->ino_root);
+		// Walk the path one component at a time
+		char name[SFS_MAX_LENGTH_FILE_NAME];
+		uint64_t ino = SFS_DATA->ino_root;
+		const char *component = path + 1;
+
+		while ((ino != SFS_INVALID_INO) && (*component != '\0')) {
+			const char *end = strchr(component, '/');
+			int length = (end != NULL) ? (int)(end - component) : (int)strlen(component);
+			if (length >= SFS_MAX_LENGTH_FILE_NAME) {
+				return SFS_INVALID_INO;
+			}
+
+			if (length > 0) {
+				memcpy(name, component, length);
+				name[length] = '\0';
+				ino = path_2_ino_internal(name, ino);
+			}
+
+			component += length;
+			if (*component == '/') {
+				++component;
+			}
+		}
+
+		return ino;
 	} else {
 		log_msg("\npath_2_no invalid path");
 	}
@@ -48,14 +242,15 @@ uint32_t path_2_ino(const char *path) {
 	return SFS_INVALID_INO;
 }
 
-uint32_t path_2_ino_internal(const char *path, uint32_t ino_parent) {
+uint64_t path_2_ino_internal(const char *path, uint64_t ino_parent) {
 
-	uint32_t ino_path = SFS_INVALID_INO;
-	char buffer[SFS_DENTRY_SIZE * SFS_NINODES];
-	memset(buffer, 0, sizeof(buffer));
+	uint64_t ino_path = SFS_INVALID_INO;
 
 	sfs_inode_t inode;
 	get_inode(ino_parent, &inode);
+	if (!S_ISDIR(inode.mode)) {
+		return SFS_INVALID_INO;
+	}
 
 	int num_dentries = (inode.size / SFS_DENTRY_SIZE);
 	if (num_dentries > 0) {
@@ -69,7 +264,7 @@ uint32_t path_2_ino_internal(const char *path, uint32_t ino_parent) {
 			log_msg("\npath_2_ino_internal Entry%d = %s, path=%s", i, dentries[i].name,path);
 	    	if (strcmp(dentries[i].name, path) == 0) {
 	    		ino_path = dentries[i].inode_number;
-	    		log_msg("\npath_2_ino: Dentry found ino = %d", ino_path);
+	    		log_msg("\npath_2_ino: Dentry found ino = %llu", ino_path);
 
 	    		break;
 	    	}
@@ -77,462 +272,4665 @@ uint32_t path_2_ino_internal(const char *path, uint32_t ino_parent) {
 	    free(dentries);
 	}
 
-	log_msg("\npath_2_ino: test outer");
 	return ino_path;
 }
 
-void get_inode(uint32_t ino, sfs_inode_t *inode_data) {
-	if (ino < SFS_NINODES) {
-		if ((SFS_DATA->state_inodes[ino].node.next == SFS_DATA->state_inodes[ino].node.prev) &&
-			(SFS_DATA->free_inodes != &(SFS_DATA->state_inodes[ino].node))) {
-			int block_offset = ino / (BLOCK_SIZE / SFS_INODE_SIZE);
-			int inside_block_offset = ino % (BLOCK_SIZE / SFS_INODE_SIZE);
+/*
+ * Returns the inode of the directory containing path and copies the last
+ * path component to name.
+ */
+uint64_t split_path(const char *path, char *name) {
+	char *path_copy = strdup(path);
+	char *base = basename(path_copy);
+	if (strlen(base) >= SFS_MAX_LENGTH_FILE_NAME) {
+		free(path_copy);
+		return SFS_INVALID_INO;
+	}
+	strcpy(name, base);
+	free(path_copy);
+
+	path_copy = strdup(path);
+	uint64_t ino_parent = path_2_ino(dirname(path_copy));
+	free(path_copy);
+
+	return ino_parent;
+}
+
+void get_inode(uint64_t ino, sfs_inode_t *inode_data) {
+	if (inode_in_use(ino)) {
+		uint32_t block_no = ino / SFS_INODES_PER_BLOCK;
+		int inside_block_offset = ino % SFS_INODES_PER_BLOCK;
 
-			char buffer[BLOCK_SIZE];
-	    	block_read(SFS_BLOCK_INODES + block_offset, buffer);
+		pthread_mutex_lock(&SFS_DATA->cache_lock);
+		sfs_cached_block *block = get_cached_block(SFS_DATA, block_no, 1);
+		memcpy(inode_data, block->data + inside_block_offset*SFS_INODE_SIZE, sizeof(sfs_inode_t));
+		pthread_mutex_unlock(&SFS_DATA->cache_lock);
 
-		    log_msg("\n here block_offset=%d inside_block_offset=%d", block_offset, inside_block_offset);
-	    	memcpy(inode_data, buffer + inside_block_offset*SFS_INODE_SIZE, sizeof(sfs_inode_t));
-		    log_msg("\n inode number %d successfully found", inode_data->ino);
-		} else {
-		    log_msg("\n inode number %d not in use", ino);
-		}
+		log_msg("\n inode number %llu successfully found", inode_data->ino);
 	} else {
-	    log_msg("\n Invalid inode number %d", ino);
+		memset(inode_data, 0, sizeof(sfs_inode_t));
+	    log_msg("\n inode number %llu not in use", ino);
 	}
 }
 
-uint32_t create_inode(const char *path, mode_t mode) {
-	uint32_t ino_path = path_2_ino(path);
-	if (ino_path == SFS_INVALID_INO) {
-		ino_path = get_ino();
-		uint32_t block_no = get_block_no();
+uint64_t create_inode(const char *path, mode_t mode) {
+	char name[SFS_MAX_LENGTH_FILE_NAME];
+	uint64_t ino_parent = split_path(path, name);
+	if (ino_parent == SFS_INVALID_INO) {
+		log_msg("\nError parent directory of %s doesn't exist!", path);
+		return SFS_INVALID_INO;
+	}
 
-		if ((ino_path != SFS_INVALID_INO) && (block_no != SFS_INVALID_BLOCK_NO)) {
-			// Step 1: Update the inode bitmap to reflect availability
-			update_inode_bitmap(ino_path, '0');
+	begin_change(SFS_DATA);
+	uint64_t ino_path = path_2_ino_internal(name, ino_parent);
+	if (ino_path == SFS_INVALID_INO) {
+		// Step 1: Take an inode in the parent directory's group, or in a
+		// roomy group for a new directory
+		ino_path = get_ino(ino_parent, S_ISDIR(mode));
 
-			// Step 2: Update Data n=bitmap
-			update_block_bitmap(block_no, '0');
+		if (ino_path != SFS_INVALID_INO) {
+			// Newer than a snapshot being taken, nothing to keep
+			keep_snapshot_image(SFS_DATA, ino_path, 0);
 
-			// Step 3: Create Inode
+			// Step 2: Create Inode, data is kept inline until it outgrows the inode
 			sfs_inode_t inode;
 			memset(&inode, 0, sizeof(inode));
 			inode.atime = inode.ctime = inode.mtime = time(NULL);
-			inode.nblocks = 1;
+			inode.nblocks = 0;
 			inode.ino = ino_path;
-			inode.blocks[0] = block_no;
 			inode.size = 0;
-			inode.nlink = 0;
+			inode.nlink = S_ISDIR(mode) ? 2 : 1;
 			inode.mode = mode;
+			inode.flags = SFS_INODE_INLINE;
 
-			// Step 4: Write inode to disk
+			// Step 3: Write inode to disk
 			update_inode_data(ino_path, &inode);
 
-			// Step 5: Create a directory entry
-			create_dentry(path+1, &inode, path_2_ino("/"));
+			// Step 4: Create a directory entry
+			create_dentry(name, &inode, ino_parent);
 
+			end_change(SFS_DATA);
 			return inode.ino;
 		}
 	} else {
 		log_msg("\nError path already exists!");
 	}
+	end_change(SFS_DATA);
 
 	return SFS_INVALID_INO;
 }
 
 int remove_inode(const char *path) {
-	uint32_t ino_path = path_2_ino(path);
+	char name[SFS_MAX_LENGTH_FILE_NAME];
+	begin_change(SFS_DATA);
+	uint64_t ino_parent = split_path(path, name);
+	uint64_t ino_path = (ino_parent != SFS_INVALID_INO) ? path_2_ino_internal(name, ino_parent) : SFS_INVALID_INO;
 	if (ino_path != SFS_INVALID_INO) {
+		pthread_rwlock_t *lock = inode_map_lock(SFS_DATA, ino_path);
 		sfs_inode_t inode_data;
-		get_inode(ino_path, &inode_data);
 
-		int num_blocks = inode_data.nblocks;
-		while (num_blocks > 0) {
+		pthread_rwlock_wrlock(lock);
+		keep_snapshot_image(SFS_DATA, ino_path, 1);
+		drop_write_buffer(SFS_DATA, ino_path, 0, SFS_MAX_FILE_BLOCKS);
+		get_inode(ino_path, &inode_data);
 
-			free_block_no(inode_data.blocks[num_blocks - 1]);
-			update_block_bitmap(inode_data.blocks[num_blocks - 1], '1');
+		if (!(inode_data.flags & SFS_INODE_INLINE) && (inode_data.nblocks > SFS_ORPHAN_MIN_BLOCKS)) {
+			// Too much to free while the caller waits
+			add_orphan(SFS_DATA, &inode_data);
+		} else {
+			if (!(inode_data.flags & SFS_INODE_INLINE)) {
+				free_inode_blocks(&inode_data, 0, SFS_MAX_FILE_BLOCKS);
+			}
 
-			--num_blocks;
+			free_ino(inode_data.ino);
 		}
-
-		free_ino(inode_data.ino);
-		update_inode_bitmap(inode_data.ino, '1');
+		pthread_rwlock_unlock(lock);
 
 		log_msg("inode removed..now proceeding to remove dentry");
-		remove_dentry(&inode_data, SFS_DATA->ino_root);
+		remove_dentry(&inode_data, ino_parent);
+		end_change(SFS_DATA);
 
 		return 0;
 	} else {
 		log_msg("\nError no such path exists!");
 	}
+	end_change(SFS_DATA);
 
 	return -ENOENT;
 }
 
-int write_inode(sfs_inode_t *inode_data, const char* buffer, int size, int offset) {
+/*
+ * Writes go to the inode's write buffer, blocks are only allocated and
+ * written once the buffer is flushed.
+ */
+int write_inode(sfs_inode_t *inode_data, const char* buffer, int size, off_t offset) {
 
-	int capacity = (SFS_NDIR_BLOCKS - (offset / BLOCK_SIZE))*BLOCK_SIZE - (offset % BLOCK_SIZE);
-	if (size > capacity) {
+	if (offset + size > (off_t)SFS_MAX_FILE_BLOCKS * BLOCK_SIZE) {
 		log_msg("Can't write a file of this size");
-		return 0;
+		return -EFBIG;
 	}
 
-	int i = 0;
-	int orig_offset = offset;
-	char tmp_buf[BLOCK_SIZE];
+	struct sfs_state *sfs = SFS_DATA;
+	pthread_rwlock_t *lock = inode_map_lock(sfs, inode_data->ino);
+	begin_change(sfs);
+	pthread_rwlock_wrlock(lock);
+	keep_snapshot_image(sfs, inode_data->ino, 1);
+
+	// A flush may have changed the block map since the caller read the inode
+	get_inode(inode_data->ino, inode_data);
+
+	if (inode_data->flags & SFS_INODE_INLINE) {
+		if (offset + size <= SFS_INLINE_DATA_SIZE) {
+			memcpy(inode_data->inline_data + offset, buffer, size);
+			if (offset + size > (off_t)inode_data->size) {
+				inode_data->size = offset + size;
+			}
+			inode_data->mtime = inode_data->ctime = time(NULL);
+
+			update_inode_data(inode_data->ino, inode_data);
+			pthread_rwlock_unlock(lock);
+			end_change(sfs);
+
+			log_msg("\nwrite_inode inline offset = %lld num bytes written = %d", offset, size);
+			return size;
+		}
+
+		if (uninline_inode(inode_data) < 0) {
+			pthread_rwlock_unlock(lock);
+			end_change(sfs);
+			return -ENOSPC;
+		}
+	}
+
+	uint64_t i = 0;
+	off_t orig_offset = offset;
 	int bytes_written = 0;
-	int num_new_blocks = 0;
-	int start_block_idx = (offset / BLOCK_SIZE);
-	offset = offset % BLOCK_SIZE;
+	uint64_t first_block_idx = offset / BLOCK_SIZE;
+	uint64_t last_block_idx = (offset + size - 1) / BLOCK_SIZE;
+	uint64_t end_block_idx = last_block_idx + 1; // First block not buffered
+	int retstat = -ENOSPC; // Why end_block_idx got cut short
+	char old_data[BLOCK_SIZE];
+	sfs_write_buffer *wb = get_write_buffer(sfs, inode_data->ino, 1);
 
-	for (i = start_block_idx; (bytes_written < size) && (i < SFS_NDIR_BLOCKS);++i) {
-		if (i >= inode_data->nblocks) {
-			inode_data->blocks[i] = get_block_no();
-			++num_new_blocks;
-			log_msg("\nAllocated a new block for file");
+	// Only the blocks written get buffered, a gap between the current end
+	// of file and offset stays a hole without any blocks
+	for (i = first_block_idx; i <= last_block_idx; ++i) {
+		if (find_buffered_block(wb, i) != NULL) {
+			continue;
 		}
 
-		if (offset != 0) {
-			int bytes_to_write = (BLOCK_SIZE - offset) > size ? size : (BLOCK_SIZE - offset);
-			block_read(SFS_BLOCK_DATA + inode_data->blocks[i], tmp_buf);
-			memcpy(tmp_buf + offset, buffer, bytes_to_write);
-			update_block_data(inode_data->blocks[i], tmp_buf);
+		uint32_t block_no = get_block_ptr(inode_data, i);
+		if (block_no & SFS_BLOCK_COMPRESSED) {
+			if (expand_cluster(sfs, inode_data, i, 1) < 0) {
+				end_block_idx = i;
+				break;
+			}
+			continue;
+		}
 
-			bytes_written += bytes_to_write;
+		// Keep the rest of the block when only a part of it is overwritten,
+		// unwritten blocks hold nothing but zeros. A rest which doesn't match
+		// its checksum fails the write instead of getting a new checksum.
+		int whole = (offset <= (off_t)(i * BLOCK_SIZE)) && (offset + size >= (off_t)((i + 1) * BLOCK_SIZE));
+		int keep = !whole && (block_no != SFS_INVALID_BLOCK_NO) && !(block_no & SFS_BLOCK_UNWRITTEN);
+		if (keep && ((block_read(block_no, old_data) < 0) || (verify_checksums(sfs, &block_no, old_data, 1) < 0))) {
+			end_block_idx = i;
+			retstat = -EIO;
+			break;
+		}
 
-			log_msg("\norig offset = %d Offset = %d written %d bytes", orig_offset, offset, bytes_written);
+		int cow = (block_no != SFS_INVALID_BLOCK_NO) && block_shared(sfs, block_no & ~SFS_BLOCK_FLAGS);
+		if ((block_no == SFS_INVALID_BLOCK_NO) || cow) {
+			// Make sure the flush will find room for it
+			int needed = (wb->meta_reserved == 0) ? (1 + SFS_WRITE_BUFFER_META_RESERVE) : 1;
+			if (reserve_blocks(sfs, needed) < 0) {
+				end_block_idx = i;
+				break;
+			}
+			wb->meta_reserved = SFS_WRITE_BUFFER_META_RESERVE;
+		}
 
-			offset = 0;
+		sfs_buffered_block *block = add_buffered_block(wb, i);
+		block->reserved = (block_no == SFS_INVALID_BLOCK_NO) || cow;
+		if (keep) {
+			memcpy(block->data, old_data, BLOCK_SIZE);
 		} else {
-			int bytes_to_write = (size - bytes_written) > BLOCK_SIZE ? BLOCK_SIZE : (size - bytes_written);
-			memcpy(tmp_buf, buffer + bytes_written, bytes_to_write);
-			update_block_data(inode_data->blocks[i], tmp_buf);
+			memset(block->data, 0, BLOCK_SIZE);
+		}
+	}
 
-			log_msg("\nUpdated block %d offset = %d num bytes written = %d",inode_data->blocks[i], offset, bytes_to_write);
+	while ((bytes_written < size) && ((uint64_t)(offset / BLOCK_SIZE) < end_block_idx)) {
+		i = offset / BLOCK_SIZE;
+		int block_offset = offset % BLOCK_SIZE;
+		int bytes_to_write = (BLOCK_SIZE - block_offset) > (size - bytes_written) ? (size - bytes_written) : (BLOCK_SIZE - block_offset);
 
-			bytes_written += bytes_to_write;
-		}
+		memcpy(find_buffered_block(wb, i)->data + block_offset, buffer + bytes_written, bytes_to_write);
+
+		log_msg("\nBuffered block %llu offset = %d num bytes written = %d", i, block_offset, bytes_to_write);
+
+		bytes_written += bytes_to_write;
+		offset += bytes_to_write;
 	}
 
-	inode_data->nblocks += num_new_blocks;
-	inode_data->size = orig_offset + size;
+	if (orig_offset + bytes_written > (off_t)inode_data->size) {
+		inode_data->size = orig_offset + bytes_written;
+	}
+	inode_data->mtime = inode_data->ctime = time(NULL);
+	if ((sfs->fast_groups > 0) && (bytes_written > 0)) {
+		heat_up(sfs, inode_data->ino, orig_offset, bytes_written);
+	}
 
-	update_inode_data(inode_data->ino, inode_data);
+	if (wb->num_blocks >= SFS_WRITE_BUFFER_MAX_BLOCKS) {
+		flush_write_buffer(sfs, wb, inode_data);
+	} else if (wb->num_blocks == 0) {
+		free_write_buffer(sfs, wb);
+		update_inode_data(inode_data->ino, inode_data);
+	} else {
+		update_inode_data(inode_data->ino, inode_data);
+	}
+	pthread_rwlock_unlock(lock);
+	end_change(sfs);
 
-	return bytes_written;
+	return (bytes_written > 0) ? bytes_written : retstat;
 }
 
-int read_inode(sfs_inode_t *inode_data, char* buffer, int size, int offset) {
+int read_inode(sfs_inode_t *inode_data, char* buffer, int size, off_t offset) {
 
 	log_msg("\nread_inode");
-	int i = 0;
-	int orig_offset = offset;
-	char tmp_buf[BLOCK_SIZE];
-	int bytes_read = 0;
-	int num_new_blocks = 0;
-	int start_block_idx = (offset / BLOCK_SIZE);
-	offset = offset % BLOCK_SIZE;
+	int bytes_read = read_inode_data(inode_data, buffer, size, offset);
+	if ((SFS_DATA->fast_groups > 0) && (bytes_read > 0)) {
+		heat_up(SFS_DATA, inode_data->ino, offset, bytes_read);
+	}
 
-	for (i = start_block_idx; (bytes_read < inode_data->size) && (i < SFS_NDIR_BLOCKS);++i) {
+	touch_inode(inode_data, SFS_ATIME);
 
-		if (offset != 0) {
-			int bytes_to_read = (BLOCK_SIZE - offset) > inode_data->size ? inode_data->size : (BLOCK_SIZE - inode_data->size);
-			block_read(SFS_BLOCK_DATA + inode_data->blocks[i], tmp_buf);
-			memcpy(buffer, tmp_buf + offset, bytes_to_read);
+	return bytes_read;
+}
 
-			bytes_read += bytes_to_read;
+/*
+ * Tracks the access pattern of an open file and, while reads are sequential,
+ * starts background reads of the blocks ahead of the reader. The window
+ * doubles with every sequential read up to SFS_READAHEAD_MAX and halves on
+ * random ones. New blocks are requested once less than half the window is
+ * left prefetched, so the disk works while the reader consumes the rest.
+ */
+void readahead_inode(sfs_inode_t *inode_data, sfs_readahead_t *ra, int size, off_t offset) {
+	if ((inode_data->flags & SFS_INODE_INLINE) || (size <= 0) || (offset >= (off_t)inode_data->size)) {
+		return;
+	}
 
-			log_msg("Offset = %d read %d bytes", offset, bytes_read);
+	if (offset == ra->next_offset) {
+		ra->window = (ra->window == 0) ? SFS_READAHEAD_MIN :
+				((2 * ra->window > SFS_READAHEAD_MAX) ? SFS_READAHEAD_MAX : (2 * ra->window));
+	} else {
+		ra->window = (ra->window / 2 < SFS_READAHEAD_MIN) ? 0 : (ra->window / 2);
+		ra->ra_end = 0;
+	}
+	ra->next_offset = offset + size;
 
-			offset = 0;
-		} else {
-			int bytes_to_read = (inode_data->size - bytes_read) > BLOCK_SIZE ? BLOCK_SIZE : (inode_data->size - bytes_to_read);
-			block_read(SFS_BLOCK_DATA + inode_data->blocks[i], tmp_buf);
-			log_msg("\ntmp_buf = %s", tmp_buf);
-			memcpy(buffer + bytes_read, tmp_buf, bytes_to_read);
+	uint64_t next_block = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint64_t num_data_blocks = (inode_data->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if ((ra->window == 0) || (ra->ra_end >= next_block + ra->window / 2)) {
+		return;
+	}
 
-			//log_msg("\nRead block %d offset = %d num bytes read = %d",inode_data->blocks[i], offset, bytes_to_read);
+	uint64_t start = (ra->ra_end > next_block) ? ra->ra_end : next_block;
+	uint64_t end = next_block + ra->window;
+	if (end > num_data_blocks) {
+		end = num_data_blocks;
+	}
+	if (start >= end) {
+		return;
+	}
 
-			log_msg("\nRead Buffer = %s", buffer);
-			log_msg("\ntmp_buf1 = %s", tmp_buf);
-			bytes_read += bytes_to_read;
+	int block_nums[SFS_READAHEAD_MAX];
+	int count = 0;
+	uint64_t i = 0;
+	for (i = start; i < end; ++i) {
+		uint32_t block_no = get_block_ptr(inode_data, i);
+		if (((block_no & ~SFS_BLOCK_FLAGS) != SFS_INVALID_BLOCK_NO) && !(block_no & SFS_BLOCK_UNWRITTEN)) {
+			block_nums[count++] = block_no & ~SFS_BLOCK_FLAGS;
 		}
 	}
+	block_prefetch(block_nums, count);
+	ra->ra_end = end;
 
-	return bytes_read;
+	log_msg("\nreadahead_inode ino = %llu blocks %llu-%llu window = %u", inode_data->ino, start, end, ra->window);
 }
 
-void fill_stat_from_ino(const sfs_inode_t* inode, struct stat *statbuf) {
-	statbuf->st_dev = 0;
-	statbuf->st_ino = inode->ino;
-	statbuf->st_mode = inode->mode;
-	statbuf->st_nlink = inode->nlink;
-	statbuf->st_uid = getuid();
-	statbuf->st_gid = getgid();
-	statbuf->st_rdev = 0;
-	statbuf->st_size = inode->size;
-	statbuf->st_blksize = BLOCK_SIZE;
-	statbuf->st_blocks = inode->nblocks;
-	statbuf->st_atime = inode->atime;
-	statbuf->st_mtime = inode->mtime;
-	statbuf->st_ctime = inode->ctime;
-}
+/*
+ * Returns the first offset >= offset holding data (want_data set) or lying
+ * in a hole, for SEEK_DATA / SEEK_HOLE. Holes are unmapped or unwritten
+ * blocks not in the write buffer, the end of file counts as a hole.
+ * Returns -ENXIO if offset is at or past the end of file, or if no data
+ * follows it.
+ */
+off_t seek_inode(sfs_inode_t *inode_data, off_t offset, int want_data) {
+	struct sfs_state *sfs = SFS_DATA;
+	pthread_rwlock_t *lock = inode_map_lock(sfs, inode_data->ino);
+	pthread_rwlock_rdlock(lock);
+	get_inode(inode_data->ino, inode_data);
 
-void read_dentries(sfs_inode_t *inode_data, sfs_dentry_t* dentries) {
-	if (S_ISDIR(inode_data->mode)) {
-		int num_blocks_read = 0;
-		int num_bytes_read = 0;
-		int num_entries = 0;
-		int entry_offset = 0;
-
-		while ((num_blocks_read < inode_data->nblocks) && (num_bytes_read < inode_data->size)) {
-			if (inode_data->size - num_bytes_read < BLOCK_SIZE) {
-				num_entries = ((inode_data->size - num_bytes_read) / SFS_DENTRY_SIZE);
-			} else {
-				num_entries = (BLOCK_SIZE / SFS_DENTRY_SIZE);
-			}
+	off_t result = -ENXIO;
+	if ((offset < 0) || ((uint64_t)offset >= inode_data->size)) {
+		pthread_rwlock_unlock(lock);
+		return -ENXIO;
+	}
 
-			log_msg("\n read_dentries num_entries=%d", num_entries);
+	if (inode_data->flags & SFS_INODE_INLINE) {
+		result = want_data ? offset : (off_t)inode_data->size;
+	} else {
+		sfs_write_buffer *wb = get_write_buffer(sfs, inode_data->ino, 0);
+		uint64_t num_data_blocks = (inode_data->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		uint64_t i = 0;
 
-			if (num_blocks_read < SFS_NDIR_BLOCKS) {
-				read_dentry_from_block(inode_data->blocks[num_blocks_read], dentries + entry_offset, num_entries);
+		result = want_data ? -ENXIO : (off_t)inode_data->size;
+		for (i = offset / BLOCK_SIZE; i < num_data_blocks; ++i) {
+			uint32_t block_no = get_block_ptr(inode_data, i);
+			int is_data = ((block_no != SFS_INVALID_BLOCK_NO) && !(block_no & SFS_BLOCK_UNWRITTEN)) ||
+					((wb != NULL) && (find_buffered_block(wb, i) != NULL));
+			if (is_data == want_data) {
+				result = ((off_t)(i * BLOCK_SIZE) > offset) ? (off_t)(i * BLOCK_SIZE) : offset;
+				break;
 			}
-
-			++num_blocks_read;
-			num_bytes_read += (num_entries * SFS_DENTRY_SIZE);
-			entry_offset += num_entries;
 		}
-	} else {
-	    log_msg("\n Invalid inode number %d, not a directory", inode_data->ino);
 	}
+	pthread_rwlock_unlock(lock);
+
+	log_msg("\nseek_inode ino = %llu offset = %lld want_data = %d result = %lld", inode_data->ino, offset, want_data, result);
+	return result;
 }
 
-void read_dentry_from_block(uint32_t block_id, sfs_dentry_t* dentries, int num_entries) {
+/*
+ * Reads file contents without updating atime, used for directories too.
+ * Buffered data is read from the write buffer.
+ */
+int read_inode_data(sfs_inode_t *inode_data, char* buffer, int size, off_t offset) {
+	struct sfs_state *sfs = SFS_DATA;
+	pthread_rwlock_t *lock = inode_map_lock(sfs, inode_data->ino);
+	pthread_rwlock_rdlock(lock);
+
+	// Use the current block map, a flush may have changed it since the
+	// caller read the inode
+	sfs_inode_t inode;
+	get_inode(inode_data->ino, &inode);
 
-	char buffer[BLOCK_SIZE];
-	block_read(SFS_BLOCK_DATA + block_id, buffer);
+	if (offset >= (off_t)inode.size) {
+		pthread_rwlock_unlock(lock);
+		return 0;
+	}
+	if (offset + size > (off_t)inode.size) {
+		size = inode.size - offset;
+	}
 
-	int entries_read = 0;
-	int bytes_read = 0;
-	while ((bytes_read < BLOCK_SIZE) && (entries_read < num_entries)) {
-		log_msg("\nread_dentry_from_block Entries read = %d", entries_read);
-		memcpy(dentries + entries_read, buffer + bytes_read, sizeof(sfs_dentry_t));
-	    ++entries_read;
-	    bytes_read += SFS_DENTRY_SIZE;
+	if (inode.flags & SFS_INODE_INLINE) {
+		memcpy(buffer, inode.inline_data + offset, size);
+		pthread_rwlock_unlock(lock);
+		return size;
 	}
-}
 
-void free_ino(uint32_t ino) {
-	if (ino < SFS_NINODES) {
-		if ((SFS_DATA->state_inodes[ino].node.next
-				== SFS_DATA->state_inodes[ino].node.prev)
-				&& (SFS_DATA->free_inodes != &(SFS_DATA->state_inodes[ino].node))) {
+	sfs_write_buffer *wb = get_write_buffer(sfs, inode.ino, 0);
+	char tmp_buf[BLOCK_SIZE];
+	uint32_t block_nos[SFS_WRITE_BUFFER_MAX_BLOCKS], sums[SFS_WRITE_BUFFER_MAX_BLOCKS];
+	uint64_t batch_first = 0, batch_end = 0;
+	uint64_t end_idx = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int bytes_read = 0, retstat = 0;
+	while (bytes_read < size) {
+		uint64_t i = offset / BLOCK_SIZE;
+		int block_offset = offset % BLOCK_SIZE;
+		int bytes_to_read = (BLOCK_SIZE - block_offset) > (size - bytes_read) ? (size - bytes_read) : (BLOCK_SIZE - block_offset);
+		sfs_buffered_block *block = (wb != NULL) ? find_buffered_block(wb, i) : NULL;
 
-			list_add_tail(&(SFS_DATA->state_inodes[ino].node), SFS_DATA->free_inodes);
-			log_msg("\nSuccess: Inode added to the free list");
+		// Map the next blocks and look up their checksums in one go
+		if (i >= batch_end) {
+			batch_first = i;
+			batch_end = ((end_idx - i) > SFS_WRITE_BUFFER_MAX_BLOCKS) ? (i + SFS_WRITE_BUFFER_MAX_BLOCKS) : end_idx;
+			uint64_t j = 0;
+			for (j = batch_first; j < batch_end; ++j) {
+				block_nos[j - batch_first] = get_block_ptr(&inode, j);
+			}
+			load_checksums(sfs, block_nos, sums, batch_end - batch_first);
+		}
+		uint32_t block_no = block_nos[i - batch_first];
 
+		if (block != NULL) {
+			memcpy(tmp_buf, block->data, BLOCK_SIZE);
+		} else if (block_no & SFS_BLOCK_COMPRESSED) {
+			if (read_cluster_block(sfs, &inode, i, tmp_buf) < 0) {
+				retstat = -EIO;
+			}
+		} else if ((block_no != SFS_INVALID_BLOCK_NO) && !(block_no & SFS_BLOCK_UNWRITTEN)) {
+			if ((block_read(block_no, tmp_buf) < 0) ||
+					(verify_checksum(block_no, sums[i - batch_first], tmp_buf) < 0)) {
+				retstat = -EIO;
+			}
 		} else {
-			log_msg("\nError: Inode already in the free list");
+			// Holes and preallocated blocks read as zeros without any I/O
+			memset(tmp_buf, 0, sizeof(tmp_buf));
 		}
+		memcpy(buffer + bytes_read, tmp_buf + block_offset, bytes_to_read);
+
+		log_msg("\nRead block %u offset = %d num bytes read = %d", block_no, block_offset, bytes_to_read);
+
+		bytes_read += bytes_to_read;
+		offset += bytes_to_read;
 	}
+	pthread_rwlock_unlock(lock);
+
+	// The data read is there anyway, directories use what they can
+	return (retstat < 0) ? retstat : bytes_read;
 }
 
-uint32_t get_ino() {
-	if (list_empty(SFS_DATA->free_inodes))  {
-		log_msg("\nError: Inode limit reached!!!");
-	} else {
-		list_t *ino_node = SFS_DATA->free_inodes;
-		list_del(SFS_DATA->free_inodes);
+/*
+ * Moves inline data out to the write buffer, for when a write doesn't fit
+ * into the inode anymore. Caller must hold the inode's map lock.
+ */
+int uninline_inode(sfs_inode_t *inode_data) {
+	struct sfs_state *sfs = SFS_DATA;
+	if (reserve_blocks(sfs, 1 + SFS_WRITE_BUFFER_META_RESERVE) < 0) {
+		log_msg("\nError: No data block left to move inline data to");
+		return -ENOSPC;
+	}
 
-		SFS_DATA->free_inodes = ino_node->next;
+	sfs_write_buffer *wb = get_write_buffer(sfs, inode_data->ino, 1);
+	sfs_buffered_block *block = add_buffered_block(wb, 0);
+	block->reserved = 1;
+	wb->meta_reserved = SFS_WRITE_BUFFER_META_RESERVE;
+	memset(block->data, 0, BLOCK_SIZE);
+	memcpy(block->data, inode_data->inline_data, inode_data->size);
 
-		INIT_LIST_HEAD(ino_node);
+	memset(inode_data->inline_data, 0, SFS_INLINE_DATA_SIZE);
+	inode_data->flags &= ~SFS_INODE_INLINE;
+	inode_data->nblocks = 0;
 
-		sfs_free_list *ptr = list_entry(ino_node, sfs_free_list, node);
-		if (ptr != NULL) {
-			log_msg("\nSuccess: Free ino found = %d", ptr->id);
-			return ptr->id;
-		} else {
-			log_msg("\nError: Free ino couldn't be retrieved");
-		}
+	log_msg("\nuninline_inode moved %llu bytes to the write buffer", inode_data->size);
+	return 0;
+}
+
+/*
+ * Sets the size of the inode, freeing the data blocks past the new end of
+ * file when it shrinks, and writes it. Growing leaves a hole which reads as
+ * zeros.
+ */
+int truncate_inode(sfs_inode_t *inode_data, uint64_t size) {
+	if (size > SFS_MAX_FILE_BLOCKS * BLOCK_SIZE) {
+		return -EFBIG;
 	}
 
-	return SFS_INVALID_INO;
-}
+	struct sfs_state *sfs = SFS_DATA;
+	pthread_rwlock_t *lock = inode_map_lock(sfs, inode_data->ino);
+	begin_change(sfs);
+	pthread_rwlock_wrlock(lock);
+	keep_snapshot_image(sfs, inode_data->ino, 1);
+	get_inode(inode_data->ino, inode_data);
 
-void free_block_no(uint32_t b_no) {
-	if (b_no < SFS_NBLOCKS_DATA) {
-		if ((SFS_DATA->state_data_blocks[b_no].node.next
-				== SFS_DATA->state_data_blocks[b_no].node.prev)
-				&& (SFS_DATA->free_data_blocks != &(SFS_DATA->state_data_blocks[b_no].node))) {
+	if (inode_data->flags & SFS_INODE_INLINE) {
+		if (size > SFS_INLINE_DATA_SIZE) {
+			if (uninline_inode(inode_data) < 0) {
+				pthread_rwlock_unlock(lock);
+				end_change(sfs);
+				return -ENOSPC;
+			}
+		} else if (size < inode_data->size) {
+			// Zero the tail so growing the file again doesn't bring old data back
+			memset(inode_data->inline_data + size, 0, inode_data->size - size);
+		}
+	} else if (size < inode_data->size) {
+		// Same for the part of the last block past the new end of file,
+		// before anything is freed so a failure leaves the file as it was
+		int retstat = (size % BLOCK_SIZE) ? zero_block_range(sfs, inode_data, size / BLOCK_SIZE, size % BLOCK_SIZE, BLOCK_SIZE) : 0;
+		if (retstat < 0) {
+			pthread_rwlock_unlock(lock);
+			end_change(sfs);
+			return retstat;
+		}
 
-			list_add_tail(&(SFS_DATA->state_data_blocks[b_no].node), SFS_DATA->free_data_blocks);
-			log_msg("\nSuccess: Data block added to the free list");
-		} else {
-			log_msg("\nError: Data block already in the free list");
+		uint64_t end = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		// A compressed cluster cut in two gets stored again
+		if (end % SFS_CLUSTER_BLOCKS) {
+			expand_cluster(sfs, inode_data, end, 0);
 		}
+		drop_write_buffer(sfs, inode_data->ino, end, SFS_MAX_FILE_BLOCKS);
+		free_inode_blocks(inode_data, end, SFS_MAX_FILE_BLOCKS);
 	}
+
+	inode_data->size = size;
+	inode_data->mtime = inode_data->ctime = time(NULL);
+	update_inode_data(inode_data->ino, inode_data);
+	pthread_rwlock_unlock(lock);
+	end_change(sfs);
+
+	return 0;
 }
 
-uint32_t get_block_no() {
-	if (list_empty(SFS_DATA->free_data_blocks))  {
-		log_msg("\nError: Data blocks limit reached!!!");
-	} else {
-		list_t *data_block_node = SFS_DATA->free_data_blocks;
-		list_del(SFS_DATA->free_data_blocks);
+/*
+ * Allocates blocks for the byte range offset to offset + length - 1, as
+ * contiguous runs if the disk allows, and marks them unwritten so they read
+ * as zeros until data is written to them. The file grows to cover the range
+ * unless keep_size is set.
+ */
+int fallocate_inode(sfs_inode_t *inode_data, int keep_size, off_t offset, off_t length) {
+	if ((offset < 0) || (length <= 0)) {
+		return -EINVAL;
+	}
+	if (offset + length > (off_t)SFS_MAX_FILE_BLOCKS * BLOCK_SIZE) {
+		return -EFBIG;
+	}
+
+	struct sfs_state *sfs = SFS_DATA;
+	pthread_rwlock_t *lock = inode_map_lock(sfs, inode_data->ino);
+	begin_change(sfs);
+	pthread_rwlock_wrlock(lock);
+	keep_snapshot_image(sfs, inode_data->ino, 1);
+	get_inode(inode_data->ino, inode_data);
 
-		SFS_DATA->free_data_blocks = data_block_node->next;
+	int retstat = 0;
+	if ((inode_data->flags & SFS_INODE_INLINE) && (offset + length > SFS_INLINE_DATA_SIZE)) {
+		retstat = uninline_inode(inode_data);
+	}
 
-		INIT_LIST_HEAD(data_block_node);
+	if ((retstat == 0) && !(inode_data->flags & SFS_INODE_INLINE)) {
+		uint64_t first = offset / BLOCK_SIZE;
+		uint64_t end = (offset + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		uint64_t i = 0, needed = 0, reserved = 0;
 
-		sfs_free_list *ptr = list_entry(data_block_node, sfs_free_list, node);
-		if (ptr != NULL) {
-			log_msg("\nSuccess: Free data block found = %d", ptr->id);
-			return ptr->id;
+		// Step 1: Count the blocks missing, and reserve them with their
+		// indirect blocks so they don't eat into space promised to the write
+		// buffers
+		for (i = first; i < end; ++i) {
+			if (get_block_ptr(inode_data, i) == SFS_INVALID_BLOCK_NO) {
+				++needed;
+			}
+		}
+		if (reserve_blocks(sfs, needed + needed / SFS_NIND_BLOCKS + 3) < 0) {
+			retstat = -ENOSPC;
 		} else {
-			log_msg("\nError: Free data block couldn't be retrieved");
+			reserved = needed + needed / SFS_NIND_BLOCKS + 3;
 		}
-	}
 
-	return SFS_INVALID_BLOCK_NO;
-}
+		// Step 2: Allocate every stretch of missing blocks as one run, each
+		// run's reservation is given back once it is taken
+		i = first;
+		while ((retstat == 0) && (i < end)) {
+			if (get_block_ptr(inode_data, i) != SFS_INVALID_BLOCK_NO) {
+				++i;
+				continue;
+			}
 
-void update_inode_bitmap(uint32_t ino, char ch) {
-	int i = 0;
-	char buffer[BLOCK_SIZE];
-	block_read(SFS_BLOCK_INODE_BITMAP + ino / BLOCK_SIZE, buffer);
-	buffer[ino] = ch;
-	block_write(SFS_BLOCK_INODE_BITMAP + ino / BLOCK_SIZE, buffer);
+			uint32_t count = 1;
+			while ((i + count < end) && (count < SFS_BLOCKS_PER_GROUP) && (get_block_ptr(inode_data, i + count) == SFS_INVALID_BLOCK_NO)) {
+				++count;
+			}
 
-	log_msg("\nupdate_inode_bitmap Successful update");
-}
+			uint32_t prev = (i > 0) ? (get_block_ptr(inode_data, i - 1) & ~SFS_BLOCK_FLAGS) : SFS_INVALID_BLOCK_NO;
+			uint32_t goal = (prev != SFS_INVALID_BLOCK_NO) ? (prev + 1) : (inode_data->ino / SFS_INODES_PER_BLOCK);
+			uint32_t run_start = sfs->seqalloc ? get_log_run(sfs, &count) : get_block_run(goal, &count);
+			if (run_start == SFS_INVALID_BLOCK_NO) {
+				retstat = -ENOSPC;
+				break;
+			}
+			unreserve_blocks(sfs, count);
+			reserved -= count;
 
-void update_block_bitmap(uint32_t bno, char ch) {
-	char buffer[BLOCK_SIZE];
-	block_read(SFS_BLOCK_DATA_BITMAP + bno / BLOCK_SIZE, buffer);
-	buffer[bno] = ch;
-	block_write(SFS_BLOCK_DATA_BITMAP + bno / BLOCK_SIZE, buffer);
+			uint32_t j = 0;
+			for (j = 0; j < count; ++j) {
+				if ((retstat == 0) && (set_block_ptr(inode_data, i + j, (run_start + j) | SFS_BLOCK_UNWRITTEN) == 0)) {
+					inode_data->nblocks++;
+				} else {
+					free_block_no(run_start + j);
+					retstat = -ENOSPC;
+				}
+			}
+			i += count;
 
-	log_msg("\nupdate_block_bitmap Successful update");
-}
+			log_msg("\nfallocate_inode ino = %llu preallocated %u blocks at %u", inode_data->ino, count, run_start);
+		}
 
-void update_inode_data(uint32_t ino, sfs_inode_t *inode) {
-	char buffer[BLOCK_SIZE];
-	inode->mtime = time(NULL);
+		// What is left was kept for indirect blocks or went unused
+		unreserve_blocks(sfs, reserved);
+	}
 
-	block_read(SFS_BLOCK_INODES + ino / (BLOCK_SIZE / SFS_INODE_SIZE), buffer);
-	memcpy(buffer + ((ino % (BLOCK_SIZE / SFS_INODE_SIZE)) * SFS_INODE_SIZE), inode, sizeof(sfs_inode_t));
-	block_write(SFS_BLOCK_INODES + ino / (BLOCK_SIZE / SFS_INODE_SIZE), buffer);
+	// Whatever got allocated stays, like on other file systems
+	if ((retstat == 0) && !keep_size && ((uint64_t)(offset + length) > inode_data->size)) {
+		inode_data->size = offset + length;
+		inode_data->mtime = time(NULL);
+	}
+	inode_data->ctime = time(NULL);
+	update_inode_data(inode_data->ino, inode_data);
+	pthread_rwlock_unlock(lock);
+	end_change(sfs);
 
-	log_msg("\nupdate_inode_data Successful update");
+	return retstat;
 }
 
-void update_block_data(uint32_t bno, char* buffer) {
-	block_write(SFS_BLOCK_DATA + bno, buffer);
+/*
+ * Deallocates the byte range offset to offset + length - 1, which reads as
+ * zeros afterwards. The file size doesn't change.
+ */
+int punch_hole_inode(sfs_inode_t *inode_data, off_t offset, off_t length) {
+	if ((offset < 0) || (length <= 0)) {
+		return -EINVAL;
+	}
 
-	log_msg("\nupdate_block_data Successful update");
+	struct sfs_state *sfs = SFS_DATA;
+	pthread_rwlock_t *lock = inode_map_lock(sfs, inode_data->ino);
+	begin_change(sfs);
+	pthread_rwlock_wrlock(lock);
+	keep_snapshot_image(sfs, inode_data->ino, 1);
+	get_inode(inode_data->ino, inode_data);
+
+	int retstat = 0;
+	uint64_t end = ((uint64_t)(offset + length) < inode_data->size) ? (uint64_t)(offset + length) : inode_data->size;
+	if ((uint64_t)offset < end) {
+		if (inode_data->flags & SFS_INODE_INLINE) {
+			memset(inode_data->inline_data + offset, 0, end - offset);
+		} else {
+			uint64_t first_whole = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			uint64_t end_whole = end / BLOCK_SIZE;
+
+			if (first_whole > end_whole) {
+				// Inside a single block
+				retstat = zero_block_range(sfs, inode_data, offset / BLOCK_SIZE, offset % BLOCK_SIZE, end % BLOCK_SIZE);
+			} else {
+				if (offset % BLOCK_SIZE) {
+					retstat = zero_block_range(sfs, inode_data, offset / BLOCK_SIZE, offset % BLOCK_SIZE, BLOCK_SIZE);
+				}
+				if ((retstat == 0) && (end % BLOCK_SIZE)) {
+					retstat = zero_block_range(sfs, inode_data, end / BLOCK_SIZE, 0, end % BLOCK_SIZE);
+				}
+
+				// The whole blocks in between only go if both ends are zeroed
+				if ((retstat == 0) && (first_whole % SFS_CLUSTER_BLOCKS)) {
+					expand_cluster(sfs, inode_data, first_whole, 0);
+				}
+				if ((retstat == 0) && (end_whole % SFS_CLUSTER_BLOCKS)) {
+					expand_cluster(sfs, inode_data, end_whole, 0);
+				}
+				if (retstat == 0) {
+					drop_write_buffer(sfs, inode_data->ino, first_whole, end_whole);
+					free_inode_blocks(inode_data, first_whole, end_whole);
+				}
+			}
+		}
+
+		inode_data->mtime = inode_data->ctime = time(NULL);
+		update_inode_data(inode_data->ino, inode_data);
+	}
+	pthread_rwlock_unlock(lock);
+	end_change(sfs);
+
+	return retstat;
+}
+
+/*
+ * Copies length bytes (0 for everything up to the end of src) from
+ * src_offset in src to dest_offset in dest, like copy_file_range(). Whole
+ * blocks are shared instead of copied when both offsets sit at the same
+ * place within a block, the rest is read and written.
+ */
+int copy_inode_range(sfs_inode_t *src, sfs_inode_t *dest, off_t src_offset, off_t dest_offset, uint64_t length) {
+	struct sfs_state *sfs = SFS_DATA;
+	get_inode(src->ino, src);
+
+	if ((src_offset < 0) || (dest_offset < 0)) {
+		return -EINVAL;
+	}
+	if ((uint64_t)src_offset >= src->size) {
+		return 0;
+	}
+	if ((length == 0) || (length > src->size - src_offset)) {
+		length = src->size - src_offset;
+	}
+	if (dest_offset + length > SFS_MAX_FILE_BLOCKS * BLOCK_SIZE) {
+		return -EFBIG;
+	}
+	if ((src->ino == dest->ino) && (src_offset < (off_t)(dest_offset + length)) && (dest_offset < (off_t)(src_offset + length))) {
+		return -EINVAL;
+	}
+
+	uint64_t done = 0;
+	if ((src_offset % BLOCK_SIZE) == (dest_offset % BLOCK_SIZE)) {
+		uint64_t head = (BLOCK_SIZE - src_offset % BLOCK_SIZE) % BLOCK_SIZE;
+		if (head > length) {
+			head = length;
+		}
+
+		int retstat = copy_bytes(src, dest, src_offset, dest_offset, head);
+		if (retstat < 0) {
+			return retstat;
+		}
+
+		int cloned = clone_blocks(sfs, src->ino, dest->ino, (src_offset + head) / BLOCK_SIZE,
+				(dest_offset + head) / BLOCK_SIZE, (length - head) / BLOCK_SIZE);
+		done = head + ((cloned > 0) ? (uint64_t)cloned * BLOCK_SIZE : 0);
+	}
+
+	log_msg("\ncopy_inode_range ino %llu -> %llu, %llu of %llu bytes shared", src->ino, dest->ino, done, length);
+	return copy_bytes(src, dest, src_offset + done, dest_offset + done, length - done);
+}
+
+/*
+ * Makes count blocks of dest from dest_first on point at the blocks of src
+ * from src_first on, taking a reference on each. Returns the number of
+ * blocks done, which is short when a block can't take another reference.
+ */
+int clone_blocks(struct sfs_state *sfs, uint64_t src_ino, uint64_t dest_ino, uint64_t src_first, uint64_t dest_first, uint64_t count) {
+	if (count == 0) {
+		return 0;
+	}
+
+	// Two inodes, lock their shards in a fixed order
+	begin_change(sfs);
+	pthread_rwlock_t *src_lock = inode_map_lock(sfs, src_ino);
+	pthread_rwlock_t *dest_lock = inode_map_lock(sfs, dest_ino);
+	pthread_rwlock_wrlock((src_lock < dest_lock) ? src_lock : dest_lock);
+	if (src_lock != dest_lock) {
+		pthread_rwlock_wrlock((src_lock < dest_lock) ? dest_lock : src_lock);
+	}
+	keep_snapshot_image(sfs, dest_ino, 1);
+
+	sfs_inode_t src_inode, dest_inode;
+	sfs_inode_t *src = &src_inode;
+	sfs_inode_t *dest = (src_ino == dest_ino) ? &src_inode : &dest_inode;
+	get_inode(src_ino, src);
+	get_inode(dest_ino, dest);
+
+	// Blocks can only be shared with a destination which has a block map
+	if ((dest->flags & SFS_INODE_INLINE) && !(src->flags & SFS_INODE_INLINE)) {
+		uninline_inode(dest);
+	}
+
+	uint64_t i = 0;
+	if (!(src->flags & SFS_INODE_INLINE) && !(dest->flags & SFS_INODE_INLINE)) {
+		// Buffered data of the source has to be on disk to be shared, the
+		// destination's gets replaced
+		sfs_write_buffer *wb = get_write_buffer(sfs, src_ino, 0);
+		if (wb != NULL) {
+			flush_write_buffer(sfs, wb, src);
+		}
+
+		// Compressed clusters get copied, sharing part of one would take
+		// its blocks apart
+		for (i = 0; i < count; ++i) {
+			if (get_block_ptr(src, src_first + i) & SFS_BLOCK_COMPRESSED) {
+				count = 0;
+			}
+		}
+		if ((dest_first % SFS_CLUSTER_BLOCKS) && (count > 0)) {
+			expand_cluster(sfs, dest, dest_first, 0);
+		}
+		if (((dest_first + count) % SFS_CLUSTER_BLOCKS) && (count > 0)) {
+			expand_cluster(sfs, dest, dest_first + count, 0);
+		}
+		drop_write_buffer(sfs, dest_ino, dest_first, dest_first + count);
+		free_inode_blocks(dest, dest_first, dest_first + count);
+
+		for (i = 0; i < count; ++i) {
+			uint32_t block_no = get_block_ptr(src, src_first + i);
+			if (block_no == SFS_INVALID_BLOCK_NO) {
+				continue;
+			}
+
+			if (ref_block(sfs, block_no & ~SFS_BLOCK_FLAGS) < 0) {
+				break;
+			}
+			if (set_block_ptr(dest, dest_first + i, block_no) < 0) {
+				free_block_no(block_no & ~SFS_BLOCK_FLAGS);
+				break;
+			}
+			dest->nblocks++;
+		}
+
+		if ((dest_first + i) * BLOCK_SIZE > dest->size) {
+			dest->size = (dest_first + i) * BLOCK_SIZE;
+		}
+		dest->mtime = dest->ctime = time(NULL);
+		update_inode_data(dest_ino, dest);
+	}
+
+	pthread_rwlock_unlock(dest_lock);
+	if (src_lock != dest_lock) {
+		pthread_rwlock_unlock(src_lock);
+	}
+	end_change(sfs);
+
+	return i;
+}
+
+int copy_bytes(sfs_inode_t *src, sfs_inode_t *dest, off_t src_offset, off_t dest_offset, uint64_t length) {
+	char *buffer = malloc(SFS_WRITE_BUFFER_MAX_BLOCKS * BLOCK_SIZE);
+	int retstat = 0;
+
+	while ((length > 0) && (retstat >= 0)) {
+		int size = (length > SFS_WRITE_BUFFER_MAX_BLOCKS * BLOCK_SIZE) ? (SFS_WRITE_BUFFER_MAX_BLOCKS * BLOCK_SIZE) : length;
+		size = read_inode_data(src, buffer, size, src_offset);
+		if (size <= 0) {
+			retstat = size;
+			break;
+		}
+
+		retstat = write_inode(dest, buffer, size, dest_offset);
+		if ((retstat >= 0) && (retstat < size)) {
+			retstat = -ENOSPC;
+		}
+		src_offset += size;
+		dest_offset += size;
+		length -= size;
+	}
+	free(buffer);
+
+	return (retstat < 0) ? retstat : 0;
+}
+
+/*
+ * Zeroes the bytes from to to - 1 of file block idx through the write
+ * buffer. Holes and unwritten blocks are zero already. Room for the block
+ * is reserved the way write_inode() does it, without any this fails with
+ * -ENOSPC, and with -EIO if the rest of the block can't be read. Caller
+ * must hold the inode's map lock.
+ */
+int zero_block_range(struct sfs_state *sfs, sfs_inode_t *inode, uint64_t idx, int from, int to) {
+	sfs_write_buffer *wb = get_write_buffer(sfs, inode->ino, 0);
+	sfs_buffered_block *block = (wb != NULL) ? find_buffered_block(wb, idx) : NULL;
+
+	if (block == NULL) {
+		uint32_t block_no = get_block_ptr(inode, idx);
+		if ((block_no == SFS_INVALID_BLOCK_NO) || (block_no & SFS_BLOCK_UNWRITTEN)) {
+			return 0;
+		}
+
+		if (block_no & SFS_BLOCK_COMPRESSED) {
+			if (expand_cluster(sfs, inode, idx, 1) < 0) {
+				return -ENOSPC;
+			}
+			block = find_buffered_block(get_write_buffer(sfs, inode->ino, 1), idx);
+		} else {
+			char old_data[BLOCK_SIZE];
+			if ((block_read(block_no, old_data) < 0) || (verify_checksums(sfs, &block_no, old_data, 1) < 0)) {
+				return -EIO;
+			}
+
+			// A block shared with a clone gets one of its own at the flush
+			int cow = block_shared(sfs, block_no);
+			if (cow) {
+				int needed = ((wb == NULL) || (wb->meta_reserved == 0)) ? (1 + SFS_WRITE_BUFFER_META_RESERVE) : 1;
+				if (reserve_blocks(sfs, needed) < 0) {
+					return -ENOSPC;
+				}
+			}
+
+			wb = get_write_buffer(sfs, inode->ino, 1);
+			if (cow) {
+				wb->meta_reserved = SFS_WRITE_BUFFER_META_RESERVE;
+			}
+			block = add_buffered_block(wb, idx);
+			block->reserved = cow;
+			memcpy(block->data, old_data, BLOCK_SIZE);
+		}
+	}
+
+	memset(block->data + from, 0, to - from);
+	return 0;
+}
+
+/*
+ * Compresses the clusters held in full by the write buffer, for a flush.
+ * The compressed data replaces the contents of the cluster's first blocks,
+ * which get cluster_part 1, the rest gets cluster_part 2. Clusters which
+ * don't shrink by a block at least are left alone.
+ */
+void compress_clusters(sfs_write_buffer *wb, uint64_t num_data_blocks) {
+	char data[SFS_CLUSTER_BLOCKS * BLOCK_SIZE];
+	char packed[SFS_CLUSTER_BLOCKS * BLOCK_SIZE];
+	int i = 0, j = 0;
+
+	for (i = 0; i < wb->num_blocks; ++i) {
+		sfs_buffered_block *blocks = wb->blocks + i;
+		if ((blocks[0].idx % SFS_CLUSTER_BLOCKS) || (blocks[0].idx >= num_data_blocks)) {
+			continue;
+		}
+
+		// Blocks are sorted by idx, the cluster is all there if its last
+		// block sits where it should
+		int count = (num_data_blocks - blocks[0].idx < SFS_CLUSTER_BLOCKS) ? (num_data_blocks - blocks[0].idx) : SFS_CLUSTER_BLOCKS;
+		if ((count < 2) || (i + count > wb->num_blocks) || (blocks[count - 1].idx != blocks[0].idx + count - 1)) {
+			continue;
+		}
+
+		for (j = 0; j < count; ++j) {
+			memcpy(data + j * BLOCK_SIZE, blocks[j].data, BLOCK_SIZE);
+		}
+		sfs_cluster_header_t *header = (sfs_cluster_header_t*)packed;
+		int size = lz_compress(data, count * BLOCK_SIZE, packed + sizeof(*header), (count - 1) * BLOCK_SIZE - sizeof(*header));
+		if (size < 0) {
+			continue;
+		}
+		header->size = size;
+		header->data_size = count * BLOCK_SIZE;
+
+		int used = (sizeof(*header) + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		memset(packed + sizeof(*header) + size, 0, used * BLOCK_SIZE - sizeof(*header) - size);
+		for (j = 0; j < count; ++j) {
+			if (j < used) {
+				memcpy(blocks[j].data, packed + j * BLOCK_SIZE, BLOCK_SIZE);
+			}
+			blocks[j].cluster_part = (j < used) ? 1 : 2;
+		}
+
+		log_msg("\ncompress_clusters ino = %llu cluster at %llu, %d blocks into %d", wb->ino, blocks[0].idx, count, used);
+		i += count - 1;
+	}
+}
+
+/*
+ * Reads file block idx out of its compressed cluster, decompressing the
+ * cluster unless it is in the cache. Caller must hold the inode's map lock.
+ */
+int read_cluster_block(struct sfs_state *sfs, sfs_inode_t *inode, uint64_t idx, char *data) {
+	uint64_t first = idx - idx % SFS_CLUSTER_BLOCKS;
+	uint32_t block_nos[SFS_CLUSTER_BLOCKS];
+	int count = 0, j = 0, retstat = 0;
+
+	for (j = 0; j < SFS_CLUSTER_BLOCKS; ++j) {
+		uint32_t block_no = get_block_ptr(inode, first + j);
+		if ((block_no & SFS_BLOCK_COMPRESSED) && ((block_no & ~SFS_BLOCK_FLAGS) != SFS_INVALID_BLOCK_NO)) {
+			block_nos[count++] = block_no & ~SFS_BLOCK_FLAGS;
+		}
+	}
+	if (count == 0) {
+		memset(data, 0, BLOCK_SIZE);
+		return -EIO;
+	}
+
+	pthread_mutex_lock(&sfs->cluster_lock);
+	sfs_cached_cluster *cluster = sfs->clusters + (block_nos[0] % SFS_CLUSTER_CACHE_SIZE);
+	if (cluster->block_no != block_nos[0]) {
+		char packed[SFS_CLUSTER_BLOCKS * BLOCK_SIZE];
+		for (j = 0; j < count; ++j) {
+			block_read(block_nos[j], packed + j * BLOCK_SIZE);
+		}
+		int corrupt = (verify_checksums(sfs, block_nos, packed, count) < 0);
+
+		sfs_cluster_header_t *header = (sfs_cluster_header_t*)packed;
+		int size = -1;
+		if (!corrupt && (header->size <= count * BLOCK_SIZE - sizeof(*header))) {
+			size = lz_decompress(packed + sizeof(*header), header->size, cluster->data, SFS_CLUSTER_BLOCKS * BLOCK_SIZE);
+		}
+		if ((size < 0) || (size != header->data_size)) {
+			log_msg("\nError: Compressed cluster at block %u is corrupt", block_nos[0]);
+			cluster->block_no = SFS_INVALID_BLOCK_NO;
+			retstat = -EIO;
+		} else {
+			cluster->block_no = block_nos[0];
+			cluster->size = size;
+		}
+	}
+
+	int offset = (idx - first) * BLOCK_SIZE;
+	if ((retstat == 0) && (offset < cluster->size)) {
+		memcpy(data, cluster->data + offset, BLOCK_SIZE);
+	} else {
+		memset(data, 0, BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&sfs->cluster_lock);
+
+	return retstat;
+}
+
+/*
+ * Moves the compressed blocks of the cluster holding file block idx into
+ * the write buffer, decompressed, so part of the cluster can change and
+ * the next flush stores all of it again. Room for the blocks is reserved
+ * if there is some, without it fails with -ENOSPC if must_reserve is set.
+ * Caller must hold the inode's map lock.
+ */
+int expand_cluster(struct sfs_state *sfs, sfs_inode_t *inode, uint64_t idx, int must_reserve) {
+	uint64_t first = idx - idx % SFS_CLUSTER_BLOCKS;
+	sfs_write_buffer *wb = get_write_buffer(sfs, inode->ino, 0);
+	int needed = 0, j = 0;
+
+	for (j = 0; j < SFS_CLUSTER_BLOCKS; ++j) {
+		if ((get_block_ptr(inode, first + j) & SFS_BLOCK_COMPRESSED) && ((wb == NULL) || (find_buffered_block(wb, first + j) == NULL))) {
+			++needed;
+		}
+	}
+	if (needed == 0) {
+		return 0;
+	}
+
+	// All or nothing, a cluster only partly rewritten would lose the rest
+	int meta = ((wb == NULL) || (wb->meta_reserved == 0)) ? SFS_WRITE_BUFFER_META_RESERVE : 0;
+	int reserved = (reserve_blocks(sfs, needed + meta) == 0);
+	if (!reserved && must_reserve) {
+		return -ENOSPC;
+	}
+
+	wb = get_write_buffer(sfs, inode->ino, 1);
+	if (reserved) {
+		wb->meta_reserved += meta;
+	}
+	for (j = 0; j < SFS_CLUSTER_BLOCKS; ++j) {
+		if ((get_block_ptr(inode, first + j) & SFS_BLOCK_COMPRESSED) && (find_buffered_block(wb, first + j) == NULL)) {
+			sfs_buffered_block *block = add_buffered_block(wb, first + j);
+			block->reserved = reserved;
+			read_cluster_block(sfs, inode, first + j, block->data);
+		}
+	}
+
+	log_msg("\nexpand_cluster ino = %llu cluster at %llu, %d blocks buffered", inode->ino, first, needed);
+	return 0;
+}
+
+pthread_rwlock_t* inode_map_lock(struct sfs_state *sfs, uint64_t ino) {
+	return sfs->wb_locks + (ino % SFS_WRITE_BUFFER_LOCKS);
+}
+
+// Nesting of begin_change() in the calling thread, only the outermost one locks
+static __thread int change_depth = 0;
+
+// Set in the thread walking the tree for snapshot_fs(), its own changes
+// don't need images
+static __thread int snapshot_walker = 0;
+
+/*
+ * Brackets a change of the tree (file data, sizes, directory entries) with
+ * the snapshot lock held for reading, so snapshot_fs() sees either all or
+ * nothing of it. Nested calls, like the ones of the snapshot walk itself,
+ * don't lock again. Taken before any inode's map lock.
+ */
+void begin_change(struct sfs_state *sfs) {
+	if (change_depth++ == 0) {
+		pthread_rwlock_rdlock(&sfs->snapshot_lock);
+	}
+}
+
+void end_change(struct sfs_state *sfs) {
+	if (--change_depth == 0) {
+		pthread_rwlock_unlock(&sfs->snapshot_lock);
+	}
+}
+
+/*
+ * Returns the write buffer of the inode, creating it if asked to. Caller
+ * must hold the inode's map lock.
+ */
+sfs_write_buffer* get_write_buffer(struct sfs_state *sfs, uint64_t ino, int create) {
+	pthread_mutex_lock(&sfs->wb_list_lock);
+	sfs_write_buffer *wb = sfs->wb_hash[ino % SFS_WRITE_BUFFER_HASH_SIZE];
+	while ((wb != NULL) && (wb->ino != ino)) {
+		wb = wb->hash_next;
+	}
+
+	if ((wb == NULL) && create) {
+		wb = calloc(1, sizeof(sfs_write_buffer));
+		wb->ino = ino;
+		wb->dirtied = time(NULL);
+		wb->hash_next = sfs->wb_hash[ino % SFS_WRITE_BUFFER_HASH_SIZE];
+		sfs->wb_hash[ino % SFS_WRITE_BUFFER_HASH_SIZE] = wb;
+		list_add_tail(&wb->dirty, &sfs->wb_dirty);
+	}
+	pthread_mutex_unlock(&sfs->wb_list_lock);
+
+	return wb;
+}
+
+/*
+ * Frees a write buffer, reservations have to be given back by the caller.
+ * Caller must hold the inode's map lock.
+ */
+void free_write_buffer(struct sfs_state *sfs, sfs_write_buffer *wb) {
+	pthread_mutex_lock(&sfs->wb_list_lock);
+	sfs_write_buffer **link = &sfs->wb_hash[wb->ino % SFS_WRITE_BUFFER_HASH_SIZE];
+	while (*link != wb) {
+		link = &(*link)->hash_next;
+	}
+	*link = wb->hash_next;
+	list_del(&wb->dirty);
+	pthread_mutex_unlock(&sfs->wb_list_lock);
+
+	int i = 0;
+	for (i = 0; i < wb->num_blocks; ++i) {
+		free(wb->blocks[i].data);
+	}
+	free(wb->blocks);
+	free(wb);
+}
+
+sfs_buffered_block* find_buffered_block(sfs_write_buffer *wb, uint64_t idx) {
+	int low = 0, high = wb->num_blocks - 1;
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		if (wb->blocks[mid].idx == idx) {
+			return wb->blocks + mid;
+		} else if (wb->blocks[mid].idx < idx) {
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Adds file block idx, which must not be buffered yet, to the write buffer.
+ * The data is left for the caller to fill in.
+ */
+sfs_buffered_block* add_buffered_block(sfs_write_buffer *wb, uint64_t idx) {
+	if (wb->num_blocks == wb->max_blocks) {
+		wb->max_blocks = (wb->max_blocks > 0) ? (2 * wb->max_blocks) : 16;
+		wb->blocks = realloc(wb->blocks, wb->max_blocks * sizeof(sfs_buffered_block));
+	}
+
+	int pos = wb->num_blocks;
+	while ((pos > 0) && (wb->blocks[pos - 1].idx > idx)) {
+		--pos;
+	}
+	memmove(wb->blocks + pos + 1, wb->blocks + pos, (wb->num_blocks - pos) * sizeof(sfs_buffered_block));
+	wb->num_blocks++;
+
+	sfs_buffered_block *block = wb->blocks + pos;
+	block->idx = idx;
+	block->block_no = SFS_INVALID_BLOCK_NO;
+	block->reserved = 0;
+	block->cluster_part = 0;
+	block->deduped = 0;
+	block->data = malloc(BLOCK_SIZE);
+
+	return block;
+}
+
+/*
+ * Drops buffered blocks first to end - 1, for truncation, hole punching
+ * and removal. Caller must hold the inode's map lock.
+ */
+void drop_write_buffer(struct sfs_state *sfs, uint64_t ino, uint64_t first, uint64_t end) {
+	sfs_write_buffer *wb = get_write_buffer(sfs, ino, 0);
+	if (wb == NULL) {
+		return;
+	}
+
+	int unreserve = 0;
+	int i = 0, kept = 0;
+	for (i = 0; i < wb->num_blocks; ++i) {
+		sfs_buffered_block *block = wb->blocks + i;
+		if ((block->idx >= first) && (block->idx < end)) {
+			unreserve += block->reserved;
+			free(block->data);
+		} else {
+			wb->blocks[kept++] = *block;
+		}
+	}
+	wb->num_blocks = kept;
+
+	if (wb->num_blocks == 0) {
+		unreserve += wb->meta_reserved;
+		free_write_buffer(sfs, wb);
+	}
+	unreserve_blocks(sfs, unreserve);
+}
+
+/*
+ * Keeps count free blocks aside for write buffers, so data which was
+ * accepted can always be allocated later on.
+ */
+int reserve_blocks(struct sfs_state *sfs, uint64_t count) {
+	int retstat = 0;
+
+	pthread_mutex_lock(&sfs->sb_lock);
+	if (sfs->sb->num_free_blocks < sfs->reserved_blocks + count) {
+		retstat = -ENOSPC;
+	} else {
+		sfs->reserved_blocks += count;
+	}
+	pthread_mutex_unlock(&sfs->sb_lock);
+
+	return retstat;
+}
+
+void unreserve_blocks(struct sfs_state *sfs, uint64_t count) {
+	pthread_mutex_lock(&sfs->sb_lock);
+	sfs->reserved_blocks -= count;
+	pthread_mutex_unlock(&sfs->sb_lock);
+}
+
+int compare_buffered_blocks(const void *a, const void *b) {
+	uint32_t block_a = (*(sfs_buffered_block* const*)a)->block_no;
+	uint32_t block_b = (*(sfs_buffered_block* const*)b)->block_no;
+	return (block_a > block_b) - (block_a < block_b);
+}
+
+/*
+ * Allocates blocks for everything in the write buffer which has none yet,
+ * as one contiguous run if the disk allows, writes all of it with as few
+ * vectored writes as possible, and frees the buffer. Reservations are given
+ * back one block at a time, as each one gets allocated. The file only
+ * points at blocks once their data is on disk, a block which fails to
+ * write leaves the old one in place and the flush fails with -EIO. inode
+ * gets updated and written. Caller must hold the inode's map lock.
+ */
+int flush_write_buffer(struct sfs_state *sfs, sfs_write_buffer *wb, sfs_inode_t *inode) {
+	int retstat = 0;
+	int i = 0, j = 0, needed = 0, unbacked = 0;
+	uint64_t num_data_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	if (sfs->compress) {
+		compress_clusters(wb, num_data_blocks);
+	}
+
+	// Step 1: Find the blocks needing allocation, blocks past the end of
+	// file are dropped
+	for (i = 0; i < wb->num_blocks; ++i) {
+		sfs_buffered_block *block = wb->blocks + i;
+		block->block_no = (block->idx < num_data_blocks) ? get_block_ptr(inode, block->idx) : SFS_INVALID_BLOCK_NO;
+		if (block->cluster_part == 2) {
+			// Compressed away, only the pointer is left to mark the cluster
+			block->block_no = SFS_INVALID_BLOCK_NO;
+		} else if ((block->idx < num_data_blocks) && (block->block_no == SFS_INVALID_BLOCK_NO)) {
+			++needed;
+		} else if (block->cluster_part || (block->block_no & SFS_BLOCK_COMPRESSED)) {
+			// Clusters change size when compressed, they always move
+			block->block_no = SFS_INVALID_BLOCK_NO;
+			++needed;
+		} else if ((block->block_no != SFS_INVALID_BLOCK_NO) && block_shared(sfs, block->block_no & ~SFS_BLOCK_FLAGS)) {
+			// Shared with a clone, the data gets a block of its own
+			block->block_no = SFS_INVALID_BLOCK_NO;
+			++needed;
+		} else if (block->block_no & SFS_BLOCK_UNWRITTEN) {
+			// Preallocated, the block becomes written with this flush
+			block->block_no &= ~SFS_BLOCK_UNWRITTEN;
+		} else if ((sfs->seqalloc || sfs->dedup) && (block->block_no != SFS_INVALID_BLOCK_NO)) {
+			// Overwrites go to the allocation cursor too, and blocks which
+			// may be in the dedup index never change
+			block->block_no = SFS_INVALID_BLOCK_NO;
+			++needed;
+		}
+
+		// Blocks staying where they are have no use for their reservation
+		int allocates = (block->idx < num_data_blocks) && (block->block_no == SFS_INVALID_BLOCK_NO) && (block->cluster_part != 2);
+		if (block->reserved && !allocates) {
+			unreserve_blocks(sfs, 1);
+			block->reserved = 0;
+		} else if (allocates && !block->reserved) {
+			++unbacked;
+		}
+	}
+
+	// Step 2: In dedup mode, share a block with the same data instead of
+	// allocating one
+	for (i = 0; sfs->dedup && (i < wb->num_blocks) && (needed > 0); ++i) {
+		sfs_buffered_block *block = wb->blocks + i;
+		if ((block->idx >= num_data_blocks) || (block->block_no != SFS_INVALID_BLOCK_NO) || block->cluster_part) {
+			continue;
+		}
+
+		uint32_t dup_block_no = find_duplicate(sfs, block->data);
+		if (dup_block_no == SFS_INVALID_BLOCK_NO) {
+			continue;
+		}
+
+		uint32_t old_block_no = get_block_ptr(inode, block->idx) & ~SFS_BLOCK_FLAGS;
+		if (set_block_ptr(inode, block->idx, dup_block_no) < 0) {
+			free_block_no(dup_block_no);
+			continue;
+		}
+		if (old_block_no != SFS_INVALID_BLOCK_NO) {
+			free_block_no(old_block_no);
+		} else {
+			inode->nblocks++;
+		}
+		block->block_no = dup_block_no;
+		block->deduped = 1;
+		needed--;
+		if (block->reserved) {
+			unreserve_blocks(sfs, 1);
+			block->reserved = 0;
+		} else {
+			unbacked--;
+		}
+	}
+
+	// Overwrites moved by seqalloc or dedup and clusters buffered without
+	// room were never reserved for, they must not take the room promised to
+	// other writes. Without it they stay unallocated.
+	if ((unbacked > 0) && (reserve_blocks(sfs, unbacked) == 0)) {
+		for (i = 0; i < wb->num_blocks; ++i) {
+			sfs_buffered_block *block = wb->blocks + i;
+			if ((block->idx < num_data_blocks) && (block->block_no == SFS_INVALID_BLOCK_NO) && (block->cluster_part != 2)) {
+				block->reserved = 1;
+			}
+		}
+	} else if (unbacked > 0) {
+		log_msg("\nflush_write_buffer no space left for %d unreserved blocks of ino %llu", unbacked, inode->ino);
+		needed -= unbacked;
+		retstat = -ENOSPC;
+	}
+
+	// Step 3: Allocate, placing the run right after the file's previous
+	// block, on the tier it belongs to with tiering, or at the log head
+	// with seqalloc. The file keeps pointing at the old blocks for now.
+	uint32_t run_start = SFS_INVALID_BLOCK_NO, run_left = 0;
+	for (i = 0; (i < wb->num_blocks) && (needed > 0); ++i) {
+		sfs_buffered_block *block = wb->blocks + i;
+		if ((block->idx >= num_data_blocks) || (block->block_no != SFS_INVALID_BLOCK_NO) || (block->cluster_part == 2) || !block->reserved) {
+			continue;
+		}
+
+		if (run_left == 0) {
+			uint32_t prev = (block->idx > 0) ? (get_block_ptr(inode, block->idx - 1) & ~SFS_BLOCK_FLAGS) : SFS_INVALID_BLOCK_NO;
+			uint32_t goal = (prev != SFS_INVALID_BLOCK_NO) ? (prev + 1) : (inode->ino / SFS_INODES_PER_BLOCK);
+			if (!sfs->seqalloc && (sfs->fast_groups > 0)) {
+				// Small files and hot extents go to the fast tier while it has room
+				int fast = ((inode->size <= SFS_TIER_SMALL_FILE) ||
+						(extent_heat(sfs, inode->ino, block->idx / SFS_TIER_EXTENT_BLOCKS) >= SFS_TIER_HOT)) &&
+						(fast_tier_free_pct(sfs) > SFS_TIER_RESERVE_PCT);
+				goal = tier_goal(sfs, goal, fast);
+			}
+
+			run_left = needed;
+			run_start = sfs->seqalloc ? get_log_run(sfs, &run_left) : get_block_run(goal, &run_left);
+			if (run_start == SFS_INVALID_BLOCK_NO) {
+				log_msg("\nflush_write_buffer no space left for ino %llu", inode->ino);
+				retstat = -ENOSPC;
+				break;
+			}
+		}
+
+		block->block_no = run_start++;
+		unreserve_blocks(sfs, 1);
+		block->reserved = 0;
+		run_left--;
+		needed--;
+	}
+
+	// Blocks left over from a run cut short by a failure
+	while (run_left > 0) {
+		free_block_no(run_start++);
+		run_left--;
+	}
+
+	// Without room to move them, overwrites with seqalloc and dedup go in
+	// place if nobody else owns the block, after taking it out of the dedup
+	// index
+	for (i = 0; (sfs->seqalloc || sfs->dedup) && (retstat < 0) && (i < wb->num_blocks); ++i) {
+		sfs_buffered_block *block = wb->blocks + i;
+		if ((block->idx < num_data_blocks) && (block->block_no == SFS_INVALID_BLOCK_NO) && !block->cluster_part) {
+			uint32_t old_block_no = get_block_ptr(inode, block->idx);
+			pthread_mutex_lock(&sfs->dedup_lock);
+			if ((old_block_no != SFS_INVALID_BLOCK_NO) && !(old_block_no & SFS_BLOCK_COMPRESSED) && !block_shared(sfs, old_block_no)) {
+				if (sfs->dedup) {
+					forget_fingerprint(sfs, old_block_no);
+				}
+				block->block_no = old_block_no;
+			}
+			pthread_mutex_unlock(&sfs->dedup_lock);
+		}
+	}
+
+	// Step 4: Write in disk order, adjacent blocks with a single call
+	sfs_buffered_block **sorted = malloc(wb->num_blocks * sizeof(sfs_buffered_block*));
+	char *failed = calloc(wb->num_blocks + 1, 1);
+	int num_sorted = 0;
+	for (i = 0; i < wb->num_blocks; ++i) {
+		if ((wb->blocks[i].block_no != SFS_INVALID_BLOCK_NO) && !wb->blocks[i].deduped) {
+			sorted[num_sorted++] = wb->blocks + i;
+		}
+	}
+	qsort(sorted, num_sorted, sizeof(sfs_buffered_block*), compare_buffered_blocks);
+
+	struct iovec iov[SFS_WRITE_BUFFER_MAX_BLOCKS];
+	int first = 0;
+	while (first < num_sorted) {
+		int count = 1;
+		while ((first + count < num_sorted) && (count < SFS_WRITE_BUFFER_MAX_BLOCKS) &&
+			(sorted[first + count]->block_no == sorted[first]->block_no + count)) {
+			++count;
+		}
+
+		for (i = 0; i < count; ++i) {
+			iov[i].iov_base = sorted[first + i]->data;
+			iov[i].iov_len = BLOCK_SIZE;
+		}
+		if (block_writev(sorted[first]->block_no, iov, count) < 0) {
+			log_msg("\nflush_write_buffer ino = %llu failed to write %d blocks at %u", inode->ino, count, sorted[first]->block_no);
+			for (i = 0; i < count; ++i) {
+				failed[sorted[first + i] - wb->blocks] = 1;
+			}
+			retstat = -EIO;
+		} else {
+			store_checksums(sfs, sorted[first]->block_no, iov, count);
+			log_msg("\nflush_write_buffer ino = %llu wrote %d blocks at %u", inode->ino, count, sorted[first]->block_no);
+		}
+
+		first += count;
+	}
+	free(sorted);
+
+	// A compressed cluster only replaces the old one once all of its data
+	// made it to disk
+	for (i = 0; i < wb->num_blocks; ++i) {
+		sfs_buffered_block *block = wb->blocks + i;
+		if ((block->cluster_part == 1) && (failed[i] || (block->block_no == SFS_INVALID_BLOCK_NO))) {
+			uint64_t cluster = block->idx / SFS_CLUSTER_BLOCKS;
+			for (j = 0; j < wb->num_blocks; ++j) {
+				if (wb->blocks[j].cluster_part && (wb->blocks[j].idx / SFS_CLUSTER_BLOCKS == cluster)) {
+					failed[j] = 1;
+				}
+			}
+		}
+	}
+
+	// Step 5: Point the file at the blocks written, dropping the references
+	// to the blocks they replace. New blocks which didn't make it are given
+	// back.
+	for (i = 0; i < wb->num_blocks; ++i) {
+		sfs_buffered_block *block = wb->blocks + i;
+		if ((block->idx >= num_data_blocks) || block->deduped) {
+			continue;
+		}
+
+		uint32_t old_block_no = get_block_ptr(inode, block->idx);
+		if (block->cluster_part == 2) {
+			if (failed[i]) {
+				continue;
+			}
+			if (set_block_ptr(inode, block->idx, SFS_BLOCK_COMPRESSED) < 0) {
+				retstat = -ENOSPC;
+			} else if ((old_block_no & ~SFS_BLOCK_FLAGS) != SFS_INVALID_BLOCK_NO) {
+				free_block_no(old_block_no & ~SFS_BLOCK_FLAGS);
+				inode->nblocks--;
+			}
+			continue;
+		}
+
+		if (block->block_no == SFS_INVALID_BLOCK_NO) {
+			continue;
+		}
+		uint32_t new_block_no = block->block_no | (block->cluster_part ? SFS_BLOCK_COMPRESSED : 0);
+		int moved = ((old_block_no & ~SFS_BLOCK_FLAGS) != block->block_no);
+		if (failed[i] || ((new_block_no != old_block_no) && (set_block_ptr(inode, block->idx, new_block_no) < 0))) {
+			if (moved) {
+				free_block_no(block->block_no);
+			}
+			block->block_no = SFS_INVALID_BLOCK_NO;
+			if (!failed[i]) {
+				retstat = -ENOSPC;
+			}
+		} else if (!moved) {
+			// Written in place, or preallocated and written now
+		} else if ((old_block_no & ~SFS_BLOCK_FLAGS) != SFS_INVALID_BLOCK_NO) {
+			// Copied on write or moved, drop the reference to the old block
+			free_block_no(old_block_no & ~SFS_BLOCK_FLAGS);
+		} else {
+			inode->nblocks++;
+		}
+	}
+
+	// On disk now, the blocks can be found by later writes of the same data
+	for (i = 0; sfs->dedup && (i < wb->num_blocks); ++i) {
+		sfs_buffered_block *block = wb->blocks + i;
+		if ((block->block_no != SFS_INVALID_BLOCK_NO) && !block->deduped && !block->cluster_part) {
+			index_block(sfs, block->block_no, block->data);
+		}
+	}
+	free(failed);
+
+	// Whatever is still reserved went unused
+	int unreserve = wb->meta_reserved;
+	for (i = 0; i < wb->num_blocks; ++i) {
+		unreserve += wb->blocks[i].reserved;
+	}
+	unreserve_blocks(sfs, unreserve);
+
+	update_inode_data(inode->ino, inode);
+	free_write_buffer(sfs, wb);
+
+	return retstat;
+}
+
+/*
+ * Flushes every write buffer holding data for at least min_age seconds,
+ * oldest first.
+ */
+void flush_write_buffers(struct sfs_state *sfs, int min_age) {
+	time_t now = time(NULL);
+
+	while (1) {
+		pthread_mutex_lock(&sfs->wb_list_lock);
+		sfs_write_buffer *wb = list_empty(&sfs->wb_dirty) ? NULL : list_entry(sfs->wb_dirty.next, sfs_write_buffer, dirty);
+		uint64_t ino = ((wb != NULL) && (now - wb->dirtied >= min_age)) ? wb->ino : SFS_INVALID_INO;
+		pthread_mutex_unlock(&sfs->wb_list_lock);
+		if (ino == SFS_INVALID_INO) {
+			break;
+		}
+
+		pthread_rwlock_t *lock = inode_map_lock(sfs, ino);
+		pthread_rwlock_wrlock(lock);
+		wb = get_write_buffer(sfs, ino, 0);
+		if (wb != NULL) {
+			sfs_inode_t inode;
+			get_inode(ino, &inode);
+			flush_write_buffer(sfs, wb, &inode);
+		}
+		pthread_rwlock_unlock(lock);
+	}
+}
+
+void fill_stat_from_ino(const sfs_inode_t* inode, struct stat *statbuf) {
+	statbuf->st_dev = 0;
+	statbuf->st_ino = inode->ino;
+	statbuf->st_mode = inode->mode;
+	statbuf->st_nlink = inode->nlink;
+	statbuf->st_uid = getuid();
+	statbuf->st_gid = getgid();
+	statbuf->st_rdev = 0;
+	statbuf->st_size = inode->size;
+	statbuf->st_blksize = BLOCK_SIZE;
+	statbuf->st_blocks = inode->nblocks;
+	statbuf->st_atime = inode->atime;
+	statbuf->st_mtime = inode->mtime;
+	statbuf->st_ctime = inode->ctime;
+}
+
+void read_dentries(sfs_inode_t *inode_data, sfs_dentry_t* dentries) {
+	if (S_ISDIR(inode_data->mode)) {
+		int num_entries = (inode_data->size / SFS_DENTRY_SIZE);
+		char *buffer = malloc(num_entries * SFS_DENTRY_SIZE);
+		read_inode_data(inode_data, buffer, num_entries * SFS_DENTRY_SIZE, 0);
+
+		log_msg("\n read_dentries num_entries=%d", num_entries);
+
+		int i = 0;
+		for (i = 0; i < num_entries; ++i) {
+			memcpy(dentries + i, buffer + i * SFS_DENTRY_SIZE, sizeof(sfs_dentry_t));
+		}
+		free(buffer);
+	} else {
+	    log_msg("\n Invalid inode number %llu, not a directory", inode_data->ino);
+	}
+}
+
+/*
+ * Returns the index in the group's inode_chunks of the chunk holding
+ * block_no, or of the closest chunk in front of it, -1 if there is none.
+ */
+int find_inode_chunk(sfs_group *group, uint32_t block_no) {
+	int low = 0, high = group->num_inode_chunks - 1, found = -1;
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		if (group->inode_chunks[mid].block_no <= block_no) {
+			found = mid;
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * Returns the group the block belongs to, NULL if it's past the end of the
+ * volume.
+ */
+sfs_group* block_group(struct sfs_state *sfs, uint64_t block_no) {
+	uint64_t g = block_no / SFS_BLOCKS_PER_GROUP;
+	if (g >= sfs->num_groups) {
+		return NULL;
+	}
+
+	return sfs->groups + g;
+}
+
+/*
+ * Returns the on disk descriptor of group g for updating. Caller must hold
+ * cache_lock.
+ */
+sfs_group_desc_t* get_group_desc(struct sfs_state *sfs, uint32_t g) {
+	sfs_cached_block *block = get_cached_block(sfs, SFS_BLOCK_GROUP_DESC + g / SFS_GROUP_DESCS_PER_BLOCK, 1);
+	mark_block_dirty(sfs, block, 0);
+
+	return ((sfs_group_desc_t*)block->data) + (g % SFS_GROUP_DESCS_PER_BLOCK);
+}
+
+void update_sb_counters(struct sfs_state *sfs, int64_t free_blocks, int64_t free_inodes, int64_t inodes) {
+	pthread_mutex_lock(&sfs->sb_lock);
+	sfs->sb->num_free_blocks += free_blocks;
+	sfs->sb->num_free_inodes += free_inodes;
+	sfs->sb->num_inodes += inodes;
+	sfs->sb_dirty = 1;
+	pthread_mutex_unlock(&sfs->sb_lock);
+}
+
+int inode_in_use(uint64_t ino) {
+	struct sfs_state *sfs = SFS_DATA;
+	uint32_t block_no = ino / SFS_INODES_PER_BLOCK;
+	sfs_group *group = block_group(sfs, block_no);
+	int in_use = 0;
+	if (group == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&group->lock);
+	int idx = find_inode_chunk(group, block_no);
+	if ((idx >= 0) && (block_no > group->inode_chunks[idx].block_no) &&
+		(block_no < group->inode_chunks[idx].block_no + SFS_INODE_CHUNK_BLOCKS)) {
+		uint64_t n = ino - (uint64_t)(group->inode_chunks[idx].block_no + 1) * SFS_INODES_PER_BLOCK;
+
+		pthread_mutex_lock(&sfs->cache_lock);
+		sfs_inode_chunk_t *chunk = (sfs_inode_chunk_t*)get_cached_block(sfs, group->inode_chunks[idx].block_no, 1)->data;
+		in_use = (chunk->bitmap[n / 8] >> (n % 8)) & 1;
+		pthread_mutex_unlock(&sfs->cache_lock);
+	}
+	pthread_mutex_unlock(&group->lock);
+
+	return in_use;
+}
+
+void free_ino(uint64_t ino) {
+	struct sfs_state *sfs = SFS_DATA;
+	uint32_t block_no = ino / SFS_INODES_PER_BLOCK;
+	sfs_group *group = block_group(sfs, block_no);
+	if (group == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&group->lock);
+	int idx = find_inode_chunk(group, block_no);
+	if ((idx >= 0) && (block_no < group->inode_chunks[idx].block_no + SFS_INODE_CHUNK_BLOCKS)) {
+		uint64_t n = ino - (uint64_t)(group->inode_chunks[idx].block_no + 1) * SFS_INODES_PER_BLOCK;
+
+		pthread_mutex_lock(&sfs->cache_lock);
+		sfs_cached_block *block = get_cached_block(sfs, group->inode_chunks[idx].block_no, 1);
+		sfs_inode_chunk_t *chunk = (sfs_inode_chunk_t*)block->data;
+		int freed = 0;
+		if (chunk->bitmap[n / 8] & (1 << (n % 8))) {
+			chunk->bitmap[n / 8] &= ~(1 << (n % 8));
+			chunk->num_free++;
+			mark_block_dirty(sfs, block, 0);
+
+			group->inode_chunks[idx].num_free++;
+			group->free_inodes++;
+			get_group_desc(sfs, group - sfs->groups)->free_inodes = group->free_inodes;
+			freed = 1;
+		}
+		pthread_mutex_unlock(&sfs->cache_lock);
+
+		if (freed) {
+			update_sb_counters(sfs, 0, 1, 0);
+			log_msg("\nSuccess: Inode %llu freed", ino);
+		} else {
+			log_msg("\nError: Inode %llu already free", ino);
+		}
+	}
+	pthread_mutex_unlock(&group->lock);
+}
+
+/*
+ * Picks the group for a new directory: the one with the most free inodes
+ * among those with at least the average number of free blocks, so
+ * directories (and the files that follow them) spread over the volume.
+ * With tiering only the groups on the fast tier are considered.
+ */
+uint32_t find_dir_group(struct sfs_state *sfs, uint32_t parent_group) {
+	uint32_t num_groups = (sfs->fast_groups > 0) ? sfs->fast_groups : sfs->num_groups;
+	uint64_t avg_free_blocks = 0;
+	uint32_t i = 0;
+	if (sfs->fast_groups > 0) {
+		for (i = 0; i < num_groups; ++i) {
+			avg_free_blocks += sfs->groups[i].free_blocks;
+		}
+		avg_free_blocks /= num_groups;
+	} else {
+		pthread_mutex_lock(&sfs->sb_lock);
+		avg_free_blocks = sfs->sb->num_free_blocks / sfs->num_groups;
+		pthread_mutex_unlock(&sfs->sb_lock);
+	}
+
+	uint32_t best = parent_group;
+	uint32_t best_free_inodes = 0, best_free_blocks = 0;
+	for (i = 0; i < num_groups; ++i) {
+		// Counters are only read here, a slightly stale value does no harm
+		sfs_group *group = sfs->groups + ((parent_group + 1 + i) % num_groups);
+		if (group->free_blocks < avg_free_blocks) {
+			continue;
+		}
+
+		if ((group->free_inodes > best_free_inodes) ||
+			((group->free_inodes == best_free_inodes) && (group->free_blocks > best_free_blocks))) {
+			best = group - sfs->groups;
+			best_free_inodes = group->free_inodes;
+			best_free_blocks = group->free_blocks;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Takes a free inode from the group, adding an inode chunk to it first if
+ * it has none left and may_grow is set. Caller must hold the group lock.
+ */
+uint64_t get_ino_in_group(struct sfs_state *sfs, sfs_group *group, int may_grow) {
+	int idx = -1, i = 0;
+	for (i = 0; (idx < 0) && (i < group->num_inode_chunks); ++i) {
+		if (group->inode_chunks[i].num_free > 0) {
+			idx = i;
+		}
+	}
+
+	if ((idx < 0) && may_grow) {
+		idx = grow_inode_table(sfs, group);
+	}
+	if (idx < 0) {
+		return SFS_INVALID_INO;
+	}
+
+	uint64_t ino = SFS_INVALID_INO;
+	pthread_mutex_lock(&sfs->cache_lock);
+	sfs_cached_block *block = get_cached_block(sfs, group->inode_chunks[idx].block_no, 1);
+	sfs_inode_chunk_t *chunk = (sfs_inode_chunk_t*)block->data;
+	uint64_t n = 0;
+	for (n = 0; n < SFS_INODES_PER_CHUNK; ++n) {
+		if (!(chunk->bitmap[n / 8] & (1 << (n % 8)))) {
+			chunk->bitmap[n / 8] |= (1 << (n % 8));
+			chunk->num_free--;
+			mark_block_dirty(sfs, block, 0);
+
+			ino = (uint64_t)(group->inode_chunks[idx].block_no + 1) * SFS_INODES_PER_BLOCK + n;
+			group->inode_chunks[idx].num_free--;
+			group->free_inodes--;
+			get_group_desc(sfs, group - sfs->groups)->free_inodes = group->free_inodes;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sfs->cache_lock);
+
+	if (ino != SFS_INVALID_INO) {
+		update_sb_counters(sfs, 0, -1, 0);
+	}
+
+	return ino;
+}
+
+/*
+ * Allocates an inode, for a file in the group of ino_goal (its parent
+ * directory), for a directory in a group chosen by find_dir_group(). Other
+ * groups are only used once the chosen one is full, and only grow their
+ * inode tables when no group has a free inode left.
+ */
+uint64_t get_ino(uint64_t ino_goal, int is_dir) {
+	struct sfs_state *sfs = SFS_DATA;
+	uint64_t start = (ino_goal / SFS_INODES_PER_BLOCK) / SFS_BLOCKS_PER_GROUP;
+	uint64_t ino = SFS_INVALID_INO;
+	if (start >= sfs->num_groups) {
+		start = 0;
+	}
+	if (is_dir) {
+		start = find_dir_group(sfs, start);
+	}
+
+	int pass = 0;
+	uint32_t i = 0;
+	for (pass = 0; (pass < 2) && (ino == SFS_INVALID_INO); ++pass) {
+		for (i = 0; (i < sfs->num_groups) && (ino == SFS_INVALID_INO); ++i) {
+			sfs_group *group = sfs->groups + ((start + i) % sfs->num_groups);
+			int may_grow = (pass == 1) || (i == 0);
+			if (!may_grow && (group->free_inodes == 0)) {
+				continue;
+			}
+
+			pthread_mutex_lock(&group->lock);
+			ino = get_ino_in_group(sfs, group, may_grow);
+			pthread_mutex_unlock(&group->lock);
+		}
+	}
+
+	if (ino != SFS_INVALID_INO) {
+		log_msg("\nSuccess: Free ino found = %llu", ino);
+	} else {
+		log_msg("\nError: Inode limit reached!!!");
+	}
+
+	return ino;
+}
+
+/*
+ * Adds a chunk of inodes to the group. Returns its index in the group's
+ * inode_chunks or -1 when there is no room. Caller must hold the group lock.
+ */
+int grow_inode_table(struct sfs_state *sfs, sfs_group *group) {
+	uint32_t g = group - sfs->groups;
+	uint32_t offset = find_free_blocks(group, 0, SFS_INODE_CHUNK_BLOCKS);
+	if (offset == SFS_INVALID_BLOCK_NO) {
+		log_msg("\nError: No room left for another inode chunk in group %u", g);
+		return -1;
+	}
+	update_block_bitmap(sfs, group, offset, SFS_INODE_CHUNK_BLOCKS, 1);
+
+	uint32_t block_no = group->first_block + offset;
+	pthread_mutex_lock(&sfs->cache_lock);
+	sfs_cached_block *block = get_cached_block(sfs, block_no, 0);
+	// Dirty before get_group_desc() may drop cache_lock, so it stays cached
+	mark_block_dirty(sfs, block, 0);
+	sfs_inode_chunk_t *chunk = (sfs_inode_chunk_t*)block->data;
+	sfs_group_desc_t *desc = get_group_desc(sfs, g);
+	chunk->magic = SFS_INODE_CHUNK_MAGIC;
+	chunk->next_chunk = desc->inode_chunk_head;
+	chunk->num_free = SFS_INODES_PER_CHUNK;
+
+	group->free_inodes += SFS_INODES_PER_CHUNK;
+	desc->inode_chunk_head = block_no;
+	desc->num_inodes += SFS_INODES_PER_CHUNK;
+	desc->free_inodes = group->free_inodes;
+	pthread_mutex_unlock(&sfs->cache_lock);
+
+	update_sb_counters(sfs, 0, SFS_INODES_PER_CHUNK, SFS_INODES_PER_CHUNK);
+
+	if (group->num_inode_chunks == group->max_inode_chunks) {
+		group->max_inode_chunks = (group->max_inode_chunks > 0) ? (2 * group->max_inode_chunks) : 4;
+		group->inode_chunks = realloc(group->inode_chunks, group->max_inode_chunks * sizeof(sfs_inode_chunk));
+	}
+
+	int idx = find_inode_chunk(group, block_no) + 1;
+	memmove(group->inode_chunks + idx + 1, group->inode_chunks + idx, (group->num_inode_chunks - idx) * sizeof(sfs_inode_chunk));
+	group->inode_chunks[idx].block_no = block_no;
+	group->inode_chunks[idx].num_free = SFS_INODES_PER_CHUNK;
+	group->num_inode_chunks++;
+
+	log_msg("\ngrow_inode_table new chunk at block %u in group %u", block_no, g);
+	return idx;
+}
+
+void free_block_no(uint32_t b_no) {
+	struct sfs_state *sfs = SFS_DATA;
+	sfs_group *group = block_group(sfs, b_no);
+	if ((b_no != SFS_INVALID_BLOCK_NO) && (group != NULL)) {
+		uint32_t offset = b_no - group->first_block;
+
+		// With dedup_lock held find_duplicate() can't take a reference in
+		// between, a block still shared stays in the index and the last
+		// owner takes it out before it is freed
+		if (sfs->dedup) {
+			pthread_mutex_lock(&sfs->dedup_lock);
+		}
+		pthread_mutex_lock(&group->lock);
+		if (unref_block(sfs, group, offset)) {
+			// Still used by a clone or a duplicate
+			pthread_mutex_unlock(&group->lock);
+			if (sfs->dedup) {
+				pthread_mutex_unlock(&sfs->dedup_lock);
+			}
+			log_msg("\nData block %u still shared", b_no);
+			return;
+		}
+		if (sfs->dedup) {
+			forget_fingerprint(sfs, b_no);
+			pthread_mutex_unlock(&sfs->dedup_lock);
+		}
+
+		if (group->bitmap[offset / 8] & (1 << (offset % 8))) {
+			update_block_bitmap(sfs, group, offset, 1, 0);
+			log_msg("\nSuccess: Data block %u freed", b_no);
+		} else {
+			log_msg("\nError: Data block %u already free", b_no);
+		}
+		pthread_mutex_unlock(&group->lock);
+
+		// Drop any cached copy, the block may come back as file data
+		pthread_mutex_lock(&sfs->cache_lock);
+		forget_cached_block(sfs, b_no);
+		pthread_mutex_unlock(&sfs->cache_lock);
+
+		pthread_mutex_lock(&sfs->cluster_lock);
+		if (sfs->clusters[b_no % SFS_CLUSTER_CACHE_SIZE].block_no == b_no) {
+			sfs->clusters[b_no % SFS_CLUSTER_CACHE_SIZE].block_no = SFS_INVALID_BLOCK_NO;
+		}
+		pthread_mutex_unlock(&sfs->cluster_lock);
+
+		queue_discard(sfs, b_no);
+	}
+}
+
+/*
+ * Adds an owner to block_no, creating the group's reference counts if it
+ * has none yet. Returns -EMLINK once SFS_REFCOUNT_MAX is reached and
+ * -ENOSPC if the group has no room for its reference counts.
+ */
+int ref_block(struct sfs_state *sfs, uint32_t block_no) {
+	sfs_group *group = block_group(sfs, block_no);
+	if (group == NULL) {
+		return -EINVAL;
+	}
+
+	int retstat = 0;
+	pthread_mutex_lock(&group->lock);
+	if (group->refcount_block == SFS_INVALID_BLOCK_NO) {
+		uint32_t offset = find_free_blocks(group, 0, SFS_REFCOUNT_BLOCKS);
+		if (offset == SFS_INVALID_BLOCK_NO) {
+			pthread_mutex_unlock(&group->lock);
+			log_msg("\nref_block no room for the reference counts of group %u", group - sfs->groups);
+			return -ENOSPC;
+		}
+		update_block_bitmap(sfs, group, offset, SFS_REFCOUNT_BLOCKS, 1);
+
+		pthread_mutex_lock(&sfs->cache_lock);
+		uint32_t i = 0;
+		for (i = 0; i < SFS_REFCOUNT_BLOCKS; ++i) {
+			mark_block_dirty(sfs, get_cached_block(sfs, group->first_block + offset + i, 0), 0);
+		}
+		get_group_desc(sfs, group - sfs->groups)->refcount_block = group->first_block + offset;
+		pthread_mutex_unlock(&sfs->cache_lock);
+
+		group->refcount_block = group->first_block + offset;
+	}
+
+	uint32_t offset = block_no - group->first_block;
+	pthread_mutex_lock(&sfs->cache_lock);
+	sfs_cached_block *block = get_cached_block(sfs, group->refcount_block + offset / BLOCK_SIZE, 1);
+	uint8_t *refs = (uint8_t*)block->data + (offset % BLOCK_SIZE);
+	if (*refs == SFS_REFCOUNT_MAX) {
+		retstat = -EMLINK;
+	} else {
+		(*refs)++;
+		mark_block_dirty(sfs, block, 0);
+	}
+	pthread_mutex_unlock(&sfs->cache_lock);
+	pthread_mutex_unlock(&group->lock);
+
+	return retstat;
+}
+
+/*
+ * Drops an owner of the block at offset in the group. Returns 1 if others
+ * are left, 0 if the block has to be freed. Caller must hold the group lock.
+ */
+int unref_block(struct sfs_state *sfs, sfs_group *group, uint32_t offset) {
+	if (group->refcount_block == SFS_INVALID_BLOCK_NO) {
+		return 0;
+	}
+
+	int shared = 0;
+	pthread_mutex_lock(&sfs->cache_lock);
+	sfs_cached_block *block = get_cached_block(sfs, group->refcount_block + offset / BLOCK_SIZE, 1);
+	uint8_t *refs = (uint8_t*)block->data + (offset % BLOCK_SIZE);
+	if (*refs > 0) {
+		(*refs)--;
+		mark_block_dirty(sfs, block, 0);
+		shared = 1;
+	}
+	pthread_mutex_unlock(&sfs->cache_lock);
+
+	return shared;
+}
+
+int block_shared(struct sfs_state *sfs, uint32_t block_no) {
+	sfs_group *group = block_group(sfs, block_no);
+	if ((group == NULL) || (group->refcount_block == SFS_INVALID_BLOCK_NO)) {
+		return 0;
+	}
+
+	uint32_t offset = block_no - group->first_block;
+	pthread_mutex_lock(&group->lock);
+	pthread_mutex_lock(&sfs->cache_lock);
+	sfs_cached_block *block = get_cached_block(sfs, group->refcount_block + offset / BLOCK_SIZE, 1);
+	int shared = (((uint8_t*)block->data)[offset % BLOCK_SIZE] > 0);
+	pthread_mutex_unlock(&sfs->cache_lock);
+	pthread_mutex_unlock(&group->lock);
+
+	return shared;
+}
+
+uint32_t block_checksum(const char *data) {
+	uint32_t crc = crc32c(0, data, BLOCK_SIZE);
+	return (crc != 0) ? crc : ~0U; // 0 stands for no checksum
+}
+
+/*
+ * Gives the group its checksum blocks. Caller must hold the group lock.
+ */
+int alloc_checksum_blocks(struct sfs_state *sfs, sfs_group *group) {
+	uint32_t offset = find_free_blocks(group, 0, SFS_CHECKSUM_BLOCKS);
+	if (offset == SFS_INVALID_BLOCK_NO) {
+		log_msg("\nalloc_checksum_blocks no room for the checksums of group %u", group - sfs->groups);
+		return -ENOSPC;
+	}
+	update_block_bitmap(sfs, group, offset, SFS_CHECKSUM_BLOCKS, 1);
+
+	pthread_mutex_lock(&sfs->cache_lock);
+	uint32_t i = 0;
+	for (i = 0; i < SFS_CHECKSUM_BLOCKS; ++i) {
+		mark_block_dirty(sfs, get_cached_block(sfs, group->first_block + offset + i, 0), 0);
+	}
+	get_group_desc(sfs, group - sfs->groups)->checksum_block = group->first_block + offset;
+	group->checksum_block = group->first_block + offset;
+	pthread_mutex_unlock(&sfs->cache_lock);
+
+	return 0;
+}
+
+/*
+ * Records the checksums of count blocks just written from iov at block_no.
+ * They are all computed before any lock is taken, and each group's share
+ * is stored with a single round of locking.
+ */
+void store_checksums(struct sfs_state *sfs, uint32_t block_no, const struct iovec *iov, int count) {
+	uint32_t sums[SFS_WRITE_BUFFER_MAX_BLOCKS];
+	int i = 0, j = 0;
+	for (i = 0; i < count; ++i) {
+		sums[i] = block_checksum(iov[i].iov_base);
+	}
+
+	i = 0;
+	while (i < count) {
+		sfs_group *group = block_group(sfs, block_no + i);
+		if (group == NULL) {
+			break;
+		}
+		uint32_t offset = block_no + i - group->first_block;
+		int n = ((uint32_t)(count - i) < group->num_blocks - offset) ? (count - i) : (int)(group->num_blocks - offset);
+
+		pthread_mutex_lock(&group->lock);
+		if ((group->checksum_block != SFS_INVALID_BLOCK_NO) || (sfs->checksum && (alloc_checksum_blocks(sfs, group) == 0))) {
+			sfs_cached_block *block = NULL;
+			pthread_mutex_lock(&sfs->cache_lock);
+			for (j = 0; j < n; ++j) {
+				if ((block == NULL) || ((offset + j) % SFS_CHECKSUMS_PER_BLOCK == 0)) {
+					if (block != NULL) {
+						mark_block_dirty(sfs, block, 0);
+					}
+					block = get_cached_block(sfs, group->checksum_block + (offset + j) / SFS_CHECKSUMS_PER_BLOCK, 1);
+				}
+				((uint32_t*)block->data)[(offset + j) % SFS_CHECKSUMS_PER_BLOCK] = sums[i + j];
+			}
+			mark_block_dirty(sfs, block, 0);
+			pthread_mutex_unlock(&sfs->cache_lock);
+		}
+		pthread_mutex_unlock(&group->lock);
+
+		i += n;
+	}
+}
+
+/*
+ * Looks up the stored checksums of count data blocks, 0 for those without
+ * one, and for pointers which are holes or carry flags. All of them are
+ * looked up with a single round of locking.
+ */
+void load_checksums(struct sfs_state *sfs, const uint32_t *block_nos, uint32_t *sums, int count) {
+	int i = 0;
+
+	// checksum_block is only set with cache_lock held too, no need for the
+	// group locks here
+	sfs_cached_block *block = NULL;
+	pthread_mutex_lock(&sfs->cache_lock);
+	for (i = 0; i < count; ++i) {
+		sfs_group *group = ((block_nos[i] & SFS_BLOCK_FLAGS) == 0) ? block_group(sfs, block_nos[i]) : NULL;
+		sums[i] = 0;
+		if ((block_nos[i] != SFS_INVALID_BLOCK_NO) && (group != NULL) && (group->checksum_block != SFS_INVALID_BLOCK_NO)) {
+			// Runs of blocks mostly find their checksums in the same block
+			uint32_t offset = block_nos[i] - group->first_block;
+			uint32_t sums_block_no = group->checksum_block + offset / SFS_CHECKSUMS_PER_BLOCK;
+			if ((block == NULL) || (block->block_no != sums_block_no)) {
+				block = get_cached_block(sfs, sums_block_no, 1);
+			}
+			sums[i] = ((uint32_t*)block->data)[offset % SFS_CHECKSUMS_PER_BLOCK];
+		}
+	}
+	pthread_mutex_unlock(&sfs->cache_lock);
+}
+
+/*
+ * Checks data just read from block_no against its checksum from
+ * load_checksums(). Returns -EIO on a mismatch, 0 if it matches or the
+ * block has no checksum.
+ */
+int verify_checksum(uint32_t block_no, uint32_t sum, const char *data) {
+	if ((sum != 0) && (sum != block_checksum(data))) {
+		log_msg("\nError: Checksum mismatch in block %u", block_no);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Checks count blocks read into data, one after the other, against the
+ * checksums of block_nos. Returns -EIO if any of them doesn't match.
+ */
+int verify_checksums(struct sfs_state *sfs, const uint32_t *block_nos, const char *data, int count) {
+	uint32_t sums[SFS_WRITE_BUFFER_MAX_BLOCKS];
+	int retstat = 0, i = 0, j = 0;
+
+	for (i = 0; i < count; i += SFS_WRITE_BUFFER_MAX_BLOCKS) {
+		int n = ((count - i) > SFS_WRITE_BUFFER_MAX_BLOCKS) ? SFS_WRITE_BUFFER_MAX_BLOCKS : (count - i);
+		load_checksums(sfs, block_nos + i, sums, n);
+		for (j = 0; j < n; ++j) {
+			if (verify_checksum(block_nos[i + j], sums[j], data + (i + j) * BLOCK_SIZE) < 0) {
+				retstat = -EIO;
+			}
+		}
+	}
+	return retstat;
+}
+
+/*
+ * Hash of a block's contents for the dedup index. Matches are compared
+ * byte by byte before a block gets shared, so collisions only cost a read.
+ */
+uint64_t block_fingerprint(const char *data) {
+	uint64_t hash = 0x9e3779b97f4a7c15ULL;
+	int i = 0;
+	for (i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+		hash ^= hash >> 32;
+	}
+
+	return hash;
+}
+
+/*
+ * Looks for a block holding data in the dedup index. Returns it with a
+ * reference taken for the caller, or SFS_INVALID_BLOCK_NO.
+ */
+uint32_t find_duplicate(struct sfs_state *sfs, const char *data) {
+	uint64_t hash = block_fingerprint(data);
+	uint32_t block_no = SFS_INVALID_BLOCK_NO;
+
+	// Blocks leave the index before they are freed, under dedup_lock, so
+	// holding it until the reference is taken keeps the block from going away
+	pthread_mutex_lock(&sfs->dedup_lock);
+	sfs_fingerprint *entry = sfs->fingerprints + (hash % SFS_DEDUP_INDEX_SIZE);
+	if ((entry->block_no != SFS_INVALID_BLOCK_NO) && (entry->hash == hash) && (ref_block(sfs, entry->block_no) == 0)) {
+		block_no = entry->block_no;
+	}
+	pthread_mutex_unlock(&sfs->dedup_lock);
+
+	if (block_no != SFS_INVALID_BLOCK_NO) {
+		// A block gone bad on disk isn't worth sharing
+		char buffer[BLOCK_SIZE];
+		if ((block_read(block_no, buffer) < 0) || (verify_checksums(sfs, &block_no, buffer, 1) < 0) ||
+				(memcmp(buffer, data, BLOCK_SIZE) != 0)) {
+			free_block_no(block_no);
+			block_no = SFS_INVALID_BLOCK_NO;
+		} else {
+			log_msg("\nfind_duplicate found block %u", block_no);
+		}
+	}
+
+	return block_no;
+}
+
+/*
+ * Adds block_no, just written with data, to the dedup index. Both tables
+ * are direct mapped, an entry pushed out of one is dropped from the other
+ * so that every block in the index can be found by number.
+ */
+void index_block(struct sfs_state *sfs, uint32_t block_no, const char *data) {
+	uint64_t hash = block_fingerprint(data);
+
+	pthread_mutex_lock(&sfs->dedup_lock);
+	sfs_fingerprint *entry = sfs->fingerprints + (hash % SFS_DEDUP_INDEX_SIZE);
+	sfs_fingerprint *by_block = sfs->fingerprint_blocks + (block_no % SFS_DEDUP_INDEX_SIZE);
+
+	if ((entry->block_no != SFS_INVALID_BLOCK_NO) && (sfs->fingerprint_blocks[entry->block_no % SFS_DEDUP_INDEX_SIZE].block_no == entry->block_no)) {
+		sfs->fingerprint_blocks[entry->block_no % SFS_DEDUP_INDEX_SIZE].block_no = SFS_INVALID_BLOCK_NO;
+	}
+	if ((by_block->block_no != SFS_INVALID_BLOCK_NO) && (sfs->fingerprints[by_block->hash % SFS_DEDUP_INDEX_SIZE].block_no == by_block->block_no)) {
+		sfs->fingerprints[by_block->hash % SFS_DEDUP_INDEX_SIZE].block_no = SFS_INVALID_BLOCK_NO;
+	}
+
+	entry->hash = by_block->hash = hash;
+	entry->block_no = by_block->block_no = block_no;
+	pthread_mutex_unlock(&sfs->dedup_lock);
+}
+
+/*
+ * Takes block_no out of the dedup index. Caller must hold dedup_lock.
+ */
+void forget_fingerprint(struct sfs_state *sfs, uint32_t block_no) {
+	sfs_fingerprint *by_block = sfs->fingerprint_blocks + (block_no % SFS_DEDUP_INDEX_SIZE);
+	if (by_block->block_no == block_no) {
+		if (sfs->fingerprints[by_block->hash % SFS_DEDUP_INDEX_SIZE].block_no == block_no) {
+			sfs->fingerprints[by_block->hash % SFS_DEDUP_INDEX_SIZE].block_no = SFS_INVALID_BLOCK_NO;
+		}
+		by_block->block_no = SFS_INVALID_BLOCK_NO;
+	}
+}
+
+/*
+ * Tells whether block_no is on the fast tier, never without tiering.
+ */
+int block_on_fast_tier(struct sfs_state *sfs, uint32_t block_no) {
+	return block_no < sfs->fast_groups * SFS_BLOCKS_PER_GROUP;
+}
+
+/*
+ * Moves an allocation goal to the same relative place on the fast or the
+ * slow tier, if it isn't on that one already.
+ */
+uint32_t tier_goal(struct sfs_state *sfs, uint32_t goal, int fast) {
+	uint32_t fast_end = sfs->fast_groups * SFS_BLOCKS_PER_GROUP;
+	if ((sfs->fast_groups == 0) || (block_on_fast_tier(sfs, goal) == fast)) {
+		return goal;
+	}
+
+	return fast ? (goal % fast_end) : (fast_end + goal % (sfs->sb->num_blocks - fast_end));
+}
+
+/*
+ * Percentage of the fast tier still free, from the group counters.
+ */
+int fast_tier_free_pct(struct sfs_state *sfs) {
+	uint64_t free_blocks = 0;
+	uint32_t g = 0;
+	for (g = 0; g < sfs->fast_groups; ++g) {
+		free_blocks += sfs->groups[g].free_blocks;
+	}
+
+	return (sfs->fast_groups > 0) ? (int)(free_blocks * 100 / ((uint64_t)sfs->fast_groups * SFS_BLOCKS_PER_GROUP)) : 0;
+}
+
+/*
+ * The i-th group an allocation starting in group start looks at. With
+ * tiering the groups of start's tier come first, those of the other one
+ * only once they are full.
+ */
+sfs_group* alloc_group(struct sfs_state *sfs, sfs_group *start, uint32_t i) {
+	uint32_t s = start - sfs->groups;
+	uint32_t fast = sfs->fast_groups, slow = sfs->num_groups - sfs->fast_groups;
+	if (fast == 0) {
+		return sfs->groups + ((s + i) % sfs->num_groups);
+	}
+
+	if (s < fast) {
+		return sfs->groups + ((i < fast) ? ((s + i) % fast) : i);
+	}
+	return sfs->groups + ((i < slow) ? (fast + (s - fast + i) % slow) : (i - slow));
+}
+
+/*
+ * Allocates a block for metadata, the first free one at or after goal in
+ * the goal's group, else the first free one in the groups after it. With
+ * tiering it goes to the fast tier while that has room, with seqalloc to
+ * the front of the group, out of the segments of the log.
+ */
+uint32_t get_block_no(uint32_t goal) {
+	struct sfs_state *sfs = SFS_DATA;
+	goal = tier_goal(sfs, goal, 1);
+	if (sfs->seqalloc) {
+		goal -= goal % SFS_BLOCKS_PER_GROUP;
+	}
+	sfs_group *start = block_group(sfs, goal);
+	if (start == NULL) {
+		start = sfs->groups;
+		goal = 0;
+	}
+
+	uint32_t block_no = SFS_INVALID_BLOCK_NO;
+	uint32_t i = 0;
+	for (i = 0; (i < sfs->num_groups) && (block_no == SFS_INVALID_BLOCK_NO); ++i) {
+		sfs_group *group = alloc_group(sfs, start, i);
+		if (group->free_blocks == 0) {
+			continue;
+		}
+
+		pthread_mutex_lock(&group->lock);
+		uint32_t offset = find_free_blocks(group, (i == 0) ? (goal - group->first_block) : 0, 1);
+		if (offset != SFS_INVALID_BLOCK_NO) {
+			update_block_bitmap(sfs, group, offset, 1, 1);
+			block_no = group->first_block + offset;
+		}
+		pthread_mutex_unlock(&group->lock);
+	}
+
+	if (block_no != SFS_INVALID_BLOCK_NO) {
+		log_msg("\nSuccess: Free data block found = %u", block_no);
+	} else {
+		log_msg("\nError: Data blocks limit reached!!!");
+	}
+
+	return block_no;
+}
+
+/*
+ * Allocates up to count contiguous blocks, as close to goal as possible and
+ * on the goal's tier if there is room, settling for shorter runs when no
+ * group has count in a row. Returns the first block and sets count to the
+ * length of the run.
+ */
+uint32_t get_block_run(uint32_t goal, uint32_t *count) {
+	struct sfs_state *sfs = SFS_DATA;
+	sfs_group *start = block_group(sfs, goal);
+	if (start == NULL) {
+		start = sfs->groups;
+		goal = 0;
+	}
+
+	// With tiering, a short run on the goal's tier beats a long one on the
+	// other, which only gets a look in a second pass
+	uint32_t tier_groups = sfs->num_groups;
+	if (sfs->fast_groups > 0) {
+		tier_groups = ((uint32_t)(start - sfs->groups) < sfs->fast_groups) ? sfs->fast_groups : (sfs->num_groups - sfs->fast_groups);
+	}
+
+	int pass = 0;
+	for (pass = (tier_groups == sfs->num_groups) ? 1 : 0; pass < 2; ++pass) {
+		uint32_t num_groups = (pass == 0) ? tier_groups : sfs->num_groups;
+		uint32_t want = 0;
+		for (want = *count; want > 0; want /= 2) {
+			uint32_t i = 0;
+			for (i = 0; i < num_groups; ++i) {
+				sfs_group *group = alloc_group(sfs, start, i);
+				if (group->free_blocks < want) {
+					continue;
+				}
+
+				pthread_mutex_lock(&group->lock);
+				uint32_t offset = find_free_blocks(group, (i == 0) ? (goal - group->first_block) : 0, want);
+				if (offset != SFS_INVALID_BLOCK_NO) {
+					update_block_bitmap(sfs, group, offset, want, 1);
+					pthread_mutex_unlock(&group->lock);
+
+					*count = want;
+					log_msg("\nSuccess: Free run of %u blocks found at %u", want, group->first_block + offset);
+					return group->first_block + offset;
+				}
+				pthread_mutex_unlock(&group->lock);
+			}
+		}
+	}
+
+	*count = 0;
+	log_msg("\nError: Data blocks limit reached!!!");
+	return SFS_INVALID_BLOCK_NO;
+}
+
+/*
+ * Blocks in use in the segment starting at offset in the group. Caller
+ * must hold the group lock.
+ */
+uint32_t segment_used(sfs_group *group, uint32_t offset) {
+	uint32_t end = (offset + SFS_SEGMENT_BLOCKS < group->num_blocks) ? (offset + SFS_SEGMENT_BLOCKS) : group->num_blocks;
+	uint32_t used = 0, b = 0;
+
+	for (b = offset; b < end; ++b) {
+		if (((b % 8) == 0) && (b + 8 <= end) && (group->bitmap[b / 8] == 0)) {
+			b += 7;
+		} else if (group->bitmap[b / 8] & (1 << (b % 8))) {
+			used++;
+		}
+	}
+
+	return used;
+}
+
+/*
+ * Allocates up to count free blocks in a row in the segment holding
+ * block_no, the first ones at or after it. Returns the first block and
+ * sets count to the length of the run, SFS_INVALID_BLOCK_NO if the rest
+ * of the segment is in use.
+ */
+uint32_t get_segment_run(struct sfs_state *sfs, uint32_t block_no, uint32_t *count) {
+	sfs_group *group = block_group(sfs, block_no);
+	uint32_t offset = block_no - group->first_block;
+	uint32_t end = offset - (offset % SFS_SEGMENT_BLOCKS) + SFS_SEGMENT_BLOCKS;
+	uint32_t run = 0;
+	if (end > group->num_blocks) {
+		end = group->num_blocks;
+	}
+	if (group->free_blocks == 0) {
+		return SFS_INVALID_BLOCK_NO;
+	}
+
+	pthread_mutex_lock(&group->lock);
+	while ((offset < end) && (group->bitmap[offset / 8] & (1 << (offset % 8)))) {
+		offset++;
+	}
+	while ((offset + run < end) && (run < *count) && !(group->bitmap[(offset + run) / 8] & (1 << ((offset + run) % 8)))) {
+		run++;
+	}
+	if (run > 0) {
+		update_block_bitmap(sfs, group, offset, run, 1);
+	}
+	pthread_mutex_unlock(&group->lock);
+
+	if (run == 0) {
+		return SFS_INVALID_BLOCK_NO;
+	}
+	*count = run;
+	return group->first_block + offset;
+}
+
+/*
+ * Allocates up to count blocks at the head of the log, going on in the
+ * segment it is filling or else taking the next clean one. Without a clean
+ * segment left, it wakes up the cleaner and fills the gaps of the segments
+ * after the head, except those the cleaner is emptying. Returns the first
+ * block and sets count to the length of the run.
+ */
+uint32_t get_log_run(struct sfs_state *sfs, uint32_t *count) {
+	uint32_t block_no = SFS_INVALID_BLOCK_NO;
+	uint32_t s = 0;
+
+	pthread_mutex_lock(&sfs->log_lock);
+	pthread_mutex_lock(&sfs->sb_lock);
+	uint32_t head = sfs->sb->alloc_cursor;
+	pthread_mutex_unlock(&sfs->sb_lock);
+	if (block_group(sfs, head) == NULL) {
+		head = 0;
+	}
+
+	// Step 1: Go on from the head to the end of its segment, past blocks
+	// something else took in between. A head at the start of a segment has
+	// none to fill.
+	if ((head % SFS_SEGMENT_BLOCKS) != 0) {
+		block_no = get_segment_run(sfs, head, count);
+	}
+
+	// Step 2: Open the next clean segment. The first one of a group holds
+	// its bitmap, it is never clean.
+	uint32_t first = (head + SFS_SEGMENT_BLOCKS - 1) / SFS_SEGMENT_BLOCKS;
+	for (s = 0; (block_no == SFS_INVALID_BLOCK_NO) && (s < sfs->num_segments); ++s) {
+		uint32_t segment = (first + s) % sfs->num_segments;
+		sfs_group *group = block_group(sfs, (uint64_t)segment * SFS_SEGMENT_BLOCKS);
+		uint32_t offset = segment * SFS_SEGMENT_BLOCKS - group->first_block;
+		uint32_t length = (offset + SFS_SEGMENT_BLOCKS < group->num_blocks) ? SFS_SEGMENT_BLOCKS : (group->num_blocks - offset);
+		if ((offset == 0) || (group->free_blocks < length)) {
+			continue;
+		}
+
+		pthread_mutex_lock(&group->lock);
+		if (segment_used(group, offset) == 0) {
+			uint32_t run = (*count < length) ? *count : length;
+			update_block_bitmap(sfs, group, offset, run, 1);
+			block_no = group->first_block + offset;
+			*count = run;
+		}
+		pthread_mutex_unlock(&group->lock);
+	}
+
+	// Step 3: The cleaner is behind
+	if (block_no == SFS_INVALID_BLOCK_NO) {
+		log_msg("\nget_log_run no clean segment left");
+		pthread_cond_signal(&sfs->cleaner_cond);
+	}
+	for (s = 0; (block_no == SFS_INVALID_BLOCK_NO) && (s < sfs->num_segments); ++s) {
+		uint32_t segment = (head / SFS_SEGMENT_BLOCKS + s) % sfs->num_segments;
+		if (!sfs->segment_victims[segment]) {
+			block_no = get_segment_run(sfs, segment * SFS_SEGMENT_BLOCKS, count);
+		}
+	}
+
+	// Kept in the super block, a remount goes on where it left off
+	if (block_no != SFS_INVALID_BLOCK_NO) {
+		pthread_mutex_lock(&sfs->sb_lock);
+		sfs->sb->alloc_cursor = block_no + *count;
+		sfs->sb_dirty = 1;
+		pthread_mutex_unlock(&sfs->sb_lock);
+	} else {
+		*count = 0;
+	}
+	pthread_mutex_unlock(&sfs->log_lock);
+
+	return block_no;
+}
+
+/*
+ * Finds count contiguous free blocks in the group, searching from offset goal
+ * to the end of the group and then from its start. Returns the offset of the
+ * first one in the group (never 0, that's the bitmap or group 0's super
+ * block). Caller must hold the group lock.
+ */
+uint32_t find_free_blocks(sfs_group *group, uint32_t goal, uint32_t count) {
+	if (goal >= group->num_blocks) {
+		goal = 0;
+	}
+
+	int pass = 0;
+	for (pass = 0; pass < 2; ++pass) {
+		uint32_t b = (pass == 0) ? goal : 0;
+		uint32_t end = (pass == 0) ? group->num_blocks : goal;
+		uint32_t run = 0;
+
+		while (b < end) {
+			// Skip over fully used bytes quickly
+			if ((run == 0) && ((b % 8) == 0) && (group->bitmap[b / 8] == 0xff)) {
+				b += 8;
+				continue;
+			}
+
+			if (group->bitmap[b / 8] & (1 << (b % 8))) {
+				run = 0;
+			} else if (++run == count) {
+				return b - count + 1;
+			}
+			++b;
+		}
+	}
+
+	return SFS_INVALID_BLOCK_NO;
+}
+
+/*
+ * Marks count blocks from offset in the group used or free, in memory, in
+ * the cached bitmap block and in the group descriptor. Caller must hold the
+ * group lock.
+ */
+void update_block_bitmap(struct sfs_state *sfs, sfs_group *group, uint32_t offset, uint32_t count, int used) {
+	pthread_mutex_lock(&sfs->cache_lock);
+	sfs_cached_block *block = get_cached_block(sfs, group->bitmap_block, 1);
+	mark_block_dirty(sfs, block, 0);
+
+	uint32_t b = 0;
+	for (b = offset; b < offset + count; ++b) {
+		if (used) {
+			group->bitmap[b / 8] |= (1 << (b % 8));
+		} else {
+			group->bitmap[b / 8] &= ~(1 << (b % 8));
+		}
+		block->data[b / 8] = group->bitmap[b / 8];
+	}
+
+	if (used) {
+		group->free_blocks -= count;
+	} else {
+		group->free_blocks += count;
+	}
+	get_group_desc(sfs, group - sfs->groups)->free_blocks = group->free_blocks;
+	pthread_mutex_unlock(&sfs->cache_lock);
+
+	update_sb_counters(sfs, used ? -(int64_t)count : (int64_t)count, 0, 0);
+
+	log_msg("\nupdate_block_bitmap Successful update");
+}
+
+/*
+ * Works out where file block idx is mapped: offsets[0] is the slot in the
+ * inode's block list, offsets[1..depth] the slots in each level of indirect
+ * blocks. Returns the depth, -1 if idx is past the largest possible file.
+ */
+int block_path(uint64_t idx, int offsets[4]) {
+	if (idx < SFS_NDIR_BLOCKS) {
+		offsets[0] = idx;
+		return 0;
+	}
+	idx -= SFS_NDIR_BLOCKS;
+
+	if (idx < SFS_NIND_BLOCKS) {
+		offsets[0] = SFS_IND_BLOCK;
+		offsets[1] = idx;
+		return 1;
+	}
+	idx -= SFS_NIND_BLOCKS;
+
+	if (idx < SFS_NDIND_BLOCKS) {
+		offsets[0] = SFS_DIND_BLOCK;
+		offsets[1] = idx / SFS_NIND_BLOCKS;
+		offsets[2] = idx % SFS_NIND_BLOCKS;
+		return 2;
+	}
+	idx -= SFS_NDIND_BLOCKS;
+
+	if (idx < SFS_NTIND_BLOCKS) {
+		offsets[0] = SFS_TIND_BLOCK;
+		offsets[1] = idx / SFS_NDIND_BLOCKS;
+		offsets[2] = (idx / SFS_NIND_BLOCKS) % SFS_NIND_BLOCKS;
+		offsets[3] = idx % SFS_NIND_BLOCKS;
+		return 3;
+	}
+
+	return -1;
+}
+
+/*
+ * Returns the block holding file block idx, SFS_INVALID_BLOCK_NO if none.
+ */
+uint32_t get_block_ptr(sfs_inode_t *inode, uint64_t idx) {
+	int offsets[4];
+	int depth = block_path(idx, offsets);
+	if ((depth < 0) || (inode->flags & SFS_INODE_INLINE)) {
+		return SFS_INVALID_BLOCK_NO;
+	}
+
+	uint32_t block_no = inode->blocks[offsets[0]];
+	int level = 0;
+	for (level = 1; (level <= depth) && (block_no != SFS_INVALID_BLOCK_NO); ++level) {
+		block_no = read_indirect(block_no, offsets[level]);
+	}
+
+	return block_no;
+}
+
+/*
+ * Maps file block idx to block_no, allocating the indirect blocks on the way
+ * if needed. The caller writes the inode.
+ */
+int set_block_ptr(sfs_inode_t *inode, uint64_t idx, uint32_t block_no) {
+	int offsets[4];
+	int depth = block_path(idx, offsets);
+	if (depth < 0) {
+		return -EFBIG;
+	}
+	if (depth == 0) {
+		inode->blocks[offsets[0]] = block_no;
+		return 0;
+	}
+
+	// Indirect blocks go next to the data they point to
+	uint32_t indirect = inode->blocks[offsets[0]];
+	if (indirect == SFS_INVALID_BLOCK_NO) {
+		indirect = get_block_no(block_no & ~SFS_BLOCK_FLAGS);
+		if (indirect == SFS_INVALID_BLOCK_NO) {
+			return -ENOSPC;
+		}
+		pthread_mutex_lock(&SFS_DATA->cache_lock);
+		mark_block_dirty(SFS_DATA, get_cached_block(SFS_DATA, indirect, 0), 0);
+		pthread_mutex_unlock(&SFS_DATA->cache_lock);
+
+		inode->blocks[offsets[0]] = indirect;
+		inode->nblocks++;
+	}
+
+	int level = 0;
+	for (level = 1; level < depth; ++level) {
+		uint32_t next = read_indirect(indirect, offsets[level]);
+		if (next == SFS_INVALID_BLOCK_NO) {
+			next = get_block_no(block_no & ~SFS_BLOCK_FLAGS);
+			if (next == SFS_INVALID_BLOCK_NO) {
+				return -ENOSPC;
+			}
+			pthread_mutex_lock(&SFS_DATA->cache_lock);
+			mark_block_dirty(SFS_DATA, get_cached_block(SFS_DATA, next, 0), 0);
+			pthread_mutex_unlock(&SFS_DATA->cache_lock);
+
+			write_indirect(indirect, offsets[level], next);
+			inode->nblocks++;
+		}
+		indirect = next;
+	}
+
+	write_indirect(indirect, offsets[depth], block_no);
+	return 0;
+}
+
+uint32_t read_indirect(uint32_t block_no, int offset) {
+	pthread_mutex_lock(&SFS_DATA->cache_lock);
+	uint32_t value = ((uint32_t*)get_cached_block(SFS_DATA, block_no, 1)->data)[offset];
+	pthread_mutex_unlock(&SFS_DATA->cache_lock);
+
+	return value;
+}
+
+void write_indirect(uint32_t block_no, int offset, uint32_t value) {
+	pthread_mutex_lock(&SFS_DATA->cache_lock);
+	sfs_cached_block *block = get_cached_block(SFS_DATA, block_no, 1);
+	((uint32_t*)block->data)[offset] = value;
+	mark_block_dirty(SFS_DATA, block, 0);
+	pthread_mutex_unlock(&SFS_DATA->cache_lock);
+}
+
+/*
+ * Frees the file blocks first to end - 1 below the indirect block block_no,
+ * which maps file blocks starting at base through level levels of
+ * indirection. Returns 1 if block_no itself was freed because nothing is
+ * left below it.
+ */
+int free_block_tree(sfs_inode_t *inode, uint32_t block_no, int level, uint64_t base, uint64_t first, uint64_t end) {
+	uint64_t span = 1;
+	int i = 0;
+	for (i = 1; i < level; ++i) {
+		span *= SFS_NIND_BLOCKS;
+	}
+
+	int in_use = 0;
+	for (i = 0; i < SFS_NIND_BLOCKS; ++i) {
+		uint32_t child = read_indirect(block_no, i);
+		if (child == SFS_INVALID_BLOCK_NO) {
+			continue;
+		}
+
+		uint64_t child_base = base + i * span;
+		if ((child_base + span <= first) || (child_base >= end)) {
+			in_use = 1;
+		} else if (level == 1) {
+			// Compressed clusters have pointers without a block
+			if ((child & ~SFS_BLOCK_FLAGS) != SFS_INVALID_BLOCK_NO) {
+				free_block_no(child & ~SFS_BLOCK_FLAGS);
+				inode->nblocks--;
+			}
+			write_indirect(block_no, i, SFS_INVALID_BLOCK_NO);
+		} else if (free_block_tree(inode, child, level - 1, child_base, first, end)) {
+			write_indirect(block_no, i, SFS_INVALID_BLOCK_NO);
+		} else {
+			in_use = 1;
+		}
+	}
+
+	if (!in_use) {
+		free_block_no(block_no);
+		inode->nblocks--;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Frees the data blocks first to end - 1 of the inode, along with the
+ * indirect blocks that end up empty. The caller writes the inode.
+ */
+void free_inode_blocks(sfs_inode_t *inode, uint64_t first, uint64_t end) {
+	uint64_t i = 0;
+	for (i = first; (i < SFS_NDIR_BLOCKS) && (i < end); ++i) {
+		if ((inode->blocks[i] & ~SFS_BLOCK_FLAGS) != SFS_INVALID_BLOCK_NO) {
+			free_block_no(inode->blocks[i] & ~SFS_BLOCK_FLAGS);
+			inode->nblocks--;
+		}
+		inode->blocks[i] = SFS_INVALID_BLOCK_NO;
+	}
+
+	uint64_t base = SFS_NDIR_BLOCKS;
+	uint64_t span = SFS_NIND_BLOCKS;
+	int level = 0;
+	for (level = 1; level <= 3; ++level) {
+		int slot = SFS_IND_BLOCK + level - 1;
+		if ((inode->blocks[slot] != SFS_INVALID_BLOCK_NO) && (base + span > first) && (base < end)) {
+			if (free_block_tree(inode, inode->blocks[slot], level, base, first, end)) {
+				inode->blocks[slot] = SFS_INVALID_BLOCK_NO;
+			}
+		}
+
+		base += span;
+		span *= SFS_NIND_BLOCKS;
+	}
+}
+
+void update_inode_data(uint64_t ino, sfs_inode_t *inode) {
+	// Only the cached copy is updated here, the block goes to disk with its
+	// neighbours on the next flush.
+	pthread_mutex_lock(&SFS_DATA->cache_lock);
+	sfs_cached_block *block = get_cached_block(SFS_DATA, ino / SFS_INODES_PER_BLOCK, 1);
+	memcpy(block->data + ((ino % SFS_INODES_PER_BLOCK) * SFS_INODE_SIZE), inode, sizeof(sfs_inode_t));
+	mark_block_dirty(SFS_DATA, block, 0);
+	pthread_mutex_unlock(&SFS_DATA->cache_lock);
+
+	log_msg("\nupdate_inode_data Successful update");
+}
+
+void update_block_data(uint32_t bno, char* buffer) {
+	block_write(bno, buffer);
+
+	log_msg("\nupdate_block_data Successful update");
+}
+
+sfs_cached_block* find_cached_block(struct sfs_state *sfs, uint32_t block_no) {
+	sfs_cached_block *block = NULL;
+	for (block = sfs->cache_hash[block_no % SFS_CACHE_HASH_SIZE]; block != NULL; block = block->hash_next) {
+		if (block->block_no == block_no) {
+			break;
+		}
+	}
+
+	return block;
+}
+
+/*
+ * Returns the cached copy of a metadata block, reading it from disk on first
+ * use unless load is 0 (the block is new and starts out zeroed). Caller must
+ * hold cache_lock. The read happens without it, other threads looking for
+ * the block wait until it is there, the rest of the cache stays usable.
+ * Blocks the caller got before and hasn't marked dirty may be evicted
+ * meanwhile, it has to get them again.
+ */
+sfs_cached_block* get_cached_block(struct sfs_state *sfs, uint32_t block_no, int load) {
+	sfs_cached_block *block = find_cached_block(sfs, block_no);
+	while ((block != NULL) && block->loading) {
+		pthread_cond_wait(&sfs->cache_cond, &sfs->cache_lock);
+		block = find_cached_block(sfs, block_no);
+	}
+	if (block != NULL) {
+		list_del(&block->lru);
+		list_add_tail(&block->lru, &sfs->cache_lru);
+		if (!load) {
+			memset(block->data, 0, BLOCK_SIZE);
+		}
+		return block;
+	}
+
+	// Make room by dropping the least recently used clean block
+	if (sfs->cache_count >= SFS_CACHE_MAX_BLOCKS) {
+		list_t *pos = NULL;
+		list_for_each(pos, &sfs->cache_lru) {
+			sfs_cached_block *victim = list_entry(pos, sfs_cached_block, lru);
+			if (!victim->dirty && !victim->time_dirty && !victim->loading && !victim->flushing) {
+				forget_cached_block(sfs, victim->block_no);
+				break;
+			}
+		}
+	}
+
+	int hash = block_no % SFS_CACHE_HASH_SIZE;
+	block = malloc(sizeof(sfs_cached_block) + BLOCK_SIZE);
+	memset(block, 0, sizeof(sfs_cached_block));
+	block->block_no = block_no;
+	memset(block->data, 0, BLOCK_SIZE);
+	block->loading = load;
+
+	block->hash_next = sfs->cache_hash[hash];
+	sfs->cache_hash[hash] = block;
+	list_add_tail(&block->lru, &sfs->cache_lru);
+	sfs->cache_count++;
+
+	if (load) {
+		pthread_mutex_unlock(&sfs->cache_lock);
+		block_read(block_no, block->data);
+		pthread_mutex_lock(&sfs->cache_lock);
+		block->loading = 0;
+		pthread_cond_broadcast(&sfs->cache_cond);
+	}
+
+	return block;
+}
+
+/*
+ * Set the timestamps in flags to now. Without lazytime this is a regular
+ * inode update, with it only the cached inode changes and the block is
+ * written with the next real update, on sync or once lazytime_expire passes.
+ * Without lazytime atime follows relatime: it only moves if it isn't newer
+ * than mtime and ctime or is more than SFS_RELATIME_INTERVAL old, so reads
+ * don't write their inode every time.
+ */
+void touch_inode(sfs_inode_t *inode, int flags) {
+	time_t now = time(NULL);
+	if ((flags & SFS_ATIME) && !SFS_DATA->lazytime && (inode->atime > inode->mtime) &&
+			(inode->atime > inode->ctime) && ((now - inode->atime) < SFS_RELATIME_INTERVAL)) {
+		flags &= ~SFS_ATIME;
+	}
+	if (flags == 0) {
+		return;
+	}
+
+	if (flags & SFS_ATIME) {
+		inode->atime = now;
+	}
+	if (flags & SFS_MTIME) {
+		inode->mtime = now;
+	}
+	if (flags & SFS_CTIME) {
+		inode->ctime = now;
+	}
+
+	// Patch only the stamps in flags so a stale copy can't undo other
+	// changes, or stamps set by someone else since it was read
+	pthread_mutex_lock(&SFS_DATA->cache_lock);
+	sfs_cached_block *block = get_cached_block(SFS_DATA, inode->ino / SFS_INODES_PER_BLOCK, 1);
+	sfs_inode_t *cached = (sfs_inode_t*)(block->data + ((inode->ino % SFS_INODES_PER_BLOCK) * SFS_INODE_SIZE));
+	if (flags & SFS_ATIME) {
+		cached->atime = inode->atime;
+	}
+	if (flags & SFS_MTIME) {
+		cached->mtime = inode->mtime;
+	}
+	if (flags & SFS_CTIME) {
+		cached->ctime = inode->ctime;
+	}
+	mark_block_dirty(SFS_DATA, block, SFS_DATA->lazytime);
+	pthread_mutex_unlock(&SFS_DATA->cache_lock);
+}
+
+/*
+ * Caller must hold cache_lock.
+ */
+void mark_block_dirty(struct sfs_state *sfs, sfs_cached_block *block, int times_only) {
+	(void)sfs; // For symmetry with the other cache functions
+	if (times_only) {
+		if (!block->time_dirty) {
+			block->time_dirty = 1;
+			block->time_dirtied = time(NULL);
+		}
+	} else if (!block->dirty) {
+		block->dirty = 1;
+		block->dirtied = time(NULL);
+	}
+}
+
+/*
+ * Drops a block from the cache without writing it. Caller must hold
+ * cache_lock. A read or write of the block still running finishes first,
+ * the old contents landing after a freed block got reused would
+ * overwrite its new ones.
+ */
+void forget_cached_block(struct sfs_state *sfs, uint32_t block_no) {
+	sfs_cached_block *found = find_cached_block(sfs, block_no);
+	while ((found != NULL) && (found->loading || found->flushing)) {
+		pthread_cond_wait(&sfs->cache_cond, &sfs->cache_lock);
+		found = find_cached_block(sfs, block_no);
+	}
+
+	sfs_cached_block **link = &sfs->cache_hash[block_no % SFS_CACHE_HASH_SIZE];
+	while (*link != NULL) {
+		sfs_cached_block *block = *link;
+		if (block == found) {
+			*link = block->hash_next;
+			list_del(&block->lru);
+			free(block);
+			sfs->cache_count--;
+			return;
+		}
+		link = &block->hash_next;
+	}
+}
+
+int compare_cached_blocks(const void *a, const void *b) {
+	uint32_t block_a = (*(sfs_cached_block* const*)a)->block_no;
+	uint32_t block_b = (*(sfs_cached_block* const*)b)->block_no;
+	return (block_a > block_b) - (block_a < block_b);
+}
+
+/*
+ * Write back every block which has been dirty for at least min_age seconds,
+ * or whose timestamps only have been dirty for min_time_age, in disk order.
+ * Caller must hold cache_lock. Copies of the blocks are written without
+ * it, a block changed meanwhile is dirty again for the next pass. Passes
+ * run one at a time, so two writes of a block can't land out of order.
+ */
+void flush_cached_blocks(struct sfs_state *sfs, int min_age, int min_time_age) {
+	while (sfs->cache_flushing) {
+		pthread_cond_wait(&sfs->cache_cond, &sfs->cache_lock);
+	}
+
+	time_t now = time(NULL);
+	sfs_cached_block **due = malloc(sfs->cache_count * sizeof(sfs_cached_block*));
+	int num_due = 0;
+
+	list_t *pos = NULL;
+	list_for_each(pos, &sfs->cache_lru) {
+		sfs_cached_block *block = list_entry(pos, sfs_cached_block, lru);
+		if ((block->dirty && (now - block->dirtied >= min_age)) ||
+			(block->time_dirty && (now - block->time_dirtied >= min_time_age))) {
+			due[num_due++] = block;
+		}
+	}
+	if (num_due == 0) {
+		free(due);
+		return;
+	}
+
+	qsort(due, num_due, sizeof(sfs_cached_block*), compare_cached_blocks);
+
+	char *copies = malloc((size_t)num_due * BLOCK_SIZE);
+	int *failed = calloc(num_due, sizeof(int));
+	int i = 0;
+	for (i = 0; i < num_due; ++i) {
+		memcpy(copies + (size_t)i * BLOCK_SIZE, due[i]->data, BLOCK_SIZE);
+		due[i]->dirty = 0;
+		due[i]->time_dirty = 0;
+		due[i]->flushing = 1;
+	}
+	sfs->cache_flushing = 1;
+	pthread_mutex_unlock(&sfs->cache_lock);
+
+	// Flushing blocks aren't evicted or forgotten, due stays good
+	for (i = 0; i < num_due; ++i) {
+		failed[i] = (block_write(due[i]->block_no, copies + (size_t)i * BLOCK_SIZE) < 0);
+	}
+
+	pthread_mutex_lock(&sfs->cache_lock);
+	for (i = 0; i < num_due; ++i) {
+		due[i]->flushing = 0;
+		if (failed[i]) {
+			mark_block_dirty(sfs, due[i], 0);
+		}
+	}
+	sfs->cache_flushing = 0;
+	pthread_cond_broadcast(&sfs->cache_cond);
+
+	free(failed);
+	free(copies);
+	free(due);
+}
+
+/*
+ * Writes the super block if its counters changed.
+ */
+void flush_superblock(struct sfs_state *sfs) {
+	char buffer[BLOCK_SIZE];
+
+	pthread_mutex_lock(&sfs->sb_lock);
+	int dirty = sfs->sb_dirty;
+	if (dirty) {
+		memcpy(buffer, sfs->sb, BLOCK_SIZE);
+		sfs->sb_dirty = 0;
+	}
+	pthread_mutex_unlock(&sfs->sb_lock);
+
+	if (dirty) {
+		block_write(SFS_BLOCK_SUPERBLOCK, buffer);
+	}
+}
+
+/*
+ * Remembers a freed block for discard_blocks(), merged into the previous
+ * range when adjacent to it. Once SFS_DISCARD_MAX_RANGES ranges are queued
+ * further blocks stay allocated in the disk file.
+ */
+void queue_discard(struct sfs_state *sfs, uint32_t block_no) {
+	if (sfs->nodiscard) {
+		return;
+	}
+
+	pthread_mutex_lock(&sfs->discard_lock);
+	sfs_discard_range *last = (sfs->num_discards > 0) ? (sfs->discards + sfs->num_discards - 1) : NULL;
+	if ((last != NULL) && (last->block_no + last->count == block_no)) {
+		last->count++;
+	} else if ((last != NULL) && (last->block_no == block_no + 1)) {
+		last->block_no--;
+		last->count++;
+	} else if (sfs->num_discards < SFS_DISCARD_MAX_RANGES) {
+		sfs->discards[sfs->num_discards].block_no = block_no;
+		sfs->discards[sfs->num_discards].count = 1;
+		sfs->num_discards++;
+	}
+	pthread_mutex_unlock(&sfs->discard_lock);
+}
+
+/*
+ * Punches the blocks freed since the last call out of the disk file, so
+ * the host gets the space back. The metadata freeing them is written first,
+ * so after a crash no file points at a discarded block, and blocks which
+ * got allocated again in the meantime are left alone.
+ */
+void discard_blocks(struct sfs_state *sfs) {
+	pthread_mutex_lock(&sfs->discard_lock);
+	int num_ranges = sfs->num_discards;
+	sfs_discard_range *ranges = NULL;
+	if (num_ranges > 0) {
+		ranges = malloc(num_ranges * sizeof(sfs_discard_range));
+		memcpy(ranges, sfs->discards, num_ranges * sizeof(sfs_discard_range));
+		sfs->num_discards = 0;
+	}
+	pthread_mutex_unlock(&sfs->discard_lock);
+
+	if (num_ranges == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&sfs->cache_lock);
+	flush_cached_blocks(sfs, 0, sfs->lazytime_expire);
+	pthread_mutex_unlock(&sfs->cache_lock);
+	flush_superblock(sfs);
+
+	int i = 0;
+	uint64_t discarded = 0;
+	for (i = 0; (i < num_ranges) && !sfs->nodiscard; ++i) {
+		uint32_t b = ranges[i].block_no;
+		uint32_t end = ranges[i].block_no + ranges[i].count;
+		sfs_group *group = NULL;
+
+		while ((b < end) && ((group = block_group(sfs, b)) != NULL)) {
+			uint32_t group_end = (end < group->first_block + group->num_blocks) ? end : (group->first_block + group->num_blocks);
+
+			// Holding the group lock keeps the blocks from being allocated
+			// while they get punched out
+			pthread_mutex_lock(&group->lock);
+			while (b < group_end) {
+				uint32_t offset = b - group->first_block;
+				if (group->bitmap[offset / 8] & (1 << (offset % 8))) {
+					++b;
+					continue;
+				}
+
+				uint32_t run = 1;
+				while ((b + run < group_end) && !(group->bitmap[(offset + run) / 8] & (1 << ((offset + run) % 8)))) {
+					++run;
+				}
+
+				if (block_discard(b, run) == -EOPNOTSUPP) {
+					log_msg("\ndiscard_blocks not supported by the host, freed blocks stay allocated");
+					sfs->nodiscard = 1;
+					break;
+				}
+				discarded += run;
+				b += run;
+			}
+			pthread_mutex_unlock(&group->lock);
+
+			if (sfs->nodiscard) {
+				break;
+			}
+		}
+	}
+	free(ranges);
+
+	log_msg("\ndiscard_blocks %llu blocks given back to the host", discarded);
+}
+
+void* inode_flusher(void *arg) {
+	struct sfs_state *sfs = (struct sfs_state*)arg;
+
+	// Flushing write buffers allocates blocks through SFS_DATA
+	sfs_set_context(sfs);
+
+	pthread_mutex_lock(&sfs->cache_lock);
+	while (!sfs->inode_flusher_stop) {
+		struct timespec wakeup;
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		wakeup.tv_sec += SFS_INODE_FLUSH_INTERVAL;
+		pthread_cond_timedwait(&sfs->inode_flusher_cond, &sfs->cache_lock, &wakeup);
+
+		pthread_mutex_unlock(&sfs->cache_lock);
+		flush_write_buffers(sfs, SFS_WRITE_BUFFER_AGE);
+		pthread_mutex_lock(&sfs->cache_lock);
+
+		flush_cached_blocks(sfs, SFS_INODE_FLUSH_INTERVAL, sfs->lazytime_expire);
+
+		pthread_mutex_unlock(&sfs->cache_lock);
+		flush_superblock(sfs);
+		discard_blocks(sfs);
+		pthread_mutex_lock(&sfs->cache_lock);
+	}
+	pthread_mutex_unlock(&sfs->cache_lock);
+
+	return NULL;
+}
+
+/*
+ * Puts an unlinked inode on the orphan list for the reclaimer. Caller must
+ * hold the inode's map lock.
+ */
+void add_orphan(struct sfs_state *sfs, sfs_inode_t *inode) {
+	pthread_mutex_lock(&sfs->orphan_lock);
+	inode->nlink = 0;
+	inode->flags |= SFS_INODE_ORPHAN;
+	inode->next_orphan = sfs->sb->orphan_head;
+	inode->ctime = time(NULL);
+	update_inode_data(inode->ino, inode);
+
+	pthread_mutex_lock(&sfs->sb_lock);
+	sfs->sb->orphan_head = inode->ino;
+	sfs->sb_dirty = 1;
+	pthread_mutex_unlock(&sfs->sb_lock);
+
+	pthread_cond_signal(&sfs->orphan_cond);
+	pthread_mutex_unlock(&sfs->orphan_lock);
+
+	log_msg("\nadd_orphan ino = %llu with %llu blocks", inode->ino, inode->nblocks);
+}
+
+/*
+ * Frees the last SFS_ORPHAN_BATCH_BLOCKS blocks of an orphan. Once nothing
+ * is left the inode is taken off the orphan list and freed, and 1 returned.
+ */
+int reclaim_orphan(struct sfs_state *sfs, uint64_t ino) {
+	pthread_rwlock_t *lock = inode_map_lock(sfs, ino);
+	sfs_inode_t inode;
+
+	pthread_rwlock_wrlock(lock);
+	get_inode(ino, &inode);
+
+	uint64_t num_data_blocks = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint64_t first = (num_data_blocks > SFS_ORPHAN_BATCH_BLOCKS) ? (num_data_blocks - SFS_ORPHAN_BATCH_BLOCKS) : 0;
+	free_inode_blocks(&inode, first, SFS_MAX_FILE_BLOCKS);
+	inode.size = first * BLOCK_SIZE;
+	update_inode_data(ino, &inode);
+
+	if (first > 0) {
+		pthread_rwlock_unlock(lock);
+		return 0;
+	}
+
+	// Unlink it from the list, new orphans are added in front of it
+	pthread_mutex_lock(&sfs->orphan_lock);
+	if (sfs->sb->orphan_head == ino) {
+		pthread_mutex_lock(&sfs->sb_lock);
+		sfs->sb->orphan_head = inode.next_orphan;
+		sfs->sb_dirty = 1;
+		pthread_mutex_unlock(&sfs->sb_lock);
+	} else if (sfs->sb->orphan_head != SFS_INVALID_INO) {
+		sfs_inode_t prev;
+		get_inode(sfs->sb->orphan_head, &prev);
+		while ((prev.next_orphan != ino) && (prev.next_orphan != SFS_INVALID_INO)) {
+			get_inode(prev.next_orphan, &prev);
+		}
+		// Only unlink it if it is on the list, the tail stays as it is otherwise
+		if (prev.next_orphan == ino) {
+			prev.next_orphan = inode.next_orphan;
+			update_inode_data(prev.ino, &prev);
+		} else {
+			log_msg("\nreclaim_orphan ino = %llu wasn't on the orphan list", ino);
+		}
+	}
+	pthread_mutex_unlock(&sfs->orphan_lock);
+
+	free_ino(ino);
+	pthread_rwlock_unlock(lock);
+
+	log_msg("\nreclaim_orphan ino = %llu done", ino);
+	return 1;
+}
+
+/*
+ * Frees the blocks of orphans in the background, one batch at a time so
+ * the groups and the disk aren't kept busy for long stretches.
+ */
+void* orphan_reclaimer(void *arg) {
+	struct sfs_state *sfs = (struct sfs_state*)arg;
+	struct timespec delay = { 0, SFS_ORPHAN_BATCH_DELAY_MS * 1000000L };
+
+	sfs_set_context(sfs);
+
+	pthread_mutex_lock(&sfs->orphan_lock);
+	while (!sfs->orphan_reclaimer_stop) {
+		uint64_t ino = sfs->sb->orphan_head;
+		if (ino == SFS_INVALID_INO) {
+			pthread_cond_wait(&sfs->orphan_cond, &sfs->orphan_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&sfs->orphan_lock);
+
+		if (!reclaim_orphan(sfs, ino)) {
+			nanosleep(&delay, NULL);
+		}
+
+		pthread_mutex_lock(&sfs->orphan_lock);
+	}
+	pthread_mutex_unlock(&sfs->orphan_lock);
+
+	return NULL;
+}
+
+sfs_extent_heat* heat_entry(struct sfs_state *sfs, uint64_t ino, uint32_t extent) {
+	return sfs->heat + ((ino * 2654435761ULL + extent) % SFS_TIER_HEAT_SIZE);
+}
+
+/*
+ * Heats up the extents of the file a read or write of size bytes at offset
+ * touched. An extent colliding with a hotter one in the table cools that
+ * one down instead, and takes its place once it is cold.
+ */
+void heat_up(struct sfs_state *sfs, uint64_t ino, off_t offset, int size) {
+	uint32_t first = offset / BLOCK_SIZE / SFS_TIER_EXTENT_BLOCKS;
+	uint32_t last = (offset + size - 1) / BLOCK_SIZE / SFS_TIER_EXTENT_BLOCKS;
+	uint32_t e = 0;
+
+	pthread_mutex_lock(&sfs->heat_lock);
+	for (e = first; e <= last; ++e) {
+		sfs_extent_heat *entry = heat_entry(sfs, ino, e);
+		if ((entry->ino == ino) && (entry->extent == e)) {
+			if (entry->heat < UINT32_MAX) {
+				entry->heat++;
+			}
+		} else if (entry->heat <= 1) {
+			entry->ino = ino;
+			entry->extent = e;
+			entry->heat = 1;
+		} else {
+			entry->heat--;
+		}
+	}
+	pthread_mutex_unlock(&sfs->heat_lock);
+}
+
+uint32_t extent_heat(struct sfs_state *sfs, uint64_t ino, uint32_t extent) {
+	uint32_t heat = 0;
+
+	pthread_mutex_lock(&sfs->heat_lock);
+	sfs_extent_heat *entry = heat_entry(sfs, ino, extent);
+	if ((entry->ino == ino) && (entry->extent == extent)) {
+		heat = entry->heat;
+	}
+	pthread_mutex_unlock(&sfs->heat_lock);
+
+	return heat;
+}
+
+/*
+ * The first inode number after ino with a slot in an inode chunk, whether
+ * in use or not, SFS_INVALID_INO past the last chunk.
+ */
+uint64_t next_inode_slot(struct sfs_state *sfs, uint64_t ino) {
+	sfs_group *start = block_group(sfs, ino / SFS_INODES_PER_BLOCK);
+	uint32_t g = (start != NULL) ? (start - sfs->groups) : 0;
+
+	for (; g < sfs->num_groups; ++g) {
+		sfs_group *group = sfs->groups + g;
+		int k = 0;
+
+		pthread_mutex_lock(&group->lock);
+		for (k = 0; k < group->num_inode_chunks; ++k) {
+			uint64_t first = (uint64_t)(group->inode_chunks[k].block_no + 1) * SFS_INODES_PER_BLOCK;
+			if (first + SFS_INODES_PER_CHUNK - 1 > ino) {
+				pthread_mutex_unlock(&group->lock);
+				return (first > ino) ? first : (ino + 1);
+			}
+		}
+		pthread_mutex_unlock(&group->lock);
+	}
+
+	return SFS_INVALID_INO;
+}
+
+/*
+ * Moves the blocks of an extent of a file which aren't on the wanted tier
+ * over to it, or with to SFS_MOVE_TO_LOG the ones in segments being
+ * cleaned to the log head: copies their data to blocks allocated there
+ * and points the file at them. Extents with buffered data, compressed
+ * clusters or blocks shared with a clone stay where they are. Returns the
+ * blocks moved.
+ */
+int move_extent(struct sfs_state *sfs, uint64_t ino, uint32_t extent, int to) {
+	pthread_rwlock_t *lock = inode_map_lock(sfs, ino);
+	uint64_t idx[SFS_TIER_EXTENT_BLOCKS];
+	uint32_t old_block_nos[SFS_TIER_EXTENT_BLOCKS];
+	struct iovec iov[SFS_TIER_EXTENT_BLOCKS];
+	int count = 0, moved = 0, movable = 1;
+	uint32_t i = 0;
+	sfs_inode_t inode;
+
+	pthread_rwlock_wrlock(lock);
+	if (!inode_in_use(ino) || (get_write_buffer(sfs, ino, 0) != NULL)) {
+		pthread_rwlock_unlock(lock);
+		return 0;
+	}
+	get_inode(ino, &inode);
+	if ((!S_ISREG(inode.mode) && (to != SFS_MOVE_TO_LOG)) || (inode.nlink == 0) || (inode.flags & SFS_INODE_INLINE)) {
+		pthread_rwlock_unlock(lock);
+		return 0;
+	}
+
+	// Step 1: Find the blocks to move
+	uint64_t num_data_blocks = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint64_t first = (uint64_t)extent * SFS_TIER_EXTENT_BLOCKS;
+	for (i = 0; movable && (i < SFS_TIER_EXTENT_BLOCKS) && (first + i < num_data_blocks); ++i) {
+		uint32_t block_no = get_block_ptr(&inode, first + i);
+		if ((block_no & SFS_BLOCK_COMPRESSED) ||
+			((block_no != SFS_INVALID_BLOCK_NO) && block_shared(sfs, block_no & ~SFS_BLOCK_FLAGS))) {
+			movable = 0;
+		} else if ((block_no == SFS_INVALID_BLOCK_NO) || (block_no & SFS_BLOCK_UNWRITTEN)) {
+			continue;
+		} else if ((to == SFS_MOVE_TO_LOG) ? sfs->segment_victims[block_no / SFS_SEGMENT_BLOCKS] : (block_on_fast_tier(sfs, block_no) != to)) {
+			idx[count] = first + i;
+			old_block_nos[count] = block_no;
+			count++;
+		}
+	}
+	if (!movable || ((count > 0) && (reserve_blocks(sfs, count) < 0))) {
+		count = 0;
+	}
+
+	// Step 2: Copy them a run of new blocks at a time, a run ending up on
+	// the other tier or in a segment being cleaned means there is no room
+	// left where they should go
+	char *data = (count > 0) ? malloc(count * BLOCK_SIZE) : NULL;
+	while (moved < count) {
+		uint32_t run = count - moved;
+		uint32_t block_no = SFS_INVALID_BLOCK_NO;
+		int ok = 1;
+		if (to == SFS_MOVE_TO_LOG) {
+			block_no = get_log_run(sfs, &run);
+			for (i = 0; (block_no != SFS_INVALID_BLOCK_NO) && (i < run); ++i) {
+				if (sfs->segment_victims[(block_no + i) / SFS_SEGMENT_BLOCKS]) {
+					ok = 0;
+				}
+			}
+		} else {
+			uint32_t goal = (moved > 0) ? (get_block_ptr(&inode, idx[moved - 1]) + 1) : tier_goal(sfs, old_block_nos[0], to);
+			block_no = get_block_run(goal, &run);
+			ok = (block_no != SFS_INVALID_BLOCK_NO) && (block_on_fast_tier(sfs, block_no) == to);
+		}
+		if (block_no == SFS_INVALID_BLOCK_NO) {
+			break;
+		}
+		unreserve_blocks(sfs, run);
+
+		for (i = 0; ok && (i < run); ++i) {
+			iov[i].iov_base = data + (moved + i) * BLOCK_SIZE;
+			iov[i].iov_len = BLOCK_SIZE;
+			if (block_read(old_block_nos[moved + i], iov[i].iov_base) < 0) {
+				ok = 0;
+			}
+		}
+		if (ok && (verify_checksums(sfs, old_block_nos + moved, data + moved * BLOCK_SIZE, run) < 0)) {
+			ok = 0;
+		}
+		if (ok && (block_writev(block_no, iov, run) < 0)) {
+			ok = 0;
+		}
+		if (!ok) {
+			for (i = 0; i < run; ++i) {
+				free_block_no(block_no + i);
+			}
+			count -= run;
+			break;
+		}
+
+		store_checksums(sfs, block_no, iov, run);
+		for (i = 0; i < run; ++i) {
+			set_block_ptr(&inode, idx[moved + i], block_no + i);
+			free_block_no(old_block_nos[moved + i]);
+		}
+		moved += run;
+	}
+	free(data);
+
+	// What is left was kept for runs which didn't come about
+	if (count > moved) {
+		unreserve_blocks(sfs, count - moved);
+	}
+
+	if (moved > 0) {
+		update_inode_data(ino, &inode);
+		log_msg("\nmove_extent ino = %llu extent %u moved %d blocks to %s", ino, extent, moved,
+				(to == SFS_MOVE_TO_LOG) ? "the log head" : (to ? "the fast tier" : "the slow tier"));
+	}
+	pthread_rwlock_unlock(lock);
+
+	return moved;
+}
+
+/*
+ * One round of the migrator: cools the heat table down, moves the extents
+ * which got hot since the last round up to the fast tier while it has
+ * room, and moves cold extents of large files down while it doesn't, going
+ * on with the inodes where the last round stopped.
+ */
+void migrate_extents(struct sfs_state *sfs) {
+	sfs_extent_heat hot[SFS_TIER_MOVE_EXTENTS];
+	int num_hot = 0, moved = 0, extents = 0, scanned = 0, i = 0;
+
+	// Step 1: Cool down, remembering the hot extents
+	pthread_mutex_lock(&sfs->heat_lock);
+	for (i = 0; i < SFS_TIER_HEAT_SIZE; ++i) {
+		sfs_extent_heat *entry = sfs->heat + i;
+		if ((entry->heat >= SFS_TIER_HOT) && (num_hot < SFS_TIER_MOVE_EXTENTS)) {
+			hot[num_hot++] = *entry;
+		}
+		entry->heat /= 2;
+		if (entry->heat == 0) {
+			entry->ino = SFS_INVALID_INO;
+		}
+	}
+	pthread_mutex_unlock(&sfs->heat_lock);
+
+	// Step 2: Move the hot extents up
+	for (i = 0; (i < num_hot) && (fast_tier_free_pct(sfs) > SFS_TIER_LOW_PCT); ++i) {
+		moved += move_extent(sfs, hot[i].ino, hot[i].extent, 1);
+	}
+
+	// Step 3: Move cold extents down
+	while ((fast_tier_free_pct(sfs) < SFS_TIER_LOW_PCT) && (scanned < SFS_TIER_SCAN_INODES) && (extents < SFS_TIER_MOVE_EXTENTS)) {
+		uint64_t ino = next_inode_slot(sfs, sfs->migrate_cursor);
+		sfs_inode_t inode;
+		if (ino == SFS_INVALID_INO) {
+			sfs->migrate_cursor = 0;
+			break;
+		}
+		sfs->migrate_cursor = ino;
+		scanned++;
+
+		if (!inode_in_use(ino)) {
+			continue;
+		}
+		get_inode(ino, &inode);
+		if (!S_ISREG(inode.mode) || (inode.size <= SFS_TIER_SMALL_FILE)) {
+			continue;
+		}
+
+		uint32_t num_extents = (inode.size + SFS_TIER_EXTENT_BLOCKS * BLOCK_SIZE - 1) / (SFS_TIER_EXTENT_BLOCKS * BLOCK_SIZE);
+		uint32_t e = 0;
+		for (e = 0; (e < num_extents) && (extents < SFS_TIER_MOVE_EXTENTS) && (fast_tier_free_pct(sfs) < SFS_TIER_LOW_PCT); ++e) {
+			int n = (extent_heat(sfs, ino, e) == 0) ? move_extent(sfs, ino, e, 0) : 0;
+			if (n > 0) {
+				moved += n;
+				extents++;
+			}
+		}
+	}
+
+	if (moved > 0) {
+		log_msg("\nmigrate_extents moved %d blocks, fast tier %d%% free", moved, fast_tier_free_pct(sfs));
+	}
+}
+
+/*
+ * Moves extents between the tiers by their heat, every SFS_TIER_INTERVAL
+ * seconds.
+ */
+void* migrator(void *arg) {
+	struct sfs_state *sfs = (struct sfs_state*)arg;
+
+	sfs_set_context(sfs);
+
+	pthread_mutex_lock(&sfs->heat_lock);
+	while (!sfs->migrator_stop) {
+		struct timespec wakeup;
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		wakeup.tv_sec += SFS_TIER_INTERVAL;
+		pthread_cond_timedwait(&sfs->migrator_cond, &sfs->heat_lock, &wakeup);
+		if (sfs->migrator_stop) {
+			break;
+		}
+
+		pthread_mutex_unlock(&sfs->heat_lock);
+		migrate_extents(sfs);
+		pthread_mutex_lock(&sfs->heat_lock);
+	}
+	pthread_mutex_unlock(&sfs->heat_lock);
+
+	return NULL;
+}
+
+/*
+ * One round of the cleaner: with less than min_pct percent of the segments
+ * clean, picks the least used of the others and moves the blocks they
+ * hold to the log head, looking for them in every inode. Returns the
+ * segments emptied.
+ */
+int clean_segments(int min_pct) {
+	struct sfs_state *sfs = SFS_DATA;
+	uint32_t victims[SFS_CLEAN_SEGMENTS];
+	uint32_t victim_used[SFS_CLEAN_SEGMENTS];
+	int num_victims = 0, cleaned = 0, i = 0;
+	uint64_t remaining = 0;
+	uint32_t clean = 0, g = 0;
+
+	if (!sfs->seqalloc) {
+		return 0;
+	}
+	pthread_mutex_lock(&sfs->cleaner_lock);
+
+	// Step 1: Count the clean segments and pick the least used others,
+	// leaving out the one the log head fills and the ones which couldn't
+	// be emptied and haven't changed since
+	pthread_mutex_lock(&sfs->sb_lock);
+	uint32_t head = sfs->sb->alloc_cursor;
+	pthread_mutex_unlock(&sfs->sb_lock);
+	uint32_t open = ((head % SFS_SEGMENT_BLOCKS) != 0) ? (head / SFS_SEGMENT_BLOCKS) : sfs->num_segments;
+
+	for (g = 0; g < sfs->num_groups; ++g) {
+		sfs_group *group = sfs->groups + g;
+		uint32_t offset = 0;
+
+		pthread_mutex_lock(&group->lock);
+		for (offset = 0; offset < group->num_blocks; offset += SFS_SEGMENT_BLOCKS) {
+			uint32_t segment = (group->first_block + offset) / SFS_SEGMENT_BLOCKS;
+			uint32_t length = (offset + SFS_SEGMENT_BLOCKS < group->num_blocks) ? SFS_SEGMENT_BLOCKS : (group->num_blocks - offset);
+			uint32_t used = segment_used(group, offset);
+			if (used == 0) {
+				clean++;
+				sfs->segment_stuck[segment] = SFS_SEGMENT_NOT_STUCK;
+				continue;
+			}
+			if ((offset == 0) || (segment == open) || (used == sfs->segment_stuck[segment]) ||
+					(used * 100 > length * SFS_CLEAN_MAX_PCT)) {
+				continue;
+			}
+
+			// Kept sorted by use, the most used one drops out first
+			int k = num_victims;
+			if (num_victims == SFS_CLEAN_SEGMENTS) {
+				if (used >= victim_used[k - 1]) {
+					continue;
+				}
+				k--;
+			} else {
+				num_victims++;
+			}
+			while ((k > 0) && (victim_used[k - 1] > used)) {
+				victims[k] = victims[k - 1];
+				victim_used[k] = victim_used[k - 1];
+				k--;
+			}
+			victims[k] = segment;
+			victim_used[k] = used;
+		}
+		pthread_mutex_unlock(&group->lock);
+	}
+
+	if ((uint64_t)clean * 100 >= (uint64_t)sfs->num_segments * min_pct) {
+		num_victims = 0;
+	}
+
+	// Step 2: Move what is in them, there is no telling which inodes own
+	// their blocks without looking at all of them
+	for (i = 0; i < num_victims; ++i) {
+		sfs->segment_victims[victims[i]] = 1;
+		remaining += victim_used[i];
+	}
+	uint64_t ino = 0;
+	while ((remaining > 0) && ((ino = next_inode_slot(sfs, ino)) != SFS_INVALID_INO)) {
+		sfs_inode_t inode;
+		if (!inode_in_use(ino)) {
+			continue;
+		}
+		get_inode(ino, &inode);
+		if (inode.flags & SFS_INODE_INLINE) {
+			continue;
+		}
+
+		uint32_t num_extents = (inode.size + SFS_TIER_EXTENT_BLOCKS * BLOCK_SIZE - 1) / (SFS_TIER_EXTENT_BLOCKS * BLOCK_SIZE);
+		uint32_t e = 0;
+		for (e = 0; (e < num_extents) && (remaining > 0); ++e) {
+			uint64_t n = move_extent(sfs, ino, e, SFS_MOVE_TO_LOG);
+			remaining -= (n < remaining) ? n : remaining;
+		}
+	}
+
+	// Step 3: See which ones are clean now
+	for (i = 0; i < num_victims; ++i) {
+		sfs_group *group = block_group(sfs, (uint64_t)victims[i] * SFS_SEGMENT_BLOCKS);
+		pthread_mutex_lock(&group->lock);
+		uint32_t used = segment_used(group, victims[i] * SFS_SEGMENT_BLOCKS - group->first_block);
+		pthread_mutex_unlock(&group->lock);
+
+		sfs->segment_victims[victims[i]] = 0;
+		if (used == 0) {
+			cleaned++;
+		} else {
+			sfs->segment_stuck[victims[i]] = used;
+		}
+	}
+	pthread_mutex_unlock(&sfs->cleaner_lock);
+
+	if (num_victims > 0) {
+		log_msg("\nclean_segments emptied %d of %d segments, %u were clean", cleaned, num_victims, clean);
+	}
+	return cleaned;
+}
+
+/*
+ * Cleans segments every SFS_CLEAN_INTERVAL seconds, or sooner when the log
+ * head finds none clean.
+ */
+void* cleaner(void *arg) {
+	struct sfs_state *sfs = (struct sfs_state*)arg;
+
+	sfs_set_context(sfs);
+
+	pthread_mutex_lock(&sfs->cleaner_lock);
+	while (!sfs->cleaner_stop) {
+		struct timespec wakeup;
+		clock_gettime(CLOCK_REALTIME, &wakeup);
+		wakeup.tv_sec += SFS_CLEAN_INTERVAL;
+		pthread_cond_timedwait(&sfs->cleaner_cond, &sfs->cleaner_lock, &wakeup);
+		if (sfs->cleaner_stop) {
+			break;
+		}
+
+		pthread_mutex_unlock(&sfs->cleaner_lock);
+		clean_segments(SFS_CLEAN_MIN_PCT);
+		pthread_mutex_lock(&sfs->cleaner_lock);
+	}
+	pthread_mutex_unlock(&sfs->cleaner_lock);
+
+	return NULL;
+}
+
+/*
+ * Writes an empty file system of num_blocks blocks with room for (at least)
+ * num_inodes inodes to the disk, the inode tables grow later on as needed.
+ */
+int format_fs(uint64_t num_blocks, uint64_t num_inodes) {
+	char buffer[BLOCK_SIZE];
+	uint32_t num_groups = (num_blocks + SFS_BLOCKS_PER_GROUP - 1) / SFS_BLOCKS_PER_GROUP;
+	uint32_t desc_blocks = (num_groups + SFS_GROUP_DESCS_PER_BLOCK - 1) / SFS_GROUP_DESCS_PER_BLOCK;
+	uint64_t min_blocks = SFS_BLOCK_GROUP_DESC + desc_blocks + 1 + SFS_INODE_CHUNK_BLOCKS + 1;
+	if (num_blocks < min_blocks) {
+		num_blocks = min_blocks;
+	}
+	if ((num_blocks > (uint32_t)~SFS_BLOCK_FLAGS) || (num_groups > SFS_MAX_GROUPS)) {
+		log_msg("\nformat_fs %llu blocks are more than the layout can address", num_blocks);
+		return -EINVAL;
+	}
+	// A last group of a single block would hold nothing but its bitmap
+	if ((num_blocks % SFS_BLOCKS_PER_GROUP) == 1) {
+		num_blocks--;
+		num_groups--;
+	}
+
+	// Step 1: Write the group descriptors and the data bitmap of every group,
+	// with the bitmap itself, and for group 0 super block and descriptors, in use
+	uint64_t free_blocks = 0;
+	uint32_t g = 0;
+	for (g = 0; g < num_groups; ++g) {
+		uint32_t first_block = g * SFS_BLOCKS_PER_GROUP;
+		uint32_t group_blocks = (num_blocks - first_block < SFS_BLOCKS_PER_GROUP) ? (num_blocks - first_block) : SFS_BLOCKS_PER_GROUP;
+		uint32_t used_blocks = (g == 0) ? (SFS_BLOCK_GROUP_DESC + desc_blocks + 1) : 1;
+
+		sfs_group_desc_t desc;
+		memset(&desc, 0, sizeof(desc));
+		desc.bitmap_block = first_block + used_blocks - 1;
+		desc.free_blocks = group_blocks - used_blocks;
+		free_blocks += desc.free_blocks;
+
+		if ((g % SFS_GROUP_DESCS_PER_BLOCK) == 0) {
+			memset(buffer, 0, sizeof(buffer));
+		}
+		memcpy(buffer + (g % SFS_GROUP_DESCS_PER_BLOCK) * SFS_GROUP_DESC_SIZE, &desc, sizeof(desc));
+		if (((g % SFS_GROUP_DESCS_PER_BLOCK) == SFS_GROUP_DESCS_PER_BLOCK - 1) || (g == num_groups - 1)) {
+			block_write(SFS_BLOCK_GROUP_DESC + g / SFS_GROUP_DESCS_PER_BLOCK, buffer);
+		}
+	}
+
+	for (g = 0; g < num_groups; ++g) {
+		uint32_t used_blocks = (g == 0) ? (SFS_BLOCK_GROUP_DESC + desc_blocks + 1) : 1;
+		uint32_t b = 0;
+
+		memset(buffer, 0, sizeof(buffer));
+		for (b = 0; b < used_blocks; ++b) {
+			buffer[b / 8] |= (1 << (b % 8));
+		}
+		block_write(g * SFS_BLOCKS_PER_GROUP + used_blocks - 1, buffer);
+	}
+
+	// Step 2: Write super block to disk file
+	sfs_superblock sb = {
+			.magic = SFS_MAGIC_NUM,
+			.block_size = BLOCK_SIZE,
+			.num_blocks = num_blocks,
+			.num_free_blocks = free_blocks,
+			.num_inodes = 0,
+			.num_free_inodes = 0,
+			.num_groups = num_groups,
+			.group_desc_blocks = desc_blocks,
+			.inode_root = SFS_INVALID_INO
+	};
+
+	memset(buffer, 0, sizeof(buffer));
+	memcpy(buffer, &sb, sizeof(sb));
+	block_write(SFS_BLOCK_SUPERBLOCK, buffer);
+
+	// Step 3: Extend the disk file to its full size, the data region is left sparse
+	memset(buffer, 0, sizeof(buffer));
+	block_write(num_blocks - 1, buffer);
+
+	// Step 4: Create the initial inode chunks, spread over the groups, and
+	// the root directory
+	int retstat = init_fs();
+	if (retstat < 0) {
+		return retstat;
+	}
+
+	uint64_t num_chunks = (num_inodes + SFS_INODES_PER_CHUNK - 1) / SFS_INODES_PER_CHUNK;
+	uint64_t i = 0;
+	for (i = 0; i < num_chunks; ++i) {
+		sfs_group *group = SFS_DATA->groups + (i * num_groups / num_chunks);
+		pthread_mutex_lock(&group->lock);
+		grow_inode_table(SFS_DATA, group);
+		pthread_mutex_unlock(&group->lock);
+	}
+
+	sfs_inode_t inode;
+	memset(&inode, 0, sizeof(inode));
+	inode.ino = get_ino(SFS_INVALID_INO, 0);
+	if (inode.ino == SFS_INVALID_INO) {
+		destroy_fs();
+		return -ENOSPC;
+	}
+
+	// Root starts out empty, its dentries are kept inline until they
+	// outgrow the inode, so no data block is taken yet.
+	inode.atime = inode.ctime = inode.mtime = time(NULL);
+	inode.nblocks = 0;
+	inode.size = 0;
+	inode.nlink = 2;
+	inode.mode = S_IFDIR | 0755;
+	inode.flags = SFS_INODE_INLINE;
+	update_inode_data(inode.ino, &inode);
+
+	pthread_mutex_lock(&SFS_DATA->sb_lock);
+	SFS_DATA->sb->inode_root = inode.ino;
+	SFS_DATA->sb_dirty = 1;
+	pthread_mutex_unlock(&SFS_DATA->sb_lock);
+
+	destroy_fs();
+
+	log_msg("\nformat_fs %llu blocks in %u groups, %llu inodes", num_blocks, num_groups, num_inodes);
+	return 0;
 }
 
-void create_dentry(const char *name, sfs_inode_t *inode, uint32_t ino_parent) {
-	log_msg("\ncreate_dentry path=%s ino = %d ino_parent=%d", name, inode->ino, ino_parent);
-	sfs_inode_t inode_parent;
-	get_inode(ino_parent, &inode_parent);
+// Volume set by the calling thread, and the one mounted last for threads
+// which never set one
+static __thread struct sfs_state *thread_sfs = NULL;
+static struct sfs_state *mounted_sfs = NULL;
 
-	sfs_dentry_t dentry;
-	dentry.inode_number = inode->ino;
-	strcpy(dentry.name, name);
+/*
+ * Makes sfs the volume SFS_DATA stands for in the calling thread. Threads
+ * which never set one, like the FUSE workers, get the volume mounted last.
+ */
+void sfs_set_context(struct sfs_state *sfs) {
+	thread_sfs = sfs;
+}
+
+struct sfs_state* sfs_context() {
+	return (thread_sfs != NULL) ? thread_sfs : mounted_sfs;
+}
+
+/*
+ * Loads the super block, group descriptors, data bitmaps and inode chunk
+ * lists and starts caching metadata blocks.
+ */
+int init_fs() {
+	struct sfs_state *sfs = SFS_DATA;
+
+	// Step 1: Read the super block
+	sfs->sb = malloc(BLOCK_SIZE);
+	block_read(SFS_BLOCK_SUPERBLOCK, sfs->sb);
+	if ((sfs->sb->magic != SFS_MAGIC_NUM) || (sfs->sb->block_size != BLOCK_SIZE)) {
+		log_msg("\ninit_fs bad super block, magic = %u", sfs->sb->magic);
+		free(sfs->sb);
+		sfs->sb = NULL;
+		return -EINVAL;
+	}
+	sfs->sb_dirty = 0;
+	sfs->ino_root = sfs->sb->inode_root;
+
+	// Step 2: Load every group, its descriptor, bitmap and inode chunks
+	sfs->num_groups = sfs->sb->num_groups;
+	sfs->groups = calloc(sfs->num_groups, sizeof(sfs_group));
 
 	char buffer[BLOCK_SIZE];
+	uint64_t free_blocks = 0, free_inodes = 0, num_inodes = 0;
+	uint32_t g = 0;
+	for (g = 0; g < sfs->num_groups; ++g) {
+		sfs_group *group = sfs->groups + g;
+		sfs_group_desc_t desc;
+
+		if ((g % SFS_GROUP_DESCS_PER_BLOCK) == 0) {
+			block_read(SFS_BLOCK_GROUP_DESC + g / SFS_GROUP_DESCS_PER_BLOCK, buffer);
+		}
+		memcpy(&desc, buffer + (g % SFS_GROUP_DESCS_PER_BLOCK) * SFS_GROUP_DESC_SIZE, sizeof(desc));
+
+		pthread_mutex_init(&group->lock, NULL);
+		group->first_block = g * SFS_BLOCKS_PER_GROUP;
+		group->num_blocks = (sfs->sb->num_blocks - group->first_block < SFS_BLOCKS_PER_GROUP) ?
+				(sfs->sb->num_blocks - group->first_block) : SFS_BLOCKS_PER_GROUP;
+		group->bitmap_block = desc.bitmap_block;
+		group->refcount_block = desc.refcount_block;
+		group->checksum_block = desc.checksum_block;
+		group->free_blocks = desc.free_blocks;
+		group->free_inodes = desc.free_inodes;
+		group->bitmap = malloc(BLOCK_SIZE);
+		block_read(group->bitmap_block, group->bitmap);
+
+		free_blocks += desc.free_blocks;
+		free_inodes += desc.free_inodes;
+		num_inodes += desc.num_inodes;
+
+		char chunk_buffer[BLOCK_SIZE];
+		uint32_t chunk_block = desc.inode_chunk_head;
+		while (chunk_block != 0) {
+			block_read(chunk_block, chunk_buffer);
+			sfs_inode_chunk_t *chunk = (sfs_inode_chunk_t*)chunk_buffer;
+			if (chunk->magic != SFS_INODE_CHUNK_MAGIC) {
+				log_msg("\ninit_fs bad inode chunk at block %u", chunk_block);
+				break;
+			}
+
+			if (group->num_inode_chunks == group->max_inode_chunks) {
+				group->max_inode_chunks = (group->max_inode_chunks > 0) ? (2 * group->max_inode_chunks) : 4;
+				group->inode_chunks = realloc(group->inode_chunks, group->max_inode_chunks * sizeof(sfs_inode_chunk));
+			}
+
+			// Chunks are chained newest first, lookups want them by position
+			int k = 0;
+			for (k = group->num_inode_chunks - 1; (k >= 0) && (group->inode_chunks[k].block_no > chunk_block); --k) {
+				group->inode_chunks[k + 1] = group->inode_chunks[k];
+			}
+			group->inode_chunks[k + 1].block_no = chunk_block;
+			group->inode_chunks[k + 1].num_free = chunk->num_free;
+			group->num_inode_chunks++;
+
+			chunk_block = chunk->next_chunk;
+		}
+	}
+
+	// The group descriptors are authoritative, the totals follow them
+	sfs->sb->num_free_blocks = free_blocks;
+	sfs->sb->num_free_inodes = free_inodes;
+	sfs->sb->num_inodes = num_inodes;
+
+	log_msg("\ninit_fs %llu blocks (%llu free) in %u groups, %llu inodes (%llu free)",
+			sfs->sb->num_blocks, sfs->sb->num_free_blocks, sfs->num_groups,
+			sfs->sb->num_inodes, sfs->sb->num_free_inodes);
+
+	// Step 3: Start caching metadata blocks, dirty ones get written back in
+	// batches, and buffering file data
+	pthread_mutex_init(&sfs->sb_lock, NULL);
+	pthread_mutex_init(&sfs->cache_lock, NULL);
+	pthread_cond_init(&sfs->cache_cond, NULL);
+	sfs->cache_flushing = 0;
+	pthread_cond_init(&sfs->inode_flusher_cond, NULL);
+	sfs->cache_hash = calloc(SFS_CACHE_HASH_SIZE, sizeof(sfs_cached_block*));
+	INIT_LIST_HEAD(&sfs->cache_lru);
+	sfs->cache_count = 0;
+
+	sfs->wb_hash = calloc(SFS_WRITE_BUFFER_HASH_SIZE, sizeof(sfs_write_buffer*));
+	INIT_LIST_HEAD(&sfs->wb_dirty);
+	pthread_mutex_init(&sfs->wb_list_lock, NULL);
+	sfs->wb_locks = malloc(SFS_WRITE_BUFFER_LOCKS * sizeof(pthread_rwlock_t));
+	for (g = 0; g < SFS_WRITE_BUFFER_LOCKS; ++g) {
+		pthread_rwlock_init(sfs->wb_locks + g, NULL);
+	}
+	pthread_rwlock_init(&sfs->snapshot_lock, NULL);
+	pthread_mutex_init(&sfs->snapshot_walk_lock, NULL);
+	pthread_mutex_init(&sfs->snapshot_image_lock, NULL);
+	sfs->snapshot_active = 0;
+	sfs->reserved_blocks = 0;
+
+	sfs->discards = malloc(SFS_DISCARD_MAX_RANGES * sizeof(sfs_discard_range));
+	sfs->num_discards = 0;
+	pthread_mutex_init(&sfs->discard_lock, NULL);
+
+	sfs->clusters = calloc(SFS_CLUSTER_CACHE_SIZE, sizeof(sfs_cached_cluster));
+	for (g = 0; g < SFS_CLUSTER_CACHE_SIZE; ++g) {
+		sfs->clusters[g].block_no = SFS_INVALID_BLOCK_NO;
+		sfs->clusters[g].data = malloc(SFS_CLUSTER_BLOCKS * BLOCK_SIZE);
+	}
+	pthread_mutex_init(&sfs->cluster_lock, NULL);
+
+	if (sfs->dedup) {
+		sfs->fingerprints = calloc(SFS_DEDUP_INDEX_SIZE, sizeof(sfs_fingerprint));
+		sfs->fingerprint_blocks = calloc(SFS_DEDUP_INDEX_SIZE, sizeof(sfs_fingerprint));
+	}
+	pthread_mutex_init(&sfs->dedup_lock, NULL);
+
+	if (sfs->lazytime_expire <= 0) {
+		sfs->lazytime_expire = SFS_LAZYTIME_EXPIRE;
+	}
+
+	sfs->inode_flusher_stop = 0;
+	if (pthread_create(&sfs->inode_flusher, NULL, inode_flusher, sfs) != 0) {
+		log_msg("\nError: Couldn't start the inode flusher, inodes are written back on sync only");
+		sfs->inode_flusher_stop = 1;
+	}
+
+	// Step 4: Resume freeing the files unlinked before the last unmount
+	pthread_mutex_init(&sfs->orphan_lock, NULL);
+	pthread_cond_init(&sfs->orphan_cond, NULL);
+	sfs->orphan_reclaimer_stop = 0;
+	if (pthread_create(&sfs->orphan_reclaimer, NULL, orphan_reclaimer, sfs) != 0) {
+		log_msg("\nError: Couldn't start the orphan reclaimer, unlinked files keep their blocks");
+		sfs->orphan_reclaimer_stop = 1;
+	}
+
+	// Step 5: With the tier backend, find the groups on the fast tier and
+	// start moving extents between the tiers. A fast tier holding the whole
+	// volume is no tier at all.
+	sfs->fast_groups = disk_fast_size() / BLOCK_SIZE / SFS_BLOCKS_PER_GROUP;
+	if (sfs->fast_groups >= sfs->num_groups) {
+		sfs->fast_groups = 0;
+	}
+	sfs->heat = (sfs->fast_groups > 0) ? calloc(SFS_TIER_HEAT_SIZE, sizeof(sfs_extent_heat)) : NULL;
+	pthread_mutex_init(&sfs->heat_lock, NULL);
+	pthread_cond_init(&sfs->migrator_cond, NULL);
+	sfs->migrate_cursor = 0;
+	sfs->migrator_stop = (sfs->fast_groups == 0);
+	if (!sfs->migrator_stop && (pthread_create(&sfs->migrator, NULL, migrator, sfs) != 0)) {
+		log_msg("\nError: Couldn't start the migrator, extents stay on the tier they were written to");
+		sfs->migrator_stop = 1;
+	}
+	if (sfs->fast_groups > 0) {
+		log_msg("\ninit_fs %u of %u groups on the fast tier", sfs->fast_groups, sfs->num_groups);
+	}
+
+	// Step 6: With seqalloc, start cleaning segments for the log
+	sfs->num_segments = (sfs->sb->num_blocks + SFS_SEGMENT_BLOCKS - 1) / SFS_SEGMENT_BLOCKS;
+	pthread_mutex_init(&sfs->log_lock, NULL);
+	pthread_mutex_init(&sfs->cleaner_lock, NULL);
+	pthread_cond_init(&sfs->cleaner_cond, NULL);
+	sfs->segment_victims = sfs->seqalloc ? calloc(sfs->num_segments, sizeof(uint8_t)) : NULL;
+	sfs->segment_stuck = sfs->seqalloc ? malloc(sfs->num_segments * sizeof(uint16_t)) : NULL;
+	for (g = 0; sfs->seqalloc && (g < sfs->num_segments); ++g) {
+		sfs->segment_stuck[g] = SFS_SEGMENT_NOT_STUCK;
+	}
+	sfs->cleaner_stop = !sfs->seqalloc;
+	if (!sfs->cleaner_stop && (pthread_create(&sfs->cleaner, NULL, cleaner, sfs) != 0)) {
+		log_msg("\nError: Couldn't start the cleaner, the log takes free blocks wherever they are once no segment is clean");
+		sfs->cleaner_stop = 1;
+	}
+
+	mounted_sfs = sfs;
+	return 0;
+}
+
+/*
+ * Write back all modified inodes, lazy timestamps are left alone.
+ */
+void flush_inodes() {
+	pthread_mutex_lock(&SFS_DATA->cache_lock);
+	flush_cached_blocks(SFS_DATA, 0, SFS_DATA->lazytime_expire);
+	pthread_mutex_unlock(&SFS_DATA->cache_lock);
+	flush_superblock(SFS_DATA);
+
+	log_msg("\nflush_inodes Successful update");
+}
+
+/*
+ * Write back the buffered data of one file, allocating its blocks, and
+ * then the modified metadata blocks, its inode and indirect blocks among
+ * them, for fsync. Freed blocks get punched out of the disk file too.
+ */
+void sync_inode(uint64_t ino) {
+	struct sfs_state *sfs = SFS_DATA;
+	pthread_rwlock_t *lock = inode_map_lock(sfs, ino);
+
+	pthread_rwlock_wrlock(lock);
+	sfs_write_buffer *wb = get_write_buffer(sfs, ino, 0);
+	if (wb != NULL) {
+		sfs_inode_t inode;
+		get_inode(ino, &inode);
+		flush_write_buffer(sfs, wb, &inode);
+	}
+	pthread_rwlock_unlock(lock);
+
+	pthread_mutex_lock(&sfs->cache_lock);
+	flush_cached_blocks(sfs, 0, 0);
+	pthread_mutex_unlock(&sfs->cache_lock);
+	flush_superblock(sfs);
+	discard_blocks(sfs);
+
+	log_msg("\nsync_inode ino = %llu", ino);
+}
+
+/*
+ * Write back all buffered data and modified inodes including lazy
+ * timestamps.
+ */
+void sync_inodes() {
+	flush_write_buffers(SFS_DATA, 0);
+
+	pthread_mutex_lock(&SFS_DATA->cache_lock);
+	flush_cached_blocks(SFS_DATA, 0, 0);
+	pthread_mutex_unlock(&SFS_DATA->cache_lock);
+	flush_superblock(SFS_DATA);
+	discard_blocks(SFS_DATA);
+
+	log_msg("\nsync_inodes Successful update");
+}
+
+void destroy_fs() {
+	struct sfs_state *sfs = SFS_DATA;
+
+	pthread_mutex_lock(&sfs->cleaner_lock);
+	int cleaning = !sfs->cleaner_stop;
+	sfs->cleaner_stop = 1;
+	pthread_cond_signal(&sfs->cleaner_cond);
+	pthread_mutex_unlock(&sfs->cleaner_lock);
+
+	if (cleaning) {
+		pthread_join(sfs->cleaner, NULL);
+	}
+
+	pthread_mutex_lock(&sfs->heat_lock);
+	int migrating = !sfs->migrator_stop;
+	sfs->migrator_stop = 1;
+	pthread_cond_signal(&sfs->migrator_cond);
+	pthread_mutex_unlock(&sfs->heat_lock);
+
+	if (migrating) {
+		pthread_join(sfs->migrator, NULL);
+	}
+
+	// Orphans left over stay on disk for the next mount
+	pthread_mutex_lock(&sfs->orphan_lock);
+	int reclaiming = !sfs->orphan_reclaimer_stop;
+	sfs->orphan_reclaimer_stop = 1;
+	pthread_cond_signal(&sfs->orphan_cond);
+	pthread_mutex_unlock(&sfs->orphan_lock);
+
+	if (reclaiming) {
+		pthread_join(sfs->orphan_reclaimer, NULL);
+	}
+
+	pthread_mutex_lock(&sfs->cache_lock);
+	int running = !sfs->inode_flusher_stop;
+	sfs->inode_flusher_stop = 1;
+	pthread_cond_signal(&sfs->inode_flusher_cond);
+	pthread_mutex_unlock(&sfs->cache_lock);
+
+	if (running) {
+		pthread_join(sfs->inode_flusher, NULL);
+	}
+
+	sync_inodes();
+
+	while (!list_empty(&sfs->cache_lru)) {
+		sfs_cached_block *block = list_entry(sfs->cache_lru.next, sfs_cached_block, lru);
+		forget_cached_block(sfs, block->block_no);
+	}
+	free(sfs->cache_hash);
+	sfs->cache_hash = NULL;
+
+	uint32_t g = 0;
+	for (g = 0; g < SFS_WRITE_BUFFER_LOCKS; ++g) {
+		pthread_rwlock_destroy(sfs->wb_locks + g);
+	}
+	free(sfs->wb_locks);
+	sfs->wb_locks = NULL;
+	pthread_rwlock_destroy(&sfs->snapshot_lock);
+	pthread_mutex_destroy(&sfs->snapshot_walk_lock);
+	pthread_mutex_destroy(&sfs->snapshot_image_lock);
+	free(sfs->wb_hash);
+	sfs->wb_hash = NULL;
+	pthread_mutex_destroy(&sfs->wb_list_lock);
+
+	free(sfs->discards);
+	sfs->discards = NULL;
+	pthread_mutex_destroy(&sfs->discard_lock);
+
+	for (g = 0; g < SFS_CLUSTER_CACHE_SIZE; ++g) {
+		free(sfs->clusters[g].data);
+	}
+	free(sfs->clusters);
+	sfs->clusters = NULL;
+	pthread_mutex_destroy(&sfs->cluster_lock);
+
+	free(sfs->fingerprints);
+	free(sfs->fingerprint_blocks);
+	sfs->fingerprints = sfs->fingerprint_blocks = NULL;
+	pthread_mutex_destroy(&sfs->dedup_lock);
+
+	for (g = 0; g < sfs->num_groups; ++g) {
+		pthread_mutex_destroy(&sfs->groups[g].lock);
+		free(sfs->groups[g].bitmap);
+		free(sfs->groups[g].inode_chunks);
+	}
+	free(sfs->groups);
+	sfs->groups = NULL;
+	sfs->num_groups = 0;
+
+	free(sfs->sb);
+	sfs->sb = NULL;
+
+	free(sfs->heat);
+	sfs->heat = NULL;
+	sfs->fast_groups = 0;
+	pthread_mutex_destroy(&sfs->heat_lock);
+	pthread_cond_destroy(&sfs->migrator_cond);
+
+	free(sfs->segment_victims);
+	sfs->segment_victims = NULL;
+	free(sfs->segment_stuck);
+	sfs->segment_stuck = NULL;
+	pthread_mutex_destroy(&sfs->log_lock);
+	pthread_mutex_destroy(&sfs->cleaner_lock);
+	pthread_cond_destroy(&sfs->cleaner_cond);
+
+	pthread_mutex_destroy(&sfs->orphan_lock);
+	pthread_cond_destroy(&sfs->orphan_cond);
+	pthread_mutex_destroy(&sfs->sb_lock);
+	pthread_mutex_destroy(&sfs->cache_lock);
+	pthread_cond_destroy(&sfs->cache_cond);
+	pthread_cond_destroy(&sfs->inode_flusher_cond);
+
+	if (mounted_sfs == sfs) {
+		mounted_sfs = NULL;
+	}
+}
+
+/*
+ * Takes a snapshot of the whole tree, except for the snapshots themselves,
+ * as /SFS_SNAPSHOT_DIR/name. Changes to the tree are only held off while
+ * the snapshot starts, the walk runs alongside them.
+ */
+int snapshot_fs(const char *name) {
+	if ((*name == '\0') || (strlen(name) >= SFS_MAX_LENGTH_FILE_NAME) || (strchr(name, '/') != NULL) ||
+			(strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+		return -EINVAL;
+	}
+
+	struct sfs_state *sfs = SFS_DATA;
+	char path[PATH_MAX];
+	pthread_mutex_lock(&sfs->snapshot_walk_lock);
+
+	// Step 1: Put most of the data written so far on disk outside of the
+	// lock, it becomes part of the snapshot
+	sync_inodes();
+
+	// Step 2: Start the snapshot with every change to the tree held off,
+	// the rest of the buffered data goes to disk so the block maps tell
+	// all. Its own changes don't lock again.
+	pthread_rwlock_wrlock(&sfs->snapshot_lock);
+	++change_depth;
+	flush_write_buffers(sfs, 0);
+
+	int retstat = 0;
+	snprintf(path, sizeof(path), "/%s", SFS_SNAPSHOT_DIR);
+	if ((path_2_ino(path) == SFS_INVALID_INO) && (create_inode(path, S_IFDIR | 0555) == SFS_INVALID_INO)) {
+		retstat = -ENOSPC;
+	}
+
+	snprintf(path, sizeof(path), "/%s/%s", SFS_SNAPSHOT_DIR, name);
+	if ((retstat == 0) && (path_2_ino(path) != SFS_INVALID_INO)) {
+		retstat = -EEXIST;
+	}
+	if ((retstat == 0) && (create_inode(path, S_IFDIR | 0555) == SFS_INVALID_INO)) {
+		retstat = -ENOSPC;
+	}
+
+	if (retstat == 0) {
+		sfs->snapshot_images = calloc(SFS_SNAPSHOT_HASH_SIZE, sizeof(sfs_snapshot_image*));
+		sfs->snapshot_error = 0;
+		sfs->snapshot_active = 1;
+	}
+	--change_depth;
+	pthread_rwlock_unlock(&sfs->snapshot_lock);
+
+	// Step 3: Copy the tree as it was, from the images of what changed
+	// since and from the live inodes for everything else
+	if (retstat == 0) {
+		snapshot_walker = 1;
+		uint64_t image = SFS_INVALID_INO;
+		pthread_rwlock_t *lock = inode_map_lock(sfs, sfs->ino_root);
+		pthread_rwlock_wrlock(lock);
+		retstat = take_snapshot_image(sfs, sfs->ino_root, &image);
+		pthread_rwlock_unlock(lock);
+		if (image != SFS_INVALID_INO) {
+			retstat = snapshot_dir(image, path);
+			free_inode_image(sfs, image);
+		}
+		snapshot_walker = 0;
+
+		// Step 4: Stop keeping images, no change is halfway through
+		// keeping one with the lock held for writing
+		pthread_rwlock_wrlock(&sfs->snapshot_lock);
+		sfs->snapshot_active = 0;
+		pthread_rwlock_unlock(&sfs->snapshot_lock);
+
+		if ((retstat == 0) && (sfs->snapshot_error < 0)) {
+			retstat = sfs->snapshot_error;
+		}
+
+		// Images of inodes the walk never saw, like the ones of orphans
+		int i = 0;
+		for (i = 0; i < SFS_SNAPSHOT_HASH_SIZE; ++i) {
+			while (sfs->snapshot_images[i] != NULL) {
+				sfs_snapshot_image *entry = sfs->snapshot_images[i];
+				if (entry->image != SFS_INVALID_INO) {
+					free_inode_image(sfs, entry->image);
+				}
+				sfs->snapshot_images[i] = entry->next;
+				free(entry);
+			}
+		}
+		free(sfs->snapshot_images);
+		sfs->snapshot_images = NULL;
 
-	int num_dentries = (inode_parent.size / SFS_DENTRY_SIZE);
-	int idx = num_dentries / (BLOCK_SIZE / SFS_DENTRY_SIZE);
-	int int_idx = num_dentries % (BLOCK_SIZE / SFS_DENTRY_SIZE);
+		// Half a snapshot is no use
+		if (retstat < 0) {
+			remove_tree(path);
+		}
+	}
+	pthread_mutex_unlock(&sfs->snapshot_walk_lock);
+	log_msg("\nsnapshot_fs %s retstat = %d", name, retstat);
+
+	return retstat;
+}
+
+/*
+ * Fills the snapshot directory at dest_path with the entries of the image
+ * ino_src, recursively. Files are linked to their image, directories are
+ * created anew from theirs.
+ */
+int snapshot_dir(uint64_t ino_src, const char *dest_path) {
+	struct sfs_state *sfs = SFS_DATA;
+	uint64_t ino_dest = path_2_ino(dest_path);
+	uint64_t ino_snapshots = path_2_ino("/" SFS_SNAPSHOT_DIR);
+	sfs_inode_t dir;
+	get_inode(ino_src, &dir);
+
+	int num_dentries = (dir.size / SFS_DENTRY_SIZE);
+	sfs_dentry_t *dentries = malloc(sizeof(sfs_dentry_t) * num_dentries);
+	read_dentries(&dir, dentries);
+
+	int retstat = 0;
+	int i = 0;
+	for (i = 0; (i < num_dentries) && (retstat == 0); ++i) {
+		if (dentries[i].inode_number == ino_snapshots) {
+			continue;
+		}
+
+		char path[PATH_MAX];
+		if (snprintf(path, sizeof(path), "%s/%s", dest_path, dentries[i].name) >= (int)sizeof(path)) {
+			retstat = -ENAMETOOLONG;
+			break;
+		}
+
+		uint64_t image = SFS_INVALID_INO;
+		pthread_rwlock_t *lock = inode_map_lock(sfs, dentries[i].inode_number);
+		pthread_rwlock_wrlock(lock);
+		retstat = take_snapshot_image(sfs, dentries[i].inode_number, &image);
+		pthread_rwlock_unlock(lock);
+		if (image == SFS_INVALID_INO) {
+			continue;
+		}
+
+		sfs_inode_t child;
+		get_inode(image, &child);
+		if (!S_ISDIR(child.mode)) {
+			create_dentry(dentries[i].name, &child, ino_dest);
+		} else if (create_inode(path, child.mode) == SFS_INVALID_INO) {
+			retstat = -ENOSPC;
+			free_inode_image(sfs, image);
+		} else {
+			retstat = snapshot_dir(image, path);
+			free_inode_image(sfs, image);
+		}
+	}
+	free(dentries);
+
+	// Keep the mode and timestamps of the original
+	pthread_rwlock_t *lock = inode_map_lock(sfs, ino_dest);
+	pthread_rwlock_wrlock(lock);
+	sfs_inode_t dest;
+	get_inode(ino_dest, &dest);
+	dest.mode = dir.mode;
+	dest.atime = dir.atime;
+	dest.mtime = dir.mtime;
+	dest.ctime = dir.ctime;
+	update_inode_data(ino_dest, &dest);
+	pthread_rwlock_unlock(lock);
+
+	return retstat;
+}
+
+/*
+ * Finds the snapshot entry of ino, adding one without an image if asked
+ * to. Caller must hold snapshot_image_lock.
+ */
+sfs_snapshot_image* find_snapshot_image(struct sfs_state *sfs, uint64_t ino, int create) {
+	sfs_snapshot_image **bucket = sfs->snapshot_images + (ino % SFS_SNAPSHOT_HASH_SIZE);
+	sfs_snapshot_image *entry = *bucket;
+	while ((entry != NULL) && (entry->ino != ino)) {
+		entry = entry->next;
+	}
+
+	if ((entry == NULL) && create) {
+		entry = malloc(sizeof(sfs_snapshot_image));
+		entry->ino = ino;
+		entry->image = SFS_INVALID_INO;
+		entry->next = *bucket;
+		*bucket = entry;
+	}
+
+	return entry;
+}
+
+/*
+ * Called before ino changes while a snapshot is being taken. The first
+ * time, an image of the inode keeps what the snapshot has to see, unless
+ * copy is 0 for an inode the snapshot doesn't have. Caller must hold the
+ * inode's map lock within begin_change().
+ */
+void keep_snapshot_image(struct sfs_state *sfs, uint64_t ino, int copy) {
+	if (!sfs->snapshot_active || snapshot_walker) {
+		return;
+	}
+
+	pthread_mutex_lock(&sfs->snapshot_image_lock);
+	if (find_snapshot_image(sfs, ino, 0) != NULL) {
+		pthread_mutex_unlock(&sfs->snapshot_image_lock);
+		return;
+	}
+	sfs_snapshot_image *entry = find_snapshot_image(sfs, ino, 1);
+	pthread_mutex_unlock(&sfs->snapshot_image_lock);
+
+	// Entries stay until the snapshot is done, and the map lock keeps
+	// anybody else away from this one
+	uint64_t image = SFS_INVALID_INO;
+	int retstat = copy ? copy_inode_image(sfs, ino, &image) : 0;
+
+	pthread_mutex_lock(&sfs->snapshot_image_lock);
+	entry->image = image;
+	if ((retstat < 0) && (sfs->snapshot_error == 0)) {
+		sfs->snapshot_error = retstat;
+	}
+	pthread_mutex_unlock(&sfs->snapshot_image_lock);
+}
+
+/*
+ * Hands the image of ino over to the snapshot walk, making one now if the
+ * inode didn't change yet. image stays SFS_INVALID_INO for an inode the
+ * snapshot doesn't have. Caller must hold the inode's map lock.
+ */
+int take_snapshot_image(struct sfs_state *sfs, uint64_t ino, uint64_t *image) {
+	pthread_mutex_lock(&sfs->snapshot_image_lock);
+	sfs_snapshot_image *entry = find_snapshot_image(sfs, ino, 0);
+	int changed = (entry != NULL);
+	if (!changed) {
+		entry = find_snapshot_image(sfs, ino, 1);
+	}
+	*image = entry->image;
+	entry->image = SFS_INVALID_INO;
+	pthread_mutex_unlock(&sfs->snapshot_image_lock);
+
+	return changed ? 0 : copy_inode_image(sfs, ino, image);
+}
+
+/*
+ * Makes image a new inode with the contents of ino, sharing all of its
+ * blocks. Only the inode and the indirect blocks are written. Caller must
+ * hold the inode's map lock.
+ */
+int copy_inode_image(struct sfs_state *sfs, uint64_t ino, uint64_t *image) {
+	sfs_inode_t src, dest;
+	get_inode(ino, &src);
+
+	*image = get_ino(ino, S_ISDIR(src.mode));
+	if (*image == SFS_INVALID_INO) {
+		return -ENOSPC;
+	}
+
+	dest = src;
+	dest.ino = *image;
+	dest.nlink = S_ISDIR(src.mode) ? 2 : 1;
+	dest.flags &= ~SFS_INODE_ORPHAN;
+
+	int retstat = 0;
+	if (!(src.flags & SFS_INODE_INLINE)) {
+		memset(dest.blocks, 0, sizeof(dest.blocks));
+		dest.next_orphan = SFS_INVALID_INO;
+		dest.nblocks = 0;
+
+		uint64_t i = 0;
+		for (i = 0; (i < SFS_NDIR_BLOCKS) && (retstat == 0); ++i) {
+			retstat = share_block(sfs, &dest, i, src.blocks[i]);
+		}
+
+		uint64_t base = SFS_NDIR_BLOCKS;
+		uint64_t span = SFS_NIND_BLOCKS;
+		int level = 0;
+		for (level = 1; (level <= 3) && (retstat == 0); ++level) {
+			if (src.blocks[SFS_IND_BLOCK + level - 1] != SFS_INVALID_BLOCK_NO) {
+				retstat = share_block_tree(sfs, &dest, src.blocks[SFS_IND_BLOCK + level - 1], level, base);
+			}
+			base += span;
+			span *= SFS_NIND_BLOCKS;
+		}
+	}
+
+	if (retstat < 0) {
+		// Nobody knows about it yet, its map lock isn't needed
+		free_inode_blocks(&dest, 0, SFS_MAX_FILE_BLOCKS);
+		free_ino(dest.ino);
+		*image = SFS_INVALID_INO;
+	} else {
+		update_inode_data(dest.ino, &dest);
+	}
+
+	log_msg("\ncopy_inode_image ino %llu -> %llu retstat = %d", ino, dest.ino, retstat);
+	return retstat;
+}
 
-	if ((int_idx == 0) && (num_dentries != 0)) {
-		inode_parent.blocks[idx] = get_block_no();
-		update_block_bitmap(inode_parent.blocks[idx], '0');
-		inode_parent.nblocks += 1;
+/*
+ * Shares the file blocks below the indirect block block_no, which maps
+ * file blocks from base on through level levels of indirection, with dest.
+ */
+int share_block_tree(struct sfs_state *sfs, sfs_inode_t *dest, uint32_t block_no, int level, uint64_t base) {
+	uint64_t span = 1;
+	int i = 0;
+	for (i = 1; i < level; ++i) {
+		span *= SFS_NIND_BLOCKS;
+	}
+
+	int retstat = 0;
+	for (i = 0; (i < SFS_NIND_BLOCKS) && (retstat == 0); ++i) {
+		uint32_t child = read_indirect(block_no, i);
+		if (child == SFS_INVALID_BLOCK_NO) {
+			continue;
+		}
+
+		if (level == 1) {
+			retstat = share_block(sfs, dest, base + i, child);
+		} else {
+			retstat = share_block_tree(sfs, dest, child, level - 1, base + i * span);
+		}
+	}
+
+	return retstat;
+}
+
+/*
+ * Makes file block idx of dest point at block_no, flags included, taking a
+ * reference on it.
+ */
+int share_block(struct sfs_state *sfs, sfs_inode_t *dest, uint64_t idx, uint32_t block_no) {
+	if (block_no == SFS_INVALID_BLOCK_NO) {
+		return 0;
+	}
+
+	// Compressed clusters have pointers without a block
+	int has_block = ((block_no & ~SFS_BLOCK_FLAGS) != SFS_INVALID_BLOCK_NO);
+	if (has_block) {
+		int retstat = ref_block(sfs, block_no & ~SFS_BLOCK_FLAGS);
+		if (retstat < 0) {
+			return retstat;
+		}
+	}
+
+	if (set_block_ptr(dest, idx, block_no) < 0) {
+		if (has_block) {
+			free_block_no(block_no & ~SFS_BLOCK_FLAGS);
+		}
+		return -ENOSPC;
+	}
+	if (has_block) {
+		dest->nblocks++;
+	}
+
+	return 0;
+}
+
+/*
+ * Frees an image nobody links to, dropping its references to the blocks.
+ * Caller must not hold any inode's map lock.
+ */
+void free_inode_image(struct sfs_state *sfs, uint64_t ino) {
+	pthread_rwlock_t *lock = inode_map_lock(sfs, ino);
+	sfs_inode_t inode;
+
+	pthread_rwlock_wrlock(lock);
+	get_inode(ino, &inode);
+	if (!(inode.flags & SFS_INODE_INLINE)) {
+		free_inode_blocks(&inode, 0, SFS_MAX_FILE_BLOCKS);
+	}
+	free_ino(ino);
+	pthread_rwlock_unlock(lock);
+}
+
+int delete_snapshot(const char *name) {
+	char path[PATH_MAX];
+	if ((*name == '\0') || (strchr(name, '/') != NULL) || (strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+		return -EINVAL;
+	}
+
+	snprintf(path, sizeof(path), "/%s/%s", SFS_SNAPSHOT_DIR, name);
+	if (path_2_ino(path) == SFS_INVALID_INO) {
+		return -ENOENT;
+	}
+
+	return remove_tree(path);
+}
+
+/*
+ * Removes path and, for a directory, everything below it.
+ */
+int remove_tree(const char *path) {
+	sfs_inode_t inode;
+	uint64_t ino = path_2_ino(path);
+	if (ino == SFS_INVALID_INO) {
+		return -ENOENT;
+	}
+	get_inode(ino, &inode);
+
+	if (S_ISDIR(inode.mode)) {
+		int num_dentries = (inode.size / SFS_DENTRY_SIZE);
+		sfs_dentry_t *dentries = malloc(sizeof(sfs_dentry_t) * num_dentries);
+		read_dentries(&inode, dentries);
+
+		int i = 0;
+		for (i = 0; i < num_dentries; ++i) {
+			char child[PATH_MAX];
+			snprintf(child, sizeof(child), "%s/%s", path, dentries[i].name);
+			remove_tree(child);
+		}
+		free(dentries);
 	}
 
-	block_read(SFS_BLOCK_DATA + inode_parent.blocks[idx], buffer);
-	memcpy(buffer + (int_idx * SFS_DENTRY_SIZE), &dentry, sizeof(sfs_dentry_t));
-	block_write(SFS_BLOCK_DATA + inode_parent.blocks[idx], buffer);
+	return remove_inode(path);
+}
+
+void create_dentry(const char *name, sfs_inode_t *inode, uint64_t ino_parent) {
+	log_msg("\ncreate_dentry path=%s ino = %llu ino_parent=%llu", name, inode->ino, ino_parent);
+	sfs_inode_t inode_parent;
+	get_inode(ino_parent, &inode_parent);
+
+	sfs_dentry_t dentry;
+	memset(&dentry, 0, sizeof(dentry));
+	dentry.inode_number = inode->ino;
+	strncpy(dentry.name, name, SFS_MAX_LENGTH_FILE_NAME - 1);
+
+	char buffer[SFS_DENTRY_SIZE];
+	memset(buffer, 0, sizeof(buffer));
+	memcpy(buffer, &dentry, sizeof(sfs_dentry_t));
 
-	inode_parent.size += SFS_DENTRY_SIZE;
-	update_inode_data(inode_parent.ino, &inode_parent);
+	// Appending goes through the regular write path, which takes care of
+	// small directories living inline in their inode.
+	write_inode(&inode_parent, buffer, SFS_DENTRY_SIZE, inode_parent.size);
 }
 
-void remove_dentry(sfs_inode_t *inode, uint32_t ino_parent) {
+void remove_dentry(sfs_inode_t *inode, uint64_t ino_parent) {
 	sfs_inode_t inode_parent;
 	get_inode(ino_parent, &inode_parent);
 	if (S_ISDIR(inode_parent.mode)) {
-		int num_blocks_read = 0;
-		int num_bytes_read = 0;
-		int num_entries = 0;
-		int entry_offset = 0;
-
-		while ((num_blocks_read < inode_parent.nblocks)
-				&& (num_bytes_read < inode_parent.size)) {
-			if (inode_parent.size - num_bytes_read < BLOCK_SIZE) {
-				num_entries = ((inode_parent.size - num_bytes_read) / SFS_DENTRY_SIZE);
-			} else {
-				num_entries = (BLOCK_SIZE / SFS_DENTRY_SIZE);
-			}
-
-			log_msg("\n read_dentries num_entries=%d", num_entries);
-
-			if (num_blocks_read < SFS_NDIR_BLOCKS) {
-				char buffer[BLOCK_SIZE];
-				block_read(SFS_BLOCK_DATA + inode_parent.blocks[num_blocks_read], buffer);
-
-				int entries_read = 0;
-				int bytes_read = 0;
-				while ((bytes_read < BLOCK_SIZE) && (entries_read < num_entries)) {
-					log_msg("\nread_dentry_from_block Entries read = %d", entries_read);
-					sfs_dentry_t dentry;
-					memcpy(&dentry, buffer + bytes_read, sizeof(sfs_dentry_t));
-					if (dentry.inode_number == inode->ino) {
-						log_msg("\nEntry to be deleted found");
-						// Now i am going to overwrite it with the last dentry
-
-						int total_entries = (inode_parent.size / SFS_DENTRY_SIZE);
-						if (total_entries > 1) {
-							int idx = (total_entries - 1) / (BLOCK_SIZE / SFS_DENTRY_SIZE);
-							int int_idx = (total_entries - 1) % (BLOCK_SIZE / SFS_DENTRY_SIZE);
-
-							char buffer_last[BLOCK_SIZE];
-							block_read(SFS_BLOCK_DATA + inode_parent.blocks[idx], buffer_last);
-							sfs_dentry_t dentry_last;
-							memcpy(&dentry_last, buffer_last + SFS_DENTRY_SIZE * int_idx, sizeof(sfs_dentry_t));
-
-							if (int_idx == 0) {
-								inode_parent.nblocks--;
-								free_block_no(inode_parent.blocks[idx]);
-								update_block_bitmap(inode_parent.blocks[idx], '1');
-							}
-
-							memcpy(buffer + bytes_read, &dentry_last, sizeof(sfs_dentry_t));
-							update_block_data(inode_parent.blocks[num_blocks_read], buffer);
-							inode_parent.size -= SFS_DENTRY_SIZE;
-						} else {
-							inode_parent.size -= SFS_DENTRY_SIZE;
-						}
-
-						update_inode_data(inode_parent.ino, &inode_parent);
-						log_msg("\n Item deleted successfully");
-						return;
-					}
-					++entries_read;
-					bytes_read += SFS_DENTRY_SIZE;
+		int num_dentries = (inode_parent.size / SFS_DENTRY_SIZE);
+		sfs_dentry_t* dentries = malloc(sizeof(sfs_dentry_t) * num_dentries);
+		read_dentries(&inode_parent, dentries);
+
+		int i = 0;
+		for (i = 0; i < num_dentries; ++i) {
+			if (dentries[i].inode_number == inode->ino) {
+				log_msg("\nEntry to be deleted found");
+
+				// Now i am going to overwrite it with the last dentry
+				if (i != num_dentries - 1) {
+					char buffer[SFS_DENTRY_SIZE];
+					memset(buffer, 0, sizeof(buffer));
+					memcpy(buffer, dentries + num_dentries - 1, sizeof(sfs_dentry_t));
+					write_inode(&inode_parent, buffer, SFS_DENTRY_SIZE, i * SFS_DENTRY_SIZE);
 				}
-			}
 
-			++num_blocks_read;
-			num_bytes_read += (num_entries * SFS_DENTRY_SIZE);
-			entry_offset += num_entries;
+				truncate_inode(&inode_parent, (num_dentries - 1) * SFS_DENTRY_SIZE);
+				log_msg("\n Item deleted successfully");
+				break;
+			}
 		}
+
+		free(dentries);
 	} else {
-		log_msg("\n Invalid inode number %d, not a directory", inode_parent.ino);
+		log_msg("\n Invalid inode number %llu, not a directory", inode_parent.ino);
 	}
 }
@@ -15,7 +15,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdint.h>
-#include <fuse.h>
+#include <sys/ioctl.h>
+#include "block.h"
 
 #define SFS_NDIR_BLOCKS		12 						// Number of direct blocks
 #define SFS_IND_BLOCK		SFS_NDIR_BLOCKS 		// Index of indirect block
@@ -26,58 +27,345 @@
 #define SFS_NIND_BLOCKS		(BLOCK_SIZE / 4) 					// 128 Blocks = 64KB
 #define SFS_NDIND_BLOCKS 	((BLOCK_SIZE / 4) * SFS_NIND_BLOCKS) // 16384 Blocks = 8MB
 #define SFS_NTIND_BLOCKS 	((BLOCK_SIZE / 4) * SFS_NDIND_BLOCKS) // 2097152 blocks = 1GB
+#define SFS_MAX_FILE_BLOCKS	((uint64_t)SFS_NDIR_BLOCKS + SFS_NIND_BLOCKS + SFS_NDIND_BLOCKS + SFS_NTIND_BLOCKS)
 
-#define SFS_NINODES 256 // Max number of inodes/files
-#define SFS_INODE_SIZE 128 // Size in bytes of inode struct, below mentioned struct should be < 128bytes
-#define SFS_NBLOCKS_INODE (SFS_NINODES / (BLOCK_SIZE / SFS_INODE_SIZE)) // Number of blocks for inodes = 64
-#define SFS_NBLOCKS_DATA (SFS_NINODES * SFS_NDIND_BLOCKS) // Enough blocks to at least accommodate double indirection
+#define SFS_MAGIC_NUM 1730 // Changed from 1729 with the move to block groups
 
-#define SFS_NBLOCKS_INODE_BITMAP 1 // Can store 512*8 inodes (More than enough for now)
-#define SFS_NBLOCKS_DATA_BITMAP (SFS_NBLOCKS_DATA / (BLOCK_SIZE * 8)) // 1024 blocks for this bitmap
+#define SFS_INODE_SIZE 256 // Size in bytes of inode struct, below mentioned struct should be < 256bytes
+#define SFS_INODES_PER_BLOCK (BLOCK_SIZE / SFS_INODE_SIZE) // = 2
+
+/*
+ * Layout:
+ *   block 0                 super block
+ *   block 1 ..              group descriptors
+ *   rest                    block groups
+ *
+ * The volume is split into block groups of SFS_BLOCKS_PER_GROUP blocks, group g
+ * starting at block g * SFS_BLOCKS_PER_GROUP. Every group has its own data
+ * bitmap, one bit per block of the group (1 = in use), in its first block
+ * (right after the group descriptors for group 0), its own inode chunks and
+ * its own free counters, so allocations in different groups don't contend.
+ *
+ * Inodes live in chunks of SFS_INODE_CHUNK_BLOCKS blocks inside a group, the
+ * first block of a chunk holds its header (free map), the others hold the
+ * inodes. Chunks are created at format time and whenever a group runs out of
+ * inodes, and are chained from the group descriptor. An inode number is the
+ * position of the inode on disk, (block * SFS_INODES_PER_BLOCK + slot), so 0
+ * is never a valid one.
+ *
+ * New directories go to a group with more than the average number of free
+ * inodes and blocks, files to the group of their parent directory and data
+ * blocks next to the previous block of the file.
+ */
+#define SFS_BLOCKS_PER_GROUP (BLOCK_SIZE * 8) // Covered by one bitmap block, 4096 blocks = 2MB
+#define SFS_GROUP_DESC_SIZE 32
+#define SFS_GROUP_DESCS_PER_BLOCK (BLOCK_SIZE / SFS_GROUP_DESC_SIZE) // = 16
+#define SFS_MAX_GROUPS ((SFS_BLOCKS_PER_GROUP - SFS_INODE_CHUNK_BLOCKS - 2) * SFS_GROUP_DESCS_PER_BLOCK) // Descriptors have to fit in group 0
+
+#define SFS_INODE_CHUNK_BLOCKS 256 // 128KB per chunk
+#define SFS_INODES_PER_CHUNK ((SFS_INODE_CHUNK_BLOCKS - 1) * SFS_INODES_PER_BLOCK) // = 510
+#define SFS_INODE_CHUNK_MAGIC 0x534e4943 // "CINS"
+
+#define SFS_DEFAULT_NBLOCKS (1 << 22) // Volume size used when formatting, 2GB
+#define SFS_DEFAULT_NINODES (4 * SFS_INODES_PER_CHUNK) // Inodes created when formatting
 
 #define SFS_BLOCK_SUPERBLOCK 0 // 0
-#define SFS_BLOCK_INODE_BITMAP (SFS_BLOCK_SUPERBLOCK + 1) // Only 1 super block. = 1
-#define SFS_BLOCK_DATA_BITMAP (SFS_BLOCK_INODE_BITMAP + SFS_NBLOCKS_INODE_BITMAP) // = 2
-#define SFS_BLOCK_INODES (SFS_BLOCK_DATA_BITMAP + SFS_NBLOCKS_DATA_BITMAP) // 2 + 1024 = 1026
-#define SFS_BLOCK_DATA (SFS_BLOCK_INODES + SFS_NBLOCKS_INODE) // 1026 + 64
+#define SFS_BLOCK_GROUP_DESC (SFS_BLOCK_SUPERBLOCK + 1) // Only 1 super block. = 1
+
+#define SFS_INODE_FLUSH_INTERVAL 5 // Seconds a dirty inode block may stay in memory before write back
+#define SFS_LAZYTIME_EXPIRE (12 * 60 * 60) // Default for lazytime_expire, same as linux dirtytime_expire_seconds
+#define SFS_RELATIME_INTERVAL (24 * 60 * 60) // Without lazytime, atime moves at least this often on reads
+#define SFS_CACHE_HASH_SIZE 4096 // Buckets of the metadata block cache
+#define SFS_CACHE_MAX_BLOCKS 8192 // Clean metadata blocks get evicted above this, 4MB
+
+#define SFS_WRITE_BUFFER_LOCKS 64 // Shards of the write buffer / block map locks
+#define SFS_WRITE_BUFFER_HASH_SIZE 256
+#define SFS_WRITE_BUFFER_MAX_BLOCKS 256 // A file's buffer is flushed once it holds this much, 128KB
+#define SFS_WRITE_BUFFER_META_RESERVE 8 // Blocks reserved per buffer for indirect blocks
+#define SFS_WRITE_BUFFER_AGE SFS_INODE_FLUSH_INTERVAL // Seconds buffered data may wait for allocation
+
+/*
+ * Blocks shared between files by cloning carry a reference count, kept in
+ * SFS_REFCOUNT_BLOCKS blocks allocated inside the group the first time one
+ * of its blocks gets shared. A byte per block counts the owners besides the
+ * first one, so freeing a shared block only drops a reference, and data
+ * written to it goes to a new block when the write buffer is flushed.
+ */
+#define SFS_REFCOUNT_BLOCKS (SFS_BLOCKS_PER_GROUP / BLOCK_SIZE) // = 8
+#define SFS_REFCOUNT_MAX 255 // More owners get a copy instead
+
+/*
+ * Data blocks have a CRC32C checksum, kept in SFS_CHECKSUM_BLOCKS blocks
+ * of their group and checked on every read, which fails with EIO on a
+ * mismatch. With -o checksum a group gets its checksum blocks when data is
+ * first written to it. Groups which have them keep them up to date on
+ * every mount. A checksum of 0 stands for none, blocks written before
+ * their group got checksums have none.
+ */
+#define SFS_CHECKSUMS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define SFS_CHECKSUM_BLOCKS (SFS_BLOCKS_PER_GROUP / SFS_CHECKSUMS_PER_BLOCK) // = 32
+
+#define SFS_DISCARD_MAX_RANGES 4096 // Freed block ranges remembered between discards, more stay allocated on the host
+
+/*
+ * Files with more than SFS_ORPHAN_MIN_BLOCKS blocks aren't freed by unlink
+ * but put on the orphan list, chained through next_orphan from the super
+ * block. Orphans are never inline, so the field doesn't clash with
+ * inline_data.
+ * A background thread frees their blocks, SFS_ORPHAN_BATCH_BLOCKS at a
+ * time from the end of the file with a pause in between, and then the
+ * inode. The list is on disk, so a remount finishes what was left over.
+ */
+#define SFS_ORPHAN_MIN_BLOCKS 256 // 128KB
+#define SFS_ORPHAN_BATCH_BLOCKS 2048 // 1MB
+#define SFS_ORPHAN_BATCH_DELAY_MS 10
+
+/*
+ * With -o seqalloc, file data goes to a log. The volume is split into
+ * segments of SFS_SEGMENT_BLOCKS blocks, aligned within their group, and
+ * every block a flush writes, overwrites included, is appended at the log
+ * head (alloc_cursor in the super block). The head fills a clean segment,
+ * one with no block in use, in order and then moves on to the next clean
+ * one. Indirect blocks and the other metadata go to the first segment of
+ * their group, which holds its bitmap and never is clean.
+ * The cleaner thread keeps SFS_CLEAN_MIN_PCT percent of the segments
+ * clean: every SFS_CLEAN_INTERVAL seconds, or when the head finds no clean
+ * segment, it moves the blocks of the SFS_CLEAN_SEGMENTS least used
+ * segments which are at most SFS_CLEAN_MAX_PCT percent in use to the log
+ * head, finding their owners by a scan of the inodes. Blocks which can't
+ * move (buffered, compressed, shared, unwritten or metadata) keep their
+ * segment in use, and it isn't tried again until its use changes. Inodes
+ * keep their fixed place and are written in place, there is no inode map.
+ */
+#define SFS_SEGMENT_BLOCKS 512 // 256KB, 8 per group
+#define SFS_CLEAN_MIN_PCT 10
+#define SFS_CLEAN_MAX_PCT 75
+#define SFS_CLEAN_SEGMENTS 16 // Segments cleaned per round at most
+#define SFS_CLEAN_INTERVAL 10 // Seconds
+#define SFS_SEGMENT_NOT_STUCK UINT16_MAX
+#define SFS_MOVE_TO_LOG 2 // For move_extent(), out of the segments being cleaned to the log head
+
+/*
+ * With -o compress, a write buffer flush compresses every cluster of
+ * SFS_CLUSTER_BLOCKS file blocks (aligned on its size) the buffer holds in
+ * full, and stores it in as many blocks as the compressed data takes if
+ * that saves at least one. The first of them starts with an
+ * sfs_cluster_header_t. All pointers of the cluster carry
+ * SFS_BLOCK_COMPRESSED, the ones past the compressed data point at no
+ * block. Writing to a cluster moves all of it into the write buffer.
+ */
+#define SFS_CLUSTER_BLOCKS 8 // 4KB
+#define SFS_CLUSTER_CACHE_SIZE 64 // Decompressed clusters kept for reads
+
+/*
+ * With -o dedup, a flush looks up the blocks it writes in an in-memory
+ * index of the blocks written since mount, by fingerprint, and points the
+ * file at the block found when the data matches, taking a reference on
+ * it. Blocks in the index never change, overwrites get a new block, and a
+ * block leaves it when its last owner frees it. The index isn't stored on
+ * disk: after a remount, new data is only matched against blocks written
+ * since, never against what was already there.
+ */
+#define SFS_DEDUP_INDEX_SIZE 65536 // Entries, 32MB of data
+
+/*
+ * With the tier backend, the groups on the fast diskFile take the inodes of
+ * new directories and their files, indirect blocks, the data of files up to
+ * SFS_TIER_SMALL_FILE and hot extents of SFS_TIER_EXTENT_BLOCKS file
+ * blocks, as long as more than SFS_TIER_RESERVE_PCT percent of them is
+ * free. Reads and writes heat up the extents they touch in an in-memory
+ * table, which cools down by half every SFS_TIER_INTERVAL seconds. Then
+ * the migrator moves extents which got SFS_TIER_HOT up to the fast tier
+ * while it has more than SFS_TIER_LOW_PCT percent free, and cold extents
+ * of large files down to the slow tier while it has less.
+ */
+#define SFS_TIER_EXTENT_BLOCKS 128 // 64KB
+#define SFS_TIER_SMALL_FILE (1024 * 1024)
+#define SFS_TIER_HEAT_SIZE 16384 // Entries of the heat table
+#define SFS_TIER_HOT 16 // Reads and writes of an extent in an interval, roughly
+#define SFS_TIER_INTERVAL 10 // Seconds
+#define SFS_TIER_RESERVE_PCT 10 // Left for metadata, data goes to the slow tier instead
+#define SFS_TIER_LOW_PCT 20 // Cold extents move down below that
+#define SFS_TIER_SCAN_INODES 4096 // Inode slots looked at for cold extents per interval
+#define SFS_TIER_MOVE_EXTENTS 64 // Extents moved per interval and direction at most
+#define SFS_TIER_DEFAULT_FAST_SHARE 8 // Without fast_blocks, an eighth of a new volume is on the fast tier
+
+#define SFS_READAHEAD_MIN 8 // Blocks read ahead once reads turn out to be sequential, 4KB
+#define SFS_READAHEAD_MAX 256 // Largest readahead window, 128KB
+
+// Flags for touch_inode()
+#define SFS_ATIME 0x1
+#define SFS_MTIME 0x2
+#define SFS_CTIME 0x4
+
+#define SFS_INODE_HEADER_SIZE 48 // Bytes of sfs_inode_t in front of the block list
+#define SFS_INLINE_DATA_SIZE (SFS_INODE_SIZE - SFS_INODE_HEADER_SIZE) // 208 bytes, 3 dentries
+
+// Inode flags
+#define SFS_INODE_INLINE 0x1 // Data lives in inline_data instead of blocks
+#define SFS_INODE_ORPHAN 0x2 // Unlinked, on the orphan list until its blocks are freed
+
+// ioctls, SEEK_DATA / SEEK_HOLE for FUSE versions without lseek. The
+// argument is the offset to start from, and returns the offset found.
+#define SFS_IOC_SEEK_DATA _IOWR('S', 1, int64_t)
+#define SFS_IOC_SEEK_HOLE _IOWR('S', 2, int64_t)
+#define SFS_IOC_CLONE_RANGE _IOW('S', 3, sfs_clone_range_t) // copy_file_range / reflink, see copy_inode_range()
+
+#define SFS_IOC_SNAPSHOT_CREATE _IOW('S', 4, char[SFS_MAX_LENGTH_FILE_NAME]) // Argument is the snapshot name
+#define SFS_IOC_SNAPSHOT_DELETE _IOW('S', 5, char[SFS_MAX_LENGTH_FILE_NAME])
+
+#define SFS_CLONE_PATH_MAX 256
+
+/*
+ * Snapshots are read-only copies of the tree in /SFS_SNAPSHOT_DIR/<name>,
+ * visible next to the live files. Every file of a snapshot shares its
+ * blocks with the live one, data is never copied, and the live files copy
+ * blocks on write later on. Changes to the tree only wait for the snapshot
+ * to start, not for its walk of the tree: an inode changed before the walk
+ * got to it first gets an image, a copy of the inode sharing its blocks,
+ * so the changes cost in the number of inodes changed. The walk picks up
+ * the images, and the live inodes for the rest. A block takes at most
+ * SFS_REFCOUNT_MAX references, a snapshot needing more fails with EMLINK.
+ * A crash during the walk leaks the images it hasn't linked yet.
+ */
+#define SFS_SNAPSHOT_DIR ".snapshots"
+#define SFS_SNAPSHOT_HASH_SIZE 1024 // Buckets of the images of a snapshot being taken
 
 #define SFS_MAX_LENGTH_FILE_NAME 32
 #define SFS_DENTRY_SIZE 64
 
-#define SFS_INVALID_INO (SFS_NINODES)
-#define SFS_INVALID_BLOCK_NO (SFS_NBLOCKS_DATA)
+#define SFS_INVALID_INO 0
+#define SFS_INVALID_BLOCK_NO 0
+#define SFS_BLOCK_UNWRITTEN 0x80000000 // Set in a data block pointer allocated by fallocate but never written, reads as zeros
+#define SFS_BLOCK_COMPRESSED 0x40000000 // Set in the pointers of a compressed cluster, alone in those without a block
+#define SFS_BLOCK_FLAGS (SFS_BLOCK_UNWRITTEN | SFS_BLOCK_COMPRESSED)
+
+typedef struct __attribute__((packed)) sfs_superblock {
+	uint32_t magic;
+	uint32_t block_size;
+	uint64_t num_blocks; // Total number of blocks on disk.
+	uint64_t num_free_blocks; // Total number of free blocks.
+	uint64_t num_inodes; // Total number of inodes in all the chunks.
+	uint64_t num_free_inodes;
+	uint32_t num_groups;
+	uint32_t group_desc_blocks; // Number of blocks of group descriptors
+	uint64_t inode_root;  // Root directory.
+	uint64_t orphan_head; // Last unlinked inode whose blocks aren't freed yet, 0 if none
+	uint32_t alloc_cursor; // Head of the seqalloc log, 0 for the start
+} sfs_superblock;
+
+typedef struct __attribute__((packed)) {
+	uint32_t bitmap_block; // Data bitmap of the group
+	uint32_t inode_chunk_head; // Most recently created inode chunk of the group
+	uint32_t free_blocks;
+	uint32_t free_inodes;
+	uint32_t num_inodes;
+	uint32_t refcount_block; // First block of the reference counts, 0 until a block of the group gets shared
+	uint32_t checksum_block; // First block of the data block checksums, 0 if the group has none
+	uint32_t reserved[1];
+} sfs_group_desc_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint32_t next_chunk; // Previously created chunk, 0 for the last one
+	uint32_t num_free;
+	uint8_t bitmap[(SFS_INODES_PER_CHUNK + 7) / 8]; // 1 = inode in use
+} sfs_inode_chunk_t;
 
 typedef struct __attribute__((packed)) {
-	uint32_t   	ino;     /* inode number */
+	uint64_t   	ino;     /* inode number */
 	uint32_t	mode;	/* Flags related to file mode (Dir/file/link)*/
     uint32_t   	nlink;   /* number of hard links */
-    uint32_t    size;    /* total size, in bytes */
-    uint32_t  	nblocks;  /* number of 512B blocks allocated */
+    uint64_t    size;    /* total size, in bytes */
+    uint64_t  	nblocks;  /* number of 512B blocks allocated, indirect blocks included */
     uint32_t    atime;   /* time of last access */
     uint32_t   	mtime;   /* time of last modification */
     uint32_t    ctime;   /* time of last status change */
-	uint32_t 	blocks[SFS_N_BLOCKS]; 	/* Size  = 4 * 15 = 60 bytes */
+    uint32_t    flags;   /* SFS_INODE_* flags */
+	union {
+		struct __attribute__((packed)) {
+			uint32_t 	blocks[SFS_N_BLOCKS]; 	/* Size  = 4 * 15 = 60 bytes */
+			uint64_t	next_orphan; /* Next inode on the orphan list, SFS_INODE_ORPHAN */
+		};
+		char 		inline_data[SFS_INLINE_DATA_SIZE]; /* Small files and directories, SFS_INODE_INLINE */
+	};
 } sfs_inode_t;
 
 typedef struct __attribute__((packed)) {
-	uint32_t inode_number;
+	uint64_t inode_number;
 	char name[SFS_MAX_LENGTH_FILE_NAME]; /* File name */
 } sfs_dentry_t;
 
-uint32_t path_2_ino(const char* path);
+typedef struct __attribute__((packed)) {
+	uint16_t size; // Bytes of compressed data following the header
+	uint16_t data_size; // Bytes they decompress to
+} sfs_cluster_header_t;
+
+// Argument of SFS_IOC_CLONE_RANGE, the destination is the file the ioctl is issued on
+typedef struct {
+	char src_path[SFS_CLONE_PATH_MAX]; // Source file, relative to the mount point
+	uint64_t src_offset;
+	uint64_t src_length; // 0 for everything up to the end of the source
+	uint64_t dest_offset;
+} sfs_clone_range_t;
+
+/*
+ * Readahead state of an open file, kept in fuse_file_info->fh.
+ */
+typedef struct {
+	off_t next_offset; // Where a sequential read continues
+	uint32_t window; // Blocks to stay ahead of the reader, 0 while reads are random
+	uint64_t ra_end; // First file block not prefetched yet
+} sfs_readahead_t;
+
+uint64_t path_2_ino(const char* path);
 
-void get_inode(uint32_t ino, sfs_inode_t *inode_data);
+void get_inode(uint64_t ino, sfs_inode_t *inode_data);
 
-uint32_t create_inode(const char *path, mode_t mode);
+void update_inode_data(uint64_t ino, sfs_inode_t *inode);
+
+uint64_t create_inode(const char *path, mode_t mode);
 
 int remove_inode(const char *path);
 
-int write_inode(sfs_inode_t *inode_data, const char* buffer, int size, int offset);
+int write_inode(sfs_inode_t *inode_data, const char* buffer, int size, off_t offset);
+
+int read_inode(sfs_inode_t *inode_data, char* buffer, int size, off_t offset);
+
+int truncate_inode(sfs_inode_t *inode_data, uint64_t size);
+
+int fallocate_inode(sfs_inode_t *inode_data, int keep_size, off_t offset, off_t length);
+
+int punch_hole_inode(sfs_inode_t *inode_data, off_t offset, off_t length);
 
-int read_inode(sfs_inode_t *inode_data, char* buffer, int size, int offset);
+int copy_inode_range(sfs_inode_t *src, sfs_inode_t *dest, off_t src_offset, off_t dest_offset, uint64_t length);
+
+off_t seek_inode(sfs_inode_t *inode_data, off_t offset, int want_data);
+
+void readahead_inode(sfs_inode_t *inode_data, sfs_readahead_t *ra, int size, off_t offset);
 
 void fill_stat_from_ino(const sfs_inode_t* inode, struct stat *statbuf);
 
 void read_dentries(sfs_inode_t *inode_data, sfs_dentry_t* dentries);
 
+void touch_inode(sfs_inode_t *inode, int flags);
+
+int snapshot_fs(const char *name);
+
+int delete_snapshot(const char *name);
+
+int clean_segments(int min_pct);
+
+int format_fs(uint64_t num_blocks, uint64_t num_inodes);
+
+int init_fs();
+
+void flush_inodes();
+
+void sync_inode(uint64_t ino);
+
+void sync_inodes();
+
+void destroy_fs();
+
 #endif /* SRC_INODE_H_ */
@@ -0,0 +1,747 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  libsfs, see libsfs.h. Mounting sets up the backends, formats a new block
+  store and loads the volume, for the sfs program too. The file and
+  directory calls make the volume they are handed SFS_DATA of the calling
+  thread and go straight to the inode layer, the way the FUSE operations
+  in sfs.c do.
+*/
+
+#define _GNU_SOURCE // SEEK_DATA, SEEK_HOLE
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backend.h"
+#include "block.h"
+#include "inode.h"
+#include "log.h"
+#include "libsfs.h"
+
+#define LIBSFS_IO_MAX (1024 * 1024) // Bytes handed to the inode layer at once
+
+struct sfs_file {
+    sfs_volume *vol;
+    uint64_t ino;
+    int flags; // Of the open, O_ACCMODE and O_APPEND count
+    off_t offset; // Where read() and write() go on
+    sfs_readahead_t ra;
+};
+
+struct sfs_dir {
+    sfs_volume *vol;
+    sfs_dentry_t *dentries; // Taken at opendir()
+    int num_dentries;
+    int next; // Entry readdir() returns next, . and .. are 0 and 1
+    struct dirent entry;
+};
+
+// The mount options of the sfs program, see sfs_opts in sfs.c
+typedef struct {
+    const char *templ; // Name, with "=%d", "=%llu" or "=%s" if it takes a value
+    size_t offset;
+    int value; // Set for options without a value
+} libsfs_opt;
+
+#define LIBSFS_OPT(t, p, v) { t, offsetof(struct sfs_state, p), v }
+
+// The block layer and the backends below it keep their state in globals,
+// the volume using them, NULL if none is
+static sfs_volume *libsfs_mounted = NULL;
+static pthread_mutex_t libsfs_mount_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const libsfs_opt libsfs_opts[] = {
+    LIBSFS_OPT("lazytime", lazytime, 1),
+    LIBSFS_OPT("lazytime_expire=%d", lazytime_expire, 0),
+    LIBSFS_OPT("nblocks=%llu", format_blocks, 0),
+    LIBSFS_OPT("ninodes=%llu", format_inodes, 0),
+    LIBSFS_OPT("nodiscard", nodiscard, 1),
+    LIBSFS_OPT("seqalloc", seqalloc, 1),
+    LIBSFS_OPT("compress", compress, 1),
+    LIBSFS_OPT("dedup", dedup, 1),
+    LIBSFS_OPT("checksum", checksum, 1),
+    LIBSFS_OPT("backend=%s", backend, 0),
+    LIBSFS_OPT("stripe_unit=%d", stripe_unit, 0),
+    LIBSFS_OPT("fast_blocks=%d", fast_blocks, 0),
+    LIBSFS_OPT("ram", ram, 1),
+    LIBSFS_OPT("hugepages", hugepages, 1),
+    LIBSFS_OPT("simulate=%s", simulate, 0),
+    LIBSFS_OPT("sim_latency=%d", sim_latency, 0),
+    LIBSFS_OPT("sim_bandwidth=%d", sim_bandwidth, 0),
+    LIBSFS_OPT("sim_qdepth=%d", sim_qdepth, 0),
+    { NULL, 0, 0 }
+};
+
+/*
+ * Sets the fields of vol for a comma separated list of options. Returns
+ * -EINVAL for one that isn't in libsfs_opts or has a bad value.
+ */
+static int libsfs_parse_opts(sfs_volume *vol, const char *options)
+{
+    char *opts = strdup(options);
+    char *saveptr = NULL;
+    char *opt = NULL;
+    int retstat = 0;
+
+    for (opt = strtok_r(opts, ",", &saveptr); (opt != NULL) && (retstat == 0); opt = strtok_r(NULL, ",", &saveptr)) {
+	const libsfs_opt *o = NULL;
+	char *value = strchr(opt, '=');
+	size_t name_len = (value != NULL) ? (size_t)(value - opt) : strlen(opt);
+
+	for (o = libsfs_opts; o->templ != NULL; ++o) {
+	    const char *templ_value = strchr(o->templ, '=');
+	    size_t templ_len = (templ_value != NULL) ? (size_t)(templ_value - o->templ) : strlen(o->templ);
+	    if ((templ_len == name_len) && (strncmp(o->templ, opt, name_len) == 0) &&
+		    ((templ_value == NULL) == (value == NULL))) {
+		break;
+	    }
+	}
+
+	void *field = (char*)vol + o->offset;
+	if (o->templ == NULL) {
+	    retstat = -EINVAL;
+	} else if (value == NULL) {
+	    *(int*)field = o->value;
+	} else if (strcmp(strchr(o->templ, '='), "=%s") == 0) {
+	    *(char**)field = strdup(value + 1);
+	} else if (sscanf(value + 1, strchr(o->templ, '=') + 1, field) != 1) {
+	    retstat = -EINVAL;
+	}
+    }
+    free(opts);
+
+    return retstat;
+}
+
+/** Mount a volume
+ *
+ * Opens the block store in diskfile, formatting it if it is new, and
+ * loads the volume. options is a comma separated list of the -o options
+ * of the sfs program ("backend=mmap,checksum", ...), NULL for none. With
+ * "ram" diskfile may be NULL.
+ */
+sfs_volume* libsfs_mount(const char *diskfile, const char *options)
+{
+    sfs_volume *vol = calloc(1, sizeof(sfs_volume));
+    int retstat = 0;
+    if (vol == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    if (options != NULL) {
+	retstat = libsfs_parse_opts(vol, options);
+    }
+    if ((retstat == 0) && vol->ram) {
+	if ((vol->backend != NULL) && (strcmp(vol->backend, "ram") != 0)) {
+	    retstat = -EINVAL;
+	}
+	free(vol->backend);
+	vol->backend = strdup("ram");
+    }
+    if ((retstat == 0) && (diskfile == NULL) && !vol->ram) {
+	retstat = -EINVAL;
+    }
+    // Like for sfs, several disk files make a striped volume
+    if ((retstat == 0) && (vol->backend == NULL) && (strchr(diskfile, ':') != NULL)) {
+	vol->backend = strdup("stripe");
+    }
+    if (retstat == 0) {
+	vol->diskfile = (diskfile != NULL) ? strdup(diskfile) : NULL;
+	retstat = libsfs_mount_volume(vol);
+    }
+
+    if (retstat < 0) {
+	free(vol->diskfile);
+	free(vol->backend);
+	free(vol->simulate);
+	free(vol);
+	errno = -retstat;
+	return NULL;
+    }
+
+    return vol;
+}
+
+/** Write everything back and unmount the volume
+ *
+ * Files and directories still open on it must not be used anymore.
+ */
+int libsfs_unmount(sfs_volume *vol)
+{
+    libsfs_unmount_volume(vol);
+    free(vol->diskfile);
+    free(vol->backend);
+    free(vol->simulate);
+    free(vol);
+
+    return 0;
+}
+
+/*
+ * Sets up the backends and opens the block store of vol, for
+ * libsfs_mount_volume() once it has the block layer to itself.
+ */
+static int libsfs_open_volume(sfs_volume *vol)
+{
+    int retstat = 0;
+
+    // A ram volume gets all of its memory mapped up front
+    uint64_t num_blocks = (vol->format_blocks > 0) ? vol->format_blocks : SFS_DEFAULT_NBLOCKS;
+    ram_backend_reserve((size_t)num_blocks * BLOCK_SIZE, vol->hugepages);
+    stripe_backend_setup((size_t)vol->stripe_unit * BLOCK_SIZE);
+    // The fast tier of a new volume ends at a group boundary
+    uint64_t fast_blocks = (vol->fast_blocks > 0) ? (uint64_t)vol->fast_blocks : (num_blocks / SFS_TIER_DEFAULT_FAST_SHARE);
+    fast_blocks = (fast_blocks < SFS_BLOCKS_PER_GROUP) ? SFS_BLOCKS_PER_GROUP : (fast_blocks / SFS_BLOCKS_PER_GROUP * SFS_BLOCKS_PER_GROUP);
+    tier_backend_setup((off_t)fast_blocks * BLOCK_SIZE);
+    if (sim_backend_setup(vol->simulate, vol->sim_latency, vol->sim_bandwidth, vol->sim_qdepth) < 0) {
+	log_msg("\nlibsfs_mount_volume unknown device model %s", vol->simulate);
+	return -EINVAL;
+    }
+    if ((retstat = disk_open(vol->diskfile, vol->backend)) < 0) {
+	return retstat;
+    }
+
+    sfs_set_context(vol);
+
+    // Check for first time initialization.
+    if (disk_size() == 0) {
+	uint64_t num_inodes = (vol->format_inodes > 0) ? vol->format_inodes : SFS_DEFAULT_NINODES;
+	if (format_fs(num_blocks, num_inodes) < 0) {
+	    log_msg("\nlibsfs_mount_volume format failed");
+	}
+    }
+
+    // Load the allocation state and start caching metadata blocks
+    if (init_fs() < 0) {
+	log_msg("\nlibsfs_mount_volume %s is not a valid file system image", vol->diskfile);
+	disk_close();
+	return -EINVAL;
+    }
+
+    log_msg("\nlibsfs_mount_volume ino_root = %llu", vol->ino_root);
+    return 0;
+}
+
+/** Mount a volume with its options filled in
+ *
+ * The backends get the setup the options ask for, the same as for the sfs
+ * program, a new block store gets formatted. Returns -EBUSY while another
+ * volume is mounted, before touching the setup it runs on.
+ */
+int libsfs_mount_volume(sfs_volume *vol)
+{
+    int retstat = 0;
+
+    pthread_mutex_lock(&libsfs_mount_lock);
+    if (libsfs_mounted != NULL) {
+	pthread_mutex_unlock(&libsfs_mount_lock);
+	return -EBUSY;
+    }
+    libsfs_mounted = vol;
+    pthread_mutex_unlock(&libsfs_mount_lock);
+
+    if ((retstat = libsfs_open_volume(vol)) < 0) {
+	pthread_mutex_lock(&libsfs_mount_lock);
+	libsfs_mounted = NULL;
+	pthread_mutex_unlock(&libsfs_mount_lock);
+    }
+
+    return retstat;
+}
+
+void libsfs_unmount_volume(sfs_volume *vol)
+{
+    sfs_set_context(vol);
+    destroy_fs();
+    disk_close();
+    sfs_set_context(NULL);
+
+    pthread_mutex_lock(&libsfs_mount_lock);
+    if (libsfs_mounted == vol) {
+	libsfs_mounted = NULL;
+    }
+    pthread_mutex_unlock(&libsfs_mount_lock);
+}
+
+/** Write all buffered data and metadata of the volume to its store
+ */
+int libsfs_sync(sfs_volume *vol)
+{
+    int retstat = 0;
+
+    sfs_set_context(vol);
+    sync_inodes();
+    if ((retstat = disk_sync()) < 0) {
+	errno = -retstat;
+	return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Snapshots are read-only, like in sfs.c.
+ */
+static int libsfs_check_writable(const char *path)
+{
+    const char *snapshots = "/" SFS_SNAPSHOT_DIR "/";
+    if (strncmp(path, snapshots, strlen(snapshots)) == 0) {
+	return -EROFS;
+    }
+
+    return 0;
+}
+
+/*
+ * Whether the directory path would be created in exists.
+ */
+static int libsfs_parent_exists(const char *path)
+{
+    char *path_copy = strdup(path);
+    uint64_t ino_parent = path_2_ino(dirname(path_copy));
+    free(path_copy);
+
+    return ino_parent != SFS_INVALID_INO;
+}
+
+/** Open a file
+ *
+ * flags are those of open(), O_CREAT creates the file with mode if it
+ * doesn't exist, O_EXCL fails if it does, O_TRUNC empties it and with
+ * O_APPEND every write goes to the end. Directories can't be opened.
+ */
+sfs_file* libsfs_open(sfs_volume *vol, const char *path, int flags, mode_t mode)
+{
+    int writing = ((flags & O_ACCMODE) != O_RDONLY);
+    int retstat = 0;
+    sfs_inode_t inode;
+
+    sfs_set_context(vol);
+    log_msg("\nlibsfs_open(path=\"%s\", flags=0x%x)", path, flags);
+
+    if ((writing || (flags & (O_CREAT | O_TRUNC))) && ((retstat = libsfs_check_writable(path)) < 0)) {
+	errno = -retstat;
+	return NULL;
+    }
+
+    uint64_t ino = path_2_ino(path);
+    if (ino == SFS_INVALID_INO) {
+	if (!(flags & O_CREAT)) {
+	    errno = ENOENT;
+	    return NULL;
+	}
+	ino = create_inode(path, (mode & ~S_IFMT) | S_IFREG);
+	if (ino == SFS_INVALID_INO) {
+	    errno = libsfs_parent_exists(path) ? ENOSPC : ENOENT;
+	    return NULL;
+	}
+    } else if ((flags & O_CREAT) && (flags & O_EXCL)) {
+	errno = EEXIST;
+	return NULL;
+    }
+
+    get_inode(ino, &inode);
+    if (S_ISDIR(inode.mode)) {
+	errno = EISDIR;
+	return NULL;
+    }
+    if (writing && (flags & O_TRUNC) && (inode.size > 0) && ((retstat = truncate_inode(&inode, 0)) < 0)) {
+	errno = -retstat;
+	return NULL;
+    }
+
+    sfs_file *file = calloc(1, sizeof(sfs_file));
+    if (file == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    file->vol = vol;
+    file->ino = ino;
+    file->flags = flags;
+
+    return file;
+}
+
+/** Close a file
+ *
+ * Like release in sfs.c, writes back the inodes modified through it.
+ */
+int libsfs_close(sfs_file *file)
+{
+    sfs_set_context(file->vol);
+    flush_inodes();
+    free(file);
+
+    return 0;
+}
+
+ssize_t libsfs_pread(sfs_file *file, void *buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+    sfs_inode_t inode;
+
+    sfs_set_context(file->vol);
+    if ((file->flags & O_ACCMODE) == O_WRONLY) {
+	errno = EBADF;
+	return -1;
+    }
+    if (offset < 0) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    get_inode(file->ino, &inode);
+    while (done < size) {
+	int count = ((size - done) > LIBSFS_IO_MAX) ? LIBSFS_IO_MAX : (int)(size - done);
+	readahead_inode(&inode, &file->ra, count, offset + done);
+	int retstat = read_inode(&inode, (char*)buf + done, count, offset + done);
+	if (retstat < 0) {
+	    if (done > 0) {
+		break;
+	    }
+	    errno = -retstat;
+	    return -1;
+	}
+	done += retstat;
+	if (retstat < count) {
+	    break;
+	}
+    }
+
+    return done;
+}
+
+ssize_t libsfs_pwrite(sfs_file *file, const void *buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+    sfs_inode_t inode;
+
+    sfs_set_context(file->vol);
+    if ((file->flags & O_ACCMODE) == O_RDONLY) {
+	errno = EBADF;
+	return -1;
+    }
+    if (offset < 0) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    get_inode(file->ino, &inode);
+    while (done < size) {
+	int count = ((size - done) > LIBSFS_IO_MAX) ? LIBSFS_IO_MAX : (int)(size - done);
+	int retstat = write_inode(&inode, (const char*)buf + done, count, offset + done);
+	if (retstat < 0) {
+	    if (done > 0) {
+		break;
+	    }
+	    errno = -retstat;
+	    return -1;
+	}
+	done += retstat;
+	if (retstat < count) {
+	    break;
+	}
+    }
+
+    return done;
+}
+
+ssize_t libsfs_read(sfs_file *file, void *buf, size_t size)
+{
+    ssize_t retstat = libsfs_pread(file, buf, size, file->offset);
+    if (retstat > 0) {
+	file->offset += retstat;
+    }
+
+    return retstat;
+}
+
+ssize_t libsfs_write(sfs_file *file, const void *buf, size_t size)
+{
+    if (file->flags & O_APPEND) {
+	sfs_inode_t inode;
+	sfs_set_context(file->vol);
+	get_inode(file->ino, &inode);
+	file->offset = inode.size;
+    }
+
+    ssize_t retstat = libsfs_pwrite(file, buf, size, file->offset);
+    if (retstat > 0) {
+	file->offset += retstat;
+    }
+
+    return retstat;
+}
+
+/** Move the offset of read() and write()
+ *
+ * SEEK_DATA and SEEK_HOLE find data and holes like in lseek().
+ */
+off_t libsfs_lseek(sfs_file *file, off_t offset, int whence)
+{
+    sfs_inode_t inode;
+    off_t pos = -1;
+
+    sfs_set_context(file->vol);
+    get_inode(file->ino, &inode);
+    if (whence == SEEK_SET) {
+	pos = offset;
+    } else if (whence == SEEK_CUR) {
+	pos = file->offset + offset;
+    } else if (whence == SEEK_END) {
+	pos = inode.size + offset;
+#ifdef SEEK_DATA
+    } else if ((whence == SEEK_DATA) || (whence == SEEK_HOLE)) {
+	pos = seek_inode(&inode, offset, whence == SEEK_DATA);
+	if (pos < 0) {
+	    errno = -pos;
+	    return -1;
+	}
+#endif
+    }
+
+    if (pos < 0) {
+	errno = EINVAL;
+	return -1;
+    }
+    file->offset = pos;
+
+    return pos;
+}
+
+int libsfs_fsync(sfs_file *file)
+{
+    int retstat = 0;
+
+    sfs_set_context(file->vol);
+    sync_inode(file->ino);
+    if ((retstat = disk_sync()) < 0) {
+	errno = -retstat;
+	return -1;
+    }
+
+    return 0;
+}
+
+int libsfs_fstat(sfs_file *file, struct stat *statbuf)
+{
+    sfs_inode_t inode;
+
+    sfs_set_context(file->vol);
+    get_inode(file->ino, &inode);
+    fill_stat_from_ino(&inode, statbuf);
+
+    return 0;
+}
+
+int libsfs_stat(sfs_volume *vol, const char *path, struct stat *statbuf)
+{
+    sfs_set_context(vol);
+    uint64_t ino = path_2_ino(path);
+    if (ino == SFS_INVALID_INO) {
+	errno = ENOENT;
+	return -1;
+    }
+
+    sfs_inode_t inode;
+    get_inode(ino, &inode);
+    fill_stat_from_ino(&inode, statbuf);
+
+    return 0;
+}
+
+int libsfs_truncate(sfs_volume *vol, const char *path, off_t size)
+{
+    int retstat = 0;
+    sfs_inode_t inode;
+
+    sfs_set_context(vol);
+    uint64_t ino = path_2_ino(path);
+    if ((retstat = libsfs_check_writable(path)) < 0) {
+	errno = -retstat;
+	return -1;
+    }
+    if (ino == SFS_INVALID_INO) {
+	errno = ENOENT;
+	return -1;
+    }
+
+    get_inode(ino, &inode);
+    if (S_ISDIR(inode.mode)) {
+	retstat = -EISDIR;
+    } else if (size < 0) {
+	retstat = -EINVAL;
+    } else {
+	retstat = truncate_inode(&inode, size);
+    }
+    if (retstat < 0) {
+	errno = -retstat;
+	return -1;
+    }
+
+    return 0;
+}
+
+int libsfs_unlink(sfs_volume *vol, const char *path)
+{
+    int retstat = 0;
+    sfs_inode_t inode;
+
+    sfs_set_context(vol);
+    if ((retstat = libsfs_check_writable(path)) < 0) {
+	errno = -retstat;
+	return -1;
+    }
+
+    uint64_t ino = path_2_ino(path);
+    if (ino == SFS_INVALID_INO) {
+	errno = ENOENT;
+	return -1;
+    }
+    get_inode(ino, &inode);
+    if (S_ISDIR(inode.mode)) {
+	errno = EISDIR;
+	return -1;
+    }
+    if ((retstat = remove_inode(path)) < 0) {
+	errno = -retstat;
+	return -1;
+    }
+
+    return 0;
+}
+
+int libsfs_mkdir(sfs_volume *vol, const char *path, mode_t mode)
+{
+    int retstat = 0;
+
+    sfs_set_context(vol);
+    if ((retstat = libsfs_check_writable(path)) < 0) {
+	errno = -retstat;
+	return -1;
+    }
+    if (path_2_ino(path) != SFS_INVALID_INO) {
+	errno = EEXIST;
+	return -1;
+    }
+
+    if (create_inode(path, (mode & ~S_IFMT) | S_IFDIR) == SFS_INVALID_INO) {
+	errno = libsfs_parent_exists(path) ? ENOSPC : ENOENT;
+	return -1;
+    }
+
+    return 0;
+}
+
+/** Remove an empty directory
+ */
+int libsfs_rmdir(sfs_volume *vol, const char *path)
+{
+    int retstat = 0;
+    sfs_inode_t inode;
+
+    sfs_set_context(vol);
+    if ((retstat = libsfs_check_writable(path)) < 0) {
+	errno = -retstat;
+	return -1;
+    }
+
+    uint64_t ino = path_2_ino(path);
+    if (ino == SFS_INVALID_INO) {
+	errno = ENOENT;
+	return -1;
+    }
+    get_inode(ino, &inode);
+    if (!S_ISDIR(inode.mode)) {
+	retstat = -ENOTDIR;
+    } else if (ino == vol->ino_root) {
+	retstat = -EBUSY;
+    } else if (inode.size > 0) {
+	retstat = -ENOTEMPTY;
+    } else {
+	retstat = remove_inode(path);
+    }
+    if (retstat < 0) {
+	errno = -retstat;
+	return -1;
+    }
+
+    return 0;
+}
+
+/** Open a directory
+ *
+ * Its entries are read right away, readdir() returns them as they were
+ * then.
+ */
+sfs_dir* libsfs_opendir(sfs_volume *vol, const char *path)
+{
+    sfs_inode_t inode;
+
+    sfs_set_context(vol);
+    uint64_t ino = path_2_ino(path);
+    if (ino == SFS_INVALID_INO) {
+	errno = ENOENT;
+	return NULL;
+    }
+    get_inode(ino, &inode);
+    if (!S_ISDIR(inode.mode)) {
+	errno = ENOTDIR;
+	return NULL;
+    }
+
+    sfs_dir *dir = calloc(1, sizeof(sfs_dir));
+    if (dir == NULL) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    dir->vol = vol;
+    dir->num_dentries = inode.size / SFS_DENTRY_SIZE;
+    dir->dentries = malloc(sizeof(sfs_dentry_t) * (dir->num_dentries + 1));
+    read_dentries(&inode, dir->dentries);
+
+    return dir;
+}
+
+/** Next entry of a directory, NULL after the last one
+ *
+ * The entry stays valid until the next call on dir.
+ */
+struct dirent* libsfs_readdir(sfs_dir *dir)
+{
+    struct dirent *entry = &dir->entry;
+    if (dir->next >= dir->num_dentries + 2) {
+	return NULL;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    if (dir->next < 2) {
+	strcpy(entry->d_name, (dir->next == 0) ? "." : "..");
+    } else {
+	sfs_dentry_t *dentry = &dir->dentries[dir->next - 2];
+	entry->d_ino = dentry->inode_number;
+	strncpy(entry->d_name, dentry->name, sizeof(entry->d_name) - 1);
+    }
+    dir->next++;
+
+    return entry;
+}
+
+int libsfs_closedir(sfs_dir *dir)
+{
+    free(dir->dentries);
+    free(dir);
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _LIBSFS_H_
+#define _LIBSFS_H_
+
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * libsfs, the file system as a library for programs which want it in
+ * process, without FUSE and the kernel in between. Every call takes the
+ * volume it works on, returned by libsfs_mount(), or a file or directory
+ * opened on it. Paths are absolute inside the volume. Like the system
+ * calls they are named after, the functions return -1 (or NULL) with
+ * errno set on failure.
+ *
+ * The block layer below keeps a single block store open, so a process can
+ * have one volume mounted at a time, which any number of threads may use.
+ * Mounting another one fails with EBUSY until it is unmounted.
+ */
+typedef struct sfs_state sfs_volume;
+typedef struct sfs_file sfs_file;
+typedef struct sfs_dir sfs_dir;
+
+sfs_volume* libsfs_mount(const char *diskfile, const char *options);
+int libsfs_unmount(sfs_volume *vol);
+int libsfs_sync(sfs_volume *vol);
+
+sfs_file* libsfs_open(sfs_volume *vol, const char *path, int flags, mode_t mode);
+int libsfs_close(sfs_file *file);
+ssize_t libsfs_read(sfs_file *file, void *buf, size_t size);
+ssize_t libsfs_write(sfs_file *file, const void *buf, size_t size);
+ssize_t libsfs_pread(sfs_file *file, void *buf, size_t size, off_t offset);
+ssize_t libsfs_pwrite(sfs_file *file, const void *buf, size_t size, off_t offset);
+off_t libsfs_lseek(sfs_file *file, off_t offset, int whence);
+int libsfs_fsync(sfs_file *file);
+int libsfs_fstat(sfs_file *file, struct stat *statbuf);
+
+int libsfs_stat(sfs_volume *vol, const char *path, struct stat *statbuf);
+int libsfs_truncate(sfs_volume *vol, const char *path, off_t size);
+int libsfs_unlink(sfs_volume *vol, const char *path);
+int libsfs_mkdir(sfs_volume *vol, const char *path, mode_t mode);
+int libsfs_rmdir(sfs_volume *vol, const char *path);
+
+sfs_dir* libsfs_opendir(sfs_volume *vol, const char *path);
+struct dirent* libsfs_readdir(sfs_dir *dir);
+int libsfs_closedir(sfs_dir *dir);
+
+/*
+ * For programs setting the options of vol themselves, like sfs does from
+ * its command line: vol is zeroed memory with the option fields of
+ * struct sfs_state (params.h) filled in. Returns -errno on failure.
+ */
+int libsfs_mount_volume(sfs_volume *vol);
+void libsfs_unmount_volume(sfs_volume *vol);
+
+#endif
@@ -12,17 +12,21 @@
 
 #include "params.h"
 
-#include <fuse.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <utime.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 
 #include "log.h"
 
+// Kept here as well so background threads (which have no fuse context) can log
+static FILE *sfs_logfile = NULL;
+
 FILE *log_open()
 {
     FILE *logfile;
@@ -37,6 +41,7 @@ FILE *log_open()
     
     // set logfile to line buffering
     setvbuf(logfile, NULL, _IOLBF, 0);
+    sfs_logfile = logfile;
 
     return logfile;
 }
@@ -44,125 +49,16 @@ FILE *log_open()
 void log_msg(const char *format, ...)
 {
     va_list ap;
-    va_start(ap, format);
-
-    vfprintf(SFS_DATA->logfile, format, ap);
-}
-
-// fuse context
-void log_fuse_context(struct fuse_context *context)
-{
-    log_msg("    context:\n");
-    
-    /** Pointer to the fuse object */
-    //	struct fuse *fuse;
-    log_struct(context, fuse, %08x, );
-
-    /** User ID of the calling process */
-    //	uid_t uid;
-    log_struct(context, uid, %d, );
-
-    /** Group ID of the calling process */
-    //	gid_t gid;
-    log_struct(context, gid, %d, );
-
-    /** Thread ID of the calling process */
-    //	pid_t pid;
-    log_struct(context, pid, %d, );
-
-    /** Private filesystem data */
-    //	void *private_data;
-    log_struct(context, private_data, %08x, );
-    log_struct(((struct sfs_state *)context->private_data), logfile, %08x, );
-    log_struct(((struct sfs_state *)context->private_data), diskfile, %s, );
-	
-    /** Umask of the calling process (introduced in version 2.8) */
-    //	mode_t umask;
-    log_struct(context, umask, %05o, );
-}
-
-// struct fuse_conn_info contains information about the socket
-// connection being used.  I don't actually use any of this
-// information in sfs
-void log_conn(struct fuse_conn_info *conn)
-{
-    log_msg("    conn:\n");
-    
-    /** Major version of the protocol (read-only) */
-    // unsigned proto_major;
-    log_struct(conn, proto_major, %d, );
-
-    /** Minor version of the protocol (read-only) */
-    // unsigned proto_minor;
-    log_struct(conn, proto_minor, %d, );
 
-    /** Is asynchronous read supported (read-write) */
-    // unsigned async_read;
-    log_struct(conn, async_read, %d, );
+    // libsfs users only get a log if they open one
+    if (sfs_logfile == NULL) {
+	return;
+    }
+    va_start(ap, format);
 
-    /** Maximum size of the write buffer */
-    // unsigned max_write;
-    log_struct(conn, max_write, %d, );
-    
-    /** Maximum readahead */
-    // unsigned max_readahead;
-    log_struct(conn, max_readahead, %d, );
-    
-    /** Capability flags, that the kernel supports */
-    // unsigned capable;
-    log_struct(conn, capable, %08x, );
-    
-    /** Capability flags, that the filesystem wants to enable */
-    // unsigned want;
-    log_struct(conn, want, %08x, );
-    
-    /** For future use. */
-    // unsigned reserved[23];
+    vfprintf(sfs_logfile, format, ap);
+    va_end(ap);
 }
-    
-// struct fuse_file_info keeps information about files (surprise!).
-// This dumps all the information in a struct fuse_file_info.  The struct
-// definition, and comments, come from /usr/include/fuse/fuse_common.h
-// Duplicated here for convenience.
-void log_fi (struct fuse_file_info *fi)
-{
-    log_msg("    fi:\n");
-    
-    /** Open flags.  Available in open() and release() */
-    //	int flags;
-	log_struct(fi, flags, 0x%08x, );
-	
-    /** Old file handle, don't use */
-    //	unsigned long fh_old;	
-	log_struct(fi, fh_old, 0x%08lx,  );
-
-    /** In case of a write operation indicates if this was caused by a
-        writepage */
-    //	int writepage;
-	log_struct(fi, writepage, %d, );
-
-    /** Can be filled in by open, to use direct I/O on this file.
-        Introduced in version 2.4 */
-    //	unsigned int keep_cache : 1;
-	log_struct(fi, direct_io, %d, );
-
-    /** Can be filled in by open, to indicate, that cached file data
-        need not be invalidated.  Introduced in version 2.4 */
-    //	unsigned int flush : 1;
-	log_struct(fi, keep_cache, %d, );
-
-    /** Padding.  Do not use*/
-    //	unsigned int padding : 29;
-
-    /** File handle.  May be filled in by filesystem in open().
-        Available in all other file operations */
-    //	uint64_t fh;
-	log_struct(fi, fh, 0x%016llx,  );
-	
-    /** Lock owner id.  Available in locking operations and flush */
-    //  uint64_t lock_owner;
-	log_struct(fi, lock_owner, 0x%016llx, );
-};
 
 // This dumps the info from a struct stat.  The struct is defined in
 // <bits/stat.h>; this is indirectly included from <fcntl.h>
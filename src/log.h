@@ -9,13 +9,16 @@
 #define _LOG_H_
 #include <stdio.h>
 
+// Doesn't need the FUSE headers, the FUSE structs are logged in sfs.c
+struct stat;
+struct statvfs;
+struct utimbuf;
+
 //  macro to log fields in structs.
 #define log_struct(st, field, format, typecast) \
   log_msg("    " #field " = " #format "\n", typecast st->field)
 
 FILE *log_open(void);
-void log_conn (struct fuse_conn_info *conn);
-void log_fi (struct fuse_file_info *fi);
 void log_stat(struct stat *si);
 void log_statvfs(struct statvfs *sv);
 void log_utime(struct utimbuf *buf);
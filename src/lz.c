@@ -0,0 +1,168 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  A small LZ77 codec in the style of LZ4, fast enough to run on every
+  write buffer flush. The output is a series of sequences, each a token
+  byte holding the literal count (high nibble) and the match length minus
+  LZ_MIN_MATCH (low nibble), a nibble of 15 continuing in extra bytes
+  that are added up until one is below 255, then the literals, then the
+  match offset in two bytes, little endian. The last sequence ends after
+  its literals.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+static uint32_t lz_hash(const unsigned char *p) {
+	uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char* lz_put_length(unsigned char *op, unsigned char *oend, int len) {
+	while ((len >= 255) && (op < oend)) {
+		*op++ = 255;
+		len -= 255;
+	}
+	if (op < oend) {
+		*op++ = len;
+	}
+	return op;
+}
+
+/*
+ * Compresses in_len bytes into out. Returns the compressed size, or -1 if
+ * it doesn't fit into out_max bytes, in which case the data is better kept
+ * as it is.
+ */
+int lz_compress(const char *in, int in_len, char *out, int out_max) {
+	if ((in_len < 0) || (in_len > LZ_MAX_INPUT)) {
+		return -1;
+	}
+
+	const unsigned char *ip = (const unsigned char*)in;
+	const unsigned char *iend = ip + in_len;
+	const unsigned char *anchor = ip; // First literal not written yet
+	unsigned char *op = (unsigned char*)out;
+	unsigned char *oend = op + out_max;
+	uint16_t table[1 << LZ_HASH_BITS];
+	memset(table, 0xff, sizeof(table));
+
+	const unsigned char *p = ip;
+	while (p + LZ_MIN_MATCH <= iend) {
+		uint32_t h = lz_hash(p);
+		const unsigned char *ref = (table[h] != 0xffff) ? ip + table[h] : NULL;
+		table[h] = p - ip;
+		if ((ref == NULL) || (memcmp(ref, p, LZ_MIN_MATCH) != 0)) {
+			++p;
+			continue;
+		}
+
+		int match_len = LZ_MIN_MATCH;
+		while ((p + match_len < iend) && (ref[match_len] == p[match_len])) {
+			++match_len;
+		}
+
+		// Sequence: token, literals, offset
+		int lit_len = p - anchor;
+		if (op + 1 + lit_len / 255 + 1 + lit_len + 2 + (match_len - LZ_MIN_MATCH) / 255 + 1 > oend) {
+			return -1;
+		}
+		unsigned char *token = op++;
+		*token = ((lit_len >= 15) ? 15 : lit_len) << 4;
+		if (lit_len >= 15) {
+			op = lz_put_length(op, oend, lit_len - 15);
+		}
+		memcpy(op, anchor, lit_len);
+		op += lit_len;
+		*op++ = (p - ref) & 0xff;
+		*op++ = (p - ref) >> 8;
+		*token |= (match_len - LZ_MIN_MATCH >= 15) ? 15 : (match_len - LZ_MIN_MATCH);
+		if (match_len - LZ_MIN_MATCH >= 15) {
+			op = lz_put_length(op, oend, match_len - LZ_MIN_MATCH - 15);
+		}
+
+		p += match_len;
+		anchor = p;
+	}
+
+	// Last sequence, literals only
+	int lit_len = iend - anchor;
+	if (op + 1 + lit_len / 255 + 1 + lit_len > oend) {
+		return -1;
+	}
+	*op++ = ((lit_len >= 15) ? 15 : lit_len) << 4;
+	if (lit_len >= 15) {
+		op = lz_put_length(op, oend, lit_len - 15);
+	}
+	memcpy(op, anchor, lit_len);
+	op += lit_len;
+
+	return op - (unsigned char*)out;
+}
+
+/*
+ * Decompresses in_len bytes of lz_compress() output into out, which takes
+ * out_len bytes. Returns the decompressed size, or -1 if the input is
+ * corrupt.
+ */
+int lz_decompress(const char *in, int in_len, char *out, int out_len) {
+	const unsigned char *ip = (const unsigned char*)in;
+	const unsigned char *iend = ip + in_len;
+	unsigned char *op = (unsigned char*)out;
+	unsigned char *oend = op + out_len;
+
+	while (ip < iend) {
+		int token = *ip++;
+		int len = token >> 4;
+		if (len == 15) {
+			int extra = 255;
+			while ((extra == 255) && (ip < iend)) {
+				extra = *ip++;
+				len += extra;
+			}
+		}
+		if ((ip + len > iend) || (op + len > oend)) {
+			return -1;
+		}
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		if (ip >= iend) {
+			break;
+		}
+
+		if (ip + 2 > iend) {
+			return -1;
+		}
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		len = (token & 15) + LZ_MIN_MATCH;
+		if ((token & 15) == 15) {
+			int extra = 255;
+			while ((extra == 255) && (ip < iend)) {
+				extra = *ip++;
+				len += extra;
+			}
+		}
+		if ((offset == 0) || (offset > op - (unsigned char*)out) || (op + len > oend)) {
+			return -1;
+		}
+
+		// Byte by byte, the match may overlap what it produces
+		const unsigned char *ref = op - offset;
+		while (len-- > 0) {
+			*op++ = *ref++;
+		}
+	}
+
+	return op - (unsigned char*)out;
+}
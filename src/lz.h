@@ -0,0 +1,17 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+// Largest input lz_compress() takes, offsets and positions fit 16 bits
+#define LZ_MAX_INPUT 65535
+
+int lz_compress(const char *in, int in_len, char *out, int out_max);
+int lz_decompress(const char *in, int in_len, char *out, int out_len);
+
+#endif
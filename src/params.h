@@ -24,26 +24,195 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 #include "list.h"
 
+typedef struct sfs_cached_block {
+	uint32_t block_no;
+	int dirty; // Set when the block has not been written to disk yet
+	time_t dirtied; // Time at which the block became dirty
+	int time_dirty; // Set when only timestamps changed (lazytime), see touch_inode()
+	time_t time_dirtied; // Time at which the first timestamp only change happened
+	int loading; // Being read without cache_lock, the data isn't there yet
+	int flushing; // A copy is being written without cache_lock
+	struct sfs_cached_block *hash_next;
+	list_t lru; // Least recently used blocks first
+	char data[]; // BLOCK_SIZE bytes
+} sfs_cached_block;
+
+typedef struct {
+	uint32_t block_no; // First block of the chunk (its header)
+	uint32_t num_free;
+} sfs_inode_chunk;
+
+typedef struct {
+	pthread_mutex_t lock; // Protects everything below, taken before cache_lock
+	uint32_t first_block; // First block of the group
+	uint32_t num_blocks; // Blocks in the group, the last one may be short
+	uint32_t bitmap_block; // Block holding the group's data bitmap
+	uint32_t refcount_block; // First of the SFS_REFCOUNT_BLOCKS reference count blocks, 0 if none
+	uint32_t checksum_block; // First of the SFS_CHECKSUM_BLOCKS checksum blocks, 0 if none, set under cache_lock too
+	uint32_t free_blocks;
+	uint32_t free_inodes;
+	uint8_t *bitmap; // In memory copy of the data bitmap, used for allocation
+	sfs_inode_chunk *inode_chunks; // Inode chunks of the group, sorted by block_no
+	int num_inode_chunks;
+	int max_inode_chunks;
+} sfs_group;
+
+typedef struct {
+	uint64_t idx; // File block
+	uint32_t block_no; // Where it goes, filled in at flush
+	int reserved; // Holds a block reservation, it wasn't allocated when buffered
+	int cluster_part; // Set at flush in a compressed cluster, 1 if the block holds compressed data, 2 if not
+	int deduped; // Set at flush when block_no is a block found with the same data, nothing to write
+	char *data; // BLOCK_SIZE bytes
+} sfs_buffered_block;
+
+typedef struct sfs_write_buffer {
+	uint64_t ino;
+	struct sfs_write_buffer *hash_next;
+	list_t dirty; // Oldest buffer first
+	time_t dirtied;
+	sfs_buffered_block *blocks; // Sorted by idx
+	int num_blocks;
+	int max_blocks;
+	int meta_reserved; // Blocks reserved for indirect blocks
+} sfs_write_buffer;
+
+// Decompressed cluster, found by the first block of its compressed data
+typedef struct {
+	uint32_t block_no;
+	int size;
+	char *data; // SFS_CLUSTER_BLOCKS blocks
+} sfs_cached_cluster;
+
+// Entry of the dedup index
 typedef struct {
-	int id;
-	list_t node;
-} sfs_free_list;
+	uint64_t hash; // block_fingerprint() of the block
+	uint32_t block_no; // SFS_INVALID_BLOCK_NO if the entry is empty
+} sfs_fingerprint;
+
+// Entry of the heat table, for an extent of SFS_TIER_EXTENT_BLOCKS file blocks
+typedef struct {
+	uint64_t ino; // SFS_INVALID_INO if the entry is empty
+	uint32_t extent;
+	uint32_t heat; // Accesses, halved every SFS_TIER_INTERVAL
+} sfs_extent_heat;
+
+// Inode of a snapshot being taken, as it was when the snapshot started
+typedef struct sfs_snapshot_image {
+	uint64_t ino; // Live inode
+	uint64_t image; // Copy sharing its blocks, SFS_INVALID_INO once the walk took it or if there is nothing to keep
+	struct sfs_snapshot_image *next;
+} sfs_snapshot_image;
+
+// Freed blocks waiting to be punched out of the disk file
+typedef struct {
+	uint32_t block_no;
+	uint32_t count;
+} sfs_discard_range;
+
+struct sfs_superblock;
 
 struct sfs_state {
     FILE *logfile;
     char *diskfile;
+    char *backend; // Name of the block store backend, see backend_find()
+    int stripe_unit; // Blocks per chunk of the stripe backend, 0 for the default
+    int ram; // Keep the whole volume in memory, formatted at mount and gone on unmount
+    int hugepages; // Back the memory of a ram volume with huge pages
+    char *simulate; // Device model put in front of the backend, see sim_backend_setup()
+    int sim_latency; // Model overrides, 0 keeps the model's value
+    int sim_bandwidth;
+    int sim_qdepth;
+    int fast_blocks; // Blocks on the fast diskFile of a new tier volume, 0 for the default
+
+    uint64_t ino_root;
+    struct sfs_superblock *sb; // In memory copy of the super block
+    int sb_dirty;
+    pthread_mutex_t sb_lock; // Protects sb and sb_dirty, taken last
+
+    sfs_group *groups; // Block groups, each one allocates independently
+    uint32_t num_groups;
+
+    sfs_cached_block **cache_hash; // Write back cache of metadata blocks (inodes, bitmap, indirect blocks)
+    list_t cache_lru;
+    int cache_count;
+    pthread_mutex_t cache_lock; // Protects the cache, taken after a group lock, not held for disk I/O
+    pthread_cond_t cache_cond; // Signalled when a block is done loading or flushing, and after a flush pass
+    int cache_flushing; // A flush_cached_blocks() pass is writing blocks
+    pthread_cond_t inode_flusher_cond; // Used to wake up the flusher on exit
+    pthread_t inode_flusher; // Thread writing back dirty metadata blocks periodically
+    int inode_flusher_stop;
+
+    sfs_write_buffer **wb_hash; // Data written but not allocated or on disk yet, by inode
+    list_t wb_dirty; // Write buffers, oldest first
+    pthread_mutex_t wb_list_lock; // Protects wb_hash and wb_dirty, taken last
+    pthread_rwlock_t *wb_locks; // Per inode shard, protect the write buffer and block map of an inode, taken after snapshot_lock
+    uint64_t reserved_blocks; // Free blocks promised to write buffers, protected by sb_lock
+    pthread_rwlock_t snapshot_lock; // Changes to the tree hold it for reading, snapshot_fs() briefly for writing, taken first
+    pthread_mutex_t snapshot_walk_lock; // Held by snapshot_fs() throughout, one snapshot at a time, taken before snapshot_lock
+    int snapshot_active; // A snapshot walk is running, only changes with snapshot_lock held for writing
+    sfs_snapshot_image **snapshot_images; // Inodes changed or walked since it started, by ino
+    int snapshot_error; // First failure to keep an inode for it
+    pthread_mutex_t snapshot_image_lock; // Protects snapshot_images and snapshot_error, taken last
+
+    sfs_discard_range *discards; // Blocks freed since the last discard, in the order freed
+    int num_discards;
+    pthread_mutex_t discard_lock; // Protects discards, taken last
+    int nodiscard; // Leave freed blocks allocated in the disk file
 
-    sfs_free_list* state_inodes; // Array of list nodes for all inodes state info
-    sfs_free_list* state_data_blocks; // Array of data block nodes for all data blocks
+    // Sequential allocation: file data goes to a log of segments, see
+    // SFS_SEGMENT_BLOCKS
+    int seqalloc;
+    uint32_t num_segments;
+    pthread_mutex_t log_lock; // Protects the log head, taken before a group lock
+    pthread_mutex_t cleaner_lock; // Held by a cleaner round, protects everything below, taken first
+    pthread_cond_t cleaner_cond; // Wakes up the cleaner when no segment is clean and on exit
+    pthread_t cleaner; // Thread cleaning segments
+    int cleaner_stop;
+    uint8_t *segment_victims; // Per segment, 1 while a cleaner round empties it
+    uint16_t *segment_stuck; // Per segment, blocks in use the cleaner couldn't move, SFS_SEGMENT_NOT_STUCK if none
 
-    list_t* free_inodes;
-    list_t* free_data_blocks;
+    int compress; // Compress file data in clusters, see SFS_CLUSTER_BLOCKS
+    sfs_cached_cluster *clusters; // Direct mapped by block number
+    pthread_mutex_t cluster_lock; // Protects clusters, taken last
 
-    uint32_t ino_root;
+    int checksum; // Give groups data block checksums, see SFS_CHECKSUM_BLOCKS
+
+    int dedup; // Share blocks with the same data, see SFS_DEDUP_INDEX_SIZE
+    sfs_fingerprint *fingerprints; // Dedup index, direct mapped by hash
+    sfs_fingerprint *fingerprint_blocks; // The same entries, direct mapped by block number
+    pthread_mutex_t dedup_lock; // Protects the dedup index, taken before a group lock
+
+    pthread_mutex_t orphan_lock; // Protects the orphan list, taken after an inode's map lock and before a group lock
+    pthread_cond_t orphan_cond; // Wakes up the reclaimer on new orphans and on exit
+    pthread_t orphan_reclaimer; // Thread freeing the blocks of orphans
+    int orphan_reclaimer_stop;
+
+    // Tiering: with the tier backend the first fast_groups groups are on the
+    // fast diskFile, they take metadata, small files and hot extents
+    uint32_t fast_groups; // 0 without tiering
+    sfs_extent_heat *heat; // Heat table, direct mapped by ino and extent
+    pthread_mutex_t heat_lock; // Protects heat, taken last
+    pthread_cond_t migrator_cond; // Wakes up the migrator on exit
+    pthread_t migrator; // Thread moving extents between the tiers
+    int migrator_stop;
+    uint64_t migrate_cursor; // Inode the migrator looks at next for cold extents
+
+    int lazytime; // Keep timestamp only inode changes in memory
+    int lazytime_expire; // Seconds after which lazy timestamps are written anyway
+
+    uint64_t format_blocks; // Volume size in blocks when a new disk gets formatted
+    uint64_t format_inodes; // Number of inodes created when a new disk gets formatted
 };
 
-#define SFS_DATA ((struct sfs_state *) fuse_get_context()->private_data)
+// Volume the calling thread works on, see sfs_set_context() in inode.c
+struct sfs_state* sfs_context();
+void sfs_set_context(struct sfs_state *sfs);
+
+#define SFS_DATA (sfs_context())
 
 #endif
@@ -9,14 +9,17 @@
 
 #include "params.h"
 #include "block.h"
+#include "backend.h"
 
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <fuse_opt.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -25,6 +28,18 @@
 #include <sys/stat.h>
 #include <time.h>
 #include "inode.h"
+#include "libsfs.h"
+
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
 
 #ifdef HAVE_SYS_XATTR_H
 #include <sys/xattr.h>
@@ -32,18 +47,6 @@
 
 #include "log.h"
 
-#define SFS_MAGIC_NUM 1707
-
-typedef struct __attribute__((packed)) {
-	uint32_t magic;
-	uint32_t num_data_blocks; // Total number of data blocks on disk.
-	uint32_t num_free_blocks; // Total number of free blocks.
-	uint32_t num_inodes; // Total number of inodes on disk.
-	uint32_t bitmap_inode_blocks;
-	uint32_t bitmap_data_blocks;
-	uint32_t inode_root;  // Root directory.
-} sfs_superblock;
-
 /*
  * Use the root directory to get the full path for the input relative path
  */
@@ -53,6 +56,89 @@ static void sfs_fullpath(char buffer[PATH_MAX], const char *path)
     strncat(buffer, path, PATH_MAX);
 }
 
+/*
+ * Snapshots are read-only, returns -EROFS for paths inside of them.
+ */
+static int sfs_check_writable(const char *path)
+{
+    const char *snapshots = "/" SFS_SNAPSHOT_DIR "/";
+    if (strncmp(path, snapshots, strlen(snapshots)) == 0) {
+	return -EROFS;
+    }
+
+    return 0;
+}
+
+// fuse context
+static void log_fuse_context(struct fuse_context *context)
+{
+    log_msg("    context:\n");
+    
+    /** Pointer to the fuse object */
+    //	struct fuse *fuse;
+    log_struct(context, fuse, %08x, );
+
+    /** User ID of the calling process */
+    //	uid_t uid;
+    log_struct(context, uid, %d, );
+
+    /** Group ID of the calling process */
+    //	gid_t gid;
+    log_struct(context, gid, %d, );
+
+    /** Thread ID of the calling process */
+    //	pid_t pid;
+    log_struct(context, pid, %d, );
+
+    /** Private filesystem data */
+    //	void *private_data;
+    log_struct(context, private_data, %08x, );
+    log_struct(((struct sfs_state *)context->private_data), logfile, %08x, );
+    log_struct(((struct sfs_state *)context->private_data), diskfile, %s, );
+	
+    /** Umask of the calling process (introduced in version 2.8) */
+    //	mode_t umask;
+    log_struct(context, umask, %05o, );
+}
+
+// struct fuse_conn_info contains information about the socket
+// connection being used.  I don't actually use any of this
+// information in sfs
+static void log_conn(struct fuse_conn_info *conn)
+{
+    log_msg("    conn:\n");
+    
+    /** Major version of the protocol (read-only) */
+    // unsigned proto_major;
+    log_struct(conn, proto_major, %d, );
+
+    /** Minor version of the protocol (read-only) */
+    // unsigned proto_minor;
+    log_struct(conn, proto_minor, %d, );
+
+    /** Is asynchronous read supported (read-write) */
+    // unsigned async_read;
+    log_struct(conn, async_read, %d, );
+
+    /** Maximum size of the write buffer */
+    // unsigned max_write;
+    log_struct(conn, max_write, %d, );
+    
+    /** Maximum readahead */
+    // unsigned max_readahead;
+    log_struct(conn, max_readahead, %d, );
+    
+    /** Capability flags, that the kernel supports */
+    // unsigned capable;
+    log_struct(conn, capable, %08x, );
+    
+    /** Capability flags, that the filesystem wants to enable */
+    // unsigned want;
+    log_struct(conn, want, %08x, );
+    
+    /** For future use. */
+    // unsigned reserved[23];
+}
 
 ///////////////////////////////////////////////////////////
 //
@@ -78,158 +164,15 @@ void *sfs_init(struct fuse_conn_info *conn)
     log_conn(conn);
     log_fuse_context(fuse_get_context());
 
-    disk_open(SFS_DATA->diskfile);
-    struct stat *statbuf = (struct stat*)malloc(sizeof(struct stat));
-    lstat(SFS_DATA->diskfile, statbuf);
-
-    // Check for first time initialization.
-    if (statbuf->st_size == 0) {
-
-    	// Step 1: Write super block to disk file
-    	sfs_superblock sb = {
-    			.magic = SFS_MAGIC_NUM,
-    			.num_data_blocks = SFS_NBLOCKS_DATA,
-				.num_free_blocks = SFS_NBLOCKS_DATA,
-				.num_inodes = SFS_NINODES,
-				.bitmap_inode_blocks = SFS_BLOCK_INODE_BITMAP,
-				.bitmap_data_blocks = SFS_BLOCK_DATA_BITMAP,
-				.inode_root = 0
-    	};
-
-    	block_write_padded(SFS_BLOCK_SUPERBLOCK, &sb, sizeof(sfs_superblock));
-
-    	//Step 2: Write inode bitmap
-    	int i = 0;
-    	char bitmap_inodes[BLOCK_SIZE];
-    	memset(bitmap_inodes, '1', sizeof(bitmap_inodes));
-    	for (i = 0; i < SFS_NBLOCKS_INODE_BITMAP; ++i) {
-        	block_write((SFS_BLOCK_INODE_BITMAP + i), bitmap_inodes);
-    	}
-
-    	//Step 3: Write data bitmap
-    	char bitmap_data[BLOCK_SIZE];
-    	memset(bitmap_data, '1', sizeof(bitmap_data));
-    	for (i = 0; i < SFS_NBLOCKS_DATA_BITMAP; ++i) {
-        	block_write((SFS_BLOCK_DATA_BITMAP + i), bitmap_data);
-    	}
-
-    	//Step 4: Write inode blocks
-    	char buffer_inode[BLOCK_SIZE];
-    	memset(buffer_inode, '0', sizeof(buffer_inode));
-    	for (i = 0; i < SFS_NBLOCKS_INODE; ++i) {
-        	block_write((SFS_BLOCK_INODES + i), buffer_inode);
-    	}
-
-    	//Step 5: Write data blocks
-    	char buffer_data[BLOCK_SIZE];
-    	memset(buffer_data, '0', sizeof(buffer_data));
-    	for (i = 0; i < SFS_NBLOCKS_DATA; ++i) {
-        	block_write((SFS_BLOCK_DATA + i), buffer_data);
-    	}
-
-    	//Step 6: Initialize the root inode
-    	if (block_read(SFS_BLOCK_INODE_BITMAP, bitmap_inodes) > 0) {
-    		bitmap_inodes[0] = '0';
-    		block_write(SFS_BLOCK_INODE_BITMAP, bitmap_inodes);
-    	}
-
-		if (block_read(SFS_BLOCK_DATA_BITMAP, bitmap_data) > 0) {
-			bitmap_data[0] = '0';
-			block_write(SFS_BLOCK_DATA_BITMAP, bitmap_data);
-		}
-
-		sfs_inode_t inode;
-		memset(&inode, 0, sizeof(inode));
-		inode.atime = inode.ctime = inode.mtime = time(NULL);
-		inode.nblocks = 1;
-		inode.ino = 0;
-		inode.blocks[0] = SFS_BLOCK_DATA;
-		inode.size = 0;
-		inode.nlink = 0;
-		inode.mode = S_IFDIR;
-
-		block_write_padded(SFS_BLOCK_INODES, &inode, sizeof(sfs_inode_t));
+    struct sfs_state *sfs = fuse_get_context()->private_data;
+    int retstat = libsfs_mount_volume(sfs);
+    if (retstat < 0) {
+    	log_msg("\nsfs_init() can't mount %s: %s", sfs->diskfile, strerror(-retstat));
+    	fprintf(stderr, "can't mount %s: %s\n", sfs->diskfile, strerror(-retstat));
+    	exit(EXIT_FAILURE);
     }
 
-    // Here we start the init process
-
-    // Step 1: Cache the state of inodes availability in fuse context
-
-    SFS_DATA->state_inodes = (sfs_free_list*)malloc(SFS_NINODES * sizeof(sfs_free_list));
-    memset(SFS_DATA->state_inodes, 0, SFS_NINODES * sizeof(sfs_free_list));
-
-    int i = 0, inodes_cached = 0;
-	char bitmap_inodes[BLOCK_SIZE];
-	int num_used_inodes = 0;
-	for (i = 0; i < SFS_NBLOCKS_INODE_BITMAP; ++i) {
-		block_read((SFS_BLOCK_INODE_BITMAP + i), bitmap_inodes);
-
-		int block_ptr = 0;
-		while((block_ptr < BLOCK_SIZE) && (inodes_cached < SFS_NINODES)) {
-			sfs_free_list *node = SFS_DATA->state_inodes + inodes_cached;
-			node->id = inodes_cached;
-			INIT_LIST_HEAD(&(node->node));
-			if (bitmap_inodes[block_ptr] == '1') {
-				if (SFS_DATA->free_inodes == NULL) {
-					SFS_DATA->free_inodes = &(node->node);
-				} else {
-					list_add_tail(&(node->node), SFS_DATA->free_inodes);
-				}
-			} else {
-				num_used_inodes++;
-			}
-
-			++inodes_cached;
-			++block_ptr;
-		}
-	}
-
-    log_msg("\nsfs_init() num_used_inodes = %d", num_used_inodes);
-
-    // Step 2: Cache the state of data block's availability in fuse context
-
-    SFS_DATA->state_data_blocks = (sfs_free_list*)malloc(SFS_NBLOCKS_DATA * sizeof(sfs_free_list));
-    memset(SFS_DATA->state_data_blocks, 0, SFS_NBLOCKS_DATA * sizeof(sfs_free_list));
-
-	int data_blocks_cached = 0;
-	char bitmap_data[BLOCK_SIZE];
-	int num_used_data_blocks = 0;
-	for (i = 0; i < SFS_NBLOCKS_DATA_BITMAP; ++i) {
-		block_read((SFS_BLOCK_DATA_BITMAP + i), bitmap_data);
-
-		int block_ptr = 0;
-		while ((block_ptr < BLOCK_SIZE) && (data_blocks_cached < SFS_NBLOCKS_DATA)) {
-			sfs_free_list *node = SFS_DATA->state_data_blocks + data_blocks_cached;
-			node->id = data_blocks_cached;
-			INIT_LIST_HEAD(&(node->node));
-			if (bitmap_data[block_ptr] == '1') {
-				if (SFS_DATA->free_data_blocks == NULL) {
-				    log_msg("\nsfs_init() here it is null");
-					SFS_DATA->free_data_blocks = &(node->node);
-				} else {
-					list_add_tail(&(node->node), SFS_DATA->free_data_blocks);
-				}
-			} else {
-				++num_used_data_blocks;
-			}
-
-			++data_blocks_cached;
-			++block_ptr;
-		}
-	}
-
-    log_msg("\nsfs_init() num_used_data_blocks = %d", num_used_data_blocks);
-
-    // Step 3: Cache root's inode number
-    char buffer_super_block[BLOCK_SIZE];
-	block_read(SFS_BLOCK_SUPERBLOCK, buffer_super_block);
-	sfs_superblock sb;
-	memcpy(&sb, buffer_super_block, sizeof(sb));
-
-	SFS_DATA->ino_root = sb.inode_root;
-    log_msg("\nsfs_init() ino_root = %d", SFS_DATA->ino_root);
-
-    return SFS_DATA;
+    return sfs;
 }
 
 /**
@@ -242,16 +185,7 @@ void *sfs_init(struct fuse_conn_info *conn)
 void sfs_destroy(void *userdata)
 {
     log_msg("\nsfs_destroy(userdata=0x%08x)\n", userdata);
-    disk_close();
-
-    free(SFS_DATA->state_inodes);
-    SFS_DATA->state_inodes = NULL;
-
-    free(SFS_DATA->state_data_blocks);
-    SFS_DATA->state_data_blocks = NULL;
-
-    SFS_DATA->free_inodes = NULL;
-    SFS_DATA->free_data_blocks = NULL;
+    libsfs_unmount_volume(userdata);
 }
 
 /** Get file attributes.
@@ -268,7 +202,7 @@ int sfs_getattr(const char *path, struct stat *statbuf)
     log_msg("\nsfs_getattr(path=\"%s\", statbuf=0x%08x)\n",
 	  path, statbuf);
     
-    uint32_t ino = path_2_ino(path);
+    uint64_t ino = path_2_ino(path);
     if (ino != SFS_INVALID_INO) {
     	log_msg("\nsfs_getattr path found");
     	sfs_inode_t inode;
@@ -300,9 +234,14 @@ int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     int retstat = 0;
     log_msg("\nsfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n",
 	    path, mode, fi);
+
+    if ((retstat = sfs_check_writable(path)) < 0) {
+	return retstat;
+    }
     
-    uint32_t ino = create_inode(path, mode);
-    log_msg("\nFile creation success inode = %d", ino);
+    uint64_t ino = create_inode(path, mode);
+    log_msg("\nFile creation success inode = %llu", ino);
+    fi->fh = (uint64_t)(uintptr_t)calloc(1, sizeof(sfs_readahead_t));
 
     return retstat;
 }
@@ -312,6 +251,9 @@ int sfs_unlink(const char *path)
 {
     int retstat = 0;
     log_msg("sfs_unlink(path=\"%s\")\n", path);
+    if ((retstat = sfs_check_writable(path)) < 0) {
+	return retstat;
+    }
     retstat = remove_inode(path);
     
     return retstat;
@@ -333,11 +275,17 @@ int sfs_open(const char *path, struct fuse_file_info *fi)
     log_msg("\nsfs_open(path\"%s\", fi=0x%08x)\n",
 	    path, fi);
 
-	uint32_t ino = path_2_ino(path);
+    if (((fi->flags & O_ACCMODE) != O_RDONLY) && (sfs_check_writable(path) < 0)) {
+	return -EROFS;
+    }
+
+	uint64_t ino = path_2_ino(path);
 	if (ino != SFS_INVALID_INO) {
 		sfs_inode_t inode;
 		get_inode(ino, &inode);
 		if (S_ISREG(inode.mode)) {
+			// Access pattern of this open file, for readahead
+			fi->fh = (uint64_t)(uintptr_t)calloc(1, sizeof(sfs_readahead_t));
 			retstat = 0;
 		}
 	} else {
@@ -367,7 +315,37 @@ int sfs_release(const char *path, struct fuse_file_info *fi)
     log_msg("\nsfs_release(path=\"%s\", fi=0x%08x)\n",
 	  path, fi);
     
-    // No saved data related to any file which needs to be freed.
+    // Drop the readahead state and write back the inodes which were
+    // modified through the file.
+    free((sfs_readahead_t*)(uintptr_t)fi->fh);
+    fi->fh = 0;
+    flush_inodes();
+
+    return retstat;
+}
+
+/** Synchronize file contents
+ *
+ * If the datasync parameter is non-zero, then only the user data
+ * should be flushed, not the meta data.
+ *
+ * Changed in version 2.2
+ */
+int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    log_msg("\nsfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n",
+	    path, datasync, fi);
+
+    // The file's data can still be in its write buffer without blocks,
+    // its inode (size, block list, lazy timestamps) and indirect blocks in
+    // the metadata cache. Both go out before the disk file is synced.
+    uint64_t ino = path_2_ino(path);
+    if (ino == SFS_INVALID_INO) {
+	return -ENOENT;
+    }
+    sync_inode(ino);
+    retstat = disk_sync();
 
     return retstat;
 }
@@ -389,7 +367,7 @@ int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
     log_msg("\nsfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
 	    path, buf, size, offset, fi);
 
-	uint32_t ino = path_2_ino(path);
+	uint64_t ino = path_2_ino(path);
 	if (ino != SFS_INVALID_INO) {
 		log_msg("\nsfs_read path found");
 		sfs_inode_t inode;
@@ -397,6 +375,9 @@ int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse
 
 		log_msg("\nsfs_read got the inode");
 
+		if (fi->fh != 0) {
+			readahead_inode(&inode, (sfs_readahead_t*)(uintptr_t)fi->fh, size, offset);
+		}
 		retstat = read_inode(&inode, buf, size, offset);
 		log_msg("\nData read = %s", buf);
 	} else {
@@ -422,7 +403,11 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
     log_msg("\nsfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
 	    path, buf, size, offset, fi);
 
-	uint32_t ino = path_2_ino(path);
+    if ((retstat = sfs_check_writable(path)) < 0) {
+	return retstat;
+    }
+
+	uint64_t ino = path_2_ino(path);
 	if (ino != SFS_INVALID_INO) {
 		log_msg("\nsfs_write path found");
 		sfs_inode_t inode;
@@ -437,6 +422,163 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
     return retstat;
 }
 
+/** Change the size of a file */
+int sfs_truncate(const char *path, off_t newsize)
+{
+    int retstat = 0;
+    log_msg("\nsfs_truncate(path=\"%s\", newsize=%lld)\n",
+	    path, newsize);
+
+    if ((retstat = sfs_check_writable(path)) < 0) {
+	return retstat;
+    }
+
+	uint64_t ino = path_2_ino(path);
+	if (ino != SFS_INVALID_INO) {
+		sfs_inode_t inode;
+		get_inode(ino, &inode);
+
+		if (S_ISDIR(inode.mode)) {
+			retstat = -EISDIR;
+		} else if (newsize < 0) {
+			retstat = -EINVAL;
+		} else {
+			retstat = truncate_inode(&inode, newsize);
+		}
+	} else {
+		log_msg("\nsfs_truncate path not found");
+		retstat = -ENOENT;
+	}
+
+    return retstat;
+}
+
+/**
+ * Change the size of an open file
+ *
+ * This method is called instead of the truncate() method if the
+ * truncation was invoked from an ftruncate() system call.
+ *
+ * Introduced in version 2.5
+ */
+int sfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+    log_msg("\nsfs_ftruncate(path=\"%s\", offset=%lld, fi=0x%08x)\n",
+	    path, offset, fi);
+
+    return sfs_truncate(path, offset);
+}
+
+/**
+ * Allocates space for an open file
+ *
+ * Only plain preallocation, FALLOC_FL_KEEP_SIZE and FALLOC_FL_PUNCH_HOLE
+ * (which has to come with FALLOC_FL_KEEP_SIZE) are supported.
+ *
+ * Introduced in version 2.9.1
+ */
+int sfs_fallocate(const char *path, int mode, off_t offset, off_t length,
+		  struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    log_msg("\nsfs_fallocate(path=\"%s\", mode=0x%x, offset=%lld, length=%lld, fi=0x%08x)\n",
+	    path, mode, offset, length, fi);
+
+    if ((retstat = sfs_check_writable(path)) < 0) {
+	return retstat;
+    }
+
+	uint64_t ino = path_2_ino(path);
+	if (ino != SFS_INVALID_INO) {
+		sfs_inode_t inode;
+		get_inode(ino, &inode);
+
+		if (S_ISDIR(inode.mode)) {
+			retstat = -EISDIR;
+		} else if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+			retstat = punch_hole_inode(&inode, offset, length);
+		} else if ((mode & ~FALLOC_FL_KEEP_SIZE) == 0) {
+			retstat = fallocate_inode(&inode, mode & FALLOC_FL_KEEP_SIZE, offset, length);
+		} else {
+			retstat = -EOPNOTSUPP;
+		}
+	} else {
+		log_msg("\nsfs_fallocate path not found");
+		retstat = -ENOENT;
+	}
+
+    return retstat;
+}
+/**
+ * Ioctl
+ *
+ * SFS_IOC_SEEK_DATA and SFS_IOC_SEEK_HOLE do what lseek() SEEK_DATA and
+ * SEEK_HOLE do, and SFS_IOC_CLONE_RANGE what copy_file_range() and reflink
+ * cloning do, which this FUSE version has no operations for.
+ * SFS_IOC_SNAPSHOT_CREATE and SFS_IOC_SNAPSHOT_DELETE take and remove a
+ * snapshot of the whole file system, on whichever file they are issued.
+ *
+ * Introduced in version 2.8
+ */
+int sfs_ioctl(const char *path, int cmd, void *arg,
+	      struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+    int retstat = 0;
+    log_msg("\nsfs_ioctl(path=\"%s\", cmd=0x%x, arg=0x%08x, fi=0x%08x, flags=0x%x, data=0x%08x)\n",
+	    path, cmd, arg, fi, flags, data);
+
+    if (((unsigned int)cmd == SFS_IOC_SNAPSHOT_CREATE) || ((unsigned int)cmd == SFS_IOC_SNAPSHOT_DELETE)) {
+	char *name = data;
+	name[SFS_MAX_LENGTH_FILE_NAME - 1] = '\0';
+	return ((unsigned int)cmd == SFS_IOC_SNAPSHOT_CREATE) ? snapshot_fs(name) : delete_snapshot(name);
+    }
+
+    if (((unsigned int)cmd != SFS_IOC_SEEK_DATA) && ((unsigned int)cmd != SFS_IOC_SEEK_HOLE) &&
+	((unsigned int)cmd != SFS_IOC_CLONE_RANGE)) {
+	return -ENOTTY;
+    }
+    if (((unsigned int)cmd == SFS_IOC_CLONE_RANGE) && ((retstat = sfs_check_writable(path)) < 0)) {
+	return retstat;
+    }
+
+	uint64_t ino = path_2_ino(path);
+	if (ino != SFS_INVALID_INO) {
+		sfs_inode_t inode;
+		get_inode(ino, &inode);
+
+		if ((unsigned int)cmd == SFS_IOC_CLONE_RANGE) {
+			sfs_clone_range_t *range = data;
+			range->src_path[SFS_CLONE_PATH_MAX - 1] = '\0';
+
+			uint64_t ino_src = path_2_ino(range->src_path);
+			sfs_inode_t inode_src;
+			if (ino_src == SFS_INVALID_INO) {
+				retstat = -ENOENT;
+			} else {
+				get_inode(ino_src, &inode_src);
+				if (S_ISDIR(inode.mode) || S_ISDIR(inode_src.mode)) {
+					retstat = -EISDIR;
+				} else {
+					retstat = copy_inode_range(&inode_src, &inode, range->src_offset,
+							range->dest_offset, range->src_length);
+				}
+			}
+		} else {
+			int64_t *offset = data;
+			off_t found = seek_inode(&inode, *offset, (unsigned int)cmd == SFS_IOC_SEEK_DATA);
+			if (found < 0) {
+				retstat = found;
+			} else {
+				*offset = found;
+			}
+		}
+	} else {
+		log_msg("\nsfs_ioctl path not found");
+		retstat = -ENOENT;
+	}
+
+    return retstat;
+}
 
 /** Create a directory */
 int sfs_mkdir(const char *path, mode_t mode)
@@ -445,8 +587,12 @@ int sfs_mkdir(const char *path, mode_t mode)
     log_msg("\nsfs_mkdir(path=\"%s\", mode=0%3o)\n",
 	    path, mode);
 
-    uint32_t ino = create_inode(path, mode);
-    log_msg("\nFile creation success inode = %d", ino);
+    if ((retstat = sfs_check_writable(path)) < 0) {
+	return retstat;
+    }
+
+    uint64_t ino = create_inode(path, mode | S_IFDIR);
+    log_msg("\nFile creation success inode = %llu", ino);
     
     return retstat;
 }
@@ -477,7 +623,7 @@ int sfs_opendir(const char *path, struct fuse_file_info *fi)
     log_msg("\nsfs_opendir(path=\"%s\", fi=0x%08x)\n",
 	  path, fi);
 
-	uint32_t ino = path_2_ino(path);
+	uint64_t ino = path_2_ino(path);
 	if (ino != SFS_INVALID_INO) {
 		sfs_inode_t inode;
 		get_inode(ino, &inode);
@@ -521,7 +667,7 @@ int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 
     filler(buf, ".", NULL, 0);
 	filler(buf, "..", NULL, 0);
-	uint32_t ino = path_2_ino(path);
+	uint64_t ino = path_2_ino(path);
 	if (ino != SFS_INVALID_INO) {
 		log_msg("\nsfs_readdir path found");
 		sfs_inode_t inode;
@@ -567,6 +713,11 @@ struct fuse_operations sfs_oper = {
   .release = sfs_release,
   .read = sfs_read,
   .write = sfs_write,
+  .fsync = sfs_fsync,
+  .truncate = sfs_truncate,
+  .ftruncate = sfs_ftruncate,
+  .fallocate = sfs_fallocate,
+  .ioctl = sfs_ioctl,
 
   .rmdir = sfs_rmdir,
   .mkdir = sfs_mkdir,
@@ -576,42 +727,157 @@ struct fuse_operations sfs_oper = {
   .releasedir = sfs_releasedir
 };
 
+// sfs specific mount options, everything else is passed on to fuse
+#define SFS_OPT(t, p, v) { t, offsetof(struct sfs_state, p), v }
+
+static struct fuse_opt sfs_opts[] = {
+    SFS_OPT("lazytime", lazytime, 1),
+    SFS_OPT("lazytime_expire=%d", lazytime_expire, 0),
+    SFS_OPT("nblocks=%llu", format_blocks, 0),
+    SFS_OPT("ninodes=%llu", format_inodes, 0),
+    SFS_OPT("nodiscard", nodiscard, 1),
+    SFS_OPT("seqalloc", seqalloc, 1),
+    SFS_OPT("compress", compress, 1),
+    SFS_OPT("dedup", dedup, 1),
+    SFS_OPT("checksum", checksum, 1),
+    SFS_OPT("backend=%s", backend, 0),
+    SFS_OPT("stripe_unit=%d", stripe_unit, 0),
+    SFS_OPT("fast_blocks=%d", fast_blocks, 0),
+    SFS_OPT("ram", ram, 1),
+    SFS_OPT("hugepages", hugepages, 1),
+    SFS_OPT("simulate=%s", simulate, 0),
+    SFS_OPT("sim_latency=%d", sim_latency, 0),
+    SFS_OPT("sim_bandwidth=%d", sim_bandwidth, 0),
+    SFS_OPT("sim_qdepth=%d", sim_qdepth, 0),
+    FUSE_OPT_END
+};
+
 void sfs_usage()
 {
-    fprintf(stderr, "usage:  sfs [FUSE and mount options] diskFile mountPoint\n");
+    fprintf(stderr, "usage:  sfs [FUSE and mount options] diskFile[:diskFile...] mountPoint\n");
+    fprintf(stderr, "        sfs -o ram [FUSE and mount options] mountPoint\n");
+    fprintf(stderr, "sfs options:\n");
+    fprintf(stderr, "    -o lazytime            keep timestamp only inode updates in memory\n");
+    fprintf(stderr, "    -o lazytime_expire=N   write lazy timestamps after N seconds (default %d)\n", SFS_LAZYTIME_EXPIRE);
+    fprintf(stderr, "    -o nblocks=N           size in blocks of a new disk file (default %d)\n", SFS_DEFAULT_NBLOCKS);
+    fprintf(stderr, "    -o ninodes=N           inodes created with a new disk file (default %d), more are added as needed\n", SFS_DEFAULT_NINODES);
+    fprintf(stderr, "    -o nodiscard           don't punch freed blocks out of the disk file\n");
+    fprintf(stderr, "    -o seqalloc            append file data to a log of segments, cleaned in the background\n");
+    fprintf(stderr, "    -o compress            store file data compressed where it saves space\n");
+    fprintf(stderr, "    -o dedup               store blocks with the same data written since mount only once\n");
+    fprintf(stderr, "    -o checksum            checksum file data and check it on every read\n");
+    fprintf(stderr, "    -o backend=NAME        keep blocks with file (default), mmap, ram (lost on unmount), io_uring,\n");
+    fprintf(stderr, "                           stripe (over all diskFiles, the default with more than one),\n");
+    fprintf(stderr, "                           mirror (a copy on each diskFile) or tier (fast:slow diskFile,\n");
+    fprintf(stderr, "                           hot data on the fast one)\n");
+    fprintf(stderr, "    -o stripe_unit=N       blocks in a row on one diskFile with stripe (default 128)\n");
+    fprintf(stderr, "    -o fast_blocks=N       blocks on the fast diskFile of a new tier volume (default nblocks/%d)\n", SFS_TIER_DEFAULT_FAST_SHARE);
+    fprintf(stderr, "    -o ram                 volume of nblocks in memory only, no diskFile, same as backend=ram\n");
+    fprintf(stderr, "    -o hugepages           back a ram volume with huge pages\n");
+    fprintf(stderr, "    -o simulate=MODEL      make I/O as slow as on an hdd or ssd\n");
+    fprintf(stderr, "    -o sim_latency=US      per I/O latency of the simulated device in microseconds\n");
+    fprintf(stderr, "    -o sim_bandwidth=MB    bandwidth of the simulated device in MB/s\n");
+    fprintf(stderr, "    -o sim_qdepth=N        I/Os the simulated device works on at once\n");
     abort();
 }
 
+/*
+ * Absolute paths of the ':' separated disk files, the ones which don't
+ * exist yet are kept as given.
+ */
+static char* sfs_realpaths(const char *list)
+{
+    char *paths = strdup(list);
+    char *result = calloc(1, 1);
+    char *saveptr = NULL;
+    char *name = NULL;
+
+    for (name = strtok_r(paths, ":", &saveptr); name != NULL; name = strtok_r(NULL, ":", &saveptr)) {
+	char *path = realpath(name, NULL);
+	const char *p = (path != NULL) ? path : name;
+	result = realloc(result, strlen(result) + strlen(p) + 2);
+	if (result[0] != '\0') {
+	    strcat(result, ":");
+	}
+	strcat(result, p);
+	free(path);
+    }
+    free(paths);
+
+    return result;
+}
+
+// diskFile and mountPoint, in the order given, see sfs_opt_proc()
+static const char *sfs_args[2];
+static int sfs_num_args = 0;
+
+/*
+ * Keeps the non-option arguments from fuse, main() gives it back the
+ * mountPoint once it knows whether a diskFile came before it.
+ */
+static int sfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+    if ((key == FUSE_OPT_KEY_NONOPT) && (sfs_num_args < 2)) {
+	sfs_args[sfs_num_args++] = arg;
+	return 0;
+    }
+
+    return 1;
+}
+
 int main(int argc, char *argv[])
 {
     int fuse_stat;
     struct sfs_state *sfs_data;
     
     // sanity checking on the command line
-    if ((argc < 3) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-'))
+    if ((argc < 2) || (argv[argc-1][0] == '-'))
 	sfs_usage();
 
-    sfs_data = malloc(sizeof(struct sfs_state));
+    sfs_data = calloc(1, sizeof(struct sfs_state));
     if (sfs_data == NULL) {
 	perror("main calloc");
 	abort();
     }
 
-    // Pull the diskfile and save it in internal data
-    sfs_data->diskfile = realpath(argv[argc-2], NULL); // Save the absolute path of the diskfile
-    printf("%s", sfs_data->diskfile);
-    argv[argc-2] = argv[argc-1];
-    argv[argc-1] = NULL;
-    argc--;
-    
     sfs_data->logfile = log_open();
-    sfs_data->free_data_blocks = NULL;
-    sfs_data->free_inodes = NULL;
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, sfs_data, sfs_opts, sfs_opt_proc) == -1) {
+	sfs_usage();
+    }
+    if (sfs_data->ram) {
+	if ((sfs_data->backend != NULL) && (strcmp(sfs_data->backend, "ram") != 0)) {
+	    sfs_usage();
+	}
+	sfs_data->backend = "ram";
+    }
+    if (backend_find(sfs_data->backend) == NULL) {
+	fprintf(stderr, "unknown backend %s\n", sfs_data->backend);
+	sfs_usage();
+    }
+
+    // A ram volume has no use for a diskFile, it may be left out
+    const char *mountpoint = NULL;
+    if (sfs_num_args == 2) {
+	sfs_data->diskfile = sfs_realpaths(sfs_args[0]); // Save the absolute paths of the diskfiles
+	printf("%s", sfs_data->diskfile);
+	mountpoint = sfs_args[1];
+	if ((sfs_data->backend == NULL) && (strchr(sfs_data->diskfile, ':') != NULL)) {
+	    sfs_data->backend = "stripe";
+	}
+    } else if ((sfs_num_args == 1) && (sfs_data->backend != NULL) && (strcmp(sfs_data->backend, "ram") == 0)) {
+	mountpoint = sfs_args[0];
+    } else {
+	sfs_usage();
+    }
+    fuse_opt_add_arg(&args, mountpoint);
     
     // turn over control to fuse
-    fprintf(stderr, "about to call fuse_main, %s \n", sfs_data->diskfile);
-    fuse_stat = fuse_main(argc, argv, &sfs_oper, sfs_data);
+    fprintf(stderr, "about to call fuse_main, %s \n", (sfs_data->diskfile != NULL) ? sfs_data->diskfile : "ram");
+    fuse_stat = fuse_main(args.argc, args.argv, &sfs_oper, sfs_data);
     fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+    fuse_opt_free_args(&args);
     
     return fuse_stat;
 }
@@ -0,0 +1,1751 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Tests of the file system, run in process on top of libsfs by `make
+  check`. Every test formats a volume of its own in the current
+  directory, works on it through libsfs and the inode layer and mostly
+  checks what it wrote again after a remount. The disk files are removed
+  afterwards.
+
+  usage: sfs_test [test...]
+
+  Without names all tests run, the exit status is 0 if they all pass.
+*/
+
+#define _GNU_SOURCE // SEEK_DATA, SEEK_HOLE
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "inode.h"
+#include "libsfs.h"
+
+#define TEST_DISKFILE "sfs_test.img"
+#define TEST_DISKFILE2 "sfs_test2.img" // Second disk file of striped, mirrored and tiered volumes
+#define TEST_DISKFILES TEST_DISKFILE ":" TEST_DISKFILE2
+#define TEST_NBLOCKS 32768 // 16MB, 8 groups
+#define TEST_OPTIONS "nblocks=32768" // TEST_NBLOCKS
+
+typedef struct {
+    const char *name;
+    void (*run)();
+} sfs_test;
+
+static int test_failed = 0; // Checks the running test failed
+static uint32_t test_seed = 2463534242u;
+
+/*
+ * Counts a failed check and tells where it is. Returns cond, so a test
+ * can stop when it can't go on.
+ */
+static int test_check(int cond, const char *what, int line)
+{
+    if (!cond) {
+	fprintf(stderr, "test.c:%d: %s failed (errno %d, %s)\n", line, what, errno, strerror(errno));
+	++test_failed;
+    }
+
+    return cond;
+}
+
+#define CHECK(cond) test_check((cond) != 0, #cond, __LINE__)
+
+static void test_remove()
+{
+    unlink(TEST_DISKFILE);
+    unlink(TEST_DISKFILE2);
+}
+
+/*
+ * Mounts diskfile with options, the tests can't go on without it.
+ */
+static sfs_volume* test_mount(const char *diskfile, const char *options)
+{
+    sfs_volume *vol = libsfs_mount(diskfile, options);
+    if (vol == NULL) {
+	fprintf(stderr, "sfs_test: libsfs_mount(%s, %s) failed: %s\n", (diskfile != NULL) ? diskfile : "NULL",
+		options, strerror(errno));
+	test_remove();
+	exit(EXIT_FAILURE);
+    }
+
+    return vol;
+}
+
+/*
+ * Mounts a new volume, on TEST_DISKFILE unless diskfile says otherwise.
+ */
+static sfs_volume* test_format(const char *diskfile, const char *options)
+{
+    test_remove();
+
+    return test_mount(diskfile, options);
+}
+
+static sfs_volume* test_remount(sfs_volume *vol, const char *diskfile, const char *options)
+{
+    libsfs_unmount(vol);
+
+    return test_mount(diskfile, options);
+}
+
+/*
+ * Deterministic xorshift, incompressible data that is the same on every
+ * run.
+ */
+static void test_fill(char *buf, size_t size)
+{
+    size_t i = 0;
+    for (i = 0; i < size; ++i) {
+	test_seed ^= test_seed << 13;
+	test_seed ^= test_seed >> 17;
+	test_seed ^= test_seed << 5;
+	buf[i] = (char)test_seed;
+    }
+}
+
+/*
+ * Makes path a file holding size bytes of buf.
+ */
+static void test_write(sfs_volume *vol, const char *path, const char *buf, size_t size)
+{
+    sfs_file *file = libsfs_open(vol, path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (CHECK(file != NULL)) {
+	CHECK(libsfs_pwrite(file, buf, size, 0) == (ssize_t)size);
+	libsfs_close(file);
+    }
+}
+
+/*
+ * Whether path holds exactly the size bytes of buf.
+ */
+static int test_verify(sfs_volume *vol, const char *path, const char *buf, size_t size)
+{
+    sfs_file *file = libsfs_open(vol, path, O_RDONLY, 0);
+    char *data = malloc(size + 1);
+    struct stat statbuf;
+    int same = 0;
+
+    if (file != NULL) {
+	same = (libsfs_fstat(file, &statbuf) == 0) && ((size_t)statbuf.st_size == size) &&
+		(libsfs_pread(file, data, size + 1, 0) == (ssize_t)size) && (memcmp(data, buf, size) == 0);
+	libsfs_close(file);
+    }
+    free(data);
+
+    return same;
+}
+
+/*
+ * The inode of path, its number is SFS_INVALID_INO if there is none.
+ */
+static void test_inode(sfs_volume *vol, const char *path, sfs_inode_t *inode)
+{
+    sfs_set_context(vol);
+    memset(inode, 0, sizeof(sfs_inode_t));
+    uint64_t ino = path_2_ino(path);
+    if (ino != SFS_INVALID_INO) {
+	get_inode(ino, inode);
+    }
+}
+
+/*
+ * Format, write files of all sizes in a few directories, remount and read
+ * them back.
+ */
+static void test_roundtrip()
+{
+    static const size_t sizes[] = { 0, 1, 100, 512, 4000, 70000, 3000000 };
+    char *buf = malloc(3000000);
+    char path[PATH_MAX];
+    size_t i = 0;
+
+    test_fill(buf, 3000000);
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS);
+    CHECK(libsfs_mkdir(vol, "/a", 0755) == 0);
+    CHECK(libsfs_mkdir(vol, "/a/b", 0755) == 0);
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+	snprintf(path, sizeof(path), "/a/b/f%zu", sizes[i]);
+	test_write(vol, path, buf + i, sizes[i]);
+    }
+    test_write(vol, "/top", buf, 1000);
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+	snprintf(path, sizeof(path), "/a/b/f%zu", sizes[i]);
+	CHECK(test_verify(vol, path, buf + i, sizes[i]));
+    }
+    CHECK(test_verify(vol, "/top", buf, 1000));
+    libsfs_unmount(vol);
+
+    free(buf);
+}
+
+/*
+ * Inode updates stay in the cached inode table block until it is written
+ * back, and are there after a remount.
+ */
+static void test_writeback()
+{
+    char block[BLOCK_SIZE];
+    char path[PATH_MAX];
+    sfs_inode_t inode;
+    int i = 0;
+
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS);
+    for (i = 0; i < 100; ++i) {
+	snprintf(path, sizeof(path), "/f%d", i);
+	test_write(vol, path, path, strlen(path));
+    }
+
+    test_inode(vol, "/f7", &inode);
+    inode.mode = S_IFREG | 0600;
+    update_inode_data(inode.ino, &inode);
+    sfs_inode_t *on_disk = (sfs_inode_t*)(block + (inode.ino % SFS_INODES_PER_BLOCK) * SFS_INODE_SIZE);
+    CHECK(block_read(inode.ino / SFS_INODES_PER_BLOCK, block) == BLOCK_SIZE);
+    CHECK(on_disk->mode == (S_IFREG | 0644));
+    flush_inodes();
+    CHECK(block_read(inode.ino / SFS_INODES_PER_BLOCK, block) == BLOCK_SIZE);
+    CHECK(on_disk->mode == (S_IFREG | 0600));
+
+    for (i = 0; i < 100; ++i) {
+	snprintf(path, sizeof(path), "/f%d", i);
+	test_inode(vol, path, &inode);
+	inode.mode = S_IFREG | 0640;
+	update_inode_data(inode.ino, &inode);
+    }
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    for (i = 0; i < 100; ++i) {
+	snprintf(path, sizeof(path), "/f%d", i);
+	test_inode(vol, path, &inode);
+	CHECK(inode.mode == (S_IFREG | 0640));
+	CHECK(test_verify(vol, path, path, strlen(path)));
+    }
+    libsfs_unmount(vol);
+}
+
+static long long test_now_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void* test_sync_thread(void *arg)
+{
+    libsfs_sync((sfs_volume*)arg);
+    return NULL;
+}
+
+/*
+ * Writing dirty inode table blocks back doesn't hold up lookups of cached
+ * ones: a stat takes far less than the write back pass running alongside.
+ */
+static void test_writeback_io()
+{
+    char path[PATH_MAX];
+    struct stat statbuf;
+    sfs_inode_t inode;
+    pthread_t syncer;
+    long long slowest = 0;
+    int i = 0;
+
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS);
+    CHECK(libsfs_mkdir(vol, "/d", 0755) == 0);
+    for (i = 0; i < 100; ++i) {
+	snprintf(path, sizeof(path), "/d/f%d", i);
+	test_write(vol, path, path, strlen(path));
+    }
+
+    // Every I/O takes 10ms, one after the other
+    vol = test_remount(vol, TEST_DISKFILE, "simulate=ssd,sim_latency=10000,sim_qdepth=1");
+    for (i = 0; i < 100; ++i) {
+	snprintf(path, sizeof(path), "/d/f%d", i);
+	CHECK(libsfs_stat(vol, path, &statbuf) == 0);
+	test_inode(vol, path, &inode);
+	inode.mode = S_IFREG | 0640;
+	update_inode_data(inode.ino, &inode);
+    }
+
+    long long start = test_now_us();
+    if (CHECK(pthread_create(&syncer, NULL, test_sync_thread, vol) == 0)) {
+	usleep(100000);
+	for (i = 0; i < 10; ++i) {
+	    long long stat_start = test_now_us();
+	    CHECK(libsfs_stat(vol, "/d/f99", &statbuf) == 0);
+	    if (test_now_us() - stat_start > slowest) {
+		slowest = test_now_us() - stat_start;
+	    }
+	}
+	pthread_join(syncer, NULL);
+    }
+    long long pass = test_now_us() - start;
+    CHECK(pass >= 300000);
+    CHECK(slowest < 50000);
+    CHECK((statbuf.st_mode & 0777) == 0640);
+    libsfs_unmount(vol);
+}
+
+/*
+ * Sets atime of path and mtime and ctime, which are the same.
+ */
+static void test_set_times(sfs_volume *vol, const char *path, time_t atime, time_t mtime)
+{
+    sfs_inode_t inode;
+
+    test_inode(vol, path, &inode);
+    inode.atime = atime;
+    inode.mtime = mtime;
+    inode.ctime = mtime;
+    update_inode_data(inode.ino, &inode);
+    flush_inodes();
+}
+
+/*
+ * Without lazytime reads only move atime when it isn't newer than mtime
+ * (relatime). With it, timestamp only changes stay in memory until the
+ * inode gets written back, at the latest on unmount.
+ */
+static void test_lazytime()
+{
+    char block[BLOCK_SIZE];
+    char buf[100];
+    sfs_inode_t inode;
+    time_t now = time(NULL);
+
+    test_fill(buf, sizeof(buf));
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS);
+    test_write(vol, "/f", buf, sizeof(buf));
+
+    test_set_times(vol, "/f", now - 100, now - 200);
+    CHECK(test_verify(vol, "/f", buf, sizeof(buf)));
+    test_inode(vol, "/f", &inode);
+    CHECK(inode.atime == now - 100);
+
+    test_set_times(vol, "/f", now - 300, now - 200);
+    CHECK(test_verify(vol, "/f", buf, sizeof(buf)));
+    test_inode(vol, "/f", &inode);
+    CHECK(inode.atime >= now);
+
+    vol = test_remount(vol, TEST_DISKFILE, "lazytime");
+    test_set_times(vol, "/f", now - 300, now - 200);
+    CHECK(test_verify(vol, "/f", buf, sizeof(buf)));
+    test_inode(vol, "/f", &inode);
+    CHECK(inode.atime >= now);
+    flush_inodes();
+    sfs_inode_t *on_disk = (sfs_inode_t*)(block + (inode.ino % SFS_INODES_PER_BLOCK) * SFS_INODE_SIZE);
+    CHECK(block_read(inode.ino / SFS_INODES_PER_BLOCK, block) == BLOCK_SIZE);
+    CHECK(on_disk->atime == now - 300);
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    test_inode(vol, "/f", &inode);
+    CHECK(inode.atime >= now);
+
+    // A read touching a copy loaded before a write keeps the write's mtime
+    sfs_inode_t stale;
+    test_set_times(vol, "/f", now - 300, now - 200);
+    test_inode(vol, "/f", &stale);
+    test_write(vol, "/f", buf, sizeof(buf));
+    touch_inode(&stale, SFS_ATIME);
+    test_inode(vol, "/f", &inode);
+    CHECK((inode.atime >= now) && (inode.mtime >= now) && (inode.ctime >= now));
+    libsfs_unmount(vol);
+}
+
+/*
+ * Small files and directories keep their data in the inode, and move it
+ * to blocks once it outgrows SFS_INLINE_DATA_SIZE.
+ */
+static void test_inline()
+{
+    char buf[1000];
+    char path[PATH_MAX];
+    sfs_inode_t inode;
+    struct dirent *entry = NULL;
+    int entries = 0;
+    int i = 0;
+
+    test_fill(buf, sizeof(buf));
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS);
+    test_write(vol, "/small", buf, 100);
+    test_write(vol, "/grown", buf, 100);
+    CHECK(libsfs_mkdir(vol, "/d", 0755) == 0);
+    test_write(vol, "/d/f0", buf, 1);
+    test_inode(vol, "/small", &inode);
+    CHECK((inode.flags & SFS_INODE_INLINE) && (inode.nblocks == 0));
+    test_inode(vol, "/d", &inode);
+    CHECK(inode.flags & SFS_INODE_INLINE);
+
+    sfs_file *file = libsfs_open(vol, "/grown", O_WRONLY, 0);
+    if (CHECK(file != NULL)) {
+	CHECK(libsfs_pwrite(file, buf + 100, sizeof(buf) - 100, 100) == (ssize_t)(sizeof(buf) - 100));
+	libsfs_close(file);
+    }
+    for (i = 1; i < 10; ++i) {
+	snprintf(path, sizeof(path), "/d/f%d", i);
+	test_write(vol, path, buf, 1);
+    }
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    CHECK(test_verify(vol, "/small", buf, 100));
+    CHECK(test_verify(vol, "/grown", buf, sizeof(buf)));
+    test_inode(vol, "/small", &inode);
+    CHECK(inode.flags & SFS_INODE_INLINE);
+    test_inode(vol, "/grown", &inode);
+    CHECK(!(inode.flags & SFS_INODE_INLINE) && (inode.nblocks > 0));
+    test_inode(vol, "/d", &inode);
+    CHECK(!(inode.flags & SFS_INODE_INLINE));
+    sfs_dir *dir = libsfs_opendir(vol, "/d");
+    if (CHECK(dir != NULL)) {
+	while ((entry = libsfs_readdir(dir)) != NULL) {
+	    ++entries;
+	}
+	libsfs_closedir(dir);
+    }
+    CHECK(entries == 12);
+    CHECK(test_verify(vol, "/d/f9", buf, 1));
+    libsfs_unmount(vol);
+}
+
+/*
+ * The inode table starts small and gets new chunks as files are created.
+ */
+static void test_inodes()
+{
+    char path[PATH_MAX];
+    struct stat statbuf;
+    int i = 0;
+
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS ",ninodes=510");
+    CHECK(vol->sb->num_inodes == SFS_INODES_PER_CHUNK);
+    CHECK(libsfs_mkdir(vol, "/many", 0755) == 0);
+    uint64_t used = vol->sb->num_inodes - vol->sb->num_free_inodes;
+    for (i = 0; i < 1500; ++i) {
+	snprintf(path, sizeof(path), "/many/f%d", i);
+	test_write(vol, path, path, strlen(path));
+    }
+    CHECK(vol->sb->num_inodes >= used + 1500);
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    CHECK(vol->sb->num_inodes - vol->sb->num_free_inodes == used + 1500);
+    for (i = 0; i < 1500; ++i) {
+	snprintf(path, sizeof(path), "/many/f%d", i);
+	CHECK(test_verify(vol, path, path, strlen(path)));
+	CHECK(libsfs_unlink(vol, path) == 0);
+    }
+    CHECK((libsfs_stat(vol, "/many/f0", &statbuf) < 0) && (errno == ENOENT));
+    CHECK(vol->sb->num_inodes - vol->sb->num_free_inodes == used);
+    libsfs_unmount(vol);
+}
+
+/*
+ * Whether the free blocks of the groups add up to those of the volume.
+ */
+static int test_groups_consistent(sfs_volume *vol)
+{
+    uint64_t free_blocks = 0;
+    uint32_t g = 0;
+
+    for (g = 0; g < vol->num_groups; ++g) {
+	free_blocks += vol->groups[g].free_blocks;
+    }
+
+    return free_blocks == vol->sb->num_free_blocks;
+}
+
+/*
+ * The volume is split into groups of SFS_BLOCKS_PER_GROUP blocks, a file
+ * larger than a group spills over into others.
+ */
+static void test_groups()
+{
+    size_t size = 3 * SFS_BLOCKS_PER_GROUP * BLOCK_SIZE / 2;
+    char *buf = malloc(size);
+
+    test_fill(buf, size);
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS);
+    CHECK(vol->num_groups == TEST_NBLOCKS / SFS_BLOCKS_PER_GROUP);
+    CHECK(test_groups_consistent(vol));
+    uint64_t free_blocks = vol->sb->num_free_blocks;
+    CHECK(libsfs_mkdir(vol, "/d", 0755) == 0);
+    test_write(vol, "/d/big", buf, size);
+    test_write(vol, "/d/small", buf, 5000);
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    CHECK(test_verify(vol, "/d/big", buf, size));
+    CHECK(test_verify(vol, "/d/small", buf, 5000));
+    CHECK(vol->sb->num_free_blocks <= free_blocks - size / BLOCK_SIZE);
+    CHECK(test_groups_consistent(vol));
+    CHECK(libsfs_unlink(vol, "/d/small") == 0);
+    CHECK(test_groups_consistent(vol));
+    libsfs_unmount(vol);
+
+    free(buf);
+}
+
+/*
+ * Sequential reads grow the readahead window up to SFS_READAHEAD_MAX and
+ * prefetch the blocks ahead, a random one shrinks it again. The data
+ * read is the same either way.
+ */
+static void test_readahead()
+{
+    size_t size = 1024 * 1024;
+    char *buf = malloc(size);
+    char data[4096];
+    sfs_readahead_t ra;
+    sfs_inode_t inode;
+    off_t offset = 0;
+
+    test_fill(buf, size);
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS);
+    test_write(vol, "/f", buf, size);
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    memset(&ra, 0, sizeof(ra));
+    test_inode(vol, "/f", &inode);
+    for (offset = 0; offset < (off_t)size; offset += sizeof(data)) {
+	readahead_inode(&inode, &ra, sizeof(data), offset);
+	CHECK(read_inode(&inode, data, sizeof(data), offset) == sizeof(data));
+	CHECK(memcmp(data, buf + offset, sizeof(data)) == 0);
+	if (offset == 8 * sizeof(data)) {
+	    CHECK(ra.window == SFS_READAHEAD_MAX);
+	    CHECK(ra.ra_end >= (offset + sizeof(data)) / BLOCK_SIZE + SFS_READAHEAD_MAX / 2);
+	}
+    }
+
+    readahead_inode(&inode, &ra, sizeof(data), 0);
+    CHECK(ra.window == SFS_READAHEAD_MAX / 2);
+    CHECK(read_inode(&inode, data, sizeof(data), 0) == sizeof(data));
+    CHECK(memcmp(data, buf, sizeof(data)) == 0);
+    libsfs_unmount(vol);
+
+    free(buf);
+}
+
+/*
+ * Writes stay in the write buffer of their file without blocks until it
+ * gets flushed, by fsync here. Two files written in turns still get a
+ * contiguous run of blocks each.
+ */
+static void test_delalloc()
+{
+    static const char *paths[] = { "/a", "/b" };
+    char buf[SFS_NDIR_BLOCKS * BLOCK_SIZE];
+    sfs_file *files[2];
+    sfs_inode_t inode;
+    size_t offset = 0;
+    int i = 0;
+    int k = 0;
+
+    test_fill(buf, sizeof(buf));
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS);
+    for (k = 0; k < 2; ++k) {
+	files[k] = libsfs_open(vol, paths[k], O_CREAT | O_RDWR, 0644);
+	if (!CHECK(files[k] != NULL)) {
+	    libsfs_unmount(vol);
+	    return;
+	}
+    }
+    for (offset = 0; offset < sizeof(buf); offset += BLOCK_SIZE / 2) {
+	for (k = 0; k < 2; ++k) {
+	    CHECK(libsfs_pwrite(files[k], buf + offset, BLOCK_SIZE / 2, offset) == BLOCK_SIZE / 2);
+	}
+    }
+
+    for (k = 0; k < 2; ++k) {
+	test_inode(vol, paths[k], &inode);
+	CHECK((inode.size == sizeof(buf)) && (inode.blocks[0] == SFS_INVALID_BLOCK_NO));
+	CHECK(test_verify(vol, paths[k], buf, sizeof(buf)));
+	CHECK(libsfs_fsync(files[k]) == 0);
+	libsfs_close(files[k]);
+
+	test_inode(vol, paths[k], &inode);
+	CHECK(inode.blocks[0] != SFS_INVALID_BLOCK_NO);
+	for (i = 1; i < SFS_NDIR_BLOCKS; ++i) {
+	    CHECK(inode.blocks[i] == inode.blocks[0] + i);
+	}
+    }
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    for (k = 0; k < 2; ++k) {
+	CHECK(test_verify(vol, paths[k], buf, sizeof(buf)));
+    }
+    libsfs_unmount(vol);
+}
+
+/*
+ * fallocate takes blocks which read as zeros until written, with and
+ * without growing the file, and truncate gives them back.
+ */
+static void test_fallocate()
+{
+    size_t size = 256 * 1024;
+    char *buf = calloc(1, size);
+    char data[1000];
+    sfs_inode_t inode;
+
+    test_fill(data, sizeof(data));
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS);
+    test_write(vol, "/f", NULL, 0);
+    test_write(vol, "/keep", NULL, 0);
+    uint64_t free_blocks = vol->sb->num_free_blocks;
+
+    test_inode(vol, "/f", &inode);
+    CHECK(fallocate_inode(&inode, 0, 0, size) == 0);
+    test_inode(vol, "/f", &inode);
+    CHECK((inode.size == size) && (inode.blocks[8] & SFS_BLOCK_UNWRITTEN));
+    CHECK(vol->sb->num_free_blocks <= free_blocks - size / BLOCK_SIZE);
+    CHECK(test_verify(vol, "/f", buf, size));
+    test_inode(vol, "/keep", &inode);
+    CHECK(fallocate_inode(&inode, 1, 0, 64 * 1024) == 0);
+    test_inode(vol, "/keep", &inode);
+    CHECK((inode.size == 0) && (inode.nblocks >= 64 * 1024 / BLOCK_SIZE));
+    CHECK(libsfs_sync(vol) == 0);
+    CHECK(vol->reserved_blocks == 0);
+
+    sfs_file *file = libsfs_open(vol, "/f", O_WRONLY, 0);
+    if (CHECK(file != NULL)) {
+	CHECK(libsfs_pwrite(file, data, sizeof(data), 2048) == sizeof(data));
+	libsfs_close(file);
+    }
+    memcpy(buf + 2048, data, sizeof(data));
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    CHECK(test_verify(vol, "/f", buf, size));
+    test_inode(vol, "/f", &inode);
+    CHECK(!(inode.blocks[2048 / BLOCK_SIZE] & SFS_BLOCK_UNWRITTEN) && (inode.blocks[8] & SFS_BLOCK_UNWRITTEN));
+    CHECK(truncate_inode(&inode, 0) == 0);
+    CHECK(libsfs_unlink(vol, "/keep") == 0);
+    CHECK(vol->sb->num_free_blocks == free_blocks);
+    libsfs_unmount(vol);
+
+    free(buf);
+}
+
+/*
+ * Checks the holes and data of a file with 100 bytes at 0 and at
+ * 1MB, a hole in between.
+ */
+static void test_check_sparse(sfs_volume *vol)
+{
+    sfs_file *file = libsfs_open(vol, "/s", O_RDONLY, 0);
+    struct stat statbuf;
+
+    if (CHECK(file != NULL)) {
+	CHECK(libsfs_lseek(file, 0, SEEK_DATA) == 0);
+	CHECK(libsfs_lseek(file, 0, SEEK_HOLE) == BLOCK_SIZE);
+	CHECK(libsfs_lseek(file, BLOCK_SIZE, SEEK_DATA) == 1024 * 1024);
+	CHECK(libsfs_lseek(file, 1024 * 1024, SEEK_HOLE) == 1024 * 1024 + 100);
+	CHECK((libsfs_lseek(file, 1024 * 1024 + 100, SEEK_DATA) < 0) && (errno == ENXIO));
+	CHECK((libsfs_fstat(file, &statbuf) == 0) && (statbuf.st_blocks < 16));
+	libsfs_close(file);
+    }
+}
+
+/*
+ * Writes past the end of file leave a hole without blocks, which reads
+ * as zeros and which SEEK_DATA and SEEK_HOLE skip, before and after the
+ * data is flushed.
+ */
+static void test_sparse()
+{
+    size_t size = 1024 * 1024 + 100;
+    char *buf = calloc(1, size);
+
+    test_fill(buf, 100);
+    test_fill(buf + size - 100, 100);
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS);
+    sfs_file *file = libsfs_open(vol, "/s", O_CREAT | O_WRONLY, 0644);
+    if (CHECK(file != NULL)) {
+	CHECK(libsfs_pwrite(file, buf, 100, 0) == 100);
+	CHECK(libsfs_pwrite(file, buf + size - 100, 100, size - 100) == 100);
+	test_check_sparse(vol);
+	CHECK(libsfs_fsync(file) == 0);
+	libsfs_close(file);
+    }
+    test_check_sparse(vol);
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    test_check_sparse(vol);
+    CHECK(test_verify(vol, "/s", buf, size));
+    libsfs_unmount(vol);
+
+    free(buf);
+}
+
+/*
+ * Whether the file system of the disk files can punch holes, discard
+ * needs that.
+ */
+static int test_can_punch()
+{
+    char buf[8 * BLOCK_SIZE];
+    int fd = open(TEST_DISKFILE2, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    int punched = 0;
+
+    memset(buf, 1, sizeof(buf));
+    if (fd >= 0) {
+	punched = (pwrite(fd, buf, sizeof(buf), 0) == (ssize_t)sizeof(buf)) &&
+		(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, sizeof(buf)) == 0);
+	close(fd);
+    }
+    unlink(TEST_DISKFILE2);
+
+    return punched;
+}
+
+/*
+ * Bytes the disk file takes on the host.
+ */
+static off_t test_disk_usage()
+{
+    struct stat statbuf;
+    if (stat(TEST_DISKFILE, &statbuf) < 0) {
+	return -1;
+    }
+
+    return (off_t)statbuf.st_blocks * 512;
+}
+
+/*
+ * Writes files of size bytes in total, syncs, unlinks them and syncs
+ * again. Returns how much less of the disk file is in use afterwards.
+ */
+static off_t test_free_files(sfs_volume *vol, const char *buf, size_t size)
+{
+    char path[PATH_MAX];
+    int i = 0;
+
+    for (i = 0; i < 16; ++i) {
+	snprintf(path, sizeof(path), "/f%d", i);
+	test_write(vol, path, buf + i * (size / 16), size / 16);
+    }
+    CHECK(libsfs_sync(vol) == 0);
+    off_t used = test_disk_usage();
+    for (i = 0; i < 16; ++i) {
+	snprintf(path, sizeof(path), "/f%d", i);
+	CHECK(libsfs_unlink(vol, path) == 0);
+    }
+    CHECK(libsfs_sync(vol) == 0);
+
+    return used - test_disk_usage();
+}
+
+/*
+ * Freed blocks get punched out of the disk file, unless the volume is
+ * mounted with nodiscard. The blocks still in use keep their data.
+ */
+static void test_discard()
+{
+    size_t size = 16 * SFS_ORPHAN_MIN_BLOCKS / 2 * BLOCK_SIZE; // Files freed right away, not orphans
+    char *buf = malloc(size);
+
+    if (!test_can_punch()) {
+	fprintf(stderr, "sfs_test: no hole punching here, discard isn't tested\n");
+	free(buf);
+	return;
+    }
+
+    test_fill(buf, size);
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS ",nodiscard");
+    test_write(vol, "/keep", buf, 100000);
+    CHECK(test_free_files(vol, buf, size) < (off_t)size / 4);
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    CHECK(test_free_files(vol, buf, size) >= (off_t)size / 2);
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    CHECK(test_verify(vol, "/keep", buf, 100000));
+    libsfs_unmount(vol);
+
+    free(buf);
+}
+
+/*
+ * Waits up to 10 seconds for the orphan list to get empty. Returns whether
+ * it did.
+ */
+static int test_orphans_reclaimed(sfs_volume *vol)
+{
+    struct timespec delay = { 0, 10 * 1000000L };
+    uint64_t head = SFS_INVALID_INO;
+    int i = 0;
+
+    for (i = 0; i < 1000; ++i) {
+	pthread_mutex_lock(&vol->orphan_lock);
+	head = vol->sb->orphan_head;
+	pthread_mutex_unlock(&vol->orphan_lock);
+	if (head == SFS_INVALID_INO) {
+	    return 1;
+	}
+	nanosleep(&delay, NULL);
+    }
+
+    return 0;
+}
+
+/*
+ * Unlinking a large file only puts it on the orphan list, its blocks are
+ * freed in the background. What is left over at unmount gets finished
+ * after the next mount.
+ */
+static void test_orphans()
+{
+    size_t size = 4 * SFS_ORPHAN_BATCH_BLOCKS * BLOCK_SIZE;
+    char *buf = malloc(size);
+    struct stat statbuf;
+
+    test_fill(buf, size);
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS);
+    test_write(vol, "/keep", buf, 5000);
+    CHECK(libsfs_sync(vol) == 0);
+    uint64_t free_blocks = vol->sb->num_free_blocks;
+    test_write(vol, "/big", buf, size);
+    CHECK(libsfs_sync(vol) == 0);
+    CHECK(libsfs_unlink(vol, "/big") == 0);
+    CHECK(vol->sb->orphan_head != SFS_INVALID_INO);
+    CHECK((libsfs_stat(vol, "/big", &statbuf) < 0) && (errno == ENOENT));
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    CHECK(test_orphans_reclaimed(vol));
+    CHECK(vol->sb->num_free_blocks == free_blocks);
+    test_write(vol, "/big", buf, size);
+    CHECK(libsfs_unlink(vol, "/big") == 0);
+    CHECK(test_orphans_reclaimed(vol));
+    CHECK(vol->sb->num_free_blocks == free_blocks);
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    CHECK(vol->sb->num_free_blocks == free_blocks);
+    CHECK(test_verify(vol, "/keep", buf, 5000));
+    libsfs_unmount(vol);
+
+    free(buf);
+}
+
+/*
+ * A clone shares the blocks of its source until one of them writes to
+ * them, a range at a different offset within the block gets copied.
+ * Either file lives on without the other.
+ */
+static void test_reflink()
+{
+    size_t size = 1024 * 1024 + 100;
+    char *buf = malloc(size);
+    char *changed = malloc(size);
+    char data[1000];
+    sfs_inode_t src;
+    sfs_inode_t dest;
+
+    test_fill(buf, size);
+    test_fill(data, sizeof(data));
+    memcpy(changed, buf, size);
+    memcpy(changed + 4096, data, sizeof(data));
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS);
+    test_write(vol, "/src", buf, size);
+    test_write(vol, "/clone", NULL, 0);
+    test_write(vol, "/part", NULL, 0);
+    CHECK(libsfs_sync(vol) == 0);
+    uint64_t free_blocks = vol->sb->num_free_blocks;
+
+    test_inode(vol, "/src", &src);
+    test_inode(vol, "/clone", &dest);
+    CHECK(copy_inode_range(&src, &dest, 0, 0, 0) == 0);
+    test_inode(vol, "/part", &dest);
+    CHECK(copy_inode_range(&src, &dest, 1000, 0, 3000) == 0);
+    CHECK(libsfs_sync(vol) == 0);
+    CHECK(vol->sb->num_free_blocks + 64 > free_blocks);
+    CHECK(test_verify(vol, "/clone", buf, size));
+    CHECK(test_verify(vol, "/part", buf + 1000, 3000));
+
+    sfs_file *file = libsfs_open(vol, "/clone", O_WRONLY, 0);
+    if (CHECK(file != NULL)) {
+	CHECK(libsfs_pwrite(file, data, sizeof(data), 4096) == sizeof(data));
+	libsfs_close(file);
+    }
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    CHECK(test_verify(vol, "/src", buf, size));
+    CHECK(test_verify(vol, "/clone", changed, size));
+    CHECK(test_verify(vol, "/part", buf + 1000, 3000));
+
+    // Cutting into a shared block needs one of its own, on a full disk the
+    // truncate fails instead of the flush
+    off_t filled = 0;
+    test_write(vol, "/fill", NULL, 0);
+    test_inode(vol, "/fill", &dest);
+    while (fallocate_inode(&dest, 0, filled, 64 * 1024) == 0) {
+	filled += 64 * 1024;
+    }
+    while (fallocate_inode(&dest, 0, filled, BLOCK_SIZE) == 0) {
+	filled += BLOCK_SIZE;
+    }
+    test_inode(vol, "/clone", &dest);
+    CHECK(truncate_inode(&dest, 100) == -ENOSPC);
+    CHECK(libsfs_sync(vol) == 0);
+    CHECK(test_verify(vol, "/clone", changed, size));
+    CHECK(libsfs_unlink(vol, "/fill") == 0);
+
+    CHECK(libsfs_unlink(vol, "/src") == 0);
+    CHECK(test_verify(vol, "/clone", changed, size));
+    libsfs_unmount(vol);
+
+    free(changed);
+    free(buf);
+}
+
+/*
+ * Blocks taken by the inode chunks added since the volume had num_inodes.
+ */
+static uint64_t test_chunk_blocks(sfs_volume *vol, uint64_t num_inodes)
+{
+    return (vol->sb->num_inodes - num_inodes) / SFS_INODES_PER_CHUNK * SFS_INODE_CHUNK_BLOCKS;
+}
+
+/*
+ * A snapshot keeps the tree as it was when it was taken, read-only and
+ * sharing the blocks, while the live files change. Deleting it leaves
+ * the live files alone.
+ */
+static void test_snapshot()
+{
+    size_t size = 64 * 1024;
+    char *buf = malloc(size);
+    char *changed = malloc(size);
+    struct stat statbuf;
+
+    test_fill(buf, size);
+    test_fill(changed, size);
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS);
+    CHECK(libsfs_mkdir(vol, "/d", 0755) == 0);
+    test_write(vol, "/d/a", buf, size);
+    test_write(vol, "/b", buf, 100);
+    CHECK(libsfs_sync(vol) == 0);
+    uint64_t free_blocks = vol->sb->num_free_blocks;
+    uint64_t num_inodes = vol->sb->num_inodes;
+
+    sfs_set_context(vol);
+    CHECK(snapshot_fs("s1") == 0);
+    CHECK(snapshot_fs("s1") < 0);
+    CHECK(snapshot_fs("a/b") == -EINVAL);
+    CHECK(vol->sb->num_free_blocks + 64 > free_blocks - test_chunk_blocks(vol, num_inodes));
+    test_write(vol, "/d/a", changed, size);
+    CHECK(libsfs_unlink(vol, "/b") == 0);
+    test_write(vol, "/c", buf, 100);
+
+    CHECK(test_verify(vol, "/" SFS_SNAPSHOT_DIR "/s1/d/a", buf, size));
+    CHECK(test_verify(vol, "/" SFS_SNAPSHOT_DIR "/s1/b", buf, 100));
+    CHECK((libsfs_stat(vol, "/" SFS_SNAPSHOT_DIR "/s1/c", &statbuf) < 0) && (errno == ENOENT));
+    CHECK((libsfs_open(vol, "/" SFS_SNAPSHOT_DIR "/s1/b", O_RDWR, 0) == NULL) && (errno == EROFS));
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    CHECK(test_verify(vol, "/" SFS_SNAPSHOT_DIR "/s1/d/a", buf, size));
+    CHECK(test_verify(vol, "/d/a", changed, size));
+    sfs_set_context(vol);
+    CHECK(delete_snapshot("s1") == 0);
+    CHECK(delete_snapshot("s1") == -ENOENT);
+    CHECK((libsfs_stat(vol, "/" SFS_SNAPSHOT_DIR "/s1", &statbuf) < 0) && (errno == ENOENT));
+    CHECK(test_verify(vol, "/d/a", changed, size));
+    CHECK(test_verify(vol, "/c", buf, 100));
+    libsfs_unmount(vol);
+
+    free(changed);
+    free(buf);
+}
+
+#define TEST_SNAPSHOT_FILES 300
+
+typedef struct {
+    sfs_volume *vol;
+    const char *data;
+    uint64_t shard; // Map lock the walk waits for until the first changes are done
+    int ready; // Set once the lock is held
+    int during_walk; // Changes done while the snapshot walk was running
+} test_snapshot_writer_t;
+
+/*
+ * Changes every file of /d once the snapshot has started: overwrites
+ * /d/f<i>, removes /d/g<i> and creates /d/new<i>. Holding one of the map
+ * locks until the changes that don't need it are done keeps the walk from
+ * ending before, even on a single CPU.
+ */
+static void* test_snapshot_writer(void *arg)
+{
+    test_snapshot_writer_t *writer = (test_snapshot_writer_t*)arg;
+    pthread_rwlock_t *lock = writer->vol->wb_locks + writer->shard;
+    char path[PATH_MAX];
+    int i = 0;
+
+    sfs_set_context(writer->vol);
+    pthread_rwlock_wrlock(lock);
+    *(volatile int*)&writer->ready = 1;
+    while (!*(volatile int*)&writer->vol->snapshot_active) {
+	sched_yield();
+    }
+    for (i = TEST_SNAPSHOT_FILES - 1; i >= 0; --i) {
+	snprintf(path, sizeof(path), "/d/f%d", i);
+	uint64_t ino_f = path_2_ino(path);
+	snprintf(path, sizeof(path), "/d/g%d", i);
+	uint64_t ino_g = path_2_ino(path);
+	if ((ino_f % SFS_WRITE_BUFFER_LOCKS != writer->shard) && (ino_g % SFS_WRITE_BUFFER_LOCKS != writer->shard)) {
+	    snprintf(path, sizeof(path), "/d/f%d", i);
+	    test_write(writer->vol, path, writer->data, BLOCK_SIZE);
+	    snprintf(path, sizeof(path), "/d/g%d", i);
+	    libsfs_unlink(writer->vol, path);
+	    ++writer->during_walk;
+	}
+    }
+    pthread_rwlock_unlock(lock);
+
+    // The rest may or may not run alongside the walk
+    for (i = TEST_SNAPSHOT_FILES - 1; i >= 0; --i) {
+	snprintf(path, sizeof(path), "/d/f%d", i);
+	test_write(writer->vol, path, writer->data, BLOCK_SIZE);
+	snprintf(path, sizeof(path), "/d/g%d", i);
+	libsfs_unlink(writer->vol, path);
+	snprintf(path, sizeof(path), "/d/new%d", i);
+	test_write(writer->vol, path, writer->data, 100);
+    }
+
+    return NULL;
+}
+
+/*
+ * Changes to the tree go on while a snapshot walks it, the snapshot still
+ * shows the tree as it was when it started, and its files share all their
+ * blocks, compressed ones included.
+ */
+static void test_snapshot_live()
+{
+    char path[PATH_MAX];
+    char buf[BLOCK_SIZE];
+    char changed[BLOCK_SIZE];
+    char big[16 * BLOCK_SIZE];
+    struct stat statbuf;
+    test_snapshot_writer_t writer;
+    pthread_t thread;
+    int i = 0;
+
+    test_fill(buf, sizeof(buf));
+    memset(changed, 'x', sizeof(changed));
+    memset(big, 'z', sizeof(big));
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS ",compress");
+    CHECK(libsfs_mkdir(vol, "/d", 0755) == 0);
+    for (i = 0; i < TEST_SNAPSHOT_FILES; ++i) {
+	snprintf(path, sizeof(path), "/d/f%d", i);
+	test_write(vol, path, buf, sizeof(buf));
+	snprintf(path, sizeof(path), "/d/g%d", i);
+	test_write(vol, path, buf, 100);
+    }
+    test_write(vol, "/big", big, sizeof(big));
+
+    // With /SFS_SNAPSHOT_DIR there already, snapshot_fs() only takes its
+    // map lock and the one of / before the walk, the writer holds another
+    sfs_set_context(vol);
+    CHECK(snapshot_fs("t") == 0);
+    uint64_t ino_snapshots = path_2_ino("/" SFS_SNAPSHOT_DIR);
+    uint64_t ino_d = path_2_ino("/d");
+    writer.shard = 0;
+    while ((writer.shard == vol->ino_root % SFS_WRITE_BUFFER_LOCKS) || (writer.shard == ino_d % SFS_WRITE_BUFFER_LOCKS) ||
+	    (writer.shard == ino_snapshots % SFS_WRITE_BUFFER_LOCKS)) {
+	++writer.shard;
+    }
+    CHECK(libsfs_sync(vol) == 0);
+    uint64_t free_blocks = vol->sb->num_free_blocks;
+    uint64_t num_inodes = vol->sb->num_inodes;
+
+    writer.vol = vol;
+    writer.data = changed;
+    writer.ready = 0;
+    writer.during_walk = 0;
+    if (CHECK(pthread_create(&thread, NULL, test_snapshot_writer, &writer) == 0)) {
+	while (!*(volatile int*)&writer.ready) {
+	    sched_yield();
+	}
+	CHECK(snapshot_fs("s") == 0);
+	pthread_join(thread, NULL);
+    }
+    CHECK(writer.during_walk > 0);
+    CHECK(vol->snapshot_images == NULL);
+
+    // No data copied: only inodes, directories, indirect blocks and the
+    // blocks changed since
+    CHECK(libsfs_sync(vol) == 0);
+    CHECK(vol->sb->num_free_blocks + 2 * TEST_SNAPSHOT_FILES + 64 > free_blocks - test_chunk_blocks(vol, num_inodes));
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    for (i = 0; i < TEST_SNAPSHOT_FILES; ++i) {
+	snprintf(path, sizeof(path), "/" SFS_SNAPSHOT_DIR "/s/d/f%d", i);
+	CHECK(test_verify(vol, path, buf, sizeof(buf)));
+	snprintf(path, sizeof(path), "/" SFS_SNAPSHOT_DIR "/s/d/g%d", i);
+	CHECK(test_verify(vol, path, buf, 100));
+	snprintf(path, sizeof(path), "/" SFS_SNAPSHOT_DIR "/s/d/new%d", i);
+	CHECK((libsfs_stat(vol, path, &statbuf) < 0) && (errno == ENOENT));
+	snprintf(path, sizeof(path), "/d/f%d", i);
+	CHECK(test_verify(vol, path, changed, sizeof(changed)));
+    }
+    CHECK(test_verify(vol, "/" SFS_SNAPSHOT_DIR "/s/big", big, sizeof(big)));
+
+    // Deleting the snapshot gives back what it held on its own
+    sfs_set_context(vol);
+    CHECK(delete_snapshot("s") == 0);
+    CHECK(delete_snapshot("t") == 0);
+    CHECK(test_verify(vol, "/big", big, sizeof(big)));
+    libsfs_unmount(vol);
+}
+
+/*
+ * Blocks in use in the seqalloc segment holding block_no.
+ */
+static uint32_t test_segment_used(sfs_volume *vol, uint32_t block_no)
+{
+    sfs_group *group = vol->groups + block_no / SFS_BLOCKS_PER_GROUP;
+    uint32_t first = (block_no - group->first_block) / SFS_SEGMENT_BLOCKS * SFS_SEGMENT_BLOCKS;
+    uint32_t used = 0, b = 0;
+
+    for (b = first; (b < first + SFS_SEGMENT_BLOCKS) && (b < group->num_blocks); ++b) {
+	used += (group->bitmap[b / 8] >> (b % 8)) & 1;
+    }
+
+    return used;
+}
+
+/*
+ * With seqalloc flushes append to a log head filling clean segments,
+ * overwrites included, and the head carries over to the next mount.
+ * Indirect blocks stay out of the log. Overwriting every other block of
+ * a file leaves its segments half used, and the cleaner moves what is
+ * left in them to the log head so they are clean again.
+ */
+static void test_seqalloc()
+{
+    char buf[SFS_NDIR_BLOCKS * BLOCK_SIZE];
+    char data[BLOCK_SIZE];
+    size_t size = 2 * SFS_SEGMENT_BLOCKS * BLOCK_SIZE;
+    char *big = malloc(size);
+    sfs_inode_t inode;
+    size_t i = 0;
+
+    test_fill(buf, sizeof(buf));
+    test_fill(data, sizeof(data));
+    test_fill(big, size);
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS ",seqalloc");
+    test_write(vol, "/a", buf, sizeof(buf));
+    CHECK(libsfs_sync(vol) == 0);
+    test_inode(vol, "/a", &inode);
+    uint32_t first = inode.blocks[0];
+    uint32_t cursor = vol->sb->alloc_cursor;
+    CHECK(((first % SFS_SEGMENT_BLOCKS) == 0) && ((first % SFS_BLOCKS_PER_GROUP) != 0));
+    CHECK(cursor == first + SFS_NDIR_BLOCKS);
+
+    sfs_file *file = libsfs_open(vol, "/a", O_WRONLY, 0);
+    if (CHECK(file != NULL)) {
+	CHECK(libsfs_pwrite(file, data, sizeof(data), 0) == sizeof(data));
+	CHECK(libsfs_fsync(file) == 0);
+	libsfs_close(file);
+    }
+    memcpy(buf, data, sizeof(data));
+    test_inode(vol, "/a", &inode);
+    CHECK((inode.blocks[0] == cursor) && (inode.blocks[1] == first + 1));
+    cursor = vol->sb->alloc_cursor;
+
+    vol = test_remount(vol, TEST_DISKFILE, "seqalloc");
+    CHECK(vol->sb->alloc_cursor == cursor);
+    CHECK(test_verify(vol, "/a", buf, sizeof(buf)));
+    test_write(vol, "/b", data, sizeof(data));
+    CHECK(libsfs_sync(vol) == 0);
+    test_inode(vol, "/b", &inode);
+    CHECK(inode.blocks[0] == cursor);
+
+    test_write(vol, "/c", big, size);
+    CHECK(libsfs_sync(vol) == 0);
+    test_inode(vol, "/c", &inode);
+    uint32_t c_first = inode.blocks[0];
+    uint32_t c_middle = c_first + size / BLOCK_SIZE / 2;
+    CHECK((inode.blocks[SFS_IND_BLOCK] % SFS_BLOCKS_PER_GROUP) < SFS_SEGMENT_BLOCKS);
+
+    // Random overwrites end up next to each other
+    file = libsfs_open(vol, "/c", O_WRONLY, 0);
+    if (CHECK(file != NULL)) {
+	for (i = 0; i < size / BLOCK_SIZE; i += 2) {
+	    CHECK(libsfs_pwrite(file, data, sizeof(data), i * BLOCK_SIZE) == sizeof(data));
+	    memcpy(big + i * BLOCK_SIZE, data, sizeof(data));
+	}
+	CHECK(libsfs_fsync(file) == 0);
+	libsfs_close(file);
+    }
+    test_inode(vol, "/c", &inode);
+    CHECK((inode.blocks[2] == inode.blocks[0] + 1) && (inode.blocks[4] == inode.blocks[0] + 2));
+    CHECK(test_segment_used(vol, c_first) > 0);
+    CHECK(test_segment_used(vol, c_middle) <= SFS_SEGMENT_BLOCKS / 2);
+
+    sfs_set_context(vol);
+    CHECK(clean_segments(100) >= 2);
+    CHECK(test_segment_used(vol, c_first) == 0);
+    CHECK(test_segment_used(vol, c_middle) == 0);
+    CHECK(test_verify(vol, "/a", buf, sizeof(buf)));
+    CHECK(test_verify(vol, "/b", data, sizeof(data)));
+    CHECK(test_verify(vol, "/c", big, size));
+
+    vol = test_remount(vol, TEST_DISKFILE, "seqalloc");
+    CHECK(test_verify(vol, "/a", buf, sizeof(buf)));
+    CHECK(test_verify(vol, "/b", data, sizeof(data)));
+    CHECK(test_verify(vol, "/c", big, size));
+    libsfs_unmount(vol);
+
+    free(big);
+}
+
+/*
+ * With compress, clusters which compress get stored in fewer blocks, the
+ * others as they are, and a write into a compressed cluster keeps the
+ * rest of it. The data reads back the same without the option too.
+ */
+static void test_compress()
+{
+    static const char text[] = "All work and no play makes Jack a dull boy. ";
+    size_t size = 256 * 1024;
+    char *buf = malloc(size);
+    char *random = malloc(size);
+    sfs_inode_t inode;
+    size_t i = 0;
+
+    for (i = 0; i < size; ++i) {
+	buf[i] = text[i % (sizeof(text) - 1)];
+    }
+    test_fill(random, size);
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS ",compress");
+    test_write(vol, "/text", buf, size);
+    test_write(vol, "/random", random, size);
+    CHECK(libsfs_sync(vol) == 0);
+    test_inode(vol, "/text", &inode);
+    CHECK((inode.blocks[0] & SFS_BLOCK_COMPRESSED) && (inode.nblocks < size / BLOCK_SIZE / 2));
+    test_inode(vol, "/random", &inode);
+    CHECK(!(inode.blocks[0] & SFS_BLOCK_COMPRESSED) && (inode.nblocks >= size / BLOCK_SIZE));
+    CHECK(test_verify(vol, "/text", buf, size));
+
+    sfs_file *file = libsfs_open(vol, "/text", O_WRONLY, 0);
+    if (CHECK(file != NULL)) {
+	CHECK(libsfs_pwrite(file, random, 10, 1000) == 10);
+	libsfs_close(file);
+    }
+    memcpy(buf + 1000, random, 10);
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    CHECK(test_verify(vol, "/text", buf, size));
+    CHECK(test_verify(vol, "/random", random, size));
+    libsfs_unmount(vol);
+
+    free(random);
+    free(buf);
+}
+
+/*
+ * With dedup, blocks written with data already on the volume share the
+ * block holding it, also after the file first written is gone. A write
+ * to a shared block leaves the other files alone.
+ */
+static void test_dedup()
+{
+    size_t size = 64 * 1024;
+    char *buf = malloc(size);
+    char *changed = malloc(size);
+
+    test_fill(buf, size);
+    memcpy(changed, buf, size);
+    test_fill(changed, 100);
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS ",dedup");
+    test_write(vol, "/a", buf, size);
+    CHECK(libsfs_sync(vol) == 0);
+    uint64_t free_blocks = vol->sb->num_free_blocks;
+    test_write(vol, "/b", buf, size);
+    CHECK(libsfs_sync(vol) == 0);
+    CHECK(vol->sb->num_free_blocks + SFS_REFCOUNT_BLOCKS + 8 > free_blocks);
+    CHECK(libsfs_unlink(vol, "/a") == 0);
+    test_write(vol, "/c", buf, size);
+    CHECK(libsfs_sync(vol) == 0);
+    CHECK(vol->sb->num_free_blocks + SFS_REFCOUNT_BLOCKS + 8 > free_blocks);
+
+    sfs_file *file = libsfs_open(vol, "/b", O_WRONLY, 0);
+    if (CHECK(file != NULL)) {
+	CHECK(libsfs_pwrite(file, changed, 100, 0) == 100);
+	libsfs_close(file);
+    }
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    CHECK(test_verify(vol, "/b", changed, size));
+    CHECK(test_verify(vol, "/c", buf, size));
+    libsfs_unmount(vol);
+
+    free(changed);
+    free(buf);
+}
+
+/*
+ * With checksum, a block changed behind the file system's back fails
+ * reads and partial writes with EIO, the blocks around it don't, and
+ * writing all of it makes it good again.
+ */
+static void test_checksum()
+{
+    char buf[8 * BLOCK_SIZE];
+    char data[BLOCK_SIZE];
+    sfs_inode_t inode;
+
+    test_fill(buf, sizeof(buf));
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS ",checksum");
+    test_write(vol, "/f", buf, sizeof(buf));
+    CHECK(libsfs_sync(vol) == 0);
+    test_inode(vol, "/f", &inode);
+    libsfs_unmount(vol);
+
+    int fd = open(TEST_DISKFILE, O_RDWR);
+    if (CHECK(fd >= 0)) {
+	CHECK(pwrite(fd, "X", 1, (off_t)inode.blocks[3] * BLOCK_SIZE + 100) == 1);
+	close(fd);
+    }
+
+    vol = test_mount(TEST_DISKFILE, NULL);
+    sfs_file *file = libsfs_open(vol, "/f", O_RDWR, 0);
+    if (CHECK(file != NULL)) {
+	CHECK((libsfs_pread(file, data, BLOCK_SIZE, 3 * BLOCK_SIZE) < 0) && (errno == EIO));
+	CHECK(libsfs_pread(file, data, BLOCK_SIZE, 2 * BLOCK_SIZE) == BLOCK_SIZE);
+	CHECK(libsfs_pread(file, data, BLOCK_SIZE, 4 * BLOCK_SIZE) == BLOCK_SIZE);
+	CHECK((libsfs_pwrite(file, "zz", 2, 3 * BLOCK_SIZE + 5) < 0) && (errno == EIO));
+	CHECK(libsfs_pwrite(file, buf + 3 * BLOCK_SIZE, BLOCK_SIZE, 3 * BLOCK_SIZE) == BLOCK_SIZE);
+	libsfs_close(file);
+    }
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    CHECK(test_verify(vol, "/f", buf, sizeof(buf)));
+    libsfs_unmount(vol);
+}
+
+/*
+ * Format diskfile with options, write a small and a big file, remount it
+ * with remount_options and read them back.
+ */
+static void test_roundtrip_on(const char *diskfile, const char *options, const char *remount_options)
+{
+    char *buf = malloc(300000);
+
+    test_fill(buf, 300000);
+    sfs_volume *vol = test_format(diskfile, options);
+    CHECK(libsfs_mkdir(vol, "/d", 0755) == 0);
+    test_write(vol, "/d/small", buf, 1000);
+    test_write(vol, "/d/big", buf, 300000);
+
+    vol = test_remount(vol, diskfile, remount_options);
+    CHECK(test_verify(vol, "/d/small", buf, 1000));
+    CHECK(test_verify(vol, "/d/big", buf, 300000));
+    libsfs_unmount(vol);
+
+    free(buf);
+}
+
+/*
+ * Every backend reads back what it wrote, the block store is the same
+ * whichever wrote it, and an unknown backend doesn't mount.
+ */
+static void test_backends()
+{
+    test_roundtrip_on(TEST_DISKFILE, TEST_OPTIONS ",backend=file", "backend=file");
+    test_roundtrip_on(TEST_DISKFILE, TEST_OPTIONS ",backend=mmap", "backend=mmap");
+    test_roundtrip_on(TEST_DISKFILE, TEST_OPTIONS ",backend=io_uring", "backend=io_uring");
+    test_roundtrip_on(TEST_DISKFILE, TEST_OPTIONS ",backend=file", "backend=mmap");
+    test_roundtrip_on(TEST_DISKFILE, TEST_OPTIONS ",backend=mmap", "backend=io_uring");
+
+    test_remove();
+    CHECK((libsfs_mount(TEST_DISKFILE, TEST_OPTIONS ",backend=nosuchbackend") == NULL) && (errno == EINVAL));
+}
+
+/*
+ * A ram volume needs no disk file and keeps its files until it is
+ * unmounted, the next one starts empty. It can't have another backend.
+ */
+static void test_ram()
+{
+    char buf[100000];
+    struct stat statbuf;
+
+    test_fill(buf, sizeof(buf));
+    sfs_volume *vol = test_mount(NULL, TEST_OPTIONS ",ram");
+    CHECK(libsfs_mkdir(vol, "/d", 0755) == 0);
+    test_write(vol, "/d/f", buf, sizeof(buf));
+    CHECK(libsfs_sync(vol) == 0);
+    CHECK(test_verify(vol, "/d/f", buf, sizeof(buf)));
+    CHECK(access(TEST_DISKFILE, F_OK) < 0);
+
+    vol = test_remount(vol, NULL, TEST_OPTIONS ",ram");
+    CHECK((libsfs_stat(vol, "/d", &statbuf) < 0) && (errno == ENOENT));
+    test_write(vol, "/f", buf, 5000);
+    CHECK(test_verify(vol, "/f", buf, 5000));
+    libsfs_unmount(vol);
+
+    CHECK((libsfs_mount(NULL, TEST_OPTIONS ",ram,backend=file") == NULL) && (errno == EINVAL));
+}
+
+/*
+ * The simulated device keeps the data of the backend it wraps, each
+ * synchronous write takes at least its latency, and an unknown model
+ * doesn't mount.
+ */
+static void test_sim()
+{
+    char buf[BLOCK_SIZE];
+    struct timespec start, end;
+    int i = 0;
+
+    test_roundtrip_on(TEST_DISKFILE, TEST_OPTIONS ",simulate=hdd", "simulate=ssd");
+
+    test_fill(buf, sizeof(buf));
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS ",simulate=ssd,sim_latency=2000,sim_qdepth=1");
+    sfs_file *file = libsfs_open(vol, "/f", O_CREAT | O_RDWR, 0644);
+    if (CHECK(file != NULL)) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < 10; ++i) {
+	    CHECK(libsfs_pwrite(file, buf, sizeof(buf), (off_t)i * BLOCK_SIZE) == (ssize_t)sizeof(buf));
+	    CHECK(libsfs_fsync(file) == 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	CHECK((end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000 >= 10 * 2000);
+	libsfs_close(file);
+    }
+    libsfs_unmount(vol);
+
+    test_remove();
+    CHECK((libsfs_mount(TEST_DISKFILE, TEST_OPTIONS ",simulate=bogus") == NULL) && (errno == EINVAL));
+}
+
+/*
+ * Several disk files make a striped volume, which spreads over all of
+ * them. It mounts again with the stripe unit it was written with, none
+ * for the default.
+ */
+static void test_stripe()
+{
+    struct stat statbuf;
+
+    test_roundtrip_on(TEST_DISKFILES, TEST_OPTIONS ",stripe_unit=8", "stripe_unit=8");
+    CHECK((stat(TEST_DISKFILE, &statbuf) == 0) && (statbuf.st_size > 0));
+    CHECK((stat(TEST_DISKFILE2, &statbuf) == 0) && (statbuf.st_size > 0));
+
+    test_roundtrip_on(TEST_DISKFILES, TEST_OPTIONS ",backend=stripe", NULL);
+}
+
+/*
+ * Whether the disk files a and b hold the same bytes.
+ */
+static int test_same_files(const char *a, const char *b)
+{
+    char buf_a[65536], buf_b[65536];
+    int fd_a = open(a, O_RDONLY);
+    int fd_b = open(b, O_RDONLY);
+    ssize_t len_a = 0, len_b = 0;
+    int same = (fd_a >= 0) && (fd_b >= 0);
+
+    while (same) {
+	len_a = read(fd_a, buf_a, sizeof(buf_a));
+	len_b = read(fd_b, buf_b, sizeof(buf_b));
+	same = (len_a == len_b) && (len_a >= 0) && (memcmp(buf_a, buf_b, len_a) == 0);
+	if (len_a <= 0) {
+	    break;
+	}
+    }
+    if (fd_a >= 0) {
+	close(fd_a);
+    }
+    if (fd_b >= 0) {
+	close(fd_b);
+    }
+
+    return same;
+}
+
+/*
+ * Every mirror of a mirrored volume holds all of it, so each one mounts
+ * on its own with the files.
+ */
+static void test_mirror()
+{
+    char buf[300000];
+
+    test_roundtrip_on(TEST_DISKFILES, TEST_OPTIONS ",backend=mirror", "backend=mirror");
+    CHECK(test_same_files(TEST_DISKFILE, TEST_DISKFILE2));
+
+    test_fill(buf, sizeof(buf));
+    sfs_volume *vol = test_format(TEST_DISKFILES, TEST_OPTIONS ",backend=mirror");
+    test_write(vol, "/f", buf, sizeof(buf));
+    libsfs_unmount(vol);
+    CHECK(test_same_files(TEST_DISKFILE, TEST_DISKFILE2));
+
+    vol = test_mount(TEST_DISKFILE2, NULL);
+    CHECK(test_verify(vol, "/f", buf, sizeof(buf)));
+    libsfs_unmount(vol);
+}
+
+/*
+ * Free blocks of the groups on the slow tier.
+ */
+static uint64_t test_slow_free(sfs_volume *vol)
+{
+    uint64_t free_blocks = 0;
+    uint32_t g = 0;
+
+    for (g = vol->fast_groups; g < vol->num_groups; ++g) {
+	free_blocks += vol->groups[g].free_blocks;
+    }
+
+    return free_blocks;
+}
+
+/*
+ * A tiered volume keeps its first groups on the fast disk file, where
+ * small files go, and big ones mostly on the slow one. It mounts again
+ * with the fast tier it was formatted with.
+ */
+static void test_tier()
+{
+    char *buf = malloc(4 * SFS_TIER_SMALL_FILE);
+    sfs_inode_t inode;
+    struct stat statbuf;
+
+    test_roundtrip_on(TEST_DISKFILES, TEST_OPTIONS ",backend=tier", "backend=tier");
+
+    test_fill(buf, 4 * SFS_TIER_SMALL_FILE);
+    sfs_volume *vol = test_format(TEST_DISKFILES, TEST_OPTIONS ",backend=tier");
+    uint64_t fast_end = (uint64_t)vol->fast_groups * SFS_BLOCKS_PER_GROUP;
+    CHECK((vol->fast_groups > 0) && (vol->fast_groups < vol->num_groups));
+    uint64_t slow_free = test_slow_free(vol);
+    test_write(vol, "/small", buf, 100000);
+    CHECK(libsfs_sync(vol) == 0);
+    test_inode(vol, "/small", &inode);
+    CHECK(inode.blocks[0] < fast_end);
+    CHECK(test_slow_free(vol) == slow_free);
+
+    test_write(vol, "/big", buf, 4 * SFS_TIER_SMALL_FILE);
+    CHECK(libsfs_sync(vol) == 0);
+    CHECK(test_slow_free(vol) + 2 * SFS_TIER_SMALL_FILE / BLOCK_SIZE <= slow_free);
+    CHECK((stat(TEST_DISKFILE, &statbuf) == 0) && ((uint64_t)statbuf.st_size <= fast_end * BLOCK_SIZE));
+
+    vol = test_remount(vol, TEST_DISKFILES, "backend=tier");
+    CHECK(vol->fast_groups * SFS_BLOCKS_PER_GROUP == fast_end);
+    CHECK(test_verify(vol, "/small", buf, 100000));
+    CHECK(test_verify(vol, "/big", buf, 4 * SFS_TIER_SMALL_FILE));
+    libsfs_unmount(vol);
+
+    free(buf);
+}
+
+/*
+ * What the benchmarks time works at their scale too: a directory of
+ * thousands of files, half of them unlinked, and random overwrites of a
+ * big file, all there after a remount.
+ */
+static void test_bench()
+{
+    char *buf = malloc(4 * 1024 * 1024);
+    char small[2000 + 16];
+    char path[PATH_MAX];
+    struct stat statbuf;
+    struct dirent *entry = NULL;
+    int entries = 0;
+    int i = 0;
+
+    test_fill(buf, 4 * 1024 * 1024);
+    test_fill(small, sizeof(small));
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS);
+    CHECK(libsfs_mkdir(vol, "/files", 0755) == 0);
+    for (i = 0; i < 2000; ++i) {
+	snprintf(path, sizeof(path), "/files/f%d", i);
+	test_write(vol, path, small + i, 16);
+    }
+    for (i = 1; i < 2000; i += 2) {
+	snprintf(path, sizeof(path), "/files/f%d", i);
+	CHECK(libsfs_unlink(vol, path) == 0);
+    }
+
+    test_write(vol, "/big", buf, 4 * 1024 * 1024);
+    sfs_file *file = libsfs_open(vol, "/big", O_RDWR, 0);
+    if (CHECK(file != NULL)) {
+	for (i = 0; i < 500; ++i) {
+	    off_t offset = (off_t)(test_seed % (4 * 1024 * 1024 / 4096)) * 4096;
+	    test_fill(buf + offset, 4096);
+	    CHECK(libsfs_pwrite(file, buf + offset, 4096, offset) == 4096);
+	}
+	libsfs_close(file);
+    }
+
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    for (i = 0; i < 2000; ++i) {
+	snprintf(path, sizeof(path), "/files/f%d", i);
+	if (i % 2 == 0) {
+	    CHECK(test_verify(vol, path, small + i, 16));
+	} else {
+	    CHECK((libsfs_stat(vol, path, &statbuf) < 0) && (errno == ENOENT));
+	}
+    }
+    sfs_dir *dir = libsfs_opendir(vol, "/files");
+    if (CHECK(dir != NULL)) {
+	while ((entry = libsfs_readdir(dir)) != NULL) {
+	    entries++;
+	}
+	libsfs_closedir(dir);
+    }
+    CHECK(entries == 1000 + 2);
+    CHECK(test_verify(vol, "/big", buf, 4 * 1024 * 1024));
+    libsfs_unmount(vol);
+
+    free(buf);
+}
+
+/*
+ * The calls of libsfs behave like the system calls they are named after.
+ */
+static void test_libsfs()
+{
+    char buf[8192];
+    char data[8192];
+    struct stat statbuf;
+    struct dirent *entry = NULL;
+    int entries = 0;
+
+    test_fill(buf, sizeof(buf));
+    sfs_volume *vol = test_format(TEST_DISKFILE, TEST_OPTIONS);
+    CHECK((libsfs_mount(TEST_DISKFILE2, NULL) == NULL) && (errno == EBUSY));
+    CHECK((libsfs_mount(TEST_DISKFILE2, "simulate=bogus") == NULL) && (errno == EBUSY));
+    CHECK((libsfs_mount(NULL, "ram") == NULL) && (errno == EBUSY));
+    CHECK(access(TEST_DISKFILE2, F_OK) < 0);
+    CHECK(libsfs_mkdir(vol, "/d", 0755) == 0);
+    CHECK((libsfs_mkdir(vol, "/d", 0755) < 0) && (errno == EEXIST));
+    CHECK((libsfs_open(vol, "/x/f", O_CREAT | O_RDWR, 0644) == NULL) && (errno == ENOENT));
+    CHECK((libsfs_open(vol, "/d", O_RDONLY, 0) == NULL) && (errno == EISDIR));
+
+    sfs_file *file = libsfs_open(vol, "/d/f", O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (CHECK(file != NULL)) {
+	CHECK((libsfs_open(vol, "/d/f", O_CREAT | O_EXCL | O_RDWR, 0644) == NULL) && (errno == EEXIST));
+	CHECK(libsfs_write(file, buf, 5000) == 5000);
+	CHECK(libsfs_lseek(file, 0, SEEK_CUR) == 5000);
+	CHECK(libsfs_lseek(file, 100, SEEK_SET) == 100);
+	CHECK(libsfs_read(file, data, sizeof(data)) == 4900);
+	CHECK(memcmp(data, buf + 100, 4900) == 0);
+	CHECK(libsfs_read(file, data, sizeof(data)) == 0);
+	CHECK(libsfs_lseek(file, -1, SEEK_END) == 4999);
+	CHECK(libsfs_fsync(file) == 0);
+	CHECK((libsfs_fstat(file, &statbuf) == 0) && (statbuf.st_size == 5000) && S_ISREG(statbuf.st_mode));
+	libsfs_close(file);
+    }
+
+    file = libsfs_open(vol, "/d/f", O_WRONLY | O_APPEND, 0);
+    if (CHECK(file != NULL)) {
+	CHECK(libsfs_write(file, buf + 5000, 3192) == 3192);
+	CHECK((libsfs_read(file, data, 1) < 0) && (errno == EBADF));
+	libsfs_close(file);
+    }
+    CHECK(test_verify(vol, "/d/f", buf, sizeof(buf)));
+    CHECK((libsfs_rmdir(vol, "/d") < 0) && (errno == ENOTEMPTY));
+
+    sfs_dir *dir = libsfs_opendir(vol, "/d");
+    if (CHECK(dir != NULL)) {
+	while ((entry = libsfs_readdir(dir)) != NULL) {
+	    entries += (strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0) ||
+		    (strcmp(entry->d_name, "f") == 0);
+	}
+	libsfs_closedir(dir);
+    }
+    CHECK(entries == 3);
+
+    CHECK(libsfs_truncate(vol, "/d/f", 100) == 0);
+    vol = test_remount(vol, TEST_DISKFILE, NULL);
+    CHECK(test_verify(vol, "/d/f", buf, 100));
+    file = libsfs_open(vol, "/d/f", O_RDWR | O_TRUNC, 0);
+    if (CHECK(file != NULL)) {
+	libsfs_close(file);
+    }
+    CHECK(test_verify(vol, "/d/f", buf, 0));
+    CHECK(libsfs_unlink(vol, "/d/f") == 0);
+    CHECK((libsfs_unlink(vol, "/d/f") < 0) && (errno == ENOENT));
+    CHECK(libsfs_rmdir(vol, "/d") == 0);
+    CHECK((libsfs_stat(vol, "/d", &statbuf) < 0) && (errno == ENOENT));
+    libsfs_unmount(vol);
+
+    CHECK((libsfs_mount(TEST_DISKFILE, "nosuchoption") == NULL) && (errno == EINVAL));
+    CHECK((libsfs_mount(NULL, NULL) == NULL) && (errno == EINVAL));
+}
+
+static const sfs_test tests[] = {
+    { "roundtrip", test_roundtrip },
+    { "writeback", test_writeback },
+    { "writeback_io", test_writeback_io },
+    { "lazytime", test_lazytime },
+    { "inline", test_inline },
+    { "inodes", test_inodes },
+    { "groups", test_groups },
+    { "readahead", test_readahead },
+    { "delalloc", test_delalloc },
+    { "fallocate", test_fallocate },
+    { "sparse", test_sparse },
+    { "discard", test_discard },
+    { "orphans", test_orphans },
+    { "reflink", test_reflink },
+    { "snapshot", test_snapshot },
+    { "snapshot_live", test_snapshot_live },
+    { "seqalloc", test_seqalloc },
+    { "compress", test_compress },
+    { "dedup", test_dedup },
+    { "checksum", test_checksum },
+    { "backends", test_backends },
+    { "ram", test_ram },
+    { "sim", test_sim },
+    { "stripe", test_stripe },
+    { "mirror", test_mirror },
+    { "tier", test_tier },
+    { "bench", test_bench },
+    { "libsfs", test_libsfs },
+    { NULL, NULL }
+};
+
+int main(int argc, char *argv[])
+{
+    const sfs_test *test = NULL;
+    int failures = 0;
+    int i = 0;
+
+    for (i = 1; i < argc; ++i) {
+	for (test = tests; (test->name != NULL) && (strcmp(test->name, argv[i]) != 0); ++test) {
+	}
+	if (test->name == NULL) {
+	    fprintf(stderr, "usage:  sfs_test [test...]\n");
+	    return EXIT_FAILURE;
+	}
+    }
+
+    for (test = tests; test->name != NULL; ++test) {
+	for (i = 1; (i < argc) && (strcmp(test->name, argv[i]) != 0); ++i) {
+	}
+	if ((argc > 1) && (i == argc)) {
+	    continue;
+	}
+
+	test_failed = 0;
+	test->run();
+	test_remove();
+	printf("%s: %s\n", (test_failed > 0) ? "FAIL" : "PASS", test->name);
+	fflush(stdout);
+	failures += (test_failed > 0);
+    }
+
+    return (failures > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}